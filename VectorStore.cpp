@@ -1,33 +1,113 @@
 #include "VectorStore.h"
 
+#include <fstream>
+#include <cstdio>
+#include <cstddef>
+#include <climits>
+#include <filesystem>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VECTORSTORE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define VECTORSTORE_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Instrumentation probes; they expand to nothing unless VECTORSTORE_STATS
+// is defined, so the arguments must not have side effects.
+#ifdef VECTORSTORE_STATS
+#define VS_STATS_JOIN2(a, b) a##b
+#define VS_STATS_JOIN(a, b) VS_STATS_JOIN2(a, b)
+#define VS_COUNT(counter, n) Instrumentation::add(Instrumentation::Counter::counter, (n))
+#define VS_TIME(timer) \
+    Instrumentation::ScopedTimer VS_STATS_JOIN(statsTimer, __LINE__)(Instrumentation::Timer::timer)
+#else
+#define VS_COUNT(counter, n) ((void)0)
+#define VS_TIME(timer) ((void)0)
+#endif
+
 // ----------------- ArrayList Implementation -----------------
 
+template <class T>
+T* ArrayList<T>::allocate(int n) {
+    return static_cast<T*>(::operator new(sizeof(T) * static_cast<size_t>(n)));
+}
+
+template <class T>
+void ArrayList<T>::deallocate(T* block) {
+    ::operator delete(block);
+}
+
+template <class T>
+void ArrayList<T>::destroy(T* first, int n) {
+    if (!std::is_trivially_destructible<T>::value) {
+        for (int i = 0; i < n; ++i) first[i].~T();
+    }
+}
+
+template <class T>
+void ArrayList<T>::relocate(T* from, T* to, int n) {
+    if (std::is_trivially_copyable<T>::value) {
+        if (n > 0) memcpy(static_cast<void*>(to), static_cast<const void*>(from), sizeof(T) * static_cast<size_t>(n));
+        return;
+    }
+    // Moves unless the move may throw and a copy is possible, so a failed
+    // growth leaves the old buffer intact.
+    int built = 0;
+    try {
+        for (; built < n; ++built) new (to + built) T(std::move_if_noexcept(from[built]));
+    } catch (...) {
+        destroy(to, built);
+        throw;
+    }
+    destroy(from, n);
+}
+
 template <class T>
 ArrayList<T>::ArrayList(int initCapacity) {
     capacity = (initCapacity > 0) ? initCapacity : 10;
-    data = new T[capacity];
+    data = allocate(capacity);
     count = 0;
 }
 
 template <class T>
 ArrayList<T>::ArrayList(const ArrayList<T>& other) {
-    capacity = other.capacity;
-    count = other.count;
-    data = new T[capacity];
-    for (int i = 0; i < count; ++i) {
-        data[i] = other.data[i];
+    capacity = (other.capacity > 0) ? other.capacity : 10;
+    count = 0;
+    data = allocate(capacity);
+    try {
+        for (; count < other.count; ++count) new (data + count) T(other.data[count]);
+    } catch (...) {
+        destroy(data, count);
+        deallocate(data);
+        throw;
     }
 }   
 
 template <class T>
-ArrayList<T>::~ArrayList() {
-    delete[] data;
+ArrayList<T>::ArrayList(ArrayList<T>&& other) noexcept {
+    data = other.data;
+    capacity = other.capacity;
+    count = other.count;
+    other.data = nullptr;
+    other.capacity = 0;
+    other.count = 0;
 }
 
 template <class T>
-void ArrayList<T>::ensureCapacity(int cap) { // thêm overflow check do fail test 19
-    if (cap <= capacity) return;
+ArrayList<T>::~ArrayList() {
+    destroy(data, count);
+    deallocate(data);
+}
 
+template <class T>
+int ArrayList<T>::grownCapacity(int cap) const { // thêm overflow check do fail test 19
     // use hard-coded 32-bit signed max để tránh overflow khi nhân chia
     const long long MAX_INT32 = 2147483647LL;
     long long proposed = static_cast<long long>(capacity);
@@ -35,48 +115,126 @@ void ArrayList<T>::ensureCapacity(int cap) { // thêm overflow check do fail tes
     proposed = proposed + (proposed >> 1); // *1.5
     if (proposed <cap) proposed = cap; // ensure at least required
     if (proposed > MAX_INT32) throw std::overflow_error("Requested capacity too large") ;
+    return static_cast<int>(proposed);
+}
 
-    // bat dau thay
-    int newCapacity = static_cast<int>(proposed);
-    T* newData = new T[newCapacity];
-    for (int i = 0; i < count; ++i) newData[i] = data[i];
-    delete[] data;
+template <class T>
+void ArrayList<T>::reallocate(int newCapacity) {
+    T* newData = allocate(newCapacity);
+    try {
+        relocate(data, newData, count);
+    } catch (...) {
+        deallocate(newData);
+        throw;
+    }
+    deallocate(data);
     data = newData;
     capacity = newCapacity;
 }
 
+template <class T>
+void ArrayList<T>::ensureCapacity(int cap) {
+    if (cap <= capacity) return;
+
+    reallocate(grownCapacity(cap));
+}
+
+template <class T>
+void ArrayList<T>::reserve(int cap) {
+    if (cap <= capacity) return;
+
+    reallocate(cap);
+}
+
+template <class T>
+void ArrayList<T>::shrink_to_fit() {
+    int target = (count > 0) ? count : 1;
+    if (target >= capacity) return;
+
+    reallocate(target);
+}
+
+template <class T>
+int ArrayList<T>::getCapacity() const {
+    return capacity;
+}
+
 template <class T>
 ArrayList<T>& ArrayList<T>::operator=(const ArrayList<T>& other) { // thêm exception safety do fail test 31
     if (this == &other) return *this;
 
     // thử Allocate trước khi xóa
-    T* newData = new T[other.capacity];
-    for (int i = 0; i < other.count; ++i) {
-        newData[i] = other.data[i];
+    int newCapacity = (other.capacity > 0) ? other.capacity : 10;
+    T* newData = allocate(newCapacity);
+    int built = 0;
+    try {
+        for (; built < other.count; ++built) new (newData + built) T(other.data[built]);
+    } catch (...) {
+        destroy(newData, built);
+        deallocate(newData);
+        throw;
     }
     // Now commit.
-    delete[] data;
+    destroy(data, count);
+    deallocate(data);
     data = newData;
+    capacity = newCapacity;
+    count = other.count;
+    return *this;
+}
+
+template <class T>
+ArrayList<T>& ArrayList<T>::operator=(ArrayList<T>&& other) noexcept {
+    if (this == &other) return *this;
+
+    destroy(data, count);
+    deallocate(data);
+    data = other.data;
     capacity = other.capacity;
     count = other.count;
+    other.data = nullptr;
+    other.capacity = 0;
+    other.count = 0;
     return *this;
 }
 
 template <class T>
-void ArrayList<T>::add(T e) {
-    ensureCapacity(count + 1);
-    data[count++] = e;
+void ArrayList<T>::add(const T& e) {
+    emplace_back(e);
+}
+
+template <class T>
+void ArrayList<T>::add(T&& e) {
+    emplace_back(std::move(e));
 }
 
 template <class T>
-void ArrayList<T>::add(int index, T e) {
+void ArrayList<T>::add(int index, const T& e) {
     if (index < 0 || index > count) throw std::out_of_range("Index is out of range!");
-    
+
+    T copy(e); // e may live in this list and move during the shift
+    insertAt(index, std::move(copy));
+}
+
+template <class T>
+void ArrayList<T>::add(int index, T&& e) {
+    if (index < 0 || index > count) throw std::out_of_range("Index is out of range!");
+
+    insertAt(index, std::move(e));
+}
+
+template <class T>
+void ArrayList<T>::insertAt(int index, T&& e) {
     ensureCapacity(count + 1);
-    for (int i = count; i > index; --i) {
-        data[i] = data[i - 1];
+    if (index == count) {
+        new (data + count) T(std::move(e));
+    } else {
+        new (data + count) T(std::move(data[count - 1]));
+        for (int i = count - 1; i > index; --i) {
+            data[i] = std::move(data[i - 1]);
+        }
+        data[index] = std::move(e);
     }
-    data[index] = e;
     ++count;
 }
 
@@ -84,20 +242,25 @@ template <class T>
 T ArrayList<T>::removeAt(int index) {
     if (index < 0 || index >=count) throw std::out_of_range("ArrayList::removeAt - index out of range");
     
-    T element = data[index];
+    T element = std::move(data[index]);
     for (int i = index; i < count - 1; ++i) {
-        data[i] = data[i + 1];
+        data[i] = std::move(data[i + 1]);
     }
+    data[count - 1].~T();
     --count;
     return element;
 }
 
 template <class T>
 void ArrayList<T>::clear() {
-    delete[] data;
-    capacity = 10;
-    data = new T[capacity];
+    destroy(data, count);
     count = 0;
+    if (capacity == 10) return; // already the default buffer
+
+    T* fresh = allocate(10);
+    deallocate(data);
+    data = fresh;
+    capacity = 10;
 }
 
 template <class T>
@@ -113,14 +276,28 @@ T& ArrayList<T>::get(int index) {
 }
 
 template <class T>
-void ArrayList<T>::set(int index, T e) {
+const T& ArrayList<T>::get(int index) const {
+    if (index < 0 || index >= count) throw std::out_of_range("ArrayList::get - index out of range");
+
+    return data[index];
+}
+
+template <class T>
+void ArrayList<T>::set(int index, const T& e) {
     if (index < 0 || index >= count) throw std::out_of_range("ArrayList::set - index out of range");
     
     data[index] = e;
 }
 
 template <class T>
-int ArrayList<T>::indexOf(T item) const {
+void ArrayList<T>::set(int index, T&& e) {
+    if (index < 0 || index >= count) throw std::out_of_range("ArrayList::set - index out of range");
+
+    data[index] = std::move(e);
+}
+
+template <class T>
+int ArrayList<T>::indexOf(const T& item) const {
     for (int i = 0; i < count; ++i) {
         if (data[i] == item) {
             return i;
@@ -130,7 +307,7 @@ int ArrayList<T>::indexOf(T item) const {
 }
 
 template <class T>
-bool ArrayList<T>::contains(T item) const {
+bool ArrayList<T>::contains(const T& item) const {
     return indexOf(item) != -1;
 }
 
@@ -235,12 +412,97 @@ typename ArrayList<T>::Iterator ArrayList<T>::Iterator::operator--(int) {
     return temp;
 }
 
+// ----------------- SlabArena Implementation -----------------
+SlabArena::SlabArena(size_t blockSize, int firstChunkBlocks, int maxChunkBlocks) {
+    // Every block must hold the free-list link and keep the alignment of
+    // whatever is placed in it.
+    size_t align = alignof(std::max_align_t);
+    if (blockSize < sizeof(void*)) blockSize = sizeof(void*);
+    this->blockSize = (blockSize + align - 1) / align * align;
+    this->nextChunkBlocks = (firstChunkBlocks > 0) ? firstChunkBlocks : 1;
+    this->maxChunkBlocks = (maxChunkBlocks >= this->nextChunkBlocks) ? maxChunkBlocks : this->nextChunkBlocks;
+    chunks = nullptr;
+    freeList = nullptr;
+    cursor = nullptr;
+    limit = nullptr;
+    reservedBytes = 0;
+}
+
+SlabArena::~SlabArena() {
+    release();
+}
+
+void SlabArena::grow() {
+    // The chunk header (link to the previous chunk) takes one block so the
+    // blocks behind it stay aligned.
+    size_t bytes = blockSize * (static_cast<size_t>(nextChunkBlocks) + 1);
+    char* chunk = static_cast<char*>(::operator new(bytes));
+    *reinterpret_cast<char**>(chunk) = chunks;
+    chunks = chunk;
+    cursor = chunk + blockSize;
+    limit = chunk + bytes;
+    reservedBytes += static_cast<long long>(bytes);
+    if (nextChunkBlocks < maxChunkBlocks) {
+        nextChunkBlocks = (nextChunkBlocks * 2 < maxChunkBlocks) ? nextChunkBlocks * 2 : maxChunkBlocks;
+    }
+}
+
+void* SlabArena::allocate(size_t bytes) {
+    if (bytes > blockSize) return ::operator new(bytes);
+
+    if (freeList) {
+        void* block = freeList;
+        freeList = *static_cast<void**>(block);
+        return block;
+    }
+    if (cursor == limit) grow();
+    void* block = cursor;
+    cursor += blockSize;
+    return block;
+}
+
+void SlabArena::deallocate(void* block, size_t bytes) {
+    if (!block) return;
+    if (bytes > blockSize) {
+        ::operator delete(block);
+        return;
+    }
+    *static_cast<void**>(block) = freeList;
+    freeList = block;
+}
+
+void SlabArena::release() {
+    while (chunks) {
+        char* previous = *reinterpret_cast<char**>(chunks);
+        ::operator delete(chunks);
+        chunks = previous;
+    }
+    freeList = nullptr;
+    cursor = nullptr;
+    limit = nullptr;
+    reservedBytes = 0;
+}
+
+long long SlabArena::bytesReserved() const {
+    return reservedBytes;
+}
+
 // ----------------- SinglyLinkedList Implementation -----------------
 template <class T>
-SinglyLinkedList<T>::SinglyLinkedList() {
+SinglyLinkedList<T>::SinglyLinkedList(NodeAllocator* allocator) : ownArena(sizeof(Node)) {
+    head = nullptr;
+    tail = nullptr;
+    count = 0;
+    this->allocator = allocator ? allocator : &ownArena;
+}
+
+template <class T>
+SinglyLinkedList<T>::SinglyLinkedList(const SinglyLinkedList<T>& other) : ownArena(sizeof(Node)) {
     head = nullptr;
     tail = nullptr;
     count = 0;
+    allocator = &ownArena;
+    for (Node* node = other.head; node; node = node->next) add(node->data);
 }
 
 template <class T>
@@ -248,21 +510,68 @@ SinglyLinkedList<T>::~SinglyLinkedList() {
     clear();
 }   
 
-// TODO: implement other methods of SinglyLinkedList
+template <class T>
+SinglyLinkedList<T>& SinglyLinkedList<T>::operator=(const SinglyLinkedList<T>& other) {
+    if (this != &other) {
+        clear();
+        for (Node* node = other.head; node; node = node->next) add(node->data);
+    }
+    return *this;
+}
+
+template <class T>
+template <class U>
+typename SinglyLinkedList<T>::Node* SinglyLinkedList<T>::createNode(U&& e, Node* next) {
+    void* block = allocator->allocate(sizeof(Node));
+    try {
+        return new (block) Node(std::forward<U>(e), next);
+    } catch (...) {
+        allocator->deallocate(block, sizeof(Node));
+        throw;
+    }
+}
+
+template <class T>
+void SinglyLinkedList<T>::destroyNode(Node* node) {
+    node->~Node();
+    allocator->deallocate(node, sizeof(Node));
+}
+
 template <class T>
 void SinglyLinkedList<T>::clear() {
-    while (head != nullptr) { // making sure all nodes are deleted to avoid memory leaks, takes O(n)
+    // Destroys every element, O(n). With the list's own arena the nodes'
+    // memory then goes back in one sweep over the chunks; a borrowed
+    // allocator gets each node back individually.
+    bool owned = (allocator == &ownArena);
+    while (head != nullptr) {
         Node* temp = head;
         head = head->next;
-        delete temp;
+        if (owned) {
+            temp->~Node();
+        } else {
+            destroyNode(temp);
+        }
     }
+    if (owned) ownArena.release();
     tail = nullptr;
     count = 0;
 }
 
 template <class T>
-void SinglyLinkedList<T>::add(T e) {
-    Node* newNode = new Node(e);
+void SinglyLinkedList<T>::add(const T& e) {
+    Node* newNode = createNode(e, nullptr);
+    if (!head) {
+        head = tail = newNode;
+    } else {
+        tail->next = newNode;
+        tail = newNode;
+    }
+    ++count;
+}
+
+template <class T>
+void SinglyLinkedList<T>::add(T&& e) {
+    Node* newNode = createNode(std::move(e), nullptr);
     if (!head) {
         head = tail = newNode;
     } else {
@@ -272,6 +581,67 @@ void SinglyLinkedList<T>::add(T e) {
     ++count;
 }
 
+template <class T>
+void SinglyLinkedList<T>::add(int index, T e) {
+    if (index < 0 || index > count) 
+        throw std::out_of_range("Index is invalid!");
+
+    if (index == count) {
+        add(std::move(e));
+        return;
+    }
+    if (index == 0) {
+        head = createNode(std::move(e), head);
+    } else {
+        Node* previous = head;
+        for (int i = 0; i < index - 1; ++i) previous = previous->next;
+        previous->next = createNode(std::move(e), previous->next);
+    }
+    ++count;
+}
+
+template <class T>
+T SinglyLinkedList<T>::removeAt(int index) {
+    if (index < 0 || index >= count) 
+        throw std::out_of_range("Index is invalid!");
+
+    Node* removed;
+    if (index == 0) {
+        removed = head;
+        head = head->next;
+        if (!head) tail = nullptr;
+    } else {
+        Node* previous = head;
+        for (int i = 0; i < index - 1; ++i) previous = previous->next;
+        removed = previous->next;
+        previous->next = removed->next;
+        if (removed == tail) tail = previous;
+    }
+    T data = std::move(removed->data);
+    destroyNode(removed);
+    --count;
+    return data;
+}
+
+template <class T>
+bool SinglyLinkedList<T>::removeItem(const T& item) {
+    Node* previous = nullptr;
+    for (Node* current = head; current; previous = current, current = current->next) {
+        if (current->data == item) {
+            if (previous) {
+                previous->next = current->next;
+            } else {
+                head = current->next;
+            }
+            if (current == tail) tail = previous;
+            destroyNode(current);
+            --count;
+            return true;
+        }
+    }
+    return false;
+}
+
 template <class T>
 T& SinglyLinkedList<T>::get(int index) {
     if (index < 0 || index >= count) 
@@ -284,11 +654,58 @@ T& SinglyLinkedList<T>::get(int index) {
     return current->data;
 }
 
+template <class T>
+int SinglyLinkedList<T>::indexOf(const T& item) const {
+    int index = 0;
+    for (Node* current = head; current; current = current->next, ++index) {
+        if (current->data == item) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+template <class T>
+bool SinglyLinkedList<T>::contains(const T& item) const {
+    return indexOf(item) != -1;
+}
+
+template <class T>
+string SinglyLinkedList<T>::toString(string (*item2str)(T&)) const {
+    stringstream ss;
+    ss << '[';
+    for (Node* current = head; current; current = current->next) {
+        if (current != head) ss << ", ";
+        if (item2str) {
+            ss << item2str(current->data);
+        } else {
+            ss << current->data;
+        }
+    }
+    ss << ']';
+    return ss.str();
+}
+
 template <class T>
 int SinglyLinkedList<T>::size() const {
     return count;
 }
 
+template <class T>
+bool SinglyLinkedList<T>::empty() const {
+    return count == 0;
+}
+
+template <class T>
+typename SinglyLinkedList<T>::Iterator SinglyLinkedList<T>::begin() {
+    return Iterator(head);
+}
+
+template <class T>
+typename SinglyLinkedList<T>::Iterator SinglyLinkedList<T>::end() {
+    return Iterator(nullptr);
+}
+
 
 // ----------------- Iterator of SinglyLinkedList Implementation -----------------
 template <class T>
@@ -296,75 +713,8872 @@ SinglyLinkedList<T>::Iterator::Iterator(Node* node) {
     current = node;
 }
 
-// TODO: implement other methods of SinglyLinkedList::Iterator
+template <class T>
+typename SinglyLinkedList<T>::Iterator& SinglyLinkedList<T>::Iterator::operator=(const Iterator& other) {
+    current = other.current;
+    return *this;
+}
 
+template <class T>
+T& SinglyLinkedList<T>::Iterator::operator*() {
+    if (!current) throw std::out_of_range("Iterator is out of range!");
 
+    return current->data;
+}
 
-// ----------------- VectorStore Implementation -----------------
+template <class T>
+bool SinglyLinkedList<T>::Iterator::operator!=(const Iterator& other) const {
+    return current != other.current;
+}
 
-VectorStore::VectorStore(int dimension, EmbedFn setEmbeddingFunction) {
-    this->dimension = (dimension > 0) ? dimension : 512;
-    // Correctly assign the incoming function pointer (previously self-assigned -> left uninitialized)
-    this->embeddingFunction = setEmbeddingFunction;
-    count = 0;
+template <class T>
+typename SinglyLinkedList<T>::Iterator& SinglyLinkedList<T>::Iterator::operator++() {
+    if (!current) throw std::out_of_range("Iterator cannot advance past end!");
+
+    current = current->next;
+    return *this;
 }
 
-VectorStore::~VectorStore() {
-    clear();
+template <class T>
+typename SinglyLinkedList<T>::Iterator SinglyLinkedList<T>::Iterator::operator++(int) {
+    if (!current) throw std::out_of_range("Iterator cannot advance past end!");
+
+    Iterator temp = *this;
+    current = current->next;
+    return temp;
 }
 
-// TODO: implement other methods of VectorStore
-void VectorStore::clear() {
-    for (int i = 0; i < records.size(); ++i) {
-        delete records.get(i)->vector;
-        delete records.get(i);
+
+
+// ----------------- Instrumentation Implementation -----------------
+
+// One per recording thread. Only the owner writes, so relaxed load + store
+// pairs are enough; snapshot() and reset() read or clear them from outside.
+struct StatsSlab {
+    std::atomic<unsigned long long> counters[Instrumentation::COUNTERS];
+    std::atomic<unsigned long long> count[Instrumentation::TIMERS];
+    std::atomic<unsigned long long> sum[Instrumentation::TIMERS];
+    std::atomic<unsigned long long> min[Instrumentation::TIMERS];
+    std::atomic<unsigned long long> max[Instrumentation::TIMERS];
+    std::atomic<unsigned long long> buckets[Instrumentation::TIMERS][Instrumentation::BUCKETS];
+    StatsSlab* next;
+};
+
+struct StatsRegistry {
+    std::mutex lock;
+    StatsSlab* head;
+    Instrumentation::Snapshot retired; // totals of threads that have exited
+};
+
+static void clearSnapshot(Instrumentation::Snapshot& snapshot) {
+    memset(&snapshot, 0, sizeof(snapshot));
+}
+
+static void clearSlab(StatsSlab& slab) {
+    for (int c = 0; c < Instrumentation::COUNTERS; ++c) slab.counters[c].store(0, std::memory_order_relaxed);
+    for (int t = 0; t < Instrumentation::TIMERS; ++t) {
+        slab.count[t].store(0, std::memory_order_relaxed);
+        slab.sum[t].store(0, std::memory_order_relaxed);
+        slab.min[t].store(ULLONG_MAX, std::memory_order_relaxed);
+        slab.max[t].store(0, std::memory_order_relaxed);
+        for (int b = 0; b < Instrumentation::BUCKETS; ++b) slab.buckets[t][b].store(0, std::memory_order_relaxed);
     }
-    records.clear();
 }
 
-SinglyLinkedList<float>* VectorStore::preprocessing(string rawText) {
-    SinglyLinkedList<float>* result = nullptr;
-    if (embeddingFunction) {
-        result = embeddingFunction(rawText); //Invoke embeddingFunction to map rawText into a vector.
-    } else {
-        result = new SinglyLinkedList<float>();
-        int len = rawText.length() > dimension ? dimension : rawText.length();
-        for (int i = 0; i < len; ++i) {
-            result->add(static_cast<float>(rawText[i]));
-        }
-        // Pad with zeros if less than dimension
-        while (result->size() < dimension) {
-            result->add(0.0f);
-        }
+static void foldSlab(const StatsSlab& slab, Instrumentation::Snapshot& into) {
+    for (int c = 0; c < Instrumentation::COUNTERS; ++c) into.counters[c] += slab.counters[c].load(std::memory_order_relaxed);
+    for (int t = 0; t < Instrumentation::TIMERS; ++t) {
+        Instrumentation::Histogram& h = into.timers[t];
+        unsigned long long n = slab.count[t].load(std::memory_order_relaxed);
+        if (n == 0) continue;
+        unsigned long long lo = slab.min[t].load(std::memory_order_relaxed);
+        unsigned long long hi = slab.max[t].load(std::memory_order_relaxed);
+        if (h.count == 0 || lo < h.minNanos) h.minNanos = lo;
+        if (hi > h.maxNanos) h.maxNanos = hi;
+        h.count += n;
+        h.sumNanos += slab.sum[t].load(std::memory_order_relaxed);
+        for (int b = 0; b < Instrumentation::BUCKETS; ++b) h.buckets[b] += slab.buckets[t][b].load(std::memory_order_relaxed);
     }
-    return result;
 }
 
-void VectorStore::addText(string rawText) {
-    SinglyLinkedList<float>* vector = preprocessing(rawText);
-    VectorRecord* record = new VectorRecord(count, rawText, vector);
-    records.add(record);
-    ++count;
+// Never destroyed: threads may still exit after static destruction.
+static StatsRegistry& statsRegistry() {
+    static StatsRegistry* registry = [] {
+        StatsRegistry* r = new StatsRegistry();
+        r->head = nullptr;
+        clearSnapshot(r->retired);
+        return r;
+    }();
+    return *registry;
 }
 
-SinglyLinkedList<float>& VectorStore::getVector(int index) {
-    if (index < 0 || index >= records.size()) {
-        throw std::out_of_range("Index is invalid!");
+struct StatsHandle {
+    StatsSlab* slab;
+
+    StatsHandle() {
+        slab = new StatsSlab();
+        clearSlab(*slab);
+        StatsRegistry& registry = statsRegistry();
+        std::lock_guard<std::mutex> lock(registry.lock);
+        slab->next = registry.head;
+        registry.head = slab;
     }
-    return *(records.get(index)->vector);
+    ~StatsHandle() {
+        StatsRegistry& registry = statsRegistry();
+        std::lock_guard<std::mutex> lock(registry.lock);
+        foldSlab(*slab, registry.retired);
+        StatsSlab** link = &registry.head;
+        while (*link != slab) link = &(*link)->next;
+        *link = slab->next;
+        delete slab;
+    }
+};
+
+// The plain pointer keeps the hot path to one TLS load; the handle (with
+// its guarded constructor) is only touched on a thread's first probe.
+static StatsSlab& localStats() {
+    thread_local StatsSlab* cached = nullptr;
+    if (cached) return *cached;
+    thread_local StatsHandle handle;
+    cached = handle.slab;
+    return *cached;
 }
 
-int VectorStore::size() const {
-    return records.size();
+static inline void bumpStat(std::atomic<unsigned long long>& cell, unsigned long long n) {
+    cell.store(cell.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
 }
 
-bool VectorStore::empty() const {
-    return records.size() == 0;
+bool Instrumentation::enabled() {
+#ifdef VECTORSTORE_STATS
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Instrumentation::add(Counter c, unsigned long long n) {
+    bumpStat(localStats().counters[static_cast<int>(c)], n);
+}
+
+void Instrumentation::record(Timer t, unsigned long long nanos) {
+    StatsSlab& slab = localStats();
+    int i = static_cast<int>(t);
+    bumpStat(slab.count[i], 1);
+    bumpStat(slab.sum[i], nanos);
+    if (nanos < slab.min[i].load(std::memory_order_relaxed)) slab.min[i].store(nanos, std::memory_order_relaxed);
+    if (nanos > slab.max[i].load(std::memory_order_relaxed)) slab.max[i].store(nanos, std::memory_order_relaxed);
+    bumpStat(slab.buckets[i][bucketOf(nanos)], 1);
+}
+
+Instrumentation::ScopedTimer::~ScopedTimer() {
+    long long nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - started).count();
+    record(timer, nanos > 0 ? static_cast<unsigned long long>(nanos) : 0);
+}
+
+int Instrumentation::bucketOf(unsigned long long nanos) {
+    if (nanos < SUB_BUCKETS) return static_cast<int>(nanos);
+#if defined(__GNUC__) || defined(__clang__)
+    int exponent = 63 - __builtin_clzll(nanos);
+#else
+    int exponent = 0;
+    while (nanos >> (exponent + 1)) ++exponent;
+#endif
+    int bucket = SUB_BUCKETS * (exponent - 3) + static_cast<int>((nanos >> (exponent - 4)) - SUB_BUCKETS);
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+unsigned long long Instrumentation::bucketLow(int bucket) {
+    if (bucket < SUB_BUCKETS) return static_cast<unsigned long long>(bucket);
+    int exponent = bucket / SUB_BUCKETS + 3;
+    unsigned long long sub = static_cast<unsigned long long>(bucket % SUB_BUCKETS + SUB_BUCKETS);
+    return sub << (exponent - 4);
+}
+
+Instrumentation::Snapshot Instrumentation::snapshot() {
+    Snapshot result;
+    clearSnapshot(result);
+    StatsRegistry& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock(registry.lock);
+    result = registry.retired;
+    for (StatsSlab* slab = registry.head; slab; slab = slab->next) foldSlab(*slab, result);
+    return result;
+}
+
+void Instrumentation::reset() {
+    StatsRegistry& registry = statsRegistry();
+    std::lock_guard<std::mutex> lock(registry.lock);
+    clearSnapshot(registry.retired);
+    for (StatsSlab* slab = registry.head; slab; slab = slab->next) clearSlab(*slab);
+}
+
+const char* Instrumentation::counterName(Counter c) {
+    switch (c) {
+        case Counter::DistanceEvaluations: return "distance_evaluations";
+        case Counter::BytesScanned:        return "bytes_scanned";
+        case Counter::NodesVisited:        return "nodes_visited";
+        case Counter::Embeddings:          return "embeddings";
+        default:                           return "queries";
+    }
+}
+
+const char* Instrumentation::timerName(Timer t) {
+    switch (t) {
+        case Timer::Preprocessing:     return "preprocessing";
+        case Timer::AddText:           return "add_text";
+        case Timer::FindNearest:       return "find_nearest";
+        case Timer::TopKNearest:       return "top_k_nearest";
+        case Timer::ApproximateSearch: return "approximate_search";
+        default:                       return "scan";
+    }
+}
+
+double Instrumentation::Histogram::mean() const {
+    return count == 0 ? 0.0 : static_cast<double>(sumNanos) / static_cast<double>(count);
+}
+
+// Midpoint of the bucket holding the p-th percentile, clamped to [min, max].
+double Instrumentation::Histogram::percentile(double p) const {
+    if (count == 0) return 0.0;
+    unsigned long long rank = static_cast<unsigned long long>(p / 100.0 * static_cast<double>(count) + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    unsigned long long seen = 0;
+    for (int b = 0; b < BUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen < rank) continue;
+        double low = static_cast<double>(bucketLow(b));
+        double high = (b + 1 < BUCKETS) ? static_cast<double>(bucketLow(b + 1)) : low;
+        double mid = (low + high) / 2.0;
+        if (mid < static_cast<double>(minNanos)) mid = static_cast<double>(minNanos);
+        if (mid > static_cast<double>(maxNanos)) mid = static_cast<double>(maxNanos);
+        return mid;
+    }
+    return static_cast<double>(maxNanos);
+}
+
+unsigned long long Instrumentation::Snapshot::counter(Counter c) const {
+    return counters[static_cast<int>(c)];
+}
+
+const Instrumentation::Histogram& Instrumentation::Snapshot::timer(Timer t) const {
+    return timers[static_cast<int>(t)];
+}
+
+string Instrumentation::Snapshot::toText() const {
+    std::ostringstream out;
+    out << "counters:\n";
+    for (int c = 0; c < COUNTERS; ++c) {
+        out << "  " << counterName(static_cast<Counter>(c)) << " " << counters[c] << "\n";
+    }
+    out << "timers (ns): count mean p50 p90 p99 p999 max\n";
+    out.setf(std::ios::fixed);
+    out.precision(0);
+    for (int t = 0; t < TIMERS; ++t) {
+        const Histogram& h = timers[t];
+        out << "  " << timerName(static_cast<Timer>(t)) << " " << h.count << " " << h.mean() << " "
+            << h.percentile(50) << " " << h.percentile(90) << " " << h.percentile(99) << " "
+            << h.percentile(99.9) << " " << h.maxNanos << "\n";
+    }
+    return out.str();
+}
+
+string Instrumentation::Snapshot::toJson() const {
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(0);
+    out << "{\"enabled\":" << (enabled() ? "true" : "false") << ",\"counters\":{";
+    for (int c = 0; c < COUNTERS; ++c) {
+        out << (c ? "," : "") << "\"" << counterName(static_cast<Counter>(c)) << "\":" << counters[c];
+    }
+    out << "},\"timers\":{";
+    for (int t = 0; t < TIMERS; ++t) {
+        const Histogram& h = timers[t];
+        out << (t ? "," : "") << "\"" << timerName(static_cast<Timer>(t)) << "\":{\"count\":" << h.count
+            << ",\"mean_ns\":" << h.mean() << ",\"min_ns\":" << (h.count ? h.minNanos : 0)
+            << ",\"p50_ns\":" << h.percentile(50) << ",\"p90_ns\":" << h.percentile(90)
+            << ",\"p99_ns\":" << h.percentile(99) << ",\"p999_ns\":" << h.percentile(99.9)
+            << ",\"max_ns\":" << h.maxNanos << "}";
+    }
+    out << "}}";
+    return out.str();
+}
+
+// ----------------- DistanceKernels Implementation -----------------
+
+static float scalarDot(const float* a, const float* b, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+static float scalarL1(const float* a, const float* b, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) sum += fabsf(a[i] - b[i]);
+    return sum;
+}
+
+static float scalarL2Squared(const float* a, const float* b, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+static void scalarCosineParts(const float* a, const float* b, int n, float& dot, float& normA, float& normB) {
+    float d = 0.0f, na = 0.0f, nb = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        d += a[i] * b[i];
+        na += a[i] * a[i];
+        nb += b[i] * b[i];
+    }
+    dot = d;
+    normA = na;
+    normB = nb;
+}
+
+static void scalarDot4(const float* x, const float* const* q, int n, float* out) {
+    float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        s0 += x[i] * q[0][i];
+        s1 += x[i] * q[1][i];
+        s2 += x[i] * q[2][i];
+        s3 += x[i] * q[3][i];
+    }
+    out[0] = s0;
+    out[1] = s1;
+    out[2] = s2;
+    out[3] = s3;
+}
+
+// binary16 <-> binary32 without F16C (subnormals handled, round to nearest even).
+static float halfToFloat(unsigned short h) {
+    unsigned int sign = static_cast<unsigned int>(h & 0x8000u) << 16;
+    unsigned int exp = (h >> 10) & 0x1fu;
+    unsigned int mant = h & 0x3ffu;
+    unsigned int bits;
+    if (exp == 0) {
+        if (mant == 0) {
+            bits = sign;
+        } else {
+            exp = 113;
+            while (!(mant & 0x400u)) {
+                mant <<= 1;
+                --exp;
+            }
+            bits = sign | (exp << 23) | ((mant & 0x3ffu) << 13);
+        }
+    } else if (exp == 31) {
+        bits = sign | 0x7f800000u | (mant << 13);
+    } else {
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    }
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static unsigned short floatToHalf(float f) {
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    unsigned int sign = (bits >> 16) & 0x8000u;
+    unsigned int absBits = bits & 0x7fffffffu;
+    if (absBits >= 0x7f800000u) return static_cast<unsigned short>(sign | 0x7c00u | (absBits > 0x7f800000u ? 0x200u : 0u));
+    if (absBits >= 0x477ff000u) return static_cast<unsigned short>(sign | 0x7c00u); // rounds past 65504
+    if (absBits < 0x38800000u) {
+        if (absBits < 0x33000000u) return static_cast<unsigned short>(sign);
+        unsigned int mant = (absBits & 0x7fffffu) | 0x800000u;
+        int shift = 126 - static_cast<int>(absBits >> 23);
+        unsigned int m = mant >> shift;
+        unsigned int rem = mant & ((1u << shift) - 1u);
+        unsigned int halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (m & 1u))) ++m;
+        return static_cast<unsigned short>(sign | m);
+    }
+    absBits += 0xfffu + ((absBits >> 13) & 1u);
+    return static_cast<unsigned short>(sign | ((absBits - (112u << 23)) >> 13));
+}
+
+static int scalarDotInt8(const signed char* a, const signed char* b, int n) {
+    int sum = 0;
+    for (int i = 0; i < n; ++i) sum += static_cast<int>(a[i]) * b[i];
+    return sum;
+}
+
+static float scalarL1Int8(const float* q, const float* scale, const signed char* c, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) sum += fabsf(q[i] - scale[i] * c[i]);
+    return sum;
+}
+
+static float scalarDotHalf(const float* q, const unsigned short* x, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) sum += q[i] * halfToFloat(x[i]);
+    return sum;
+}
+
+static float scalarL1Half(const float* q, const unsigned short* x, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) sum += fabsf(q[i] - halfToFloat(x[i]));
+    return sum;
+}
+
+static float scalarL2SquaredHalf(const float* q, const unsigned short* x, int n) {
+    float sum = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        float d = q[i] - halfToFloat(x[i]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+static const DistanceKernels::Table scalarTable = {
+    DistanceKernels::Isa::Scalar, scalarDot, scalarL1, scalarL2Squared, scalarCosineParts, scalarDot4,
+    scalarDotInt8, scalarL1Int8, scalarDotHalf, scalarL1Half, scalarL2SquaredHalf
+};
+
+#ifdef VECTORSTORE_X86_KERNELS
+
+// --- SSE2: 4 lanes ---
+
+__attribute__((target("sse2"))) static inline float hsum128(__m128 v) {
+    __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    __m128 sums = _mm_add_ps(v, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("sse2"))) static float sse2Dot(const float* a, const float* b, int n) {
+    __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    for (; i + 4 <= n; i += 4) acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    float sum = hsum128(_mm_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("sse2"))) static float sse2L1(const float* a, const float* b, int n) {
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 acc = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc = _mm_add_ps(acc, _mm_and_ps(d, absMask));
+    }
+    float sum = hsum128(acc);
+    for (; i < n; ++i) sum += fabsf(a[i] - b[i]);
+    return sum;
+}
+
+__attribute__((target("sse2"))) static float sse2L2Squared(const float* a, const float* b, int n) {
+    __m128 acc = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+        acc = _mm_add_ps(acc, _mm_mul_ps(d, d));
+    }
+    float sum = hsum128(acc);
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("sse2"))) static void sse2CosineParts(const float* a, const float* b, int n,
+                                                             float& dot, float& normA, float& normB) {
+    __m128 d = _mm_setzero_ps(), na = _mm_setzero_ps(), nb = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i), vb = _mm_loadu_ps(b + i);
+        d = _mm_add_ps(d, _mm_mul_ps(va, vb));
+        na = _mm_add_ps(na, _mm_mul_ps(va, va));
+        nb = _mm_add_ps(nb, _mm_mul_ps(vb, vb));
+    }
+    float sd = hsum128(d), sa = hsum128(na), sb = hsum128(nb);
+    for (; i < n; ++i) {
+        sd += a[i] * b[i];
+        sa += a[i] * a[i];
+        sb += b[i] * b[i];
+    }
+    dot = sd;
+    normA = sa;
+    normB = sb;
+}
+
+__attribute__((target("sse2"))) static void sse2Dot4(const float* x, const float* const* q, int n, float* out) {
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps(), a2 = _mm_setzero_ps(), a3 = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 vx = _mm_loadu_ps(x + i);
+        a0 = _mm_add_ps(a0, _mm_mul_ps(vx, _mm_loadu_ps(q[0] + i)));
+        a1 = _mm_add_ps(a1, _mm_mul_ps(vx, _mm_loadu_ps(q[1] + i)));
+        a2 = _mm_add_ps(a2, _mm_mul_ps(vx, _mm_loadu_ps(q[2] + i)));
+        a3 = _mm_add_ps(a3, _mm_mul_ps(vx, _mm_loadu_ps(q[3] + i)));
+    }
+    out[0] = hsum128(a0);
+    out[1] = hsum128(a1);
+    out[2] = hsum128(a2);
+    out[3] = hsum128(a3);
+    for (; i < n; ++i) {
+        for (int j = 0; j < 4; ++j) out[j] += x[i] * q[j][i];
+    }
+}
+
+// --- AVX2 + FMA: 8 lanes ---
+
+__attribute__((target("avx2,fma"))) static inline float hsum256(__m256 v) {
+    __m128 lo = _mm256_castps256_ps128(v);
+    __m128 hi = _mm256_extractf128_ps(v, 1);
+    lo = _mm_add_ps(lo, hi);
+    __m128 shuf = _mm_movehdup_ps(lo);
+    __m128 sums = _mm_add_ps(lo, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("avx2,fma"))) static float avx2Dot(const float* a, const float* b, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), acc0);
+    float sum = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += a[i] * b[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static float avx2L1(const float* a, const float* b, int n) {
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_add_ps(acc0, _mm256_and_ps(d0, absMask));
+        acc1 = _mm256_add_ps(acc1, _mm256_and_ps(d1, absMask));
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_add_ps(acc0, _mm256_and_ps(d, absMask));
+    }
+    float sum = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += fabsf(a[i] - b[i]);
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static float avx2L2Squared(const float* a, const float* b, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        acc0 = _mm256_fmadd_ps(d, d, acc0);
+    }
+    float sum = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma"))) static void avx2CosineParts(const float* a, const float* b, int n,
+                                                                 float& dot, float& normA, float& normB) {
+    __m256 d = _mm256_setzero_ps(), na = _mm256_setzero_ps(), nb = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i), vb = _mm256_loadu_ps(b + i);
+        d = _mm256_fmadd_ps(va, vb, d);
+        na = _mm256_fmadd_ps(va, va, na);
+        nb = _mm256_fmadd_ps(vb, vb, nb);
+    }
+    float sd = hsum256(d), sa = hsum256(na), sb = hsum256(nb);
+    for (; i < n; ++i) {
+        sd += a[i] * b[i];
+        sa += a[i] * a[i];
+        sb += b[i] * b[i];
+    }
+    dot = sd;
+    normA = sa;
+    normB = sb;
+}
+
+__attribute__((target("avx2,fma"))) static void avx2Dot4(const float* x, const float* const* q, int n, float* out) {
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps(), a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        a0 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q[0] + i), a0);
+        a1 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q[1] + i), a1);
+        a2 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q[2] + i), a2);
+        a3 = _mm256_fmadd_ps(vx, _mm256_loadu_ps(q[3] + i), a3);
+    }
+    out[0] = hsum256(a0);
+    out[1] = hsum256(a1);
+    out[2] = hsum256(a2);
+    out[3] = hsum256(a3);
+    for (; i < n; ++i) {
+        for (int j = 0; j < 4; ++j) out[j] += x[i] * q[j][i];
+    }
+}
+
+// --- AVX-512F: 16 lanes, masked tail ---
+
+__attribute__((target("avx512f"))) static inline __mmask16 tailMask(int remaining) {
+    return static_cast<__mmask16>((1u << remaining) - 1u);
+}
+
+// Same reduction as hsum256 on the two halves. _mm512_reduce_add_ps and the
+// unmasked 256-bit extracts read an undefined register in GCC's headers
+// (-Wuninitialized), so the halves are taken with a zero pass-through.
+__attribute__((target("avx512f"))) static inline float hsum512(__m512 v) {
+    __m512d wide = _mm512_castps_pd(v);
+    __m256 lo = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xF, wide, 0));
+    __m256 hi = _mm256_castpd_ps(_mm512_mask_extractf64x4_pd(_mm256_setzero_pd(), 0xF, wide, 1));
+    lo = _mm256_add_ps(lo, hi);
+    __m128 q = _mm_add_ps(_mm256_castps256_ps128(lo), _mm256_extractf128_ps(lo, 1));
+    __m128 shuf = _mm_movehdup_ps(q);
+    __m128 sums = _mm_add_ps(q, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    sums = _mm_add_ss(sums, shuf);
+    return _mm_cvtss_f32(sums);
+}
+
+__attribute__((target("avx512f"))) static float avx512Dot(const float* a, const float* b, int n) {
+    __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc0);
+    if (i < n) {
+        __mmask16 m = tailMask(n - i);
+        acc1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i), acc1);
+    }
+    return hsum512(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f"))) static float avx512L1(const float* a, const float* b, int n) {
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_add_ps(acc, _mm512_abs_ps(d));
+    }
+    if (i < n) {
+        __mmask16 m = tailMask(n - i);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        acc = _mm512_add_ps(acc, _mm512_abs_ps(d));
+    }
+    return hsum512(acc);
+}
+
+__attribute__((target("avx512f"))) static float avx512L2Squared(const float* a, const float* b, int n) {
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    if (i < n) {
+        __mmask16 m = tailMask(n - i);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i));
+        acc = _mm512_fmadd_ps(d, d, acc);
+    }
+    return hsum512(acc);
+}
+
+__attribute__((target("avx512f"))) static void avx512CosineParts(const float* a, const float* b, int n,
+                                                                  float& dot, float& normA, float& normB) {
+    __m512 d = _mm512_setzero_ps(), na = _mm512_setzero_ps(), nb = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 va = _mm512_loadu_ps(a + i), vb = _mm512_loadu_ps(b + i);
+        d = _mm512_fmadd_ps(va, vb, d);
+        na = _mm512_fmadd_ps(va, va, na);
+        nb = _mm512_fmadd_ps(vb, vb, nb);
+    }
+    if (i < n) {
+        __mmask16 m = tailMask(n - i);
+        __m512 va = _mm512_maskz_loadu_ps(m, a + i), vb = _mm512_maskz_loadu_ps(m, b + i);
+        d = _mm512_fmadd_ps(va, vb, d);
+        na = _mm512_fmadd_ps(va, va, na);
+        nb = _mm512_fmadd_ps(vb, vb, nb);
+    }
+    dot = hsum512(d);
+    normA = hsum512(na);
+    normB = hsum512(nb);
+}
+
+__attribute__((target("avx512f"))) static void avx512Dot4(const float* x, const float* const* q, int n, float* out) {
+    __m512 a0 = _mm512_setzero_ps(), a1 = _mm512_setzero_ps(), a2 = _mm512_setzero_ps(), a3 = _mm512_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m512 vx = _mm512_loadu_ps(x + i);
+        a0 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q[0] + i), a0);
+        a1 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q[1] + i), a1);
+        a2 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q[2] + i), a2);
+        a3 = _mm512_fmadd_ps(vx, _mm512_loadu_ps(q[3] + i), a3);
+    }
+    if (i < n) {
+        __mmask16 m = tailMask(n - i);
+        __m512 vx = _mm512_maskz_loadu_ps(m, x + i);
+        a0 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, q[0] + i), a0);
+        a1 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, q[1] + i), a1);
+        a2 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, q[2] + i), a2);
+        a3 = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(m, q[3] + i), a3);
+    }
+    out[0] = hsum512(a0);
+    out[1] = hsum512(a1);
+    out[2] = hsum512(a2);
+    out[3] = hsum512(a3);
+}
+
+// --- Quantized rows: SSE2 int8, AVX2 int8 / F16C half ---
+
+__attribute__((target("sse2"))) static int sse2DotInt8(const signed char* a, const signed char* b, int n) {
+    __m128i acc = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        // Sign-extend bytes to 16 bits by unpacking into the high byte.
+        __m128i aLo = _mm_srai_epi16(_mm_unpacklo_epi8(va, va), 8);
+        __m128i aHi = _mm_srai_epi16(_mm_unpackhi_epi8(va, va), 8);
+        __m128i bLo = _mm_srai_epi16(_mm_unpacklo_epi8(vb, vb), 8);
+        __m128i bHi = _mm_srai_epi16(_mm_unpackhi_epi8(vb, vb), 8);
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(aLo, bLo));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(aHi, bHi));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    int sum = _mm_cvtsi128_si32(acc);
+    for (; i < n; ++i) sum += static_cast<int>(a[i]) * b[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c"))) static int avx2DotInt8(const signed char* a, const signed char* b, int n) {
+    __m256i acc0 = _mm256_setzero_si256(), acc1 = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        __m256i a1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i + 16)));
+        __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i + 16)));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(a0, b0));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(a1, b1));
+    }
+    for (; i + 16 <= n; i += 16) {
+        __m256i a0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(a0, b0));
+    }
+    __m256i acc = _mm256_add_epi32(acc0, acc1);
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    int sum = _mm_cvtsi128_si32(s);
+    for (; i < n; ++i) sum += static_cast<int>(a[i]) * b[i];
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c"))) static float avx2L1Int8(const float* q, const float* scale,
+                                                                 const signed char* c, int n) {
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(c + i));
+        __m256 code = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+        __m256 d = _mm256_fnmadd_ps(_mm256_loadu_ps(scale + i), code, _mm256_loadu_ps(q + i));
+        acc = _mm256_add_ps(acc, _mm256_and_ps(d, absMask));
+    }
+    float sum = hsum256(acc);
+    for (; i < n; ++i) sum += fabsf(q[i] - scale[i] * c[i]);
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c"))) static float avx2DotHalf(const float* q, const unsigned short* x, int n) {
+    __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        __m256 x1 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i + 8)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), x0, acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8), x1, acc1);
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), x0, acc0);
+    }
+    float sum = hsum256(_mm256_add_ps(acc0, acc1));
+    for (; i < n; ++i) sum += q[i] * halfToFloat(x[i]);
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c"))) static float avx2L1Half(const float* q, const unsigned short* x, int n) {
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        acc = _mm256_add_ps(acc, _mm256_and_ps(_mm256_sub_ps(_mm256_loadu_ps(q + i), x0), absMask));
+    }
+    float sum = hsum256(acc);
+    for (; i < n; ++i) sum += fabsf(q[i] - halfToFloat(x[i]));
+    return sum;
+}
+
+__attribute__((target("avx2,fma,f16c"))) static float avx2L2SquaredHalf(const float* q, const unsigned short* x,
+                                                                        int n) {
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(x + i)));
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(q + i), x0);
+        acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    float sum = hsum256(acc);
+    for (; i < n; ++i) {
+        float d = q[i] - halfToFloat(x[i]);
+        sum += d * d;
+    }
+    return sum;
+}
+
+// The AVX-512 table reuses the AVX2 quantized kernels: every AVX-512F part
+// also has AVX2 and F16C, and the codes are narrow enough that a scan is
+// bound by memory rather than by lane count.
+static const DistanceKernels::Table sse2Table = {
+    DistanceKernels::Isa::SSE2, sse2Dot, sse2L1, sse2L2Squared, sse2CosineParts, sse2Dot4,
+    sse2DotInt8, scalarL1Int8, scalarDotHalf, scalarL1Half, scalarL2SquaredHalf
+};
+static const DistanceKernels::Table avx2Table = {
+    DistanceKernels::Isa::AVX2, avx2Dot, avx2L1, avx2L2Squared, avx2CosineParts, avx2Dot4,
+    avx2DotInt8, avx2L1Int8, avx2DotHalf, avx2L1Half, avx2L2SquaredHalf
+};
+static const DistanceKernels::Table avx512Table = {
+    DistanceKernels::Isa::AVX512, avx512Dot, avx512L1, avx512L2Squared, avx512CosineParts, avx512Dot4,
+    avx2DotInt8, avx2L1Int8, avx2DotHalf, avx2L1Half, avx2L2SquaredHalf
+};
+
+#endif // VECTORSTORE_X86_KERNELS
+
+DistanceKernels::Isa DistanceKernels::detectIsa() {
+#ifdef VECTORSTORE_X86_KERNELS
+    // __builtin_cpu_supports reads cpuid (and XCR0 for the AVX state bits).
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("f16c")) return Isa::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") && __builtin_cpu_supports("f16c")) {
+        return Isa::AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) return Isa::SSE2;
+#endif
+    return Isa::Scalar;
+}
+
+const DistanceKernels::Table* DistanceKernels::tableFor(Isa isa) {
+#ifdef VECTORSTORE_X86_KERNELS
+    switch (isa) {
+        case Isa::AVX512: return &avx512Table;
+        case Isa::AVX2:   return &avx2Table;
+        case Isa::SSE2:   return &sse2Table;
+        default:          break;
+    }
+#endif
+    (void)isa;
+    return &scalarTable;
+}
+
+std::atomic<const DistanceKernels::Table*>& DistanceKernels::active() {
+    static std::atomic<const Table*> table(tableFor(detectIsa()));
+    return table;
+}
+
+DistanceKernels::Isa DistanceKernels::activeIsa() {
+    return active().load(std::memory_order_relaxed)->isa;
+}
+
+bool DistanceKernels::select(Isa isa) {
+    if (static_cast<int>(isa) > static_cast<int>(detectIsa())) return false;
+
+    active().store(tableFor(isa), std::memory_order_relaxed);
+    return true;
+}
+
+const char* DistanceKernels::isaName(Isa isa) {
+    switch (isa) {
+        case Isa::AVX512: return "avx512";
+        case Isa::AVX2:   return "avx2";
+        case Isa::SSE2:   return "sse2";
+        default:          return "scalar";
+    }
+}
+
+float DistanceKernels::dot(const float* a, const float* b, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, sizeof(float) * n);
+    return active().load(std::memory_order_relaxed)->dot(a, b, n);
+}
+
+float DistanceKernels::l1(const float* a, const float* b, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, sizeof(float) * n);
+    return active().load(std::memory_order_relaxed)->l1(a, b, n);
+}
+
+float DistanceKernels::l2Squared(const float* a, const float* b, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, sizeof(float) * n);
+    return active().load(std::memory_order_relaxed)->l2Squared(a, b, n);
+}
+
+void DistanceKernels::cosineParts(const float* a, const float* b, int n, float& dot, float& normA, float& normB) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, sizeof(float) * n);
+    active().load(std::memory_order_relaxed)->cosineParts(a, b, n, dot, normA, normB);
+}
+
+DistanceKernels::Metric DistanceKernels::parseMetric(const string& metric) {
+    if (metric == "cosine") return Metric::Cosine;
+    if (metric == "euclidean") return Metric::Euclidean;
+    if (metric == "manhattan") return Metric::Manhattan;
+    throw invalid_metric();
+}
+
+double DistanceKernels::distance(Metric metric, const float* a, const float* b, int n) {
+    switch (metric) {
+        case Metric::Cosine:    return 1.0 - dot(a, b, n);
+        case Metric::Euclidean: return sqrt(static_cast<double>(l2Squared(a, b, n)));
+        default:                return l1(a, b, n);
+    }
+}
+
+void DistanceKernels::normalize(float* v, int n) {
+    float norm = active().load(std::memory_order_relaxed)->dot(v, v, n); // not a distance evaluation
+    if (norm == 0.0f) return;
+    float inv = 1.0f / sqrtf(norm);
+    for (int i = 0; i < n; ++i) v[i] *= inv;
+}
+
+void DistanceKernels::dot4(const float* x, const float* const* q, int n, float* out) {
+    VS_COUNT(DistanceEvaluations, 4);
+    VS_COUNT(BytesScanned, sizeof(float) * n);
+    active().load(std::memory_order_relaxed)->dot4(x, q, n, out);
+}
+
+int DistanceKernels::dotInt8(const signed char* a, const signed char* b, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, n);
+    return active().load(std::memory_order_relaxed)->dotInt8(a, b, n);
+}
+
+float DistanceKernels::l1Int8(const float* q, const float* scale, const signed char* c, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, n);
+    return active().load(std::memory_order_relaxed)->l1Int8(q, scale, c, n);
+}
+
+float DistanceKernels::dotHalf(const float* q, const unsigned short* x, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, sizeof(unsigned short) * n);
+    return active().load(std::memory_order_relaxed)->dotHalf(q, x, n);
+}
+
+float DistanceKernels::l1Half(const float* q, const unsigned short* x, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, sizeof(unsigned short) * n);
+    return active().load(std::memory_order_relaxed)->l1Half(q, x, n);
+}
+
+float DistanceKernels::l2SquaredHalf(const float* q, const unsigned short* x, int n) {
+    VS_COUNT(DistanceEvaluations, 1);
+    VS_COUNT(BytesScanned, sizeof(unsigned short) * n);
+    return active().load(std::memory_order_relaxed)->l2SquaredHalf(q, x, n);
+}
+
+unsigned short DistanceKernels::toHalf(float v) {
+    return floatToHalf(v);
+}
+
+float DistanceKernels::fromHalf(unsigned short h) {
+    return halfToFloat(h);
+}
+
+// ----------------- WorkerPool Implementation -----------------
+
+WorkerPool::WorkerPool(int threads) {
+    if (threads <= 0) threads = static_cast<int>(std::thread::hardware_concurrency());
+    if (threads <= 0) threads = 1;
+    workerCount = threads - 1; // the caller is the last worker
+    stopping = false;
+    head = nullptr;
+    workers = (workerCount > 0) ? new std::thread[workerCount] : nullptr;
+    for (int i = 0; i < workerCount; ++i) workers[i] = std::thread(&WorkerPool::workerLoop, this);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (int i = 0; i < workerCount; ++i) workers[i].join();
+    delete[] workers;
+}
+
+int WorkerPool::size() const {
+    return workerCount + 1;
+}
+
+// Must hold `mutex`.
+void WorkerPool::unlink(Job* job) {
+    Job** link = &head;
+    while (*link && *link != job) link = &(*link)->nextJob;
+    if (*link) *link = job->nextJob;
+}
+
+void WorkerPool::workerLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || head != nullptr; });
+        if (!head) return; // stopping with nothing queued
+
+        // Jobs are only dereferenced under the lock or while one of their
+        // tasks is pending, so the owner can safely return once pending == 0.
+        Job* job = head;
+        int task = job->next.fetch_add(1);
+        if (task >= job->tasks) {
+            unlink(job);
+            continue;
+        }
+        lock.unlock();
+        job->fn(job->ctx, task);
+        bool last = (job->pending.fetch_sub(1) == 1);
+        lock.lock();
+        if (last) done.notify_all();
+    }
+}
+
+void WorkerPool::run(int tasks, void (*fn)(void*, int), void* ctx) {
+    if (tasks <= 0) return;
+    if (workerCount == 0 || tasks == 1) {
+        for (int t = 0; t < tasks; ++t) fn(ctx, t);
+        return;
+    }
+
+    Job job;
+    job.fn = fn;
+    job.ctx = ctx;
+    job.tasks = tasks;
+    job.next.store(0);
+    job.pending.store(tasks);
+    job.nextJob = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Job** link = &head;
+        while (*link) link = &(*link)->nextJob;
+        *link = &job;
+    }
+    wake.notify_all();
+
+    for (int task = job.next.fetch_add(1); task < tasks; task = job.next.fetch_add(1)) {
+        fn(ctx, task);
+        job.pending.fetch_sub(1);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&job] { return job.pending.load() == 0; });
+    unlink(&job);
+}
+
+// ----------------- HnswIndex Implementation -----------------
+
+// Unbounded binary min-heap on (key, item), used as the HNSW candidate queue.
+struct CandidateHeap {
+    double* keys;
+    int* items;
+    int count;
+    int capacity;
+
+    CandidateHeap(int capacity) : keys(new double[capacity]), items(new int[capacity]), count(0), capacity(capacity) {}
+    ~CandidateHeap() {
+        delete[] keys;
+        delete[] items;
+    }
+
+    void push(double key, int item) {
+        if (count == capacity) {
+            int newCapacity = capacity * 2;
+            double* newKeys = new double[newCapacity];
+            int* newItems = new int[newCapacity];
+            memcpy(newKeys, keys, sizeof(double) * count);
+            memcpy(newItems, items, sizeof(int) * count);
+            delete[] keys;
+            delete[] items;
+            keys = newKeys;
+            items = newItems;
+            capacity = newCapacity;
+        }
+        int pos = count++;
+        while (pos > 0) {
+            int parent = (pos - 1) / 2;
+            if (keys[parent] <= key) break;
+            keys[pos] = keys[parent];
+            items[pos] = items[parent];
+            pos = parent;
+        }
+        keys[pos] = key;
+        items[pos] = item;
+    }
+
+    void pop() {
+        double key = keys[--count];
+        int item = items[count];
+        int pos = 0;
+        while (true) {
+            int child = 2 * pos + 1;
+            if (child >= count) break;
+            if (child + 1 < count && keys[child + 1] < keys[child]) ++child;
+            if (key <= keys[child]) break;
+            keys[pos] = keys[child];
+            items[pos] = items[child];
+            pos = child;
+        }
+        keys[pos] = key;
+        items[pos] = item;
+    }
+};
+
+HnswIndex::HnswIndex(int dimension, Distance distanceKind, int M, int efConstruction, unsigned long long seed) {
+    if (dimension <= 0) throw std::invalid_argument("HnswIndex - dimension must be positive");
+
+    this->dimension = dimension;
+    this->distanceKind = distanceKind;
+    this->M = (M >= 2) ? M : 2;
+    maxM0 = 2 * this->M;
+    this->efConstruction = (efConstruction > this->M) ? efConstruction : this->M;
+    efSearch = 64;
+    levelMult = 1.0 / log(static_cast<double>(this->M));
+    vectors = nullptr;
+    levels = nullptr;
+    labels = nullptr;
+    deleted = nullptr;
+    level0Links = nullptr;
+    upperLinks = nullptr;
+    nodeCount = 0;
+    nodeCapacity = 0;
+    liveCount = 0;
+    entryPoint = -1;
+    maxLevel = -1;
+    labelToNode = nullptr;
+    labelCapacity = 0;
+    rngState = seed ? seed : 1ULL;
+    freeNodes = nullptr;
+    freeCount = 0;
+    freeCapacity = 0;
+    visitedPool = nullptr;
+    visitedPooled = 0;
+    visitedPoolCapacity = 0;
+}
+
+HnswIndex::~HnswIndex() {
+    clear();
+}
+
+void HnswIndex::clear() {
+    for (int i = 0; i < nodeCount; ++i) delete[] upperLinks[i];
+    delete[] vectors;
+    delete[] levels;
+    delete[] labels;
+    delete[] deleted;
+    delete[] level0Links;
+    delete[] upperLinks;
+    delete[] labelToNode;
+    delete[] freeNodes;
+    for (int i = 0; i < visitedPooled; ++i) {
+        delete[] visitedPool[i]->tags;
+        delete visitedPool[i];
+    }
+    delete[] visitedPool;
+    vectors = nullptr;
+    levels = nullptr;
+    labels = nullptr;
+    deleted = nullptr;
+    level0Links = nullptr;
+    upperLinks = nullptr;
+    labelToNode = nullptr;
+    freeNodes = nullptr;
+    visitedPool = nullptr;
+    nodeCount = 0;
+    nodeCapacity = 0;
+    liveCount = 0;
+    labelCapacity = 0;
+    freeCount = 0;
+    freeCapacity = 0;
+    visitedPooled = 0;
+    visitedPoolCapacity = 0;
+    entryPoint = -1;
+    maxLevel = -1;
+}
+
+void HnswIndex::ensureNodeCapacity(int cap) {
+    if (cap <= nodeCapacity) return;
+
+    int newCapacity = nodeCapacity + (nodeCapacity >> 1);
+    if (newCapacity < cap) newCapacity = cap;
+    if (newCapacity < 64) newCapacity = 64;
+
+    float* newVectors = new float[static_cast<long long>(newCapacity) * dimension];
+    int* newLevels = new int[newCapacity];
+    int* newLabels = new int[newCapacity];
+    unsigned char* newDeleted = new unsigned char[newCapacity];
+    int* newLevel0 = new int[static_cast<long long>(newCapacity) * (maxM0 + 1)];
+    int** newUpper = new int*[newCapacity];
+    if (nodeCount > 0) {
+        memcpy(newVectors, vectors, sizeof(float) * nodeCount * dimension);
+        memcpy(newLevels, levels, sizeof(int) * nodeCount);
+        memcpy(newLabels, labels, sizeof(int) * nodeCount);
+        memcpy(newDeleted, deleted, nodeCount);
+        memcpy(newLevel0, level0Links, sizeof(int) * nodeCount * (maxM0 + 1));
+        memcpy(newUpper, upperLinks, sizeof(int*) * nodeCount);
+    }
+    delete[] vectors;
+    delete[] levels;
+    delete[] labels;
+    delete[] deleted;
+    delete[] level0Links;
+    delete[] upperLinks;
+    vectors = newVectors;
+    levels = newLevels;
+    labels = newLabels;
+    deleted = newDeleted;
+    level0Links = newLevel0;
+    upperLinks = newUpper;
+    nodeCapacity = newCapacity;
+}
+
+void HnswIndex::ensureLabelCapacity(int cap) {
+    if (cap <= labelCapacity) return;
+
+    int newCapacity = labelCapacity + (labelCapacity >> 1);
+    if (newCapacity < cap) newCapacity = cap;
+    if (newCapacity < 64) newCapacity = 64;
+    int* grown = new int[newCapacity];
+    for (int i = 0; i < labelCapacity; ++i) grown[i] = labelToNode[i];
+    for (int i = labelCapacity; i < newCapacity; ++i) grown[i] = -1;
+    delete[] labelToNode;
+    labelToNode = grown;
+    labelCapacity = newCapacity;
+}
+
+const float* HnswIndex::nodeVector(int node) const {
+    return vectors + static_cast<long long>(node) * dimension;
+}
+
+int* HnswIndex::linksAt(int node, int level) const {
+    if (level == 0) return level0Links + static_cast<long long>(node) * (maxM0 + 1);
+    return upperLinks[node] + (level - 1) * (M + 1);
+}
+
+double HnswIndex::distance(const float* a, const float* b) const {
+    return DistanceKernels::distance(distanceKind, a, b, dimension);
+}
+
+// Cosine rows are stored unit length so the distance is a single dot product.
+void HnswIndex::prepareQuery(const float* query, float* out) const {
+    memcpy(out, query, sizeof(float) * dimension);
+    if (distanceKind == Distance::Cosine) DistanceKernels::normalize(out, dimension);
+}
+
+// Lists are pooled per index: a search takes one, sized to the node
+// capacity, and hands it back, so steady-state searches allocate nothing.
+HnswIndex::VisitedList* HnswIndex::acquireVisited() const {
+    VisitedList* list = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(visitedLock);
+        if (visitedPooled > 0) list = visitedPool[--visitedPooled];
+    }
+    if (!list) {
+        list = new VisitedList;
+        list->tags = nullptr;
+        list->epoch = 0;
+        list->capacity = 0;
+    }
+    if (list->capacity < nodeCount) {
+        delete[] list->tags;
+        list->tags = new unsigned short[nodeCapacity];
+        memset(list->tags, 0, sizeof(unsigned short) * nodeCapacity);
+        list->epoch = 0;
+        list->capacity = nodeCapacity;
+    }
+    return list;
+}
+
+void HnswIndex::releaseVisited(VisitedList* list) const {
+    std::lock_guard<std::mutex> guard(visitedLock);
+    if (visitedPooled == visitedPoolCapacity) {
+        int newCapacity = (visitedPoolCapacity < 4) ? 4 : visitedPoolCapacity * 2;
+        VisitedList** grown = new VisitedList*[newCapacity];
+        for (int i = 0; i < visitedPooled; ++i) grown[i] = visitedPool[i];
+        delete[] visitedPool;
+        visitedPool = grown;
+        visitedPoolCapacity = newCapacity;
+    }
+    visitedPool[visitedPooled++] = list;
+}
+
+// Clears the marks; the tags are only zeroed when the 16-bit epoch wraps.
+void HnswIndex::nextEpoch(VisitedList& list) {
+    if (++list.epoch == 0) {
+        memset(list.tags, 0, sizeof(unsigned short) * list.capacity);
+        list.epoch = 1;
+    }
+}
+
+int HnswIndex::randomLevel() {
+    rngState = rngState * 6364136223846793005ULL + 1442695040888963407ULL;
+    double u = (static_cast<double>(rngState >> 11) + 1.0) / 9007199254740993.0; // (0, 1]
+    int level = static_cast<int>(-log(u) * levelMult);
+    return (level < MAX_LEVEL) ? level : MAX_LEVEL;
+}
+
+// `skip` is never stepped onto (a node being relinked to its own vector).
+void HnswIndex::greedyDescend(const float* q, int& ep, double& epDist, int level, int skip) const {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        const int* links = linksAt(ep, level);
+        for (int i = 1; i <= links[0]; ++i) {
+            if (links[i] == skip) continue;
+            double d = distance(q, nodeVector(links[i]));
+            if (d < epDist) {
+                epDist = d;
+                ep = links[i];
+                changed = true;
+            }
+        }
+    }
+}
+
+// Best-first search of one layer. Tombstoned nodes are still expanded but,
+// with liveOnly, never enter the result set. Results are written nearest first.
+// Filtered-out nodes (tombstones with liveOnly, labels outside `allowed`)
+// still route the search; they are only kept out of the result heap.
+int HnswIndex::searchLayer(const float* q, int entry, int ef, int level, bool liveOnly, const RowBitmap* allowed,
+                           VisitedList& visited, double* keysOut, int* nodesOut) const {
+    CandidateHeap candidates(ef * 2 + 16);
+    TopKSelector top(ef);
+    double d = distance(q, nodeVector(entry));
+    visited.tags[entry] = visited.epoch;
+    int visitedCount = 1;
+    candidates.push(d, entry);
+    if ((!liveOnly || !deleted[entry]) && (!allowed || allowed->test(labels[entry]))) top.offer(d, entry);
+
+    while (candidates.count > 0) {
+        double currentKey = candidates.keys[0];
+        int current = candidates.items[0];
+        if (top.full() && currentKey > top.worstKey()) break;
+        candidates.pop();
+
+        const int* links = linksAt(current, level);
+        for (int i = 1; i <= links[0]; ++i) {
+            int nb = links[i];
+            if (visited.tags[nb] == visited.epoch) continue;
+            visited.tags[nb] = visited.epoch;
+            ++visitedCount;
+            double nd = distance(q, nodeVector(nb));
+            if (!top.full() || nd < top.worstKey()) {
+                candidates.push(nd, nb);
+                if ((!liveOnly || !deleted[nb]) && (!allowed || allowed->test(labels[nb]))) top.offer(nd, nb);
+            }
+        }
+    }
+    VS_COUNT(NodesVisited, visitedCount);
+    return top.drainSorted(keysOut, nodesOut);
+}
+
+// Malkov's heuristic: walk candidates nearest first and keep one only if it
+// is closer to the base than to every neighbour kept so far. Compacts the
+// kept entries to the front of keys/nodes.
+int HnswIndex::selectNeighbors(double* keys, int* nodes, int n, int m) const {
+    int kept = 0;
+    for (int i = 0; i < n && kept < m; ++i) {
+        bool good = true;
+        for (int j = 0; j < kept; ++j) {
+            if (distance(nodeVector(nodes[i]), nodeVector(nodes[j])) < keys[i]) {
+                good = false;
+                break;
+            }
+        }
+        if (good) {
+            keys[kept] = keys[i];
+            nodes[kept] = nodes[i];
+            ++kept;
+        }
+    }
+    return kept;
+}
+
+// Sorts nodes[0, n) nearest to `base` first, filling keys; n <= 2 * maxM0 + 1.
+void HnswIndex::sortCandidates(const float* base, double* keys, int* nodes, int n) const {
+    for (int i = 0; i < n; ++i) {
+        keys[i] = distance(base, nodeVector(nodes[i]));
+        for (int j = i; j > 0 && keys[j] < keys[j - 1]; --j) {
+            double tk = keys[j]; keys[j] = keys[j - 1]; keys[j - 1] = tk;
+            int tn = nodes[j]; nodes[j] = nodes[j - 1]; nodes[j - 1] = tn;
+        }
+    }
+}
+
+void HnswIndex::addLink(int from, int to, int level) {
+    int* links = linksAt(from, level);
+    for (int i = 1; i <= links[0]; ++i) {
+        if (links[i] == to) return; // a relinked node may already be known here
+    }
+    int maxConn = (level == 0) ? maxM0 : M;
+    if (links[0] < maxConn) {
+        links[++links[0]] = to;
+        return;
+    }
+
+    // Full: re-run the heuristic over the old neighbours plus the new one.
+    int n = links[0] + 1;
+    double* keys = new double[n];
+    int* nodes = new int[n];
+    for (int i = 0; i < n; ++i) nodes[i] = (i < links[0]) ? links[i + 1] : to;
+    sortCandidates(nodeVector(from), keys, nodes, n);
+    int kept = selectNeighbors(keys, nodes, n, maxConn);
+    links[0] = kept;
+    for (int i = 0; i < kept; ++i) links[i + 1] = nodes[i];
+    delete[] nodes;
+    delete[] keys;
+}
+
+// Links a node whose own lists are empty: greedy descent from the entry
+// point above its level, then an efConstruction search per layer below.
+void HnswIndex::linkNode(int node, int level) {
+    const float* stored = nodeVector(node);
+    int ep = entryPoint;
+    double epDist = distance(stored, nodeVector(ep));
+    for (int lc = maxLevel; lc > level; --lc) greedyDescend(stored, ep, epDist, lc, node);
+
+    VisitedList* visited = acquireVisited();
+    double* keys = new double[efConstruction];
+    int* nodes = new int[efConstruction];
+    for (int lc = (level < maxLevel) ? level : maxLevel; lc >= 0; --lc) {
+        nextEpoch(*visited);
+        visited->tags[node] = visited->epoch;
+        int found = searchLayer(stored, ep, efConstruction, lc, false, nullptr, *visited, keys, nodes);
+        if (found == 0) continue;
+        ep = nodes[0];
+
+        int kept = selectNeighbors(keys, nodes, found, M);
+        int* own = linksAt(node, lc);
+        own[0] = kept;
+        for (int i = 0; i < kept; ++i) {
+            own[i + 1] = nodes[i];
+            addLink(nodes[i], node, lc);
+        }
+    }
+    delete[] nodes;
+    delete[] keys;
+    releaseVisited(visited);
+}
+
+// Moves an existing node (same level, new vector) as hnswlib's updatePoint
+// does: each old neighbour that linked to it refills that slot from the
+// node's former neighbourhood, then the node is linked afresh. In-links
+// from elsewhere stay and only route.
+void HnswIndex::relinkNode(int node, const float* vector) {
+    int level = levels[node];
+    double* keys = new double[2 * maxM0 + 1];
+    int* nodes = new int[2 * maxM0 + 1];
+    for (int lc = level; lc >= 0; --lc) {
+        int* own = linksAt(node, lc);
+        int maxConn = (lc == 0) ? maxM0 : M;
+        for (int i = 1; i <= own[0]; ++i) {
+            int nb = own[i];
+            int* links = linksAt(nb, lc);
+            int n = 0;
+            bool linked = false;
+            for (int j = 1; j <= links[0]; ++j) {
+                if (links[j] == node) linked = true;
+                else nodes[n++] = links[j];
+            }
+            if (!linked) continue;
+            for (int j = 1; j <= own[0]; ++j) {
+                int c = own[j];
+                bool known = (c == nb);
+                for (int t = 0; t < n && !known; ++t) known = (nodes[t] == c);
+                if (!known) nodes[n++] = c;
+            }
+            sortCandidates(nodeVector(nb), keys, nodes, n);
+            int kept = selectNeighbors(keys, nodes, n, maxConn);
+            links[0] = kept;
+            for (int j = 0; j < kept; ++j) links[j + 1] = nodes[j];
+        }
+        own[0] = 0;
+    }
+    delete[] nodes;
+    delete[] keys;
+
+    prepareQuery(vector, vectors + static_cast<long long>(node) * dimension);
+    linkNode(node, level);
+}
+
+// A live label is relinked in place and a new one takes a tombstoned node
+// when there is one. The entry point is never moved: re-inserting its label
+// tombstones it and appends, as before.
+void HnswIndex::insert(const float* vector, int label) {
+    if (label < 0) throw std::out_of_range("HnswIndex::insert - negative label");
+
+    if (contains(label) && labelToNode[label] != entryPoint) {
+        relinkNode(labelToNode[label], vector);
+        return;
+    }
+    markDeleted(label);
+    ensureLabelCapacity(label + 1);
+    if (freeCount > 0) {
+        int node = freeNodes[--freeCount];
+        labels[node] = label;
+        deleted[node] = 0;
+        labelToNode[label] = node;
+        ++liveCount;
+        relinkNode(node, vector);
+        return;
+    }
+    ensureNodeCapacity(nodeCount + 1);
+
+    int node = nodeCount;
+    float* stored = vectors + static_cast<long long>(node) * dimension;
+    prepareQuery(vector, stored);
+    int level = randomLevel();
+    levels[node] = level;
+    labels[node] = label;
+    deleted[node] = 0;
+    level0Links[static_cast<long long>(node) * (maxM0 + 1)] = 0;
+    upperLinks[node] = nullptr;
+    if (level > 0) {
+        upperLinks[node] = new int[level * (M + 1)];
+        for (int l = 0; l < level; ++l) upperLinks[node][l * (M + 1)] = 0;
+    }
+    ++nodeCount;
+    labelToNode[label] = node;
+    ++liveCount;
+
+    if (entryPoint == -1) {
+        entryPoint = node;
+        maxLevel = level;
+        return;
+    }
+    linkNode(node, level);
+
+    if (level > maxLevel) {
+        maxLevel = level;
+        entryPoint = node;
+    }
+}
+
+bool HnswIndex::markDeleted(int label) {
+    if (label < 0 || label >= labelCapacity || labelToNode[label] == -1) return false;
+
+    int node = labelToNode[label];
+    deleted[node] = 1;
+    labelToNode[label] = -1;
+    --liveCount;
+    if (node != entryPoint) {
+        if (freeCount == freeCapacity) {
+            int newCapacity = (freeCapacity < 64) ? 64 : freeCapacity * 2;
+            int* grown = new int[newCapacity];
+            for (int i = 0; i < freeCount; ++i) grown[i] = freeNodes[i];
+            delete[] freeNodes;
+            freeNodes = grown;
+            freeCapacity = newCapacity;
+        }
+        freeNodes[freeCount++] = node;
+    }
+    return true;
+}
+
+bool HnswIndex::contains(int label) const {
+    return label >= 0 && label < labelCapacity && labelToNode[label] != -1;
+}
+
+int HnswIndex::search(const float* query, int k, double* keysOut, int* labelsOut,
+                      const RowBitmap* allowed) const {
+    if (k <= 0 || entryPoint == -1 || liveCount == 0) return 0;
+
+    float* q = new float[dimension];
+    prepareQuery(query, q);
+    int ep = entryPoint;
+    double epDist = distance(q, nodeVector(ep));
+    for (int lc = maxLevel; lc > 0; --lc) greedyDescend(q, ep, epDist, lc);
+
+    int ef = (efSearch > k) ? efSearch : k;
+    VisitedList* visited = acquireVisited();
+    nextEpoch(*visited);
+    double* keys = new double[ef];
+    int* nodes = new int[ef];
+    int found = searchLayer(q, ep, ef, 0, true, allowed, *visited, keys, nodes);
+    if (found > k) found = k;
+    for (int i = 0; i < found; ++i) {
+        keysOut[i] = keys[i];
+        labelsOut[i] = labels[nodes[i]];
+    }
+    delete[] nodes;
+    delete[] keys;
+    releaseVisited(visited);
+    delete[] q;
+    return found;
+}
+
+void HnswIndex::setEfSearch(int efSearch) {
+    this->efSearch = (efSearch > 0) ? efSearch : 1;
+}
+
+int HnswIndex::getEfSearch() const {
+    return efSearch;
+}
+
+int HnswIndex::getM() const {
+    return M;
+}
+
+int HnswIndex::getEfConstruction() const {
+    return efConstruction;
+}
+
+DistanceKernels::Metric HnswIndex::getDistance() const {
+    return distanceKind;
+}
+
+int HnswIndex::size() const {
+    return liveCount;
+}
+
+int HnswIndex::nodeSize() const {
+    return nodeCount;
+}
+
+// ----------------- k-means (shared by IvfIndex and ProductQuantizer) -----------------
+
+static int nearestRow(const float* v, const float* rows, int count, int dim, DistanceKernels::Metric metric) {
+    int best = 0;
+    double bestDist = DistanceKernels::distance(metric, v, rows, dim);
+    for (int c = 1; c < count; ++c) {
+        double d = DistanceKernels::distance(metric, v, rows + static_cast<long long>(c) * dim, dim);
+        if (d < bestDist) {
+            bestDist = d;
+            best = c;
+        }
+    }
+    return best;
+}
+
+// Lloyd's k-means over n prepared rows of `dim` floats into k centroids.
+// Seeds are distinct random rows; an empty cluster is re-seeded by splitting
+// the largest one. Cosine keeps centroids unit length (spherical k-means).
+static void runKMeans(const float* sample, int n, int dim, int k, int iterations,
+                      DistanceKernels::Metric metric, float* centroids, WorkerPool* pool,
+                      unsigned long long seed) {
+    // Seed with distinct random rows (partial Fisher-Yates over the sample).
+    unsigned long long state = seed ? seed : 1ULL;
+    int* order = new int[n];
+    for (int i = 0; i < n; ++i) order[i] = i;
+    for (int c = 0; c < k; ++c) {
+        int pick;
+        if (c < n) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            int j = c + static_cast<int>((state >> 33) % static_cast<unsigned long long>(n - c));
+            int t = order[c]; order[c] = order[j]; order[j] = t;
+            pick = order[c];
+        } else {
+            pick = order[c % n]; // more lists than rows: duplicates get split below
+        }
+        memcpy(centroids + static_cast<long long>(c) * dim,
+               sample + static_cast<long long>(pick) * dim, sizeof(float) * dim);
+    }
+    delete[] order;
+
+    int* assign = new int[n];
+    double* sums = new double[static_cast<long long>(k) * dim];
+    int* sizes = new int[k];
+    const int chunkRows = 1024;
+    int chunks = (n + chunkRows - 1) / chunkRows;
+    auto assignChunk = [&](int chunk) {
+        int end = (chunk + 1) * chunkRows < n ? (chunk + 1) * chunkRows : n;
+        for (int i = chunk * chunkRows; i < end; ++i) {
+            assign[i] = nearestRow(sample + static_cast<long long>(i) * dim, centroids, k, dim, metric);
+        }
+    };
+
+    for (int iter = 0; iter < iterations; ++iter) {
+        if (pool) pool->parallelFor(chunks, assignChunk);
+        else for (int c = 0; c < chunks; ++c) assignChunk(c);
+
+        memset(sums, 0, sizeof(double) * k * dim);
+        memset(sizes, 0, sizeof(int) * k);
+        for (int i = 0; i < n; ++i) {
+            double* sum = sums + static_cast<long long>(assign[i]) * dim;
+            const float* row = sample + static_cast<long long>(i) * dim;
+            for (int d = 0; d < dim; ++d) sum[d] += row[d];
+            ++sizes[assign[i]];
+        }
+        for (int c = 0; c < k; ++c) {
+            float* centroid = centroids + static_cast<long long>(c) * dim;
+            if (sizes[c] == 0) {
+                // Empty cluster: split the largest one by nudging a copy of it.
+                int largest = 0;
+                for (int o = 1; o < k; ++o) if (sizes[o] > sizes[largest]) largest = o;
+                const double* src = sums + static_cast<long long>(largest) * dim;
+                for (int d = 0; d < dim; ++d) {
+                    float mean = static_cast<float>(src[d] / (sizes[largest] > 0 ? sizes[largest] : 1));
+                    centroid[d] = mean * ((d % 2 == 0) ? 1.0001f : 0.9999f);
+                }
+            } else {
+                const double* sum = sums + static_cast<long long>(c) * dim;
+                for (int d = 0; d < dim; ++d) centroid[d] = static_cast<float>(sum[d] / sizes[c]);
+            }
+            if (metric == DistanceKernels::Metric::Cosine) DistanceKernels::normalize(centroid, dim);
+        }
+    }
+    delete[] sizes;
+    delete[] sums;
+    delete[] assign;
+}
+
+// ----------------- IvfIndex Implementation -----------------
+
+IvfIndex::IvfIndex(int dimension, DistanceKernels::Metric distanceKind, int nlist) {
+    if (dimension <= 0) throw std::invalid_argument("IvfIndex - dimension must be positive");
+
+    this->dimension = dimension;
+    this->distanceKind = distanceKind;
+    this->nlist = (nlist > 0) ? nlist : 1;
+    nprobe = (this->nlist < 8) ? this->nlist : 8;
+    trained = false;
+    centroids = new float[static_cast<long long>(this->nlist) * dimension];
+    memset(centroids, 0, sizeof(float) * this->nlist * dimension);
+    lists = new PostingList[this->nlist];
+    for (int i = 0; i < this->nlist; ++i) {
+        lists[i].vectors = nullptr;
+        lists[i].labels = nullptr;
+        lists[i].count = 0;
+        lists[i].capacity = 0;
+    }
+    labelList = nullptr;
+    labelPos = nullptr;
+    labelCapacity = 0;
+    liveCount = 0;
+}
+
+IvfIndex::~IvfIndex() {
+    reset();
+    delete[] lists;
+    delete[] centroids;
+}
+
+void IvfIndex::reset() {
+    for (int i = 0; i < nlist; ++i) {
+        delete[] lists[i].vectors;
+        delete[] lists[i].labels;
+        lists[i].vectors = nullptr;
+        lists[i].labels = nullptr;
+        lists[i].count = 0;
+        lists[i].capacity = 0;
+    }
+    delete[] labelList;
+    delete[] labelPos;
+    labelList = nullptr;
+    labelPos = nullptr;
+    labelCapacity = 0;
+    liveCount = 0;
+}
+
+double IvfIndex::distance(const float* a, const float* b) const {
+    return DistanceKernels::distance(distanceKind, a, b, dimension);
+}
+
+// Cosine vectors and centroids live on the unit sphere (spherical k-means).
+void IvfIndex::prepare(const float* v, float* out) const {
+    memcpy(out, v, sizeof(float) * dimension);
+    if (distanceKind == Distance::Cosine) DistanceKernels::normalize(out, dimension);
+}
+
+int IvfIndex::nearestCentroid(const float* v) const {
+    return nearestRow(v, centroids, nlist, dimension, distanceKind);
+}
+
+void IvfIndex::ensureLabelCapacity(int cap) {
+    if (cap <= labelCapacity) return;
+
+    int newCapacity = labelCapacity + (labelCapacity >> 1);
+    if (newCapacity < cap) newCapacity = cap;
+    if (newCapacity < 64) newCapacity = 64;
+    int* newList = new int[newCapacity];
+    int* newPos = new int[newCapacity];
+    for (int i = 0; i < labelCapacity; ++i) {
+        newList[i] = labelList[i];
+        newPos[i] = labelPos[i];
+    }
+    for (int i = labelCapacity; i < newCapacity; ++i) newList[i] = -1;
+    delete[] labelList;
+    delete[] labelPos;
+    labelList = newList;
+    labelPos = newPos;
+    labelCapacity = newCapacity;
+}
+
+void IvfIndex::append(int list, const float* prepared, int label) {
+    PostingList& pl = lists[list];
+    if (pl.count == pl.capacity) {
+        int newCapacity = (pl.capacity < 8) ? 8 : pl.capacity + (pl.capacity >> 1);
+        float* newVectors = new float[static_cast<long long>(newCapacity) * dimension];
+        int* newLabels = new int[newCapacity];
+        if (pl.count > 0) {
+            memcpy(newVectors, pl.vectors, sizeof(float) * pl.count * dimension);
+            memcpy(newLabels, pl.labels, sizeof(int) * pl.count);
+        }
+        delete[] pl.vectors;
+        delete[] pl.labels;
+        pl.vectors = newVectors;
+        pl.labels = newLabels;
+        pl.capacity = newCapacity;
+    }
+    memcpy(pl.vectors + static_cast<long long>(pl.count) * dimension, prepared, sizeof(float) * dimension);
+    pl.labels[pl.count] = label;
+    labelList[label] = list;
+    labelPos[label] = pl.count;
+    ++pl.count;
+    ++liveCount;
+}
+
+void IvfIndex::train(const float* data, int n, int stride, int iterations, WorkerPool* pool,
+                     unsigned long long seed) {
+    if (n <= 0) throw std::invalid_argument("IvfIndex::train - no training vectors");
+
+    float* sample = new float[static_cast<long long>(n) * dimension];
+    for (int i = 0; i < n; ++i) {
+        prepare(data + static_cast<long long>(i) * stride, sample + static_cast<long long>(i) * dimension);
+    }
+    runKMeans(sample, n, dimension, nlist, iterations, distanceKind, centroids, pool, seed);
+    delete[] sample;
+
+    reset();
+    trained = true;
+}
+
+void IvfIndex::add(const float* vector, int label) {
+    if (!trained) throw std::logic_error("IvfIndex::add - index is not trained");
+    if (label < 0) throw std::out_of_range("IvfIndex::add - negative label");
+
+    remove(label);
+    ensureLabelCapacity(label + 1);
+    float* prepared = new float[dimension];
+    prepare(vector, prepared);
+    append(nearestCentroid(prepared), prepared, label);
+    delete[] prepared;
+}
+
+// Bulk add: centroid assignment (the O(nlist * d) part) runs in parallel,
+// appends stay serial so list order follows input order.
+void IvfIndex::add(const float* data, int n, int stride, const int* labels, WorkerPool* pool) {
+    if (!trained) throw std::logic_error("IvfIndex::add - index is not trained");
+    if (n <= 0) return;
+
+    float* prepared = new float[static_cast<long long>(n) * dimension];
+    int* assign = new int[n];
+    const int chunkRows = 1024;
+    int chunks = (n + chunkRows - 1) / chunkRows;
+    auto assignChunk = [&](int chunk) {
+        int end = (chunk + 1) * chunkRows < n ? (chunk + 1) * chunkRows : n;
+        for (int i = chunk * chunkRows; i < end; ++i) {
+            float* row = prepared + static_cast<long long>(i) * dimension;
+            prepare(data + static_cast<long long>(i) * stride, row);
+            assign[i] = nearestCentroid(row);
+        }
+    };
+    if (pool) pool->parallelFor(chunks, assignChunk);
+    else for (int c = 0; c < chunks; ++c) assignChunk(c);
+
+    for (int i = 0; i < n; ++i) {
+        if (labels[i] < 0) continue;
+        remove(labels[i]);
+        ensureLabelCapacity(labels[i] + 1);
+        append(assign[i], prepared + static_cast<long long>(i) * dimension, labels[i]);
+    }
+    delete[] assign;
+    delete[] prepared;
+}
+
+// Swap-remove inside the posting list; order within a list carries no meaning.
+bool IvfIndex::remove(int label) {
+    if (!contains(label)) return false;
+
+    PostingList& pl = lists[labelList[label]];
+    int pos = labelPos[label];
+    int last = pl.count - 1;
+    if (pos != last) {
+        memcpy(pl.vectors + static_cast<long long>(pos) * dimension,
+               pl.vectors + static_cast<long long>(last) * dimension, sizeof(float) * dimension);
+        pl.labels[pos] = pl.labels[last];
+        labelPos[pl.labels[pos]] = pos;
+    }
+    --pl.count;
+    labelList[label] = -1;
+    --liveCount;
+    return true;
+}
+
+bool IvfIndex::contains(int label) const {
+    return label >= 0 && label < labelCapacity && labelList[label] != -1;
+}
+
+int IvfIndex::search(const float* query, int k, double* keysOut, int* labelsOut,
+                     const RowBitmap* allowed) const {
+    if (!trained || k <= 0 || liveCount == 0) return 0;
+
+    float* q = new float[dimension];
+    prepare(query, q);
+    int probes = (nprobe < nlist) ? nprobe : nlist;
+    TopKSelector nearestLists(probes);
+    for (int c = 0; c < nlist; ++c) {
+        nearestLists.offer(distance(q, centroids + static_cast<long long>(c) * dimension), c);
+    }
+    double* listKeys = new double[probes];
+    int* probeLists = new int[probes];
+    int probed = nearestLists.drainSorted(listKeys, probeLists);
+
+    TopKSelector top(k);
+    for (int p = 0; p < probed; ++p) {
+        const PostingList& pl = lists[probeLists[p]];
+        for (int i = 0; i < pl.count; ++i) {
+            if (allowed && !allowed->test(pl.labels[i])) continue;
+            top.offer(distance(q, pl.vectors + static_cast<long long>(i) * dimension), pl.labels[i]);
+        }
+    }
+    int found = top.drainSorted(keysOut, labelsOut);
+    delete[] probeLists;
+    delete[] listKeys;
+    delete[] q;
+    return found;
+}
+
+void IvfIndex::setNprobe(int nprobe) {
+    this->nprobe = (nprobe > 0) ? nprobe : 1;
+}
+
+int IvfIndex::getNprobe() const {
+    return nprobe;
+}
+
+int IvfIndex::getListCount() const {
+    return nlist;
+}
+
+int IvfIndex::listSize(int list) const {
+    if (list < 0 || list >= nlist) throw std::out_of_range("IvfIndex::listSize - list out of range");
+
+    return lists[list].count;
+}
+
+bool IvfIndex::isTrained() const {
+    return trained;
+}
+
+DistanceKernels::Metric IvfIndex::getDistance() const {
+    return distanceKind;
+}
+
+int IvfIndex::size() const {
+    return liveCount;
+}
+
+// ----------------- ProductQuantizer Implementation -----------------
+
+ProductQuantizer::ProductQuantizer(int dimension, int subspaces, DistanceKernels::Metric distanceKind) {
+    if (dimension <= 0) throw std::invalid_argument("ProductQuantizer - dimension must be positive");
+    if (subspaces <= 0 || subspaces > dimension) {
+        throw std::invalid_argument("ProductQuantizer - subspaces must be in [1, dimension]");
+    }
+
+    this->dimension = dimension;
+    this->subspaces = subspaces;
+    subDim = (dimension + subspaces - 1) / subspaces;
+    centroidsPerSub = 0;
+    this->distanceKind = distanceKind;
+    codebooks = new float[static_cast<long long>(subspaces) * CODEBOOK_SIZE * subDim];
+    memset(codebooks, 0, sizeof(float) * subspaces * CODEBOOK_SIZE * subDim);
+    trained = false;
+}
+
+ProductQuantizer::~ProductQuantizer() {
+    delete[] codebooks;
+}
+
+// Copies into subspaces * subDim floats: normalised for cosine, zero tail.
+void ProductQuantizer::pad(const float* v, float* out) const {
+    memcpy(out, v, sizeof(float) * dimension);
+    for (int i = dimension; i < subspaces * subDim; ++i) out[i] = 0.0f;
+    if (distanceKind == Distance::Cosine) DistanceKernels::normalize(out, dimension);
+}
+
+void ProductQuantizer::train(const float* data, int n, int stride, int iterations, WorkerPool* pool,
+                             unsigned long long seed) {
+    if (n <= 0) throw std::invalid_argument("ProductQuantizer::train - no training vectors");
+
+    int padded = subspaces * subDim;
+    float* prepared = new float[static_cast<long long>(n) * padded];
+    for (int i = 0; i < n; ++i) pad(data + static_cast<long long>(i) * stride, prepared + static_cast<long long>(i) * padded);
+
+    // Sub-space codebooks minimise squared error (L1 assignment for manhattan).
+    Distance subMetric = (distanceKind == Distance::Manhattan) ? Distance::Manhattan : Distance::Euclidean;
+    centroidsPerSub = (n < CODEBOOK_SIZE) ? n : CODEBOOK_SIZE;
+    float* slice = new float[static_cast<long long>(n) * subDim];
+    for (int sub = 0; sub < subspaces; ++sub) {
+        for (int i = 0; i < n; ++i) {
+            memcpy(slice + static_cast<long long>(i) * subDim,
+                   prepared + static_cast<long long>(i) * padded + sub * subDim, sizeof(float) * subDim);
+        }
+        runKMeans(slice, n, subDim, centroidsPerSub, iterations, subMetric,
+                  codebooks + static_cast<long long>(sub) * CODEBOOK_SIZE * subDim, pool, seed + sub);
+    }
+    delete[] slice;
+    delete[] prepared;
+    trained = true;
+}
+
+void ProductQuantizer::encode(const float* vector, unsigned char* code) const {
+    if (!trained) throw std::logic_error("ProductQuantizer::encode - codec is not trained");
+
+    Distance subMetric = (distanceKind == Distance::Manhattan) ? Distance::Manhattan : Distance::Euclidean;
+    float* padded = new float[subspaces * subDim];
+    pad(vector, padded);
+    for (int sub = 0; sub < subspaces; ++sub) {
+        code[sub] = static_cast<unsigned char>(nearestRow(padded + sub * subDim,
+                                                          codebooks + static_cast<long long>(sub) * CODEBOOK_SIZE * subDim,
+                                                          centroidsPerSub, subDim, subMetric));
+    }
+    delete[] padded;
+}
+
+void ProductQuantizer::decode(const unsigned char* code, float* out) const {
+    for (int sub = 0; sub < subspaces; ++sub) {
+        const float* centroid = codebooks + (static_cast<long long>(sub) * CODEBOOK_SIZE + code[sub]) * subDim;
+        for (int d = 0; d < subDim; ++d) {
+            int at = sub * subDim + d;
+            if (at < dimension) out[at] = centroid[d];
+        }
+    }
+}
+
+void ProductQuantizer::computeTable(const float* query, float* table) const {
+    float* padded = new float[subspaces * subDim];
+    pad(query, padded);
+    for (int sub = 0; sub < subspaces; ++sub) {
+        const float* q = padded + sub * subDim;
+        const float* book = codebooks + static_cast<long long>(sub) * CODEBOOK_SIZE * subDim;
+        float* row = table + sub * CODEBOOK_SIZE;
+        for (int c = 0; c < centroidsPerSub; ++c) {
+            const float* centroid = book + c * subDim;
+            switch (distanceKind) {
+                case Distance::Cosine:    row[c] = DistanceKernels::dot(q, centroid, subDim); break;
+                case Distance::Euclidean: row[c] = DistanceKernels::l2Squared(q, centroid, subDim); break;
+                default:                  row[c] = DistanceKernels::l1(q, centroid, subDim); break;
+            }
+        }
+        for (int c = centroidsPerSub; c < CODEBOOK_SIZE; ++c) row[c] = 0.0f;
+    }
+    delete[] padded;
+}
+
+// All three metrics are sums over slices: dot (cosine), squared L2, L1.
+double ProductQuantizer::adcDistance(const float* table, const unsigned char* code) const {
+    float sum = 0.0f;
+    int sub = 0;
+    for (; sub + 4 <= subspaces; sub += 4) {
+        sum += table[sub * CODEBOOK_SIZE + code[sub]] +
+               table[(sub + 1) * CODEBOOK_SIZE + code[sub + 1]] +
+               table[(sub + 2) * CODEBOOK_SIZE + code[sub + 2]] +
+               table[(sub + 3) * CODEBOOK_SIZE + code[sub + 3]];
+    }
+    for (; sub < subspaces; ++sub) sum += table[sub * CODEBOOK_SIZE + code[sub]];
+
+    switch (distanceKind) {
+        case Distance::Cosine:    return 1.0 - sum;
+        case Distance::Euclidean: return sqrt(sum > 0.0f ? static_cast<double>(sum) : 0.0);
+        default:                  return sum;
+    }
+}
+
+int ProductQuantizer::codeSize() const {
+    return subspaces;
+}
+
+int ProductQuantizer::tableSize() const {
+    return subspaces * CODEBOOK_SIZE;
+}
+
+bool ProductQuantizer::isTrained() const {
+    return trained;
+}
+
+DistanceKernels::Metric ProductQuantizer::getDistance() const {
+    return distanceKind;
+}
+
+// ----------------- PqIndex Implementation -----------------
+
+PqIndex::PqIndex(int dimension, int subspaces, DistanceKernels::Metric distanceKind)
+    : codec(dimension, subspaces, distanceKind) {
+    codes = nullptr;
+    labels = nullptr;
+    count = 0;
+    capacity = 0;
+    labelPos = nullptr;
+    labelCapacity = 0;
+}
+
+PqIndex::~PqIndex() {
+    reset();
+}
+
+void PqIndex::reset() {
+    delete[] codes;
+    delete[] labels;
+    delete[] labelPos;
+    codes = nullptr;
+    labels = nullptr;
+    labelPos = nullptr;
+    count = 0;
+    capacity = 0;
+    labelCapacity = 0;
+}
+
+void PqIndex::ensureCapacity(int cap) {
+    if (cap <= capacity) return;
+
+    int newCapacity = capacity + (capacity >> 1);
+    if (newCapacity < cap) newCapacity = cap;
+    if (newCapacity < 64) newCapacity = 64;
+    int codeSize = codec.codeSize();
+    unsigned char* newCodes = new unsigned char[static_cast<long long>(newCapacity) * codeSize];
+    int* newLabels = new int[newCapacity];
+    if (count > 0) {
+        memcpy(newCodes, codes, static_cast<size_t>(count) * codeSize);
+        memcpy(newLabels, labels, sizeof(int) * count);
+    }
+    delete[] codes;
+    delete[] labels;
+    codes = newCodes;
+    labels = newLabels;
+    capacity = newCapacity;
+}
+
+void PqIndex::ensureLabelCapacity(int cap) {
+    if (cap <= labelCapacity) return;
+
+    int newCapacity = labelCapacity + (labelCapacity >> 1);
+    if (newCapacity < cap) newCapacity = cap;
+    if (newCapacity < 64) newCapacity = 64;
+    int* grown = new int[newCapacity];
+    for (int i = 0; i < labelCapacity; ++i) grown[i] = labelPos[i];
+    for (int i = labelCapacity; i < newCapacity; ++i) grown[i] = -1;
+    delete[] labelPos;
+    labelPos = grown;
+    labelCapacity = newCapacity;
+}
+
+void PqIndex::appendCode(const unsigned char* code, int label) {
+    ensureCapacity(count + 1);
+    ensureLabelCapacity(label + 1);
+    memcpy(codes + static_cast<long long>(count) * codec.codeSize(), code, codec.codeSize());
+    labels[count] = label;
+    labelPos[label] = count;
+    ++count;
+}
+
+void PqIndex::train(const float* data, int n, int stride, int iterations, WorkerPool* pool) {
+    codec.train(data, n, stride, iterations, pool);
+    reset();
+}
+
+void PqIndex::add(const float* vector, int label) {
+    if (label < 0) throw std::out_of_range("PqIndex::add - negative label");
+
+    unsigned char* code = new unsigned char[codec.codeSize()];
+    codec.encode(vector, code);
+    remove(label);
+    appendCode(code, label);
+    delete[] code;
+}
+
+void PqIndex::add(const float* data, int n, int stride, const int* labels, WorkerPool* pool) {
+    if (n <= 0) return;
+
+    int codeSize = codec.codeSize();
+    unsigned char* encoded = new unsigned char[static_cast<long long>(n) * codeSize];
+    const int chunkRows = 1024;
+    int chunks = (n + chunkRows - 1) / chunkRows;
+    auto encodeChunk = [&](int chunk) {
+        int end = (chunk + 1) * chunkRows < n ? (chunk + 1) * chunkRows : n;
+        for (int i = chunk * chunkRows; i < end; ++i) {
+            codec.encode(data + static_cast<long long>(i) * stride, encoded + static_cast<long long>(i) * codeSize);
+        }
+    };
+    if (pool) pool->parallelFor(chunks, encodeChunk);
+    else for (int c = 0; c < chunks; ++c) encodeChunk(c);
+
+    ensureCapacity(count + n);
+    for (int i = 0; i < n; ++i) {
+        if (labels[i] < 0) continue;
+        remove(labels[i]);
+        appendCode(encoded + static_cast<long long>(i) * codeSize, labels[i]);
+    }
+    delete[] encoded;
+}
+
+bool PqIndex::remove(int label) {
+    if (!contains(label)) return false;
+
+    int pos = labelPos[label];
+    int last = count - 1;
+    int codeSize = codec.codeSize();
+    if (pos != last) {
+        memcpy(codes + static_cast<long long>(pos) * codeSize, codes + static_cast<long long>(last) * codeSize, codeSize);
+        labels[pos] = labels[last];
+        labelPos[labels[pos]] = pos;
+    }
+    --count;
+    labelPos[label] = -1;
+    return true;
+}
+
+bool PqIndex::contains(int label) const {
+    return label >= 0 && label < labelCapacity && labelPos[label] != -1;
+}
+
+int PqIndex::search(const float* query, int k, double* keysOut, int* labelsOut,
+                    const RowBitmap* allowed) const {
+    if (k <= 0 || count == 0) return 0;
+
+    float* table = new float[codec.tableSize()];
+    codec.computeTable(query, table);
+    int codeSize = codec.codeSize();
+    TopKSelector top(k);
+    for (int i = 0; i < count; ++i) {
+        if (allowed && !allowed->test(labels[i])) continue;
+        top.offer(codec.adcDistance(table, codes + static_cast<long long>(i) * codeSize), labels[i]);
+    }
+    delete[] table;
+    return top.drainSorted(keysOut, labelsOut);
+}
+
+const ProductQuantizer& PqIndex::getCodec() const {
+    return codec;
+}
+
+int PqIndex::size() const {
+    return count;
+}
+
+long long PqIndex::codeBytes() const {
+    return static_cast<long long>(count) * codec.codeSize();
+}
+
+// ----------------- ScalarQuantizer Implementation -----------------
+
+ScalarQuantizer::Query::Query() {
+    values = nullptr;
+    codes = nullptr;
+    alpha = 0.0f;
+    centerDot = 0.0;
+    normSq = 0.0;
+    dimension = 0;
+}
+
+ScalarQuantizer::Query::~Query() {
+    delete[] values;
+    delete[] codes;
+}
+
+ScalarQuantizer::ScalarQuantizer(int dimension, Precision precision) {
+    if (dimension <= 0) throw std::invalid_argument("ScalarQuantizer - dimension must be positive");
+
+    this->precision = precision;
+    this->dimension = dimension;
+    int bytes = (precision == Precision::Float16) ? dimension * 2 : dimension;
+    rowBytes = (bytes + 15) & ~15; // keeps every row 16-byte aligned for the vector loads
+    center = new float[dimension];
+    scale = new float[dimension];
+    for (int d = 0; d < dimension; ++d) {
+        center[d] = 0.0f;
+        scale[d] = 1.0f;
+    }
+    calibrated = (precision == Precision::Float16);
+    rows = nullptr;
+    norms = nullptr;
+    count = 0;
+    capacity = 0;
+}
+
+ScalarQuantizer::~ScalarQuantizer() {
+    delete[] rows;
+    delete[] norms;
+    delete[] scale;
+    delete[] center;
+}
+
+void ScalarQuantizer::calibrate(const float* data, int n, int stride) {
+    if (precision != Precision::Int8 || n <= 0) return;
+
+    float amplitude = 0.0f;
+    for (int d = 0; d < dimension; ++d) {
+        float lo = data[d], hi = data[d];
+        for (int i = 1; i < n; ++i) {
+            float v = data[static_cast<long long>(i) * stride + d];
+            if (v < lo) lo = v;
+            if (v > hi) hi = v;
+        }
+        center[d] = 0.5f * (lo + hi);
+        scale[d] = (hi - lo) / 254.0f;
+        if (fabsf(lo) > amplitude) amplitude = fabsf(lo);
+        if (fabsf(hi) > amplitude) amplitude = fabsf(hi);
+    }
+    if (amplitude == 0.0f) amplitude = 1.0f;
+    for (int d = 0; d < dimension; ++d) {
+        if (scale[d] <= amplitude * 1e-6f) {
+            center[d] = 0.0f;
+            scale[d] = amplitude / 127.0f;
+        }
+    }
+    calibrated = true;
+}
+
+bool ScalarQuantizer::isCalibrated() const {
+    return calibrated;
+}
+
+void ScalarQuantizer::ensureCapacity(int cap) {
+    if (cap <= capacity) return;
+
+    int newCapacity = capacity + (capacity >> 1);
+    if (newCapacity < cap) newCapacity = cap;
+    if (newCapacity < 16) newCapacity = 16;
+    unsigned char* newRows = new unsigned char[static_cast<long long>(newCapacity) * rowBytes];
+    float* newNorms = new float[newCapacity];
+    if (count > 0) {
+        memcpy(newRows, rows, static_cast<size_t>(count) * rowBytes);
+        memcpy(newNorms, norms, sizeof(float) * count);
+    }
+    delete[] rows;
+    delete[] norms;
+    rows = newRows;
+    norms = newNorms;
+    capacity = newCapacity;
+}
+
+void ScalarQuantizer::encode(const float* v, unsigned char* out, float& normSq) const {
+    memset(out, 0, rowBytes);
+    float sum = 0.0f;
+    if (precision == Precision::Float16) {
+        unsigned short* half = reinterpret_cast<unsigned short*>(out);
+        for (int d = 0; d < dimension; ++d) {
+            half[d] = DistanceKernels::toHalf(v[d]);
+            float back = DistanceKernels::fromHalf(half[d]);
+            sum += back * back;
+        }
+    } else {
+        signed char* code = reinterpret_cast<signed char*>(out);
+        for (int d = 0; d < dimension; ++d) {
+            float q = nearbyintf((v[d] - center[d]) / scale[d]);
+            if (q > 127.0f) q = 127.0f;
+            if (q < -127.0f) q = -127.0f;
+            code[d] = static_cast<signed char>(q);
+            float back = center[d] + scale[d] * q;
+            sum += back * back;
+        }
+    }
+    normSq = sum;
+}
+
+void ScalarQuantizer::appendRow(const float* v) {
+    if (!calibrated) calibrate(v, 1, dimension);
+    ensureCapacity(count + 1);
+    encode(v, rows + static_cast<long long>(count) * rowBytes, norms[count]);
+    ++count;
+}
+
+void ScalarQuantizer::setRow(int index, const float* v) {
+    if (index < 0 || index >= count) throw std::out_of_range("ScalarQuantizer::setRow - index out of range");
+    encode(v, rows + static_cast<long long>(index) * rowBytes, norms[index]);
+}
+
+void ScalarQuantizer::removeRow(int index) {
+    if (index < 0 || index >= count) throw std::out_of_range("ScalarQuantizer::removeRow - index out of range");
+
+    unsigned char* r = rows + static_cast<long long>(index) * rowBytes;
+    memmove(r, r + rowBytes, static_cast<size_t>(count - index - 1) * rowBytes);
+    memmove(norms + index, norms + index + 1, sizeof(float) * (count - index - 1));
+    --count;
+}
+
+void ScalarQuantizer::swapRemoveRow(int index) {
+    if (index < 0 || index >= count) throw std::out_of_range("ScalarQuantizer::swapRemoveRow - index out of range");
+
+    if (index != count - 1) {
+        memcpy(rows + static_cast<long long>(index) * rowBytes, rows + static_cast<long long>(count - 1) * rowBytes,
+               rowBytes);
+        norms[index] = norms[count - 1];
+    }
+    --count;
+}
+
+void ScalarQuantizer::clear() {
+    delete[] rows;
+    delete[] norms;
+    rows = nullptr;
+    norms = nullptr;
+    count = 0;
+    capacity = 0;
+}
+
+int ScalarQuantizer::size() const {
+    return count;
+}
+
+void ScalarQuantizer::decodeRow(int index, float* out) const {
+    if (index < 0 || index >= count) throw std::out_of_range("ScalarQuantizer::decodeRow - index out of range");
+
+    const unsigned char* r = rows + static_cast<long long>(index) * rowBytes;
+    if (precision == Precision::Float16) {
+        const unsigned short* half = reinterpret_cast<const unsigned short*>(r);
+        for (int d = 0; d < dimension; ++d) out[d] = DistanceKernels::fromHalf(half[d]);
+    } else {
+        const signed char* code = reinterpret_cast<const signed char*>(r);
+        for (int d = 0; d < dimension; ++d) out[d] = center[d] + scale[d] * code[d];
+    }
+}
+
+// Int8: q . x ~= q . center + sum (q[d] * scale[d]) * code[d]; the weighted
+// query is itself rounded to int8 (step alpha) so the row loop is a pure
+// int8 x int8 product with int32 accumulation.
+void ScalarQuantizer::prepare(const float* query, Query& out) const {
+    if (out.dimension != dimension) {
+        delete[] out.values;
+        delete[] out.codes;
+        out.values = new float[dimension];
+        out.codes = new signed char[dimension];
+        out.dimension = dimension;
+    }
+    out.normSq = DistanceKernels::dot(query, query, dimension);
+    if (precision == Precision::Float16) {
+        memcpy(out.values, query, sizeof(float) * dimension);
+        return;
+    }
+
+    float largest = 0.0f;
+    double centerDot = 0.0;
+    for (int d = 0; d < dimension; ++d) {
+        out.values[d] = query[d] - center[d];
+        float w = fabsf(query[d] * scale[d]);
+        if (w > largest) largest = w;
+        centerDot += static_cast<double>(query[d]) * center[d];
+    }
+    out.centerDot = centerDot;
+    out.alpha = (largest > 0.0f) ? largest / 127.0f : 1.0f;
+    for (int d = 0; d < dimension; ++d) {
+        out.codes[d] = static_cast<signed char>(nearbyintf(query[d] * scale[d] / out.alpha));
+    }
+}
+
+double ScalarQuantizer::score(DistanceKernels::Metric metric, const Query& query, int index) const {
+    const unsigned char* r = rows + static_cast<long long>(index) * rowBytes;
+    const unsigned short* half = reinterpret_cast<const unsigned short*>(r);
+    const signed char* code = reinterpret_cast<const signed char*>(r);
+
+    if (metric == DistanceKernels::Metric::Manhattan) {
+        if (precision == Precision::Float16) return DistanceKernels::l1Half(query.values, half, dimension);
+        return DistanceKernels::l1Int8(query.values, scale, code, dimension);
+    }
+    if (metric == DistanceKernels::Metric::Euclidean && precision == Precision::Float16) {
+        return sqrt(static_cast<double>(DistanceKernels::l2SquaredHalf(query.values, half, dimension)));
+    }
+
+    double dot;
+    if (precision == Precision::Float16) {
+        dot = DistanceKernels::dotHalf(query.values, half, dimension);
+    } else {
+        dot = query.centerDot + static_cast<double>(query.alpha) * DistanceKernels::dotInt8(query.codes, code, dimension);
+    }
+    if (metric == DistanceKernels::Metric::Euclidean) {
+        double sq = query.normSq + norms[index] - 2.0 * dot;
+        return sqrt(sq > 0.0 ? sq : 0.0);
+    }
+    if (query.normSq == 0.0 || norms[index] == 0.0f) return 0.0;
+    return dot / (sqrt(query.normSq) * sqrt(static_cast<double>(norms[index])));
+}
+
+ScalarQuantizer::Precision ScalarQuantizer::getPrecision() const {
+    return precision;
+}
+
+long long ScalarQuantizer::codeBytes() const {
+    return static_cast<long long>(count) * rowBytes;
+}
+
+// ----------------- VectorSlab Implementation -----------------
+
+static int paddedStride(int dimension) {
+    const int lanes = VectorSlab::ALIGNMENT / static_cast<int>(sizeof(float));
+    return ((dimension + lanes - 1) / lanes) * lanes;
+}
+
+static float* allocateRows(long long floats) {
+    return static_cast<float*>(::operator new[](static_cast<size_t>(floats) * sizeof(float),
+                                                std::align_val_t(VectorSlab::ALIGNMENT)));
+}
+
+static void releaseRows(float* rows) {
+    if (rows) ::operator delete[](rows, std::align_val_t(VectorSlab::ALIGNMENT));
+}
+
+VectorSlab::VectorSlab(int dimension) {
+    data = nullptr;
+    this->dimension = 0;
+    stride = 0;
+    rows = 0;
+    capacity = 0;
+    borrowed = false;
+    written = false;
+    reset(dimension);
+}
+
+VectorSlab::~VectorSlab() {
+    if (!borrowed) releaseRows(data);
+}
+
+void VectorSlab::reset(int dimension) {
+    if (!borrowed) releaseRows(data);
+    data = nullptr;
+    borrowed = false;
+    written = false;
+    this->dimension = (dimension > 0) ? dimension : 0;
+    stride = paddedStride(this->dimension);
+    rows = 0;
+    capacity = 0;
+}
+
+void VectorSlab::clear() {
+    reset(dimension);
+}
+
+void VectorSlab::ensureCapacity(int cap) {
+    if (cap <= capacity) return;
+
+    const long long MAX_INT32 = 2147483647LL;
+    long long proposed = static_cast<long long>(capacity);
+    proposed = proposed + (proposed >> 1); // *1.5, same policy as ArrayList
+    if (proposed < cap) proposed = cap;
+    if (proposed < 16) proposed = 16;
+    if (proposed > MAX_INT32) throw std::overflow_error("Requested capacity too large");
+    reallocate(static_cast<int>(proposed));
+}
+
+void VectorSlab::reallocate(int newCapacity) {
+    float* newData = allocateRows(static_cast<long long>(newCapacity) * stride);
+    if (rows > 0) memcpy(newData, data, static_cast<size_t>(rows) * stride * sizeof(float));
+    if (!borrowed) releaseRows(data);
+    data = newData;
+    borrowed = false;
+    capacity = newCapacity;
+}
+
+int VectorSlab::size() const {
+    return rows;
+}
+
+int VectorSlab::getDimension() const {
+    return dimension;
+}
+
+int VectorSlab::getStride() const {
+    return stride;
+}
+
+float* VectorSlab::row(int index) {
+    if (index < 0 || index >= rows) throw std::out_of_range("VectorSlab::row - index out of range");
+
+    written = true;
+    return data + static_cast<long long>(index) * stride;
+}
+
+const float* VectorSlab::row(int index) const {
+    if (index < 0 || index >= rows) throw std::out_of_range("VectorSlab::row - index out of range");
+
+    return data + static_cast<long long>(index) * stride;
+}
+
+void VectorSlab::reserve(int rows) {
+    if (rows > capacity) reallocate(rows);
+}
+
+float* VectorSlab::appendRow() {
+    ensureCapacity(rows + 1);
+    float* r = data + static_cast<long long>(rows) * stride;
+    memset(r, 0, static_cast<size_t>(stride) * sizeof(float)); // padding stays zero for SIMD tails
+    ++rows;
+    return r;
+}
+
+void VectorSlab::removeRow(int index) {
+    if (index < 0 || index >= rows) throw std::out_of_range("VectorSlab::removeRow - index out of range");
+
+    written = true;
+    float* r = data + static_cast<long long>(index) * stride;
+    memmove(r, r + stride, static_cast<size_t>(rows - index - 1) * stride * sizeof(float));
+    --rows;
+}
+
+void VectorSlab::swapRemoveRow(int index) {
+    if (index < 0 || index >= rows) throw std::out_of_range("VectorSlab::swapRemoveRow - index out of range");
+
+    if (index != rows - 1) {
+        written = true;
+        memcpy(data + static_cast<long long>(index) * stride, data + static_cast<long long>(rows - 1) * stride,
+               static_cast<size_t>(stride) * sizeof(float));
+    }
+    --rows;
+}
+
+void VectorSlab::attach(float* external, int count) {
+    if (reinterpret_cast<unsigned long long>(external) % ALIGNMENT != 0) {
+        throw std::invalid_argument("VectorSlab::attach - rows are not aligned");
+    }
+    reset(dimension);
+    data = external;
+    rows = count;
+    capacity = count;
+    borrowed = true;
+    written = false;
+}
+
+bool VectorSlab::isAttached() const {
+    return borrowed;
+}
+
+bool VectorSlab::isWritten() const {
+    return written;
+}
+
+// ----------------- MappedFile Implementation -----------------
+
+MappedFile::MappedFile(const string& path) {
+    base = nullptr;
+    length = 0;
+    mapped = false;
+#ifdef VECTORSTORE_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path);
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw std::runtime_error("Cannot stat " + path);
+    }
+    length = static_cast<long long>(info.st_size);
+    if (length > 0) {
+        void* view = mmap(nullptr, static_cast<size_t>(length), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (view != MAP_FAILED) {
+            base = static_cast<char*>(view);
+            mapped = true;
+        }
+    }
+    close(fd);
+    if (mapped || length == 0) return;
+#endif
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in) throw std::runtime_error("Cannot open " + path);
+    length = static_cast<long long>(in.tellg());
+    base = static_cast<char*>(::operator new[](static_cast<size_t>(length > 0 ? length : 1),
+                                               std::align_val_t(VectorSlab::ALIGNMENT)));
+    in.seekg(0);
+    if (length > 0 && !in.read(base, length)) {
+        ::operator delete[](base, std::align_val_t(VectorSlab::ALIGNMENT));
+        throw std::runtime_error("Cannot read " + path);
+    }
+}
+
+MappedFile::~MappedFile() {
+#ifdef VECTORSTORE_HAVE_MMAP
+    if (mapped) {
+        munmap(base, static_cast<size_t>(length));
+        return;
+    }
+#endif
+    if (base) ::operator delete[](base, std::align_val_t(VectorSlab::ALIGNMENT));
+}
+
+char* MappedFile::data() const {
+    return base;
+}
+
+long long MappedFile::size() const {
+    return length;
+}
+
+bool MappedFile::isMapped() const {
+    return mapped;
+}
+
+// Hands the pages lying wholly inside [from, from + bytes) back to the OS.
+// Unwritten pages of a private mapping are clean copies of the file, so
+// the next read faults them in again. No-op when the file was read in.
+void MappedFile::release(const char* from, long long bytes) {
+#ifdef VECTORSTORE_HAVE_MMAP
+    if (!mapped || bytes <= 0) return;
+    long long page = static_cast<long long>(sysconf(_SC_PAGESIZE));
+    long long begin = ((from - base) + page - 1) / page * page;
+    long long end = ((from - base) + bytes) / page * page;
+    if (end > begin) madvise(base + begin, static_cast<size_t>(end - begin), MADV_DONTNEED);
+#else
+    (void)from;
+    (void)bytes;
+#endif
+}
+
+// ----------------- WriteAheadLog Implementation -----------------
+
+static const char WAL_MAGIC[8] = { 'V', 'S', 'W', 'A', 'L', '\r', '\n', '\0' };
+static const unsigned int WAL_FORMAT_VERSION = 1;
+static const unsigned int WAL_BYTE_ORDER = 0x01020304u;
+static const int WAL_ENTRY_HEADER = 16; // op, id, text length, float count
+
+struct WalFileHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int byteOrder;
+    int dimension;
+    int reserved;
+};
+
+struct Crc32cTable {
+    unsigned int entries[256];
+
+    Crc32cTable() {
+        for (unsigned int i = 0; i < 256; ++i) {
+            unsigned int c = i;
+            for (int bit = 0; bit < 8; ++bit) c = (c & 1u) ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+            entries[i] = c;
+        }
+    }
+};
+
+#ifdef VECTORSTORE_X86_KERNELS
+__attribute__((target("sse4.2"))) static unsigned int crc32cHardware(const unsigned char* data, long long n) {
+    unsigned int crc = 0xffffffffu;
+    long long i = 0;
+#ifdef __x86_64__
+    unsigned long long wide = crc;
+    for (; i + 8 <= n; i += 8) {
+        unsigned long long v;
+        memcpy(&v, data + i, sizeof(v));
+        wide = _mm_crc32_u64(wide, v);
+    }
+    crc = static_cast<unsigned int>(wide);
+#endif
+    for (; i < n; ++i) crc = _mm_crc32_u8(crc, data[i]);
+    return crc ^ 0xffffffffu;
+}
+#endif
+
+// CRC-32C (Castagnoli): the SSE4.2 instruction where available, else a table.
+static unsigned int crc32c(const unsigned char* data, long long n) {
+#ifdef VECTORSTORE_X86_KERNELS
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return crc32cHardware(data, n);
+#endif
+    static const Crc32cTable table;
+    unsigned int crc = 0xffffffffu;
+    for (long long i = 0; i < n; ++i) crc = table.entries[(crc ^ data[i]) & 0xffu] ^ (crc >> 8);
+    return crc ^ 0xffffffffu;
+}
+
+WriteAheadLog::WriteAheadLog(const string& path, int dimension, long long groupBytes, int groupDelayMs)
+    : path(path), groupDelay(groupDelayMs > 0 ? groupDelayMs : 0) {
+    this->dimension = dimension;
+    this->groupBytes = (groupBytes > 0) ? groupBytes : 1;
+    fd = -1;
+    stream = nullptr;
+    buffer = nullptr;
+    pending = 0;
+    bufferCapacity = 0;
+    spare = nullptr;
+    spareCapacity = 0;
+    written = 0;
+    stopping = false;
+    failed = false;
+
+#ifdef VECTORSTORE_HAVE_MMAP
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) throw std::runtime_error("Cannot open " + path);
+    struct stat info;
+    if (fstat(fd, &info) == 0) written = static_cast<long long>(info.st_size);
+#else
+    std::FILE* file = std::fopen(path.c_str(), "ab");
+    if (!file) throw std::runtime_error("Cannot open " + path);
+    std::fseek(file, 0, SEEK_END);
+    written = std::ftell(file);
+    stream = file;
+#endif
+    if (written == 0) {
+        WalFileHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, WAL_MAGIC, sizeof(WAL_MAGIC));
+        header.version = WAL_FORMAT_VERSION;
+        header.byteOrder = WAL_BYTE_ORDER;
+        header.dimension = dimension;
+        try {
+            writeOut(reinterpret_cast<const char*>(&header), sizeof(header));
+        } catch (...) {
+#ifdef VECTORSTORE_HAVE_MMAP
+            close(fd);
+#else
+            std::fclose(static_cast<std::FILE*>(stream));
+#endif
+            throw;
+        }
+    }
+    flusher = std::thread(&WriteAheadLog::flusherLoop, this);
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    flusher.join();
+    try {
+        sync();
+    } catch (...) {
+        // nothing left to report to; the entries were never acknowledged as durable
+    }
+#ifdef VECTORSTORE_HAVE_MMAP
+    close(fd);
+#else
+    std::fclose(static_cast<std::FILE*>(stream));
+#endif
+    delete[] buffer;
+    delete[] spare;
+}
+
+void WriteAheadLog::writeOut(const char* data, long long bytes) {
+    bool ok = true;
+#ifdef VECTORSTORE_HAVE_MMAP
+    long long done = 0;
+    while (done < bytes) {
+        ssize_t n = write(fd, data + done, static_cast<size_t>(bytes - done));
+        if (n < 0) {
+            ok = false;
+            break;
+        }
+        done += n;
+    }
+#if defined(__APPLE__)
+    if (ok && fsync(fd) != 0) ok = false;
+#else
+    if (ok && fdatasync(fd) != 0) ok = false;
+#endif
+#else
+    std::FILE* file = static_cast<std::FILE*>(stream);
+    if (std::fwrite(data, 1, static_cast<size_t>(bytes), file) != static_cast<size_t>(bytes)) ok = false;
+    if (ok && std::fflush(file) != 0) ok = false;
+#endif
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!ok) {
+        failed = true;
+        throw std::runtime_error("WriteAheadLog - cannot write " + path);
+    }
+    written += bytes;
+}
+
+void WriteAheadLog::append(Op op, int id, const string& text, const float* vector) {
+    int floats = vector ? dimension : 0;
+    long long payload = WAL_ENTRY_HEADER + static_cast<long long>(text.length()) + static_cast<long long>(floats) * sizeof(float);
+    long long frame = 8 + payload;
+    bool flushNow;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed) throw std::runtime_error("WriteAheadLog - an earlier write to " + path + " failed");
+
+        if (pending + frame > bufferCapacity) {
+            long long grown = bufferCapacity + (bufferCapacity >> 1);
+            if (grown < pending + frame) grown = pending + frame;
+            if (grown < 4096) grown = 4096;
+            char* bigger = new char[grown];
+            if (pending > 0) memcpy(bigger, buffer, static_cast<size_t>(pending));
+            delete[] buffer;
+            buffer = bigger;
+            bufferCapacity = grown;
+        }
+        char* at = buffer + pending;
+        unsigned char* body = reinterpret_cast<unsigned char*>(at + 8);
+        int fields[4] = { static_cast<int>(op), id, static_cast<int>(text.length()), floats };
+        memcpy(body, fields, sizeof(fields));
+        memcpy(body + WAL_ENTRY_HEADER, text.data(), text.length());
+        if (floats > 0) memcpy(body + WAL_ENTRY_HEADER + text.length(), vector, sizeof(float) * floats);
+        unsigned int header[2] = { static_cast<unsigned int>(payload), crc32c(body, payload) };
+        memcpy(at, header, sizeof(header));
+
+        if (pending == 0) firstPending = std::chrono::steady_clock::now();
+        pending += frame;
+        flushNow = pending >= groupBytes;
+    }
+    if (flushNow) sync();
+    else wake.notify_one();
+}
+
+void WriteAheadLog::sync() {
+    std::lock_guard<std::mutex> io(ioMutex);
+    long long bytes;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed) throw std::runtime_error("WriteAheadLog - an earlier write to " + path + " failed");
+        char* full = buffer;
+        buffer = spare;
+        spare = full;
+        long long capacity = bufferCapacity;
+        bufferCapacity = spareCapacity;
+        spareCapacity = capacity;
+        bytes = pending;
+        pending = 0;
+    }
+    if (bytes > 0) writeOut(spare, bytes);
+}
+
+void WriteAheadLog::flusherLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        if (pending == 0 || failed) {
+            wake.wait(lock);
+            continue;
+        }
+        std::chrono::steady_clock::time_point due = firstPending + groupDelay;
+        if (std::chrono::steady_clock::now() < due) {
+            wake.wait_until(lock, due);
+            continue;
+        }
+        lock.unlock();
+        try {
+            sync();
+        } catch (...) {
+            // `failed` is set; the next append reports it
+        }
+        lock.lock();
+    }
+}
+
+long long WriteAheadLog::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return written + pending;
+}
+
+const string& WriteAheadLog::getPath() const {
+    return path;
+}
+
+template <class F>
+int WriteAheadLog::replay(const string& path, int dimension, F& apply) {
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in) return 0;
+    long long length = static_cast<long long>(in.tellg());
+    if (length < static_cast<long long>(sizeof(WalFileHeader))) return 0; // torn before the first entry
+    char* data = new char[length];
+    in.seekg(0);
+    if (!in.read(data, length)) {
+        delete[] data;
+        throw std::runtime_error("Cannot read " + path);
+    }
+
+    WalFileHeader header;
+    memcpy(&header, data, sizeof(header));
+    const char* problem = nullptr;
+    if (memcmp(header.magic, WAL_MAGIC, sizeof(WAL_MAGIC)) != 0) problem = "not a VectorStore log";
+    else if (header.byteOrder != WAL_BYTE_ORDER) problem = "byte order mismatch";
+    else if (header.version != WAL_FORMAT_VERSION) problem = "unsupported format version";
+    else if (header.dimension != dimension) problem = "dimension mismatch";
+    if (problem) {
+        delete[] data;
+        throw std::runtime_error("WriteAheadLog::replay - " + path + ": " + problem);
+    }
+
+    float* vector = new float[dimension];
+    long long at = sizeof(header);
+    int entries = 0;
+    try {
+        while (at + 8 <= length) {
+            unsigned int frame[2];
+            memcpy(frame, data + at, sizeof(frame));
+            long long payload = frame[0];
+            if (payload < WAL_ENTRY_HEADER || at + 8 + payload > length) break;
+            const unsigned char* body = reinterpret_cast<const unsigned char*>(data + at + 8);
+            if (crc32c(body, payload) != frame[1]) break;
+
+            int fields[4];
+            memcpy(fields, body, sizeof(fields));
+            if (fields[0] < static_cast<int>(Op::Add) || fields[0] > static_cast<int>(Op::Tag)) break;
+            if (fields[2] < 0 || (fields[3] != 0 && fields[3] != dimension)) break;
+            long long expected = WAL_ENTRY_HEADER + static_cast<long long>(fields[2]) +
+                                 static_cast<long long>(fields[3]) * static_cast<long long>(sizeof(float));
+            if (expected != payload) break;
+
+            Entry entry;
+            entry.op = static_cast<Op>(fields[0]);
+            entry.id = fields[1];
+            entry.text = reinterpret_cast<const char*>(body + WAL_ENTRY_HEADER);
+            entry.textLength = fields[2];
+            entry.vector = nullptr;
+            if (fields[3] > 0) {
+                memcpy(vector, body + WAL_ENTRY_HEADER + fields[2], sizeof(float) * dimension);
+                entry.vector = vector;
+            }
+            apply(entry);
+            ++entries;
+            at += 8 + payload;
+        }
+    } catch (...) {
+        delete[] vector;
+        delete[] data;
+        throw;
+    }
+    delete[] vector;
+    delete[] data;
+    return entries;
+}
+
+// ----------------- IdIndex Implementation -----------------
+
+IdIndex::IdIndex(int expected) {
+    keys = nullptr;
+    values = nullptr;
+    bits = 0;
+    capacity = 0;
+    count = 0;
+    int wanted = 4;
+    while ((1 << wanted) < 2 * expected && wanted < 30) ++wanted;
+    rehash(wanted);
+}
+
+IdIndex::~IdIndex() {
+    delete[] keys;
+    delete[] values;
+}
+
+// Fibonacci hashing: the top `bits` bits of id * 2^32 / phi.
+int IdIndex::home(int key) const {
+    return static_cast<int>((static_cast<unsigned int>(key) * 2654435769u) >> (32 - bits));
+}
+
+void IdIndex::rehash(int newBits) {
+    int* oldKeys = keys;
+    int* oldValues = values;
+    int oldCapacity = capacity;
+    bits = newBits;
+    capacity = 1 << newBits;
+    keys = new int[capacity];
+    values = new int[capacity];
+    for (int i = 0; i < capacity; ++i) keys[i] = -1;
+    count = 0;
+    for (int i = 0; i < oldCapacity; ++i) {
+        if (oldKeys[i] != -1) put(oldKeys[i], oldValues[i]);
+    }
+    delete[] oldKeys;
+    delete[] oldValues;
+}
+
+void IdIndex::put(int key, int value) {
+    if (key < 0) throw std::out_of_range("IdIndex::put - negative id");
+
+    int mask = capacity - 1;
+    int at = home(key);
+    while (keys[at] != -1 && keys[at] != key) at = (at + 1) & mask;
+    if (keys[at] == key) {
+        values[at] = value; // overwrite: the table does not grow
+        return;
+    }
+    if (2 * (count + 1) > capacity) {
+        rehash(bits + 1);
+        mask = capacity - 1;
+        at = home(key);
+        while (keys[at] != -1) at = (at + 1) & mask;
+    }
+    keys[at] = key;
+    values[at] = value;
+    ++count;
+}
+
+int IdIndex::get(int key) const {
+    int mask = capacity - 1;
+    for (int at = home(key); keys[at] != -1; at = (at + 1) & mask) {
+        if (keys[at] == key) return values[at];
+    }
+    return -1;
+}
+
+bool IdIndex::erase(int key) {
+    int mask = capacity - 1;
+    int at = home(key);
+    while (keys[at] != key) {
+        if (keys[at] == -1) return false;
+        at = (at + 1) & mask;
+    }
+    // Backward shift: pull later entries of the probe run into the hole
+    // unless that would move them before their home slot.
+    int hole = at;
+    for (int next = (hole + 1) & mask; keys[next] != -1; next = (next + 1) & mask) {
+        int want = home(keys[next]);
+        if (((next - want) & mask) >= ((next - hole) & mask)) {
+            keys[hole] = keys[next];
+            values[hole] = values[next];
+            hole = next;
+        }
+    }
+    keys[hole] = -1;
+    --count;
+    return true;
+}
+
+void IdIndex::reserve(int expected) {
+    int wanted = bits;
+    while ((1 << wanted) < 2 * expected && wanted < 30) ++wanted;
+    if (wanted > bits) rehash(wanted);
+}
+
+void IdIndex::clear() {
+    for (int i = 0; i < capacity; ++i) keys[i] = -1;
+    count = 0;
+}
+
+int IdIndex::size() const {
+    return count;
+}
+
+// ----------------- RowBitmap Implementation -----------------
+
+static int popcount64(unsigned long long word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(word);
+#else
+    int bits = 0;
+    for (; word; word &= word - 1) ++bits;
+    return bits;
+#endif
+}
+
+static int lowestBit64(unsigned long long word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    while (!(word & 1ULL)) {
+        word >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+RowBitmap::RowBitmap(int bits) {
+    words = nullptr;
+    bitCount = 0;
+    wordCapacity = 0;
+    if (bits > 0) resize(bits);
+}
+
+RowBitmap::RowBitmap(const RowBitmap& other) {
+    wordCapacity = (other.bitCount + 63) / 64;
+    words = (wordCapacity > 0) ? new unsigned long long[wordCapacity] : nullptr;
+    if (wordCapacity > 0) memcpy(words, other.words, sizeof(unsigned long long) * wordCapacity);
+    bitCount = other.bitCount;
+}
+
+RowBitmap::RowBitmap(RowBitmap&& other) noexcept {
+    words = other.words;
+    bitCount = other.bitCount;
+    wordCapacity = other.wordCapacity;
+    other.words = nullptr;
+    other.bitCount = 0;
+    other.wordCapacity = 0;
+}
+
+RowBitmap::~RowBitmap() {
+    delete[] words;
+}
+
+RowBitmap& RowBitmap::operator=(const RowBitmap& other) {
+    if (this == &other) return *this;
+
+    int needed = (other.bitCount + 63) / 64;
+    if (needed > wordCapacity) {
+        unsigned long long* fresh = new unsigned long long[needed];
+        delete[] words;
+        words = fresh;
+        wordCapacity = needed;
+    }
+    if (needed > 0) memcpy(words, other.words, sizeof(unsigned long long) * needed);
+    for (int w = needed; w < wordCapacity; ++w) words[w] = 0;
+    bitCount = other.bitCount;
+    return *this;
+}
+
+RowBitmap& RowBitmap::operator=(RowBitmap&& other) noexcept {
+    if (this == &other) return *this;
+
+    delete[] words;
+    words = other.words;
+    bitCount = other.bitCount;
+    wordCapacity = other.wordCapacity;
+    other.words = nullptr;
+    other.bitCount = 0;
+    other.wordCapacity = 0;
+    return *this;
+}
+
+// Words past size() are kept zero so growing never exposes stale bits.
+void RowBitmap::ensureWords(int needed) {
+    if (needed <= wordCapacity) return;
+
+    int newCapacity = wordCapacity + (wordCapacity >> 1);
+    if (newCapacity < needed) newCapacity = needed;
+    unsigned long long* fresh = new unsigned long long[newCapacity];
+    if (wordCapacity > 0) memcpy(fresh, words, sizeof(unsigned long long) * wordCapacity);
+    for (int w = wordCapacity; w < newCapacity; ++w) fresh[w] = 0;
+    delete[] words;
+    words = fresh;
+    wordCapacity = newCapacity;
+}
+
+void RowBitmap::resize(int bits) {
+    if (bits < 0) bits = 0;
+    int needed = (bits + 63) / 64;
+    ensureWords(needed);
+    if (bits < bitCount) {
+        // Clear the dropped tail so a later grow starts from zero bits.
+        for (int w = needed; w < (bitCount + 63) / 64; ++w) words[w] = 0;
+        if (bits % 64) words[needed - 1] &= (1ULL << (bits % 64)) - 1;
+    }
+    bitCount = bits;
+}
+
+void RowBitmap::set(int bit) {
+    if (bit < 0) throw std::out_of_range("RowBitmap::set - negative bit");
+    if (bit >= bitCount) resize(bit + 1);
+
+    words[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+void RowBitmap::reset(int bit) {
+    if (bit < 0 || bit >= bitCount) return;
+
+    words[bit >> 6] &= ~(1ULL << (bit & 63));
+}
+
+bool RowBitmap::test(int bit) const {
+    if (bit < 0 || bit >= bitCount) return false;
+
+    return (words[bit >> 6] >> (bit & 63)) & 1ULL;
+}
+
+void RowBitmap::setAll() {
+    int full = bitCount / 64;
+    for (int w = 0; w < full; ++w) words[w] = ~0ULL;
+    if (bitCount % 64) words[full] = (1ULL << (bitCount % 64)) - 1;
+}
+
+void RowBitmap::clearAll() {
+    int used = (bitCount + 63) / 64;
+    for (int w = 0; w < used; ++w) words[w] = 0;
+}
+
+void RowBitmap::andWith(const RowBitmap& other) {
+    int used = (bitCount + 63) / 64;
+    int shared = (other.bitCount + 63) / 64;
+    if (shared > used) shared = used;
+    for (int w = 0; w < shared; ++w) words[w] &= other.words[w];
+    for (int w = shared; w < used; ++w) words[w] = 0;
+}
+
+void RowBitmap::orWith(const RowBitmap& other) {
+    if (other.bitCount > bitCount) resize(other.bitCount);
+    int shared = (other.bitCount + 63) / 64;
+    for (int w = 0; w < shared; ++w) words[w] |= other.words[w];
+}
+
+void RowBitmap::flip() {
+    int used = (bitCount + 63) / 64;
+    for (int w = 0; w < used; ++w) words[w] = ~words[w];
+    if (bitCount % 64) words[used - 1] &= (1ULL << (bitCount % 64)) - 1;
+}
+
+int RowBitmap::count() const {
+    int used = (bitCount + 63) / 64;
+    int bits = 0;
+    for (int w = 0; w < used; ++w) bits += popcount64(words[w]);
+    return bits;
+}
+
+int RowBitmap::nextSet(int from) const {
+    if (from < 0) from = 0;
+    if (from >= bitCount) return -1;
+
+    int w = from >> 6;
+    unsigned long long word = words[w] & (~0ULL << (from & 63));
+    int used = (bitCount + 63) / 64;
+    while (!word) {
+        if (++w >= used) return -1;
+        word = words[w];
+    }
+    return (w << 6) + lowestBit64(word);
+}
+
+int RowBitmap::size() const {
+    return bitCount;
+}
+
+// ----------------- Filter Implementation -----------------
+
+Filter::Term::Term(Op op, const string& tag)
+    : op(op), tag(tag), intLow(0), intHigh(0), floatLow(0.0), floatHigh(0.0) {}
+
+Filter::Filter() {}
+
+Filter::Filter(const Filter& other) : terms(other.terms) {}
+
+Filter::~Filter() {}
+
+Filter& Filter::operator=(const Filter& other) {
+    terms = other.terms;
+    return *this;
+}
+
+Filter Filter::has(const string& tag) {
+    Filter f;
+    f.terms.add(Term(Op::Has, tag));
+    return f;
+}
+
+Filter Filter::intEquals(const string& tag, long long value) {
+    Filter f;
+    Term t(Op::IntEquals, tag);
+    t.intLow = t.intHigh = value;
+    f.terms.add(std::move(t));
+    return f;
+}
+
+Filter Filter::stringEquals(const string& tag, const string& value) {
+    Filter f;
+    Term t(Op::StringEquals, tag);
+    t.text = value;
+    f.terms.add(std::move(t));
+    return f;
+}
+
+Filter Filter::intRange(const string& tag, long long low, long long high) {
+    Filter f;
+    Term t(Op::IntRange, tag);
+    t.intLow = low;
+    t.intHigh = high;
+    f.terms.add(std::move(t));
+    return f;
+}
+
+Filter Filter::floatRange(const string& tag, double low, double high) {
+    Filter f;
+    Term t(Op::FloatRange, tag);
+    t.floatLow = low;
+    t.floatHigh = high;
+    f.terms.add(std::move(t));
+    return f;
+}
+
+Filter Filter::combine(const Filter& other, Op op) const {
+    Filter f;
+    f.terms.reserve(terms.size() + other.terms.size() + 1);
+    for (int i = 0; i < terms.size(); ++i) f.terms.add(terms.get(i));
+    for (int i = 0; i < other.terms.size(); ++i) f.terms.add(other.terms.get(i));
+    f.terms.add(Term(op));
+    return f;
+}
+
+Filter Filter::operator&&(const Filter& other) const {
+    if (matchesAll()) return other;
+    if (other.matchesAll()) return *this;
+    return combine(other, Op::And);
+}
+
+Filter Filter::operator||(const Filter& other) const {
+    if (matchesAll() || other.matchesAll()) return Filter();
+    return combine(other, Op::Or);
+}
+
+Filter Filter::operator!() const {
+    Filter f(*this);
+    if (f.terms.empty()) f.terms.add(Term(Op::All));
+    f.terms.add(Term(Op::Not));
+    return f;
+}
+
+bool Filter::matchesAll() const {
+    return terms.empty();
+}
+
+int Filter::termCount() const {
+    return terms.size();
+}
+
+const Filter::Term& Filter::term(int i) const {
+    return terms.get(i);
+}
+
+// ----------------- MetadataTable Implementation -----------------
+
+struct MetadataTable::Column {
+    string name;
+    Type type;
+    RowBitmap present;
+    long long* ints;     // Int: value by id
+    double* floats;      // Float: value by id
+    int* codes;          // Int / String: dictionary code by id
+    int capacity;        // ids the arrays above can hold
+    ArrayList<long long> intKeys;    // code -> Int value
+    ArrayList<string> stringKeys;    // code -> String value
+    ArrayList<RowBitmap*> postings;  // code -> ids, for codes < MAX_BITMAP_VALUES
+    int* slots;          // open addressing over codes, -1 = empty
+    int slotBits;
+    int distinct;
+
+    Column(const string& name, Type type) : name(name), type(type) {
+        ints = nullptr;
+        floats = nullptr;
+        codes = nullptr;
+        capacity = 0;
+        slotBits = 4;
+        slots = new int[1 << slotBits];
+        for (int i = 0; i < (1 << slotBits); ++i) slots[i] = -1;
+        distinct = 0;
+    }
+
+    ~Column() {
+        delete[] ints;
+        delete[] floats;
+        delete[] codes;
+        delete[] slots;
+        for (int i = 0; i < postings.size(); ++i) delete postings.get(i);
+    }
+};
+
+static unsigned long long hashInt64(long long value) {
+    unsigned long long x = static_cast<unsigned long long>(value) + 0x9E3779B97F4A7C15ULL; // splitmix64
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+static unsigned long long hashBytes(const char* data, size_t length) {
+    unsigned long long h = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < length; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static unsigned long long hashText(const string& text) {
+    return hashBytes(text.data(), text.size());
+}
+
+static const char* metadataTypeName(MetadataTable::Type type) {
+    switch (type) {
+        case MetadataTable::Type::Int:   return "int";
+        case MetadataTable::Type::Float: return "float";
+        default:                         return "string";
+    }
+}
+
+MetadataTable::MetadataTable() {}
+
+MetadataTable::~MetadataTable() {
+    clear();
+}
+
+MetadataTable::Column* MetadataTable::find(const string& tag) const {
+    for (int i = 0; i < columns.size(); ++i) {
+        if (columns.get(i)->name == tag) return columns.get(i);
+    }
+    return nullptr;
+}
+
+MetadataTable::Column* MetadataTable::column(const string& tag, Type type) {
+    Column* c = find(tag);
+    if (!c) {
+        c = new Column(tag, type);
+        columns.add(c);
+    } else if (c->type != type) {
+        throw std::invalid_argument("MetadataTable - tag '" + tag + "' holds " + metadataTypeName(c->type) +
+                                    " values, not " + metadataTypeName(type));
+    }
+    return c;
+}
+
+void MetadataTable::ensureIds(Column& c, int ids) {
+    if (ids <= c.capacity) return;
+
+    int newCapacity = c.capacity + (c.capacity >> 1);
+    if (newCapacity < ids) newCapacity = ids;
+    if (newCapacity < 64) newCapacity = 64;
+    if (c.type == Type::Float) {
+        double* fresh = new double[newCapacity];
+        if (c.capacity > 0) memcpy(fresh, c.floats, sizeof(double) * c.capacity);
+        delete[] c.floats;
+        c.floats = fresh;
+    } else {
+        int* fresh = new int[newCapacity];
+        if (c.capacity > 0) memcpy(fresh, c.codes, sizeof(int) * c.capacity);
+        for (int i = c.capacity; i < newCapacity; ++i) fresh[i] = -1;
+        delete[] c.codes;
+        c.codes = fresh;
+        if (c.type == Type::Int) {
+            long long* values = new long long[newCapacity];
+            if (c.capacity > 0) memcpy(values, c.ints, sizeof(long long) * c.capacity);
+            delete[] c.ints;
+            c.ints = values;
+        }
+    }
+    c.capacity = newCapacity;
+}
+
+// Code of a dictionary value, -1 if the column has never held it.
+int MetadataTable::lookup(const Column& c, unsigned long long hash, long long intValue, const string* text) const {
+    int mask = (1 << c.slotBits) - 1;
+    for (int at = static_cast<int>(hash & mask); c.slots[at] != -1; at = (at + 1) & mask) {
+        int code = c.slots[at];
+        if (text ? c.stringKeys.get(code) == *text : c.intKeys.get(code) == intValue) return code;
+    }
+    return -1;
+}
+
+int MetadataTable::intern(Column& c, long long intValue, const string* text) {
+    unsigned long long hash = text ? hashText(*text) : hashInt64(intValue);
+    int code = lookup(c, hash, intValue, text);
+    if (code != -1) return code;
+
+    if (2 * (c.distinct + 1) > (1 << c.slotBits)) {
+        // Rehash at half load; codes are stable, only their slots move.
+        delete[] c.slots;
+        ++c.slotBits;
+        int size = 1 << c.slotBits;
+        c.slots = new int[size];
+        for (int i = 0; i < size; ++i) c.slots[i] = -1;
+        for (int k = 0; k < c.distinct; ++k) {
+            unsigned long long h = text ? hashText(c.stringKeys.get(k)) : hashInt64(c.intKeys.get(k));
+            int at = static_cast<int>(h & (size - 1));
+            while (c.slots[at] != -1) at = (at + 1) & (size - 1);
+            c.slots[at] = k;
+        }
+    }
+    code = c.distinct++;
+    if (text) {
+        c.stringKeys.add(*text);
+    } else {
+        c.intKeys.add(intValue);
+    }
+    if (code < MAX_BITMAP_VALUES) c.postings.add(new RowBitmap());
+
+    int mask = (1 << c.slotBits) - 1;
+    int at = static_cast<int>(hash & mask);
+    while (c.slots[at] != -1) at = (at + 1) & mask;
+    c.slots[at] = code;
+    return code;
+}
+
+void MetadataTable::unlink(Column& c, int id) {
+    if (!c.present.test(id)) return;
+
+    if (c.type != Type::Float) {
+        int code = c.codes[id];
+        if (code >= 0 && code < MAX_BITMAP_VALUES) c.postings.get(code)->reset(id);
+        c.codes[id] = -1;
+    }
+    c.present.reset(id);
+}
+
+void MetadataTable::link(Column& c, int id, int code) {
+    c.codes[id] = code;
+    if (code < MAX_BITMAP_VALUES) c.postings.get(code)->set(id);
+    c.present.set(id);
+}
+
+void MetadataTable::setInt(int id, const string& tag, long long value) {
+    if (id < 0) throw std::out_of_range("MetadataTable::setInt - negative id");
+
+    Column& c = *column(tag, Type::Int);
+    ensureIds(c, id + 1);
+    unlink(c, id);
+    c.ints[id] = value;
+    link(c, id, intern(c, value, nullptr));
+}
+
+void MetadataTable::setFloat(int id, const string& tag, double value) {
+    if (id < 0) throw std::out_of_range("MetadataTable::setFloat - negative id");
+
+    Column& c = *column(tag, Type::Float);
+    ensureIds(c, id + 1);
+    c.floats[id] = value;
+    c.present.set(id);
+}
+
+void MetadataTable::setString(int id, const string& tag, const string& value) {
+    if (id < 0) throw std::out_of_range("MetadataTable::setString - negative id");
+
+    Column& c = *column(tag, Type::String);
+    ensureIds(c, id + 1);
+    unlink(c, id);
+    link(c, id, intern(c, 0, &value));
+}
+
+bool MetadataTable::erase(int id, const string& tag) {
+    Column* c = find(tag);
+    if (!c || !c->present.test(id)) return false;
+
+    unlink(*c, id);
+    return true;
+}
+
+void MetadataTable::eraseId(int id) {
+    for (int i = 0; i < columns.size(); ++i) unlink(*columns.get(i), id);
+}
+
+bool MetadataTable::getInt(int id, const string& tag, long long& out) const {
+    Column* c = find(tag);
+    if (!c || !c->present.test(id)) return false;
+    if (c->type != Type::Int) throw std::invalid_argument("MetadataTable::getInt - '" + tag + "' is not an int tag");
+
+    out = c->ints[id];
+    return true;
+}
+
+bool MetadataTable::getFloat(int id, const string& tag, double& out) const {
+    Column* c = find(tag);
+    if (!c || !c->present.test(id)) return false;
+    if (c->type != Type::Float) throw std::invalid_argument("MetadataTable::getFloat - '" + tag + "' is not a float tag");
+
+    out = c->floats[id];
+    return true;
+}
+
+bool MetadataTable::getString(int id, const string& tag, string& out) const {
+    Column* c = find(tag);
+    if (!c || !c->present.test(id)) return false;
+    if (c->type != Type::String) throw std::invalid_argument("MetadataTable::getString - '" + tag + "' is not a string tag");
+
+    out = c->stringKeys.get(c->codes[id]);
+    return true;
+}
+
+bool MetadataTable::hasTag(const string& tag) const {
+    return find(tag) != nullptr;
+}
+
+void MetadataTable::clear() {
+    for (int i = 0; i < columns.size(); ++i) delete columns.get(i);
+    columns.clear();
+}
+
+void MetadataTable::swap(MetadataTable& other) {
+    ArrayList<Column*> held = std::move(columns);
+    columns = std::move(other.columns);
+    other.columns = std::move(held);
+}
+
+// Block layout (native byte order): unsigned char kind (a Type, or
+// TAG_ERASE) | unsigned int nameLength | name | unsigned int count |
+// count x (int id | value). Values are a long long, a double, or an
+// unsigned int length and the bytes; TAG_ERASE blocks carry no value.
+static const unsigned char TAG_ERASE = 3;
+
+template <class T>
+static void appendRaw(string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+static void appendTagBlockHeader(string& out, unsigned char kind, const string& tag, unsigned int count) {
+    out.push_back(static_cast<char>(kind));
+    appendRaw(out, static_cast<unsigned int>(tag.size()));
+    out.append(tag);
+    appendRaw(out, count);
+}
+
+void MetadataTable::encode(string& out) const {
+    for (int i = 0; i < columns.size(); ++i) {
+        const Column& c = *columns.get(i);
+        appendTagBlockHeader(out, static_cast<unsigned char>(c.type), c.name, static_cast<unsigned int>(c.present.count()));
+        for (int id = c.present.nextSet(0); id != -1; id = c.present.nextSet(id + 1)) {
+            appendRaw(out, id);
+            if (c.type == Type::Int) {
+                appendRaw(out, c.ints[id]);
+            } else if (c.type == Type::Float) {
+                appendRaw(out, c.floats[id]);
+            } else {
+                const string& value = c.stringKeys.get(c.codes[id]);
+                appendRaw(out, static_cast<unsigned int>(value.size()));
+                out.append(value);
+            }
+        }
+    }
+}
+
+void MetadataTable::encodeInt(string& out, int id, const string& tag, long long value) {
+    appendTagBlockHeader(out, static_cast<unsigned char>(Type::Int), tag, 1);
+    appendRaw(out, id);
+    appendRaw(out, value);
+}
+
+void MetadataTable::encodeFloat(string& out, int id, const string& tag, double value) {
+    appendTagBlockHeader(out, static_cast<unsigned char>(Type::Float), tag, 1);
+    appendRaw(out, id);
+    appendRaw(out, value);
+}
+
+void MetadataTable::encodeString(string& out, int id, const string& tag, const string& value) {
+    appendTagBlockHeader(out, static_cast<unsigned char>(Type::String), tag, 1);
+    appendRaw(out, id);
+    appendRaw(out, static_cast<unsigned int>(value.size()));
+    out.append(value);
+}
+
+void MetadataTable::encodeErase(string& out, int id, const string& tag) {
+    appendTagBlockHeader(out, TAG_ERASE, tag, 1);
+    appendRaw(out, id);
+}
+
+// Bounds-checked reader over an encoded buffer.
+struct TagReader {
+    const char* at;
+    const char* end;
+
+    template <class T>
+    bool read(T& value) {
+        if (end - at < static_cast<long long>(sizeof(T))) return false;
+        memcpy(&value, at, sizeof(T));
+        at += sizeof(T);
+        return true;
+    }
+    bool readString(string& value) {
+        unsigned int length;
+        if (!read(length) || static_cast<unsigned long long>(end - at) < length) return false;
+        value.assign(at, length);
+        at += length;
+        return true;
+    }
+};
+
+bool MetadataTable::decode(const char* data, long long bytes, int idLimit) {
+    TagReader in = { data, data + bytes };
+    string tag, text;
+    try {
+        while (in.at < in.end) {
+            unsigned char kind;
+            unsigned int count;
+            if (!in.read(kind) || kind > TAG_ERASE || !in.readString(tag) || !in.read(count)) return false;
+            for (unsigned int i = 0; i < count; ++i) {
+                int id;
+                if (!in.read(id) || id < 0 || id >= idLimit) return false;
+                if (kind == TAG_ERASE) {
+                    erase(id, tag);
+                } else if (kind == static_cast<unsigned char>(Type::Int)) {
+                    long long value;
+                    if (!in.read(value)) return false;
+                    setInt(id, tag, value);
+                } else if (kind == static_cast<unsigned char>(Type::Float)) {
+                    double value;
+                    if (!in.read(value)) return false;
+                    setFloat(id, tag, value);
+                } else {
+                    if (!in.readString(text)) return false;
+                    setString(id, tag, text);
+                }
+            }
+        }
+    } catch (const std::invalid_argument&) {
+        return false; // one tag name with two types
+    }
+    return true;
+}
+
+// `out` is sized to idLimit and holds the ids matching a single comparison.
+void MetadataTable::evaluateTerm(const Filter::Term& t, int idLimit, RowBitmap& out) const {
+    out.resize(0);
+    out.resize(idLimit);
+    if (t.op == Filter::Op::All) {
+        out.setAll();
+        return;
+    }
+    Column* c = find(t.tag);
+    if (!c) return; // no record carries the tag
+
+    switch (t.op) {
+        case Filter::Op::Has:
+            out.orWith(c->present);
+            break;
+        case Filter::Op::IntEquals:
+        case Filter::Op::StringEquals: {
+            bool text = (t.op == Filter::Op::StringEquals);
+            if (c->type != (text ? Type::String : Type::Int)) {
+                throw std::invalid_argument("Filter - tag '" + t.tag + "' holds " + metadataTypeName(c->type) +
+                                            " values");
+            }
+            int code = text ? lookup(*c, hashText(t.text), 0, &t.text) : lookup(*c, hashInt64(t.intLow), t.intLow, nullptr);
+            if (code == -1) break;
+            if (code < MAX_BITMAP_VALUES) {
+                out.orWith(*c->postings.get(code));
+            } else {
+                for (int id = c->present.nextSet(0); id != -1; id = c->present.nextSet(id + 1)) {
+                    if (c->codes[id] == code) out.set(id);
+                }
+            }
+            break;
+        }
+        case Filter::Op::IntRange:
+        case Filter::Op::FloatRange: {
+            if (c->type == Type::String) {
+                throw std::invalid_argument("Filter - range over string tag '" + t.tag + "'");
+            }
+            bool asInt = (t.op == Filter::Op::IntRange);
+            for (int id = c->present.nextSet(0); id != -1; id = c->present.nextSet(id + 1)) {
+                bool match;
+                if (c->type == Type::Int && asInt) {
+                    match = c->ints[id] >= t.intLow && c->ints[id] <= t.intHigh;
+                } else {
+                    double v = (c->type == Type::Int) ? static_cast<double>(c->ints[id]) : c->floats[id];
+                    match = asInt ? (v >= static_cast<double>(t.intLow) && v <= static_cast<double>(t.intHigh))
+                                  : (v >= t.floatLow && v <= t.floatHigh);
+                }
+                if (match) out.set(id);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    out.resize(idLimit);
+}
+
+void MetadataTable::evaluate(const Filter& filter, int idLimit, RowBitmap& out) const {
+    if (filter.matchesAll()) {
+        out.resize(0);
+        out.resize(idLimit);
+        out.setAll();
+        return;
+    }
+
+    RowBitmap* stack = new RowBitmap[filter.termCount()];
+    int depth = 0;
+    try {
+        for (int i = 0; i < filter.termCount(); ++i) {
+            const Filter::Term& t = filter.term(i);
+            if (t.op == Filter::Op::And || t.op == Filter::Op::Or) {
+                if (depth < 2) throw std::invalid_argument("Filter - malformed expression");
+                if (t.op == Filter::Op::And) {
+                    stack[depth - 2].andWith(stack[depth - 1]);
+                } else {
+                    stack[depth - 2].orWith(stack[depth - 1]);
+                }
+                --depth;
+            } else if (t.op == Filter::Op::Not) {
+                if (depth < 1) throw std::invalid_argument("Filter - malformed expression");
+                stack[depth - 1].flip();
+            } else {
+                evaluateTerm(t, idLimit, stack[depth++]);
+            }
+        }
+        if (depth != 1) throw std::invalid_argument("Filter - malformed expression");
+    } catch (...) {
+        delete[] stack;
+        throw;
+    }
+    out = std::move(stack[0]);
+    delete[] stack;
+}
+
+// ----------------- TopKSelector Implementation -----------------
+
+TopKSelector::TopKSelector(int k) {
+    keys = nullptr;
+    items = nullptr;
+    this->k = 0;
+    count = 0;
+    reset(k);
+}
+
+TopKSelector::~TopKSelector() {
+    delete[] keys;
+    delete[] items;
+}
+
+void TopKSelector::reset(int k) {
+    if (k < 0) k = 0;
+    if (k != this->k) {
+        delete[] keys;
+        delete[] items;
+        keys = (k > 0) ? new double[k] : nullptr;
+        items = (k > 0) ? new int[k] : nullptr;
+        this->k = k;
+    }
+    count = 0;
+}
+
+// Slot a ranks below slot b: larger key, or equal key with larger item.
+bool TopKSelector::worse(int a, int b) const {
+    return keys[a] > keys[b] || (keys[a] == keys[b] && items[a] > items[b]);
+}
+
+void TopKSelector::siftUp(int pos) {
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!worse(pos, parent)) break;
+        double tk = keys[pos]; keys[pos] = keys[parent]; keys[parent] = tk;
+        int ti = items[pos]; items[pos] = items[parent]; items[parent] = ti;
+        pos = parent;
+    }
+}
+
+void TopKSelector::siftDown(int pos) {
+    while (true) {
+        int left = 2 * pos + 1, right = left + 1, largest = pos;
+        if (left < count && worse(left, largest)) largest = left;
+        if (right < count && worse(right, largest)) largest = right;
+        if (largest == pos) break;
+        double tk = keys[pos]; keys[pos] = keys[largest]; keys[largest] = tk;
+        int ti = items[pos]; items[pos] = items[largest]; items[largest] = ti;
+        pos = largest;
+    }
+}
+
+bool TopKSelector::offer(double key, int item) {
+    if (k == 0) return false;
+    if (count < k) {
+        keys[count] = key;
+        items[count] = item;
+        siftUp(count++);
+        return true;
+    }
+    if (key > keys[0] || (key == keys[0] && item > items[0])) return false;
+
+    keys[0] = key;
+    items[0] = item;
+    siftDown(0);
+    return true;
+}
+
+bool TopKSelector::full() const {
+    return count == k;
+}
+
+int TopKSelector::size() const {
+    return count;
+}
+
+double TopKSelector::worstKey() const {
+    if (count == 0) throw std::out_of_range("TopKSelector::worstKey - empty heap");
+
+    return keys[0];
+}
+
+int TopKSelector::drainSorted(double* keysOut, int* itemsOut) {
+    int n = count;
+    for (int pos = n - 1; pos >= 0; --pos) {
+        keysOut[pos] = keys[0];
+        itemsOut[pos] = items[0];
+        --count;
+        if (count > 0) {
+            keys[0] = keys[count];
+            items[0] = items[count];
+            siftDown(0);
+        }
+    }
+    return n;
+}
+
+// ----------------- TopKResult Implementation -----------------
+
+TopKResult::TopKResult(int capacity) {
+    indices = nullptr;
+    ids = nullptr;
+    scores = nullptr;
+    count = 0;
+    this->capacity = 0;
+    reserve(capacity);
+}
+
+TopKResult::TopKResult(const TopKResult& other) {
+    indices = nullptr;
+    ids = nullptr;
+    scores = nullptr;
+    count = 0;
+    capacity = 0;
+    *this = other;
+}
+
+TopKResult::TopKResult(TopKResult&& other) noexcept {
+    indices = other.indices;
+    ids = other.ids;
+    scores = other.scores;
+    count = other.count;
+    capacity = other.capacity;
+    other.indices = nullptr;
+    other.ids = nullptr;
+    other.scores = nullptr;
+    other.count = 0;
+    other.capacity = 0;
+}
+
+TopKResult::~TopKResult() {
+    delete[] indices;
+    delete[] ids;
+    delete[] scores;
+}
+
+TopKResult& TopKResult::operator=(const TopKResult& other) {
+    if (this == &other) return *this;
+
+    resize(other.count);
+    for (int i = 0; i < other.count; ++i) {
+        indices[i] = other.indices[i];
+        ids[i] = other.ids[i];
+        scores[i] = other.scores[i];
+    }
+    return *this;
+}
+
+TopKResult& TopKResult::operator=(TopKResult&& other) noexcept {
+    if (this == &other) return *this;
+
+    delete[] indices;
+    delete[] ids;
+    delete[] scores;
+    indices = other.indices;
+    ids = other.ids;
+    scores = other.scores;
+    count = other.count;
+    capacity = other.capacity;
+    other.indices = nullptr;
+    other.ids = nullptr;
+    other.scores = nullptr;
+    other.count = 0;
+    other.capacity = 0;
+    return *this;
+}
+
+void TopKResult::reserve(int capacity) {
+    if (capacity <= this->capacity) return;
+
+    int* newIndices = new int[capacity];
+    int* newIds = new int[capacity];
+    double* newScores = new double[capacity];
+    for (int i = 0; i < count; ++i) {
+        newIndices[i] = indices[i];
+        newIds[i] = ids[i];
+        newScores[i] = scores[i];
+    }
+    delete[] indices;
+    delete[] ids;
+    delete[] scores;
+    indices = newIndices;
+    ids = newIds;
+    scores = newScores;
+    this->capacity = capacity;
+}
+
+void TopKResult::resize(int count) {
+    if (count < 0) throw std::out_of_range("TopKResult::resize - negative size");
+
+    reserve(count);
+    this->count = count;
+}
+
+void TopKResult::clear() {
+    count = 0;
+}
+
+int TopKResult::size() const {
+    return count;
+}
+
+bool TopKResult::empty() const {
+    return count == 0;
+}
+
+int TopKResult::getIndex(int i) const {
+    if (i < 0 || i >= count) throw std::out_of_range("TopKResult::getIndex - index out of range");
+
+    return indices[i];
+}
+
+int TopKResult::getId(int i) const {
+    if (i < 0 || i >= count) throw std::out_of_range("TopKResult::getId - index out of range");
+
+    return ids[i];
+}
+
+double TopKResult::getScore(int i) const {
+    if (i < 0 || i >= count) throw std::out_of_range("TopKResult::getScore - index out of range");
+
+    return scores[i];
+}
+
+int* TopKResult::indexData() { return indices; }
+int* TopKResult::idData() { return ids; }
+double* TopKResult::scoreData() { return scores; }
+const int* TopKResult::indexData() const { return indices; }
+const int* TopKResult::idData() const { return ids; }
+const double* TopKResult::scoreData() const { return scores; }
+
+// ----------------- TextArena Implementation -----------------
+
+// Offsets are block << 32 | position; a text never straddles two blocks.
+static const int TEXT_OFFSET_SHIFT = 32;
+static const int TEXT_FIRST_BLOCK_BYTES = 256; // the open block doubles up to BLOCK_BYTES
+static const int TEXT_INTERN_MIN_BITS = 4;
+static const int LZ_MIN_MATCH = 4;
+static const int LZ_LAST_LITERALS = 5;   // as LZ4: the last bytes are always literals
+static const int LZ_HASH_BITS = 12;
+static const int LZ_MAX_OFFSET = 65535;
+
+TextArena::TextArena() {
+    tail = -1;
+    interning = false;
+    compression = false;
+    stored = 0;
+    garbage = 0;
+    version = nextVersion();
+    internHashes = nullptr;
+    internOffsets = nullptr;
+    internLengths = nullptr;
+    internRefs = nullptr;
+    internBits = 0;
+    internUsed = 0;
+}
+
+TextArena::~TextArena() {
+    freeBlocks();
+    rehashIntern(0);
+}
+
+unsigned long long TextArena::nextVersion() {
+    static std::atomic<unsigned long long> counter(0);
+    return ++counter;
+}
+
+TextArena::Block* TextArena::newBlock(int capacity) {
+    Block* block = new Block;
+    block->data = nullptr;
+    block->packed = nullptr;
+    block->frameEnds = nullptr;
+    block->used = 0;
+    block->capacity = capacity;
+    block->packedBytes = 0;
+    try {
+        block->data = new char[capacity > 0 ? capacity : 1];
+        blocks.add(block);
+    } catch (...) {
+        delete[] block->data;
+        delete block;
+        throw;
+    }
+    return block;
+}
+
+void TextArena::freeBlocks() {
+    for (int i = 0; i < blocks.size(); ++i) {
+        delete[] blocks.get(i)->data;
+        delete[] blocks.get(i)->packed;
+        delete[] blocks.get(i)->frameEnds;
+        delete blocks.get(i);
+    }
+    blocks.clear();
+    tail = -1;
+}
+
+// Packs a full block frame by frame; kept raw when the codec saves less
+// than an eighth.
+void TextArena::pack(Block* block) {
+    if (block->packed || block->used == 0) return;
+
+    int frames = (block->used + FRAME_BYTES - 1) / FRAME_BYTES;
+    char* buffer = new char[static_cast<size_t>(frames) * compressBound(FRAME_BYTES)];
+    int* frameEnds = nullptr;
+    char* packed = nullptr;
+    int bytes = 0;
+    try {
+        frameEnds = new int[frames];
+        for (int f = 0; f < frames; ++f) {
+            int begin = f * FRAME_BYTES;
+            int size = (block->used - begin < FRAME_BYTES) ? block->used - begin : FRAME_BYTES;
+            bytes += compress(block->data + begin, size, buffer + bytes);
+            frameEnds[f] = bytes;
+        }
+        if (bytes <= block->used - block->used / 8) packed = new char[bytes];
+    } catch (...) {
+        delete[] buffer;
+        delete[] frameEnds;
+        throw;
+    }
+    if (packed) memcpy(packed, buffer, bytes);
+    delete[] buffer;
+    if (!packed) {
+        delete[] frameEnds;
+        return;
+    }
+    block->packed = packed;
+    block->frameEnds = frameEnds;
+    block->packedBytes = bytes;
+    delete[] block->data;
+    block->data = nullptr;
+    block->capacity = 0;
+}
+
+void TextArena::unpack(Block* block) {
+    if (!block->packed) return;
+
+    char* data = new char[block->used];
+    try {
+        decodeFrames(block, 0, (block->used - 1) / FRAME_BYTES, data);
+    } catch (...) {
+        delete[] data;
+        throw;
+    }
+    delete[] block->packed;
+    delete[] block->frameEnds;
+    block->packed = nullptr;
+    block->frameEnds = nullptr;
+    block->packedBytes = 0;
+    block->data = data;
+    block->capacity = block->used;
+}
+
+// Frames first..last of a packed block, back to back at `out`.
+void TextArena::decodeFrames(const Block* block, int first, int last, char* out) const {
+    for (int f = first; f <= last; ++f) {
+        int begin = (f == 0) ? 0 : block->frameEnds[f - 1];
+        int size = (block->used - f * FRAME_BYTES < FRAME_BYTES) ? block->used - f * FRAME_BYTES : FRAME_BYTES;
+        if (decompress(block->packed + begin, block->frameEnds[f] - begin, out, size) != size) {
+            throw std::runtime_error("TextArena - packed frame is truncated");
+        }
+        out += size;
+    }
+}
+
+// Moves the intern entries into a table of 2^bits slots; 0 drops them.
+void TextArena::rehashIntern(int bits) {
+    unsigned long long* hashes = nullptr;
+    long long* offsets = nullptr;
+    int* lengths = nullptr;
+    int* refs = nullptr;
+    if (bits > 0) {
+        try {
+            hashes = new unsigned long long[1 << bits];
+            offsets = new long long[1 << bits];
+            lengths = new int[1 << bits];
+            refs = new int[1 << bits];
+        } catch (...) {
+            delete[] hashes;
+            delete[] offsets;
+            delete[] lengths;
+            delete[] refs;
+            throw;
+        }
+        for (int i = 0; i < (1 << bits); ++i) offsets[i] = -1;
+    }
+    unsigned long long* oldHashes = internHashes;
+    long long* oldOffsets = internOffsets;
+    int* oldLengths = internLengths;
+    int* oldRefs = internRefs;
+    int oldCapacity = internBits ? 1 << internBits : 0;
+    internHashes = hashes;
+    internOffsets = offsets;
+    internLengths = lengths;
+    internRefs = refs;
+    internBits = bits;
+    internUsed = 0;
+    for (int i = 0; bits > 0 && i < oldCapacity; ++i) {
+        if (oldOffsets[i] != -1) intern(oldHashes[i], oldOffsets[i], oldLengths[i], oldRefs[i]);
+    }
+    delete[] oldHashes;
+    delete[] oldOffsets;
+    delete[] oldLengths;
+    delete[] oldRefs;
+}
+
+// Linear probing on the high hash bits; the bytes are compared, so a hash
+// collision only costs a probe.
+int TextArena::findInterned(unsigned long long hash, std::string_view text, Reader& reader) const {
+    if (!internOffsets) return -1;
+
+    int mask = (1 << internBits) - 1;
+    for (int at = static_cast<int>(hash >> (64 - internBits)); internOffsets[at] != -1; at = (at + 1) & mask) {
+        if (internHashes[at] == hash && internLengths[at] == static_cast<int>(text.size()) &&
+            view(internOffsets[at], internLengths[at], reader) == text) {
+            return at;
+        }
+    }
+    return -1;
+}
+
+void TextArena::intern(unsigned long long hash, long long offset, int length, int refs) {
+    if (2 * (internUsed + 1) > (internBits ? 1 << internBits : 0)) {
+        rehashIntern(internBits ? internBits + 1 : TEXT_INTERN_MIN_BITS);
+    }
+    int mask = (1 << internBits) - 1;
+    int at = static_cast<int>(hash >> (64 - internBits));
+    while (internOffsets[at] != -1) at = (at + 1) & mask;
+    internHashes[at] = hash;
+    internOffsets[at] = offset;
+    internLengths[at] = length;
+    internRefs[at] = refs;
+    ++internUsed;
+}
+
+void TextArena::setInterning(bool enabled) {
+    interning = enabled;
+    if (!enabled) rehashIntern(0);
+}
+
+bool TextArena::getInterning() const {
+    return interning;
+}
+
+void TextArena::setCompression(bool enabled) {
+    if (enabled == compression) return;
+
+    for (int i = 0; i < blocks.size(); ++i) {
+        if (i == tail) continue;
+        if (enabled) pack(blocks.get(i));
+        else unpack(blocks.get(i));
+    }
+    compression = enabled;
+}
+
+bool TextArena::getCompression() const {
+    return compression;
+}
+
+long long TextArena::append(std::string_view text) {
+    int length = static_cast<int>(text.size());
+    if (length == 0) return 0;
+
+    unsigned long long hash = 0;
+    if (interning) {
+        Reader reader;
+        hash = hashBytes(text.data(), text.size());
+        int at = findInterned(hash, text, reader);
+        if (at >= 0) {
+            if (internRefs[at]++ == 0) garbage -= length; // revived
+            return internOffsets[at];
+        }
+    }
+
+    Block* block;
+    int index;
+    if (length > BLOCK_BYTES / 2) {
+        block = newBlock(length); // a block of its own; the open one stays open
+        index = blocks.size() - 1;
+    } else {
+        Block* open = (tail >= 0) ? blocks.get(tail) : nullptr;
+        if (!open || open->used + length > BLOCK_BYTES) {
+            int capacity = TEXT_FIRST_BLOCK_BYTES;
+            while (capacity < length) capacity *= 2;
+            block = newBlock(capacity);
+            if (open && compression) pack(open);
+            tail = blocks.size() - 1;
+        } else {
+            block = open;
+            if (block->used + length > block->capacity) {
+                int capacity = block->capacity;
+                while (capacity < block->used + length) capacity *= 2;
+                if (capacity > BLOCK_BYTES) capacity = BLOCK_BYTES;
+                char* data = new char[capacity];
+                memcpy(data, block->data, block->used);
+                delete[] block->data;
+                block->data = data;
+                block->capacity = capacity;
+            }
+        }
+        index = tail;
+    }
+    long long offset = (static_cast<long long>(index) << TEXT_OFFSET_SHIFT) | block->used;
+    if (interning) intern(hash, offset, length, 1); // before the copy: may throw
+    memcpy(block->data + block->used, text.data(), length);
+    block->used += length;
+    stored += length;
+    if (index != tail && compression) pack(block);
+    return offset;
+}
+
+std::string_view TextArena::view(long long offset, int length, Reader& reader) const {
+    if (length == 0) return std::string_view();
+
+    int index = static_cast<int>(offset >> TEXT_OFFSET_SHIFT);
+    int position = static_cast<int>(offset & 0xFFFFFFFFLL);
+    const Block* block = blocks.get(index);
+    if (block->data) return std::string_view(block->data + position, length);
+
+    int first = position / FRAME_BYTES;
+    int last = (position + length - 1) / FRAME_BYTES;
+    if (reader.version != version || reader.block != index || reader.firstFrame > first || reader.lastFrame < last) {
+        int end = ((last + 1) * FRAME_BYTES < block->used) ? (last + 1) * FRAME_BYTES : block->used;
+        reader.block = -1; // stale if decoding throws
+        reader.buffer.resize(end - first * FRAME_BYTES);
+        decodeFrames(block, first, last, &reader.buffer[0]);
+        reader.version = version;
+        reader.block = index;
+        reader.firstFrame = first;
+        reader.lastFrame = last;
+    }
+    return std::string_view(reader.buffer.data() + (position - reader.firstFrame * FRAME_BYTES), length);
+}
+
+// An interned text only turns into garbage with its last reference; texts
+// stored while interning was off were never shared.
+void TextArena::release(long long offset, int length) {
+    if (length == 0) return;
+
+    if (internOffsets) {
+        Reader reader;
+        std::string_view text = view(offset, length, reader);
+        unsigned long long hash = hashBytes(text.data(), text.size());
+        int mask = (1 << internBits) - 1;
+        for (int at = static_cast<int>(hash >> (64 - internBits)); internOffsets[at] != -1; at = (at + 1) & mask) {
+            if (internOffsets[at] == offset && internHashes[at] == hash) {
+                if (--internRefs[at] == 0) garbage += length;
+                return;
+            }
+        }
+    }
+    garbage += length;
+}
+
+void TextArena::clear() {
+    freeBlocks();
+    rehashIntern(0);
+    stored = 0;
+    garbage = 0;
+    version = nextVersion();
+}
+
+void TextArena::swap(TextArena& other) {
+    std::swap(blocks, other.blocks);
+    std::swap(tail, other.tail);
+    std::swap(interning, other.interning);
+    std::swap(compression, other.compression);
+    std::swap(stored, other.stored);
+    std::swap(garbage, other.garbage);
+    std::swap(internHashes, other.internHashes);
+    std::swap(internOffsets, other.internOffsets);
+    std::swap(internLengths, other.internLengths);
+    std::swap(internRefs, other.internRefs);
+    std::swap(internBits, other.internBits);
+    std::swap(internUsed, other.internUsed);
+    version = nextVersion();
+    other.version = nextVersion();
+}
+
+long long TextArena::storedBytes() const {
+    return stored;
+}
+
+long long TextArena::garbageBytes() const {
+    return garbage;
+}
+
+long long TextArena::memoryBytes() const {
+    long long bytes = static_cast<long long>(blocks.size()) * static_cast<long long>(sizeof(Block));
+    for (int i = 0; i < blocks.size(); ++i) {
+        const Block* block = blocks.get(i);
+        if (block->packed) bytes += block->packedBytes + ((block->used - 1) / FRAME_BYTES + 1) * static_cast<long long>(sizeof(int));
+        else bytes += block->capacity;
+    }
+    if (internBits) {
+        bytes += (1LL << internBits) * static_cast<long long>(sizeof(unsigned long long) + sizeof(long long) + 2 * sizeof(int));
+    }
+    return bytes;
+}
+
+int TextArena::compressBound(int n) {
+    return n + n / 255 + 16;
+}
+
+static void lzPutLength(char* dst, int& op, int length) {
+    while (length >= 255) {
+        dst[op++] = static_cast<char>(255);
+        length -= 255;
+    }
+    dst[op++] = static_cast<char>(length);
+}
+
+static unsigned int lzRead32(const char* p) {
+    unsigned int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Greedy single-probe matcher: a 4-byte window hashed into a table of
+// recent positions, extended forward on a hit.
+int TextArena::compress(const char* src, int n, char* dst) {
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); ++i) table[i] = -1;
+
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+    int matchEnd = n - LZ_LAST_LITERALS;
+    while (ip + LZ_MIN_MATCH <= matchEnd) {
+        unsigned int sequence = lzRead32(src + ip);
+        int h = static_cast<int>((sequence * 2654435761u) >> (32 - LZ_HASH_BITS));
+        int candidate = table[h];
+        table[h] = ip;
+        if (candidate < 0 || ip - candidate > LZ_MAX_OFFSET || lzRead32(src + candidate) != sequence) {
+            ++ip;
+            continue;
+        }
+        int match = LZ_MIN_MATCH;
+        while (ip + match < matchEnd && src[candidate + match] == src[ip + match]) ++match;
+
+        int literals = ip - anchor;
+        int token = op++;
+        dst[token] = static_cast<char>(((literals < 15 ? literals : 15) << 4) |
+                                       (match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15));
+        if (literals >= 15) lzPutLength(dst, op, literals - 15);
+        memcpy(dst + op, src + anchor, literals);
+        op += literals;
+        int distance = ip - candidate;
+        dst[op++] = static_cast<char>(distance & 0xFF);
+        dst[op++] = static_cast<char>(distance >> 8);
+        if (match - LZ_MIN_MATCH >= 15) lzPutLength(dst, op, match - LZ_MIN_MATCH - 15);
+        ip += match;
+        anchor = ip;
+    }
+
+    int literals = n - anchor;
+    dst[op++] = static_cast<char>((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15) lzPutLength(dst, op, literals - 15);
+    memcpy(dst + op, src + anchor, literals);
+    return op + literals;
+}
+
+int TextArena::decompress(const char* src, int srcBytes, char* dst, int limit) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(src);
+    int ip = 0;
+    int op = 0;
+    auto readLength = [&](int length) {
+        unsigned char more = 255;
+        while (more == 255) {
+            if (ip >= srcBytes) throw std::runtime_error("TextArena::decompress - truncated input");
+            more = in[ip++];
+            length += more;
+        }
+        return length;
+    };
+    while (ip < srcBytes && op < limit) {
+        int token = in[ip++];
+        int literals = token >> 4;
+        if (literals == 15) literals = readLength(literals);
+        if (literals > srcBytes - ip) throw std::runtime_error("TextArena::decompress - truncated input");
+        int take = (literals < limit - op) ? literals : limit - op;
+        memcpy(dst + op, src + ip, take);
+        ip += literals;
+        op += take;
+        if (ip >= srcBytes || op >= limit) break; // last sequence has no match
+
+        if (srcBytes - ip < 2) throw std::runtime_error("TextArena::decompress - truncated input");
+        int distance = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int match = token & 15;
+        if (match == 15) match = readLength(match);
+        match += LZ_MIN_MATCH;
+        if (distance == 0 || distance > op) throw std::runtime_error("TextArena::decompress - bad match offset");
+        int end = (op + match < limit) ? op + match : limit;
+        if (distance >= end - op) {
+            memcpy(dst + op, dst + op - distance, end - op);
+            op = end;
+        }
+        while (op < end) { // byte by byte: the match overlaps its own output
+            dst[op] = dst[op - distance];
+            ++op;
+        }
+    }
+    return op;
+}
+
+// ----------------- EmbeddingCache Implementation -----------------
+
+// Unpacks a list into out[0..n), truncating or zero padding. Traversal only,
+// the list itself is never modified.
+static void copyList(const SinglyLinkedList<float>& v, float* out, int n) {
+    SinglyLinkedList<float>& list = const_cast<SinglyLinkedList<float>&>(v);
+    int i = 0;
+    for (SinglyLinkedList<float>::Iterator it = list.begin(); i < n && it != list.end(); ++it) {
+        out[i++] = *it;
+    }
+    while (i < n) out[i++] = 0.0f;
+}
+
+static const int EMBEDDING_CACHE_MIN_BITS = 4;
+
+EmbeddingCache::EmbeddingCache(long long byteBudget, int shardCount) {
+    if (byteBudget <= 0) throw std::invalid_argument("EmbeddingCache - byte budget must be positive");
+
+    this->shardCount = (shardCount > 0) ? shardCount : 1;
+    budget = byteBudget;
+    shardBudget = byteBudget / this->shardCount;
+    if (shardBudget < 1) shardBudget = 1;
+    generation = 0;
+    hits = 0;
+    misses = 0;
+    evictions = 0;
+    shards = new Shard[this->shardCount];
+    for (int i = 0; i < this->shardCount; ++i) {
+        shards[i].table = nullptr;
+        resetShard(shards[i]);
+    }
+}
+
+EmbeddingCache::~EmbeddingCache() {
+    for (int i = 0; i < shardCount; ++i) {
+        for (int e = 0; e < shards[i].ring.size(); ++e) {
+            delete[] shards[i].ring.get(e)->values;
+            delete shards[i].ring.get(e);
+        }
+        delete[] shards[i].table;
+    }
+    delete[] shards;
+}
+
+// Payload plus bookkeeping: the entry, its ring pointer and two table slots
+// (the table is kept at most half full).
+long long EmbeddingCache::entryBytes(const Entry* entry) {
+    return static_cast<long long>(sizeof(Entry) + 3 * sizeof(Entry*) + entry->text.size() +
+                                  static_cast<size_t>(entry->length) * sizeof(float));
+}
+
+// Low bits pick the shard, high bits the table slot.
+EmbeddingCache::Shard& EmbeddingCache::shardOf(unsigned long long hash) const {
+    return shards[hash % static_cast<unsigned long long>(shardCount)];
+}
+
+int EmbeddingCache::find(const Shard& shard, unsigned long long hash) const {
+    int mask = (1 << shard.bits) - 1;
+    for (int at = static_cast<int>(hash >> (64 - shard.bits)); shard.table[at]; at = (at + 1) & mask) {
+        if (shard.table[at]->hash == hash) return at;
+    }
+    return -1;
+}
+
+void EmbeddingCache::place(Shard& shard, Entry* entry) {
+    if (2 * (shard.used + 1) > (1 << shard.bits)) {
+        Entry** old = shard.table;
+        int oldCapacity = 1 << shard.bits;
+        shard.table = new Entry*[static_cast<size_t>(oldCapacity) * 2]();
+        ++shard.bits;
+        shard.used = 0;
+        for (int i = 0; i < oldCapacity; ++i) {
+            if (old[i]) place(shard, old[i]);
+        }
+        delete[] old;
+    }
+    int mask = (1 << shard.bits) - 1;
+    int at = static_cast<int>(entry->hash >> (64 - shard.bits));
+    while (shard.table[at]) at = (at + 1) & mask;
+    shard.table[at] = entry;
+    ++shard.used;
+}
+
+// Drops ring[ringIndex]: backward-shift deletion from the table (as IdIndex),
+// then the last ring entry takes its place.
+void EmbeddingCache::remove(Shard& shard, int ringIndex) {
+    Entry* entry = shard.ring.get(ringIndex);
+    int mask = (1 << shard.bits) - 1;
+    int hole = find(shard, entry->hash);
+    for (int next = (hole + 1) & mask; shard.table[next]; next = (next + 1) & mask) {
+        int want = static_cast<int>(shard.table[next]->hash >> (64 - shard.bits));
+        if (((next - want) & mask) >= ((next - hole) & mask)) {
+            shard.table[hole] = shard.table[next];
+            hole = next;
+        }
+    }
+    shard.table[hole] = nullptr;
+    --shard.used;
+
+    int last = shard.ring.size() - 1;
+    shard.ring.set(ringIndex, shard.ring.get(last));
+    shard.ring.removeAt(last);
+    shard.bytes -= entryBytes(entry);
+    delete[] entry->values;
+    delete entry;
+}
+
+// CLOCK: referenced entries get a second chance, the first unreferenced one
+// under the hand goes. Ends within two sweeps.
+void EmbeddingCache::evictOne(Shard& shard) {
+    for (;;) {
+        if (shard.hand >= shard.ring.size()) shard.hand = 0;
+        Entry* entry = shard.ring.get(shard.hand);
+        if (entry->referenced) {
+            entry->referenced = false;
+            ++shard.hand;
+            continue;
+        }
+        remove(shard, shard.hand);
+        evictions.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+}
+
+void EmbeddingCache::resetShard(Shard& shard) {
+    delete[] shard.table;
+    shard.bits = EMBEDDING_CACHE_MIN_BITS;
+    shard.table = new Entry*[static_cast<size_t>(1) << shard.bits]();
+    shard.used = 0;
+    shard.ring.clear();
+    shard.hand = 0;
+    shard.bytes = 0;
+}
+
+unsigned long long EmbeddingCache::currentGeneration() const {
+    return generation.load();
+}
+
+bool EmbeddingCache::lookup(const string& text, float* out, int dimension) {
+    unsigned long long hash = hashText(text);
+    Shard& shard = shardOf(hash);
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        int at = find(shard, hash);
+        if (at >= 0 && shard.table[at]->text == text) {
+            Entry* entry = shard.table[at];
+            entry->referenced = true;
+            int n = entry->length < dimension ? entry->length : dimension;
+            memcpy(out, entry->values, static_cast<size_t>(n) * sizeof(float));
+            for (int i = n; i < dimension; ++i) out[i] = 0.0f;
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+SinglyLinkedList<float>* EmbeddingCache::lookupList(const string& text) {
+    unsigned long long hash = hashText(text);
+    Shard& shard = shardOf(hash);
+    {
+        std::lock_guard<std::mutex> lock(shard.lock);
+        int at = find(shard, hash);
+        if (at >= 0 && shard.table[at]->text == text) {
+            Entry* entry = shard.table[at];
+            entry->referenced = true;
+            SinglyLinkedList<float>* list = new SinglyLinkedList<float>();
+            for (int i = 0; i < entry->length; ++i) list->add(entry->values[i]);
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return list;
+        }
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+}
+
+void EmbeddingCache::insert(const string& text, const SinglyLinkedList<float>& vector,
+                            unsigned long long expected) {
+    if (generation.load() != expected) return;
+
+    // Copied outside the shard lock.
+    Entry* entry = new Entry;
+    entry->hash = hashText(text);
+    entry->length = vector.size();
+    entry->referenced = false;
+    entry->values = nullptr;
+    try {
+        entry->text = text;
+        entry->values = new float[entry->length > 0 ? entry->length : 1];
+        copyList(vector, entry->values, entry->length);
+    } catch (...) {
+        delete[] entry->values;
+        delete entry;
+        throw;
+    }
+    long long bytes = entryBytes(entry);
+    Shard& shard = shardOf(entry->hash);
+
+    std::lock_guard<std::mutex> lock(shard.lock);
+    int at = (bytes <= shardBudget && generation.load() == expected) ? find(shard, entry->hash) : -2;
+    if (at >= 0 && shard.table[at]->text == text) at = -2; // a racing insert got there first
+    if (at == -2) {
+        delete[] entry->values;
+        delete entry;
+        return;
+    }
+    if (at >= 0) { // same hash, other text: the newer one wins
+        for (int i = 0; i < shard.ring.size(); ++i) {
+            if (shard.ring.get(i) == shard.table[at]) {
+                remove(shard, i);
+                break;
+            }
+        }
+    }
+    while (shard.bytes + bytes > shardBudget && shard.ring.size() > 0) evictOne(shard);
+    shard.ring.add(entry);
+    place(shard, entry);
+    shard.bytes += bytes;
+}
+
+void EmbeddingCache::clear() {
+    generation.fetch_add(1);
+    for (int i = 0; i < shardCount; ++i) {
+        std::lock_guard<std::mutex> lock(shards[i].lock);
+        for (int e = 0; e < shards[i].ring.size(); ++e) {
+            delete[] shards[i].ring.get(e)->values;
+            delete shards[i].ring.get(e);
+        }
+        resetShard(shards[i]);
+    }
+}
+
+EmbeddingCache::Stats EmbeddingCache::stats() const {
+    Stats out;
+    out.hits = hits.load(std::memory_order_relaxed);
+    out.misses = misses.load(std::memory_order_relaxed);
+    out.evictions = evictions.load(std::memory_order_relaxed);
+    out.entries = 0;
+    out.bytes = 0;
+    for (int i = 0; i < shardCount; ++i) {
+        std::lock_guard<std::mutex> lock(shards[i].lock);
+        out.entries += shards[i].ring.size();
+        out.bytes += shards[i].bytes;
+    }
+    return out;
+}
+
+long long EmbeddingCache::byteBudget() const {
+    return budget;
+}
+
+// ----------------- VectorStore Implementation -----------------
+
+VectorStore::VectorStore(int dimension, EmbedFn setEmbeddingFunction, StorageMode storageMode)
+    : recordArena(sizeof(VectorRecord), 64, 4096) {
+    recordAllocator = &recordArena;
+    this->dimension = (dimension > 0) ? dimension : 512;
+    // Correctly assign the incoming function pointer (previously self-assigned -> left uninitialized)
+    this->embeddingFunction = setEmbeddingFunction;
+    embeddingCache = nullptr;
+    this->storageMode = storageMode;
+    if (storageMode == StorageMode::Contiguous) slab.reset(this->dimension);
+    pool = nullptr;
+    bulkPool = nullptr;
+    hnsw = nullptr;
+    ivf = nullptr;
+    pq = nullptr;
+    pqRerank = 0;
+    quantized = nullptr;
+    normMode = NormMode::Raw;
+    mapped = nullptr;
+    idIndex = nullptr;
+    removalMode = RemovalMode::Shift;
+    wal = nullptr;
+    walGeneration = 0;
+    walGroupBytes = 0;
+    walGroupDelayMs = 0;
+    walCompactBytes = 0;
+    compactFailed = false;
+    count = 0;
+}
+
+VectorStore::~VectorStore() {
+    try {
+        closeWal();
+    } catch (...) {
+        // a failed background snapshot leaves the logs in place for recovery
+    }
+    clear();
+    delete hnsw;
+    delete ivf;
+    delete pq;
+    delete quantized;
+    delete idIndex;
+    delete embeddingCache;
+    delete pool;
+    delete bulkPool;
+}
+
+void VectorStore::clear() {
+    logMutation(WriteAheadLog::Op::Clear, -1, -1);
+    // Records in the store's own arena are freed with its chunks.
+    bool owned = (recordAllocator == &recordArena);
+    for (int i = 0; i < records.size(); ++i) {
+        VectorRecord* record = records.get(i);
+        if (owned) {
+            delete record->vector;
+            record->~VectorRecord();
+        } else {
+            destroyRecord(record);
+        }
+    }
+    if (owned) recordArena.release();
+    records.clear();
+    texts.clear();
+    slab.clear();
+    if (hnsw) hnsw->clear();
+    if (ivf) ivf->reset();
+    if (pq) pq->reset();
+    if (quantized) quantized->clear();
+    norms.clear();
+    if (idIndex) idIndex->clear();
+    metadata.clear();
+    delete mapped; // after the slab and records that point into it
+    mapped = nullptr;
+}
+
+SinglyLinkedList<float>* VectorStore::preprocessing(const string& rawText) {
+    VS_TIME(Preprocessing);
+    SinglyLinkedList<float>* result = nullptr;
+    if (embeddingFunction) {
+        if (embeddingCache) {
+            result = embeddingCache->lookupList(rawText);
+            if (result) return result;
+        }
+        VS_COUNT(Embeddings, 1);
+        unsigned long long generation = embeddingCache ? embeddingCache->currentGeneration() : 0;
+        result = embeddingFunction(rawText); //Invoke embeddingFunction to map rawText into a vector.
+        if (embeddingCache && result) {
+            try {
+                embeddingCache->insert(rawText, *result, generation);
+            } catch (...) {
+                delete result;
+                throw;
+            }
+        }
+    } else {
+        VS_COUNT(Embeddings, 1);
+        result = new SinglyLinkedList<float>();
+        int len = rawText.length() > dimension ? dimension : rawText.length();
+        for (int i = 0; i < len; ++i) {
+            result->add(static_cast<float>(rawText[i]));
+        }
+        // Pad with zeros if less than dimension
+        while (result->size() < dimension) {
+            result->add(0.0f);
+        }
+    }
+    return result;
+}
+
+// Same mapping as preprocessing(), but written straight into a slab row so the
+// contiguous mode never builds a throw-away list for the default embedding.
+void VectorStore::embedInto(const string& rawText, float* out) {
+    VS_TIME(Preprocessing);
+    if (embeddingFunction) {
+        if (embeddingCache && embeddingCache->lookup(rawText, out, dimension)) return;
+        VS_COUNT(Embeddings, 1);
+        unsigned long long generation = embeddingCache ? embeddingCache->currentGeneration() : 0;
+        SinglyLinkedList<float>* embedded = embeddingFunction(rawText);
+        try {
+            copyVector(*embedded, out);
+            if (embeddingCache) embeddingCache->insert(rawText, *embedded, generation);
+        } catch (...) {
+            delete embedded;
+            throw;
+        }
+        delete embedded;
+        return;
+    }
+    VS_COUNT(Embeddings, 1);
+    int len = static_cast<int>(rawText.length());
+    if (len > dimension) len = dimension;
+    for (int i = 0; i < len; ++i) out[i] = static_cast<float>(rawText[i]);
+    for (int i = len; i < dimension; ++i) out[i] = 0.0f;
+}
+
+// Copies a list into a dense buffer of `dimension` floats (truncate / zero pad).
+void VectorStore::copyVector(const SinglyLinkedList<float>& v, float* out) const {
+    copyList(v, out, dimension);
+}
+
+void VectorStore::addText(string rawText) {
+    VS_TIME(AddText);
+    if (storageMode == StorageMode::Contiguous) {
+        float* row = slab.appendRow();
+        try {
+            embedInto(rawText, row);
+            appendRecord(count, rawText, nullptr);
+        } catch (...) {
+            slab.removeRow(slab.size() - 1);
+            throw;
+        }
+    } else {
+        SinglyLinkedList<float>* vector = preprocessing(rawText);
+        try {
+            appendRecord(count, rawText, vector);
+        } catch (...) {
+            delete vector;
+            throw;
+        }
+    }
+    ++count;
+    indexRecord(records.size() - 1);
+    logMutation(WriteAheadLog::Op::Add, records.size() - 1, count - 1);
+}
+
+// Texts per embedding task of addTexts.
+static const int EMBED_CHUNK_TEXTS = 64;
+
+void VectorStore::addTexts(const ArrayList<string>& rawTexts, int threads) {
+    int n = rawTexts.size();
+    if (n == 0) return;
+
+    int first = records.size();
+    records.reserve(first + n);
+    WorkerPool* workers = (n > EMBED_CHUNK_TEXTS) ? bulkWorkers(threads) : nullptr;
+
+    bool contiguous = (storageMode == StorageMode::Contiguous);
+    SinglyLinkedList<float>** vectors = nullptr;
+    float* rows = nullptr; // workers write through this, not slab.row(), which is not thread safe
+    int stride = slab.getStride();
+    if (contiguous) {
+        slab.reserve(first + n);
+        for (int i = 0; i < n; ++i) slab.appendRow();
+        rows = slab.row(first);
+    } else {
+        vectors = new SinglyLinkedList<float>*[n];
+        for (int i = 0; i < n; ++i) vectors[i] = nullptr;
+    }
+
+    std::exception_ptr failure;
+    std::mutex failureLock;
+    int chunks = (n + EMBED_CHUNK_TEXTS - 1) / EMBED_CHUNK_TEXTS;
+    auto embedChunk = [&](int chunk) {
+        int end = (chunk + 1) * EMBED_CHUNK_TEXTS < n ? (chunk + 1) * EMBED_CHUNK_TEXTS : n;
+        try {
+            for (int i = chunk * EMBED_CHUNK_TEXTS; i < end; ++i) {
+                if (contiguous) embedInto(rawTexts.get(i), rows + static_cast<long long>(i) * stride);
+                else vectors[i] = preprocessing(rawTexts.get(i));
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(failureLock);
+            if (!failure) failure = std::current_exception();
+        }
+    };
+    if (workers) workers->parallelFor(chunks, embedChunk);
+    else for (int c = 0; c < chunks; ++c) embedChunk(c);
+
+    if (failure) {
+        if (contiguous) {
+            for (int i = n - 1; i >= 0; --i) slab.removeRow(first + i);
+        } else {
+            for (int i = 0; i < n; ++i) delete vectors[i];
+            delete[] vectors;
+        }
+        std::rethrow_exception(failure);
+    }
+
+    if (idIndex) idIndex->reserve(first + n);
+    int created = 0;
+    try {
+        for (; created < n; ++created) { // records was reserved, so only createRecord can throw
+            SinglyLinkedList<float>* vector = contiguous ? nullptr : vectors[created];
+            records.add(createRecord(count + created, rawTexts.get(created), vector));
+        }
+    } catch (...) {
+        for (int i = created - 1; i >= 0; --i) {
+            VectorRecord* record = records.removeAt(first + i);
+            releaseText(record);
+            destroyRecord(record); // frees vectors[i]
+        }
+        if (contiguous) {
+            for (int i = n - 1; i >= 0; --i) slab.removeRow(first + i);
+        } else {
+            for (int i = created; i < n; ++i) delete vectors[i];
+            delete[] vectors;
+        }
+        throw;
+    }
+    delete[] vectors;
+    count += n;
+    for (int i = 0; i < n; ++i) {
+        indexRecord(first + i);
+        logMutation(WriteAheadLog::Op::Add, first + i, records.get(first + i)->id);
+    }
+}
+
+SinglyLinkedList<float> VectorStore::getVector(int index) const {
+    if (index < 0 || index >= records.size()) {
+        throw std::out_of_range("Index is invalid!");
+    }
+    if (storageMode == StorageMode::LinkedList) return *records.get(index)->vector;
+
+    SinglyLinkedList<float> copy;
+    const float* row = slab.row(index);
+    for (int i = 0; i < dimension; ++i) copy.add(row[i]);
+    return copy;
+}
+
+const float* VectorStore::getVectorData(int index) const {
+    if (index < 0 || index >= records.size()) {
+        throw std::out_of_range("Index is invalid!");
+    }
+    if (storageMode != StorageMode::Contiguous) {
+        throw std::logic_error("getVectorData requires contiguous storage");
+    }
+    return slab.row(index);
+}
+
+int VectorStore::size() const {
+    return records.size();
+}
+
+bool VectorStore::empty() const {
+    return records.size() == 0;
+}
+
+int VectorStore::getDimension() const {
+    return dimension;
+}
+
+VectorStore::StorageMode VectorStore::getStorageMode() const {
+    return storageMode;
+}
+
+string VectorStore::getRawText(int index) const {
+    if (index < 0 || index >= records.size()) {
+        throw std::out_of_range("Index is invalid!");
+    }
+    TextArena::Reader reader;
+    return string(textOf(records.get(index), reader));
+}
+
+std::string_view VectorStore::getRawTextView(int index, TextArena::Reader& reader) const {
+    if (index < 0 || index >= records.size()) {
+        throw std::out_of_range("Index is invalid!");
+    }
+    return textOf(records.get(index), reader);
+}
+
+int VectorStore::getId(int index) const {
+    if (index < 0 || index >= records.size()) {
+        throw std::out_of_range("Index is invalid!");
+    }
+    return records.get(index)->id;
+}
+
+bool VectorStore::removeAt(int index) {
+    if (index < 0 || index >= records.size()) {
+        throw std::out_of_range("Index is invalid!");
+    }
+    VectorRecord* record = records.get(index);
+    int last = records.size() - 1;
+    bool contiguous = (storageMode == StorageMode::Contiguous);
+    if (removalMode == RemovalMode::SwapWithLast && index != last) {
+        records.set(index, records.get(last));
+        records.removeAt(last);
+        if (contiguous) slab.swapRemoveRow(index);
+        if (quantized) quantized->swapRemoveRow(index);
+        if (normMode == NormMode::CachedNorms) {
+            norms.set(index, norms.get(last));
+            norms.removeAt(last);
+        }
+        idIndex->put(records.get(index)->id, index);
+    } else {
+        records.removeAt(index);
+        if (contiguous) slab.removeRow(index);
+        if (quantized) quantized->removeRow(index);
+        if (normMode == NormMode::CachedNorms) norms.removeAt(index);
+        if (idIndex) {
+            for (int i = index; i < records.size(); ++i) idIndex->put(records.get(i)->id, i);
+        }
+    }
+    if (idIndex) idIndex->erase(record->id);
+    metadata.eraseId(record->id);
+    unindexRecord(record->id);
+    int id = record->id;
+    releaseText(record);
+    destroyRecord(record);
+    logMutation(WriteAheadLog::Op::Remove, -1, id);
+    reclaimTexts();
+    return true;
+}
+
+bool VectorStore::updateText(int index, string newRawText) {
+    if (index < 0 || index >= records.size()) {
+        throw std::out_of_range("Index is invalid!");
+    }
+    VectorRecord* record = records.get(index);
+    if (storageMode == StorageMode::Contiguous) {
+        embedInto(newRawText, slab.row(index));
+    } else {
+        SinglyLinkedList<float>* vector = preprocessing(newRawText);
+        delete record->vector;
+        record->vector = vector;
+    }
+    replaceText(record, newRawText);
+    indexRecord(index); // re-inserting a label retires its old node
+    logMutation(WriteAheadLog::Op::Update, index, record->id);
+    reclaimTexts();
+    return true;
+}
+
+void VectorStore::setRecordAllocator(NodeAllocator* allocator) {
+    if (!records.empty()) throw std::logic_error("setRecordAllocator - store must be empty");
+
+    recordArena.release();
+    recordAllocator = allocator ? allocator : &recordArena;
+}
+
+void VectorStore::setRemovalMode(RemovalMode mode) {
+    if (mode == RemovalMode::SwapWithLast && !idIndex) {
+        idIndex = new IdIndex(records.size());
+        for (int i = 0; i < records.size(); ++i) idIndex->put(records.get(i)->id, i);
+    }
+    removalMode = mode;
+}
+
+VectorStore::RemovalMode VectorStore::getRemovalMode() const {
+    return removalMode;
+}
+
+int VectorStore::indexOfId(int id) const {
+    return findIndexById(id);
+}
+
+const VectorStore::VectorRecord* VectorStore::getById(int id) const {
+    int index = findIndexById(id);
+    if (index < 0) return nullptr;
+    return records.get(index);
+}
+
+const VectorStore::VectorRecord* VectorStore::getById(int id, string& rawText) const {
+    int index = findIndexById(id);
+    if (index < 0) return nullptr;
+
+    const VectorRecord* record = records.get(index);
+    TextArena::Reader reader;
+    rawText.assign(textOf(record, reader));
+    return record;
+}
+
+bool VectorStore::removeById(int id) {
+    int index = findIndexById(id);
+    if (index < 0) return false;
+    return removeAt(index);
+}
+
+int VectorStore::addEmbedded(string rawText, SinglyLinkedList<float>* vector) {
+    try {
+        if (storageMode == StorageMode::Contiguous) {
+            float* row = slab.appendRow();
+            try {
+                copyVector(*vector, row);
+                appendRecord(count, rawText, nullptr);
+            } catch (...) {
+                slab.removeRow(slab.size() - 1);
+                throw;
+            }
+            delete vector;
+        } else {
+            appendRecord(count, rawText, vector);
+        }
+    } catch (...) {
+        delete vector;
+        throw;
+    }
+    ++count;
+    indexRecord(records.size() - 1);
+    logMutation(WriteAheadLog::Op::Add, records.size() - 1, count - 1);
+    return count - 1;
+}
+
+void VectorStore::updateEmbedded(int index, string newRawText, SinglyLinkedList<float>* vector) {
+    VectorRecord* record = records.get(index);
+    if (storageMode == StorageMode::Contiguous) {
+        copyVector(*vector, slab.row(index));
+        delete vector;
+    } else {
+        delete record->vector;
+        record->vector = vector;
+    }
+    replaceText(record, newRawText);
+    indexRecord(index);
+    logMutation(WriteAheadLog::Op::Update, index, record->id);
+    reclaimTexts();
+}
+
+bool VectorStore::updateById(int id, string newRawText) {
+    int index = findIndexById(id);
+    if (index < 0) return false;
+    return updateText(index, newRawText);
+}
+
+void VectorStore::setEmbeddingFunction(EmbedFn newEmbeddingFunction) {
+    embeddingFunction = newEmbeddingFunction;
+    if (embeddingCache) embeddingCache->clear(); // vectors of the old model
+}
+
+void VectorStore::setTextInterning(bool enabled) {
+    if (enabled == texts.getInterning()) return;
+
+    texts.setInterning(enabled);
+    if (enabled) compactTexts(); // merges the copies already stored
+}
+
+void VectorStore::setTextCompression(bool enabled) {
+    texts.setCompression(enabled);
+}
+
+// Appends every live text to a fresh arena (with the same settings) and
+// swaps it in; the records are only repointed once all appends succeeded.
+void VectorStore::compactTexts() {
+    TextArena rebuilt;
+    rebuilt.setInterning(texts.getInterning());
+    rebuilt.setCompression(texts.getCompression());
+    int n = records.size();
+    long long* offsets = new long long[n > 0 ? n : 1];
+    try {
+        TextArena::Reader reader;
+        for (int i = 0; i < n; ++i) {
+            const VectorRecord* record = records.get(i);
+            if (!record->mappedText) offsets[i] = rebuilt.append(textOf(record, reader));
+        }
+    } catch (...) {
+        delete[] offsets;
+        throw;
+    }
+    for (int i = 0; i < n; ++i) {
+        VectorRecord* record = records.get(i);
+        if (!record->mappedText) record->textOffset = offsets[i];
+    }
+    delete[] offsets;
+    texts.swap(rebuilt);
+}
+
+long long VectorStore::textMemoryBytes() const {
+    return texts.memoryBytes();
+}
+
+void VectorStore::setEmbeddingCache(long long byteBudget, int shards) {
+    EmbeddingCache* created = (byteBudget > 0) ? new EmbeddingCache(byteBudget, shards) : nullptr;
+    delete embeddingCache;
+    embeddingCache = created;
+}
+
+bool VectorStore::hasEmbeddingCache() const {
+    return embeddingCache != nullptr;
+}
+
+EmbeddingCache::Stats VectorStore::embeddingCacheStats() const {
+    if (embeddingCache) return embeddingCache->stats();
+    EmbeddingCache::Stats none = {0, 0, 0, 0, 0};
+    return none;
+}
+
+void VectorStore::clearEmbeddingCache() {
+    if (embeddingCache) embeddingCache->clear();
+}
+
+void VectorStore::setSearchThreads(int threads) {
+    delete pool;
+    pool = nullptr;
+    if (threads == 1) return;
+
+    WorkerPool* created = new WorkerPool(threads);
+    if (created->size() == 1) {
+        delete created; // single-core host, stay serial
+        return;
+    }
+    pool = created;
+}
+
+int VectorStore::getSearchThreads() const {
+    return pool ? pool->size() : 1;
+}
+
+// Workers for a bulk call (nullptr = run serially). threads == 0 prefers
+// the search pool. Otherwise the store's bulk pool is created on first use,
+// sized by that call, and kept, so later calls do not spawn threads again.
+WorkerPool* VectorStore::bulkWorkers(int threads) const {
+    if (threads == 1) return nullptr;
+    if (threads == 0 && pool) return pool;
+
+    std::lock_guard<std::mutex> lock(bulkPoolLock);
+    if (!bulkPool) bulkPool = new WorkerPool(threads);
+    return (bulkPool->size() > 1) ? bulkPool : nullptr;
+}
+
+// Edits reach the store the way updateText's do: a changed vector is
+// re-normed and re-indexed, and a changed record is logged as an Update.
+void VectorStore::forEach(void (*action)(SinglyLinkedList<float>&, int, string&)) {
+    TextArena::Reader reader;
+    string text;
+    bool contiguous = (storageMode == StorageMode::Contiguous);
+    SinglyLinkedList<float> scratch; // Contiguous: the row handed to the action
+    float* before = new float[dimension];
+    float* edited = new float[dimension];
+    try {
+        for (int i = 0; i < records.size(); ++i) {
+            VectorRecord* record = records.get(i);
+            std::string_view stored = textOf(record, reader);
+            text.assign(stored);
+            bool vectorChanged;
+            if (contiguous) {
+                const float* row = static_cast<const VectorSlab&>(slab).row(i);
+                scratch.clear();
+                for (int d = 0; d < dimension; ++d) scratch.add(row[d]);
+                action(scratch, record->rawLength, text);
+                copyVector(scratch, edited);
+                vectorChanged = memcmp(edited, row, sizeof(float) * dimension) != 0;
+                if (vectorChanged) memcpy(slab.row(i), edited, sizeof(float) * dimension);
+            } else {
+                copyVector(*record->vector, before);
+                action(*record->vector, record->rawLength, text);
+                copyVector(*record->vector, edited);
+                vectorChanged = memcmp(edited, before, sizeof(float) * dimension) != 0;
+            }
+            bool textChanged = std::string_view(text) != textOf(record, reader);
+            if (textChanged) replaceText(record, text);
+            if (vectorChanged) indexRecord(i);
+            if (vectorChanged || textChanged) logMutation(WriteAheadLog::Op::Update, i, record->id);
+        }
+    } catch (...) {
+        delete[] before;
+        delete[] edited;
+        throw;
+    }
+    delete[] before;
+    delete[] edited;
+    reclaimTexts();
+}
+
+// ----------------- VectorStore Scan -----------------
+
+std::string_view VectorStore::ScanBlock::text(int r) const {
+    return store->textOf(store->records.get(firstIndex + r), *reader);
+}
+
+// One task per block; each task packs its own rows (LinkedList mode) and
+// ids, so blocks can run on any worker.
+bool VectorStore::scanBlocks(bool (*fn)(void*, const ScanBlock&), void* ctx, int blockRows, int threads) const {
+    if (blockRows <= 0) throw std::invalid_argument("VectorStore::scan - blockRows must be positive");
+
+    int n = records.size();
+    int blocks = (n + blockRows - 1) / blockRows;
+    WorkerPool* workers = (blocks > 1) ? bulkWorkers(threads) : nullptr;
+
+    bool contiguous = (storageMode == StorageMode::Contiguous);
+    std::atomic<bool> stopped(false);
+    std::exception_ptr failure;
+    std::mutex failureLock;
+    auto visitBlock = [&](int b) {
+        if (stopped.load(std::memory_order_relaxed)) return;
+        int first = b * blockRows;
+        int rows = (n - first < blockRows) ? n - first : blockRows;
+        int* ids = nullptr;
+        float* packed = nullptr;
+        try {
+            ids = new int[rows];
+            for (int r = 0; r < rows; ++r) ids[r] = records.get(first + r)->id;
+            ScanBlock block;
+            if (contiguous) {
+                block.rows = slab.row(first);
+                block.stride = slab.getStride();
+            } else {
+                packed = new float[static_cast<long long>(rows) * dimension];
+                for (int r = 0; r < rows; ++r) {
+                    copyVector(*records.get(first + r)->vector, packed + static_cast<long long>(r) * dimension);
+                }
+                block.rows = packed;
+                block.stride = dimension;
+            }
+            TextArena::Reader reader;
+            block.store = this;
+            block.idList = ids;
+            block.reader = &reader;
+            block.firstIndex = first;
+            block.count = rows;
+            if (!fn(ctx, block)) stopped.store(true, std::memory_order_relaxed);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(failureLock);
+            if (!failure) failure = std::current_exception();
+            stopped.store(true, std::memory_order_relaxed);
+        }
+        delete[] packed;
+        delete[] ids;
+    };
+    if (workers && blocks > 1) {
+        workers->parallelFor(blocks, visitBlock);
+    } else {
+        for (int b = 0; b < blocks && !stopped.load(std::memory_order_relaxed); ++b) visitBlock(b);
+    }
+
+    if (failure) std::rethrow_exception(failure);
+    return !stopped.load();
+}
+
+// ----------------- VectorStore Metrics -----------------
+
+Instrumentation::Snapshot VectorStore::stats() {
+    return Instrumentation::snapshot();
+}
+
+void VectorStore::resetStats() {
+    Instrumentation::reset();
+}
+
+double VectorStore::cosineSimilarity(const float* v1, const float* v2, int n) const {
+    float dot, norm1, norm2;
+    DistanceKernels::cosineParts(v1, v2, n, dot, norm1, norm2);
+    if (norm1 == 0.0f || norm2 == 0.0f) return 0.0;
+    return dot / (sqrt(static_cast<double>(norm1)) * sqrt(static_cast<double>(norm2)));
+}
+
+double VectorStore::l1Distance(const float* v1, const float* v2, int n) const {
+    return DistanceKernels::l1(v1, v2, n);
+}
+
+double VectorStore::l2Distance(const float* v1, const float* v2, int n) const {
+    return sqrt(static_cast<double>(DistanceKernels::l2Squared(v1, v2, n)));
+}
+
+double VectorStore::cosineSimilarity(const SinglyLinkedList<float>& v1,
+                                     const SinglyLinkedList<float>& v2) const {
+    int n = (v1.size() > v2.size()) ? v1.size() : v2.size();
+    float* a = new float[2 * n + 1];
+    copyList(v1, a, n);
+    copyList(v2, a + n, n);
+    double result = cosineSimilarity(a, a + n, n);
+    delete[] a;
+    return result;
+}
+
+double VectorStore::l1Distance(const SinglyLinkedList<float>& v1,
+                               const SinglyLinkedList<float>& v2) const {
+    int n = (v1.size() > v2.size()) ? v1.size() : v2.size();
+    float* a = new float[2 * n + 1];
+    copyList(v1, a, n);
+    copyList(v2, a + n, n);
+    double result = l1Distance(a, a + n, n);
+    delete[] a;
+    return result;
+}
+
+double VectorStore::l2Distance(const SinglyLinkedList<float>& v1,
+                               const SinglyLinkedList<float>& v2) const {
+    int n = (v1.size() > v2.size()) ? v1.size() : v2.size();
+    float* a = new float[2 * n + 1];
+    copyList(v1, a, n);
+    copyList(v2, a + n, n);
+    double result = l2Distance(a, a + n, n);
+    delete[] a;
+    return result;
+}
+
+double VectorStore::score(Metric metric, const float* query, const float* row) const {
+    switch (metric) {
+        case Metric::Cosine:    return cosineSimilarity(query, row, dimension);
+        case Metric::Euclidean: return l2Distance(query, row, dimension);
+        default:                return l1Distance(query, row, dimension);
+    }
+}
+
+// Row i as a dense float pointer: straight into the slab in contiguous mode,
+// otherwise the record's list is unpacked into `scratch`.
+const float* VectorStore::rowData(int index, float* scratch) const {
+    if (storageMode == StorageMode::Contiguous) return slab.row(index);
+
+    copyVector(*records.get(index)->vector, scratch);
+    return scratch;
+}
+
+// ----------------- VectorStore Search -----------------
+
+// Rows per parallel task; below this a chunk is not worth a hand-off.
+static const int SEARCH_CHUNK_ROWS = 4096;
+
+// Cosine once the row norm is known: |row| from the cache, or 1 for
+// normalized rows (a zero row has a zero dot product either way).
+double VectorStore::cachedCosine(const float* query, double queryNorm, int index, const float* row) const {
+    double rowNorm = (normMode == NormMode::CachedNorms) ? norms.get(index) : 1.0;
+    if (queryNorm == 0.0 || rowNorm == 0.0) return 0.0;
+    return DistanceKernels::dot(query, row, dimension) / (queryNorm * rowNorm);
+}
+
+// Offers rows [begin, end) to `selector` as lower-is-better keys (cosine
+// negated). With a quantized precision the codes are scored via `prepared`.
+// Rows whose id is not set in `eligible` are skipped.
+void VectorStore::scanRows(const float* query, const ScalarQuantizer::Query* prepared, Metric metric,
+                           int begin, int end, TopKSelector& selector, const RowBitmap* eligible) const {
+    bool higherIsBetter = (metric == Metric::Cosine);
+    if (prepared) {
+        for (int i = begin; i < end; ++i) {
+            if (eligible && !eligible->test(records.get(i)->id)) continue;
+            double s = quantized->score(metric, *prepared, i);
+            selector.offer(higherIsBetter ? -s : s, i);
+        }
+        return;
+    }
+
+    bool cached = (metric == Metric::Cosine && normMode != NormMode::Raw);
+    double queryNorm = cached ? sqrt(static_cast<double>(DistanceKernels::dot(query, query, dimension))) : 0.0;
+    float* scratch = (storageMode == StorageMode::Contiguous) ? nullptr : new float[dimension];
+    for (int i = begin; i < end; ++i) {
+        if (eligible && !eligible->test(records.get(i)->id)) continue;
+        const float* row = rowData(i, scratch);
+        double s = cached ? cachedCosine(query, queryNorm, i, row) : score(metric, query, row);
+        selector.offer(higherIsBetter ? -s : s, i);
+    }
+    delete[] scratch;
+}
+
+// Writes the best min(k, size) rows as lower-is-better keys (cosine negated)
+// into keys/items, best first. With a pool the rows are split into chunks,
+// each chunk keeps a local heap and the partial heaps are merged; since the
+// (key, index) order is total the result equals the serial scan exactly.
+// A chunk never yields more than its own rows, so the partial heaps hold at
+// most min(k, SEARCH_CHUNK_ROWS) entries; when k is a large fraction of n
+// the merge would redo most of the work, so that case stays serial.
+int VectorStore::selectNearest(const float* query, Metric metric, int k, double* keys, int* items,
+                               const RowBitmap* eligible) const {
+    int n = records.size();
+    if (k > n) k = n;
+    if (k <= 0) return 0;
+    VS_TIME(Scan);
+
+    ScalarQuantizer::Query prepared;
+    if (quantized) quantized->prepare(query, prepared);
+    const ScalarQuantizer::Query* codes = quantized ? &prepared : nullptr;
+    int chunks = (n + SEARCH_CHUNK_ROWS - 1) / SEARCH_CHUNK_ROWS;
+    if (!pool || chunks < 2 || k > n / 4) {
+        TopKSelector selector(k);
+        scanRows(query, codes, metric, 0, n, selector, eligible);
+        return selector.drainSorted(keys, items);
+    }
+
+    int slot = (k < SEARCH_CHUNK_ROWS) ? k : SEARCH_CHUNK_ROWS;
+    double* partKeys = new double[static_cast<long long>(chunks) * slot];
+    int* partItems = new int[static_cast<long long>(chunks) * slot];
+    int* partCounts = new int[chunks];
+    auto scanChunk = [&](int chunk) {
+        int begin = chunk * SEARCH_CHUNK_ROWS;
+        int end = (begin + SEARCH_CHUNK_ROWS < n) ? begin + SEARCH_CHUNK_ROWS : n;
+        TopKSelector local(slot);
+        scanRows(query, codes, metric, begin, end, local, eligible);
+        partCounts[chunk] = local.drainSorted(partKeys + static_cast<long long>(chunk) * slot,
+                                              partItems + static_cast<long long>(chunk) * slot);
+    };
+    pool->parallelFor(chunks, scanChunk);
+
+    TopKSelector merged(k);
+    for (int c = 0; c < chunks; ++c) {
+        for (int j = 0; j < partCounts[c]; ++j) {
+            long long at = static_cast<long long>(c) * slot + j;
+            if (!merged.offer(partKeys[at], partItems[at])) break; // partials are sorted
+        }
+    }
+    delete[] partCounts;
+    delete[] partItems;
+    delete[] partKeys;
+    return merged.drainSorted(keys, items);
+}
+
+// Best-first keys of `selector` -> scores / indices / ids of `out`.
+void VectorStore::drainResult(TopKSelector& selector, Metric metric, TopKResult& out) const {
+    out.resize(selector.size());
+    int got = selector.drainSorted(out.scoreData(), out.indexData());
+    for (int i = 0; i < got; ++i) {
+        if (metric == Metric::Cosine) out.scoreData()[i] = -out.scoreData()[i];
+        out.idData()[i] = records.get(out.indexData()[i])->id;
+    }
+}
+
+int VectorStore::findNearest(const SinglyLinkedList<float>& query, const string& metric) const {
+    VS_TIME(FindNearest);
+    VS_COUNT(Queries, 1);
+    Metric m = DistanceKernels::parseMetric(metric);
+    if (records.size() == 0) return -1;
+
+    float* q = new float[dimension];
+    copyVector(query, q);
+    double key;
+    int best = -1;
+    selectNearest(q, m, 1, &key, &best);
+    delete[] q;
+    return best;
+}
+
+int* VectorStore::topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric) const {
+    TopKResult result;
+    topKNearest(query, k, metric, result);
+
+    int* indices = new int[k];
+    for (int i = 0; i < k; ++i) indices[i] = result.getIndex(i);
+    return indices;
+}
+
+void VectorStore::topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                              TopKResult& out) const {
+    float* q = new float[dimension];
+    copyVector(query, q);
+    try {
+        topKNearest(q, k, metric, out);
+    } catch (...) {
+        delete[] q;
+        throw;
+    }
+    delete[] q;
+}
+
+void VectorStore::topKNearest(const float* query, int k, const string& metric, TopKResult& out) const {
+    VS_TIME(TopKNearest);
+    VS_COUNT(Queries, 1);
+    Metric m = DistanceKernels::parseMetric(metric);
+    if (k <= 0 || k > records.size()) throw invalid_k_value();
+
+    out.resize(k);
+    selectNearest(query, m, k, out.scoreData(), out.indexData());
+    for (int i = 0; i < k; ++i) {
+        if (m == Metric::Cosine) out.scoreData()[i] = -out.scoreData()[i];
+        out.idData()[i] = records.get(out.indexData()[i])->id;
+    }
+}
+
+TopKResult VectorStore::topKNearestScored(const SinglyLinkedList<float>& query, int k,
+                                          const string& metric) const {
+    TopKResult result(k > 0 ? k : 0);
+    topKNearest(query, k, metric, result);
+    return result;
+}
+
+// A filter matching fewer than 1 / FILTER_SPARSE_RATIO of the records is
+// served by visiting its ids directly instead of scanning every row.
+static const int FILTER_SPARSE_RATIO = 16;
+
+// Like selectNearest over the eligible ids only, resolving each id to its
+// row. Serial: it is meant for filters that leave few rows.
+int VectorStore::selectEligible(const float* query, Metric metric, int k, const RowBitmap& eligible,
+                                double* keys, int* items) const {
+    if (k <= 0) return 0;
+    VS_TIME(Scan);
+
+    ScalarQuantizer::Query prepared;
+    if (quantized) quantized->prepare(query, prepared);
+    float* scratch = (storageMode == StorageMode::Contiguous) ? nullptr : new float[dimension];
+    bool higherIsBetter = (metric == Metric::Cosine);
+    bool cached = (!quantized && metric == Metric::Cosine && normMode != NormMode::Raw);
+    double queryNorm = cached ? sqrt(static_cast<double>(DistanceKernels::dot(query, query, dimension))) : 0.0;
+    TopKSelector selector(k);
+    for (int id = eligible.nextSet(0); id != -1; id = eligible.nextSet(id + 1)) {
+        int index = findIndexById(id);
+        if (index < 0) continue;
+        double s;
+        if (quantized) s = quantized->score(metric, prepared, index);
+        else if (cached) s = cachedCosine(query, queryNorm, index, rowData(index, scratch));
+        else s = score(metric, query, rowData(index, scratch));
+        selector.offer(higherIsBetter ? -s : s, index);
+    }
+    delete[] scratch;
+    return selector.drainSorted(keys, items);
+}
+
+void VectorStore::filteredScan(const float* query, Metric metric, int k, const RowBitmap& eligible,
+                               TopKResult& out) const {
+    out.resize(k);
+    int found;
+    if (static_cast<long long>(eligible.count()) * FILTER_SPARSE_RATIO < records.size()) {
+        found = selectEligible(query, metric, k, eligible, out.scoreData(), out.indexData());
+    } else {
+        found = selectNearest(query, metric, k, out.scoreData(), out.indexData(), &eligible);
+    }
+    out.resize(found);
+    for (int i = 0; i < found; ++i) {
+        if (metric == Metric::Cosine) out.scoreData()[i] = -out.scoreData()[i];
+        out.idData()[i] = records.get(out.indexData()[i])->id;
+    }
+}
+
+int VectorStore::findNearest(const SinglyLinkedList<float>& query, const string& metric,
+                             const Filter& filter) const {
+    VS_TIME(FindNearest);
+    VS_COUNT(Queries, 1);
+    Metric m = DistanceKernels::parseMetric(metric);
+    if (records.size() == 0) return -1;
+
+    RowBitmap eligible;
+    metadata.evaluate(filter, count, eligible);
+    float* q = new float[dimension];
+    copyVector(query, q);
+    TopKResult result(1);
+    try {
+        filteredScan(q, m, 1, eligible, result);
+    } catch (...) {
+        delete[] q;
+        throw;
+    }
+    delete[] q;
+    return result.empty() ? -1 : result.getIndex(0);
+}
+
+void VectorStore::topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                              const Filter& filter, TopKResult& out) const {
+    float* q = new float[dimension];
+    copyVector(query, q);
+    try {
+        topKNearest(q, k, metric, filter, out);
+    } catch (...) {
+        delete[] q;
+        throw;
+    }
+    delete[] q;
+}
+
+void VectorStore::topKNearest(const float* query, int k, const string& metric, const Filter& filter,
+                              TopKResult& out) const {
+    Metric m = DistanceKernels::parseMetric(metric);
+    if (k <= 0 || k > records.size()) throw invalid_k_value();
+    if (filter.matchesAll()) {
+        topKNearest(query, k, metric, out);
+        return;
+    }
+    VS_TIME(TopKNearest);
+    VS_COUNT(Queries, 1);
+
+    RowBitmap eligible;
+    metadata.evaluate(filter, count, eligible);
+    filteredScan(query, m, k, eligible, out);
+}
+
+// ----------------- VectorStore Metadata -----------------
+
+void VectorStore::setIntTag(int id, const string& tag, long long value) {
+    if (findIndexById(id) < 0) throw std::out_of_range("VectorStore::setIntTag - unknown id");
+
+    metadata.setInt(id, tag, value);
+    if (wal) {
+        string block;
+        MetadataTable::encodeInt(block, id, tag, value);
+        logTag(id, block);
+    }
+}
+
+void VectorStore::setFloatTag(int id, const string& tag, double value) {
+    if (findIndexById(id) < 0) throw std::out_of_range("VectorStore::setFloatTag - unknown id");
+
+    metadata.setFloat(id, tag, value);
+    if (wal) {
+        string block;
+        MetadataTable::encodeFloat(block, id, tag, value);
+        logTag(id, block);
+    }
+}
+
+void VectorStore::setStringTag(int id, const string& tag, const string& value) {
+    if (findIndexById(id) < 0) throw std::out_of_range("VectorStore::setStringTag - unknown id");
+
+    metadata.setString(id, tag, value);
+    if (wal) {
+        string block;
+        MetadataTable::encodeString(block, id, tag, value);
+        logTag(id, block);
+    }
+}
+
+bool VectorStore::removeTag(int id, const string& tag) {
+    if (!metadata.erase(id, tag)) return false;
+
+    if (wal) {
+        string block;
+        MetadataTable::encodeErase(block, id, tag);
+        logTag(id, block);
+    }
+    return true;
+}
+
+bool VectorStore::getIntTag(int id, const string& tag, long long& out) const {
+    return metadata.getInt(id, tag, out);
+}
+
+bool VectorStore::getFloatTag(int id, const string& tag, double& out) const {
+    return metadata.getFloat(id, tag, out);
+}
+
+bool VectorStore::getStringTag(int id, const string& tag, string& out) const {
+    return metadata.getString(id, tag, out);
+}
+
+int VectorStore::countMatching(const Filter& filter) const {
+    if (filter.matchesAll()) return records.size();
+
+    RowBitmap eligible;
+    metadata.evaluate(filter, count, eligible);
+    int matches = 0;
+    for (int id = eligible.nextSet(0); id != -1; id = eligible.nextSet(id + 1)) {
+        if (findIndexById(id) >= 0) ++matches; // a negated filter also sets removed ids
+    }
+    return matches;
+}
+
+// ----------------- VectorStore Persistence -----------------
+
+// On-disk layout (native byte order, recorded in the header):
+//   StoreFileHeader | int ids[n] | long long textOffsets[n + 1] | text blob |
+//   pad to 64 | float matrix[n][stride] | tags (MetadataTable::encode)
+// Version 1 files end after the matrix and their header stops before
+// tagsOffset; they load with no tags.
+static const char STORE_MAGIC[8] = { 'V', 'S', 'T', 'O', 'R', 'E', '\r', '\n' };
+static const unsigned int STORE_FORMAT_VERSION = 2;
+static const unsigned int STORE_BYTE_ORDER = 0x01020304u;
+
+struct StoreFileHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int byteOrder;
+    int dimension;
+    int stride;
+    long long recordCount;
+    long long nextId;
+    long long idsOffset;
+    long long textOffsetsOffset;
+    long long textOffset;
+    long long textBytes;
+    long long matrixOffset;
+    long long fileBytes;
+    long long tagsOffset; // version 2
+    long long tagsBytes;
+};
+
+static const long long STORE_HEADER_V1_BYTES = offsetof(StoreFileHeader, tagsOffset);
+
+static long long alignUp(long long value, long long alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Flushes a closed file's data to stable storage (no-op without POSIX I/O).
+static void syncFile(const string& path) {
+#ifdef VECTORSTORE_HAVE_MMAP
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// Flushes the directory entry of `path` (a rename or a new file).
+static void syncDirectory(const string& path) {
+#ifdef VECTORSTORE_HAVE_MMAP
+    std::filesystem::path directory = std::filesystem::path(path).parent_path();
+    int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+// Writes a snapshot through `path`.tmp + rename. idAt(i) -> int,
+// textAt(i, data, length) and rowAt(i, scratch) -> const float* (dimension
+// values) supply the records and `tags` is the encoded MetadataTable, so
+// save() and WAL compaction share the layout.
+template <class IdAt, class TextAt, class RowAt>
+static void writeStoreFile(const string& path, int dimension, int n, long long nextId, IdAt& idAt,
+                           TextAt& textAt, RowAt& rowAt, const string& tags, bool durable) {
+    int stride = paddedStride(dimension);
+    StoreFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    header.version = STORE_FORMAT_VERSION;
+    header.byteOrder = STORE_BYTE_ORDER;
+    header.dimension = dimension;
+    header.stride = stride;
+    header.recordCount = n;
+    header.nextId = nextId;
+    header.idsOffset = sizeof(StoreFileHeader);
+    header.textOffsetsOffset = alignUp(header.idsOffset + static_cast<long long>(n) * sizeof(int), 8);
+    header.textOffset = header.textOffsetsOffset + static_cast<long long>(n + 1) * sizeof(long long);
+    long long* textOffsets = new long long[n + 1];
+    textOffsets[0] = 0;
+    for (int i = 0; i < n; ++i) {
+        const char* text;
+        int length;
+        textAt(i, text, length);
+        textOffsets[i + 1] = textOffsets[i] + length;
+    }
+    header.textBytes = textOffsets[n];
+    header.matrixOffset = alignUp(header.textOffset + header.textBytes, VectorSlab::ALIGNMENT);
+    header.tagsOffset = header.matrixOffset + static_cast<long long>(n) * stride * sizeof(float);
+    header.tagsBytes = static_cast<long long>(tags.size());
+    header.fileBytes = header.tagsOffset + header.tagsBytes;
+
+    string temporary = path + ".tmp";
+    std::ofstream out(temporary.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        delete[] textOffsets;
+        throw std::runtime_error("Cannot write " + temporary);
+    }
+    const char zeros[VectorSlab::ALIGNMENT] = {};
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (int i = 0; i < n; ++i) {
+        int id = idAt(i);
+        out.write(reinterpret_cast<const char*>(&id), sizeof(int));
+    }
+    out.write(zeros, header.textOffsetsOffset - (header.idsOffset + static_cast<long long>(n) * sizeof(int)));
+    out.write(reinterpret_cast<const char*>(textOffsets), static_cast<long long>(n + 1) * sizeof(long long));
+    for (int i = 0; i < n; ++i) {
+        const char* text;
+        int length;
+        textAt(i, text, length);
+        out.write(text, length);
+    }
+    out.write(zeros, header.matrixOffset - (header.textOffset + header.textBytes));
+
+    float* scratch = new float[dimension];
+    for (int i = 0; i < n; ++i) {
+        out.write(reinterpret_cast<const char*>(rowAt(i, scratch)), static_cast<long long>(dimension) * sizeof(float));
+        out.write(zeros, static_cast<long long>(stride - dimension) * sizeof(float));
+    }
+    delete[] scratch;
+    delete[] textOffsets;
+    out.write(tags.data(), header.tagsBytes);
+    out.close();
+    if (!out) {
+        std::remove(temporary.c_str());
+        throw std::runtime_error("Cannot write " + temporary);
+    }
+    syncFile(temporary); // the data must be on disk before the name points at it
+#ifdef _WIN32
+    std::remove(path.c_str()); // rename does not replace an existing file here
+#endif
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Cannot rename " + temporary + " to " + path);
+    }
+    if (durable) syncDirectory(path); // so the rename itself survives a crash
+}
+
+void VectorStore::save(const string& path) const {
+    auto idAt = [this](int i) { return records.get(i)->id; };
+    TextArena::Reader reader;
+    auto textAt = [this, &reader](int i, const char*& text, int& length) {
+        std::string_view view = textOf(records.get(i), reader);
+        text = view.data();
+        length = static_cast<int>(view.size());
+    };
+    auto rowAt = [this](int i, float* scratch) { return rowData(i, scratch); };
+    string tags;
+    metadata.encode(tags);
+    writeStoreFile(path, dimension, records.size(), count, idAt, textAt, rowAt, tags, false);
+}
+
+// True when `count` items of `size` bytes starting at `offset` end within
+// `limit`; written to avoid overflow on hostile headers.
+static bool sectionFits(long long offset, long long count, long long size, long long limit) {
+    return offset >= 0 && count >= 0 && offset <= limit && count <= (limit - offset) / size;
+}
+
+// Every check load() needs before it trusts a byte of the file: the header,
+// section bounds and alignment, the text offset table, the ids and the tags
+// (decoded into `tags`). Returns nullptr or the reason the file is rejected.
+static const char* validateStoreFile(const char* base, long long size, int dimension, StoreFileHeader& header,
+                                     MetadataTable& tags) {
+    if (size < STORE_HEADER_V1_BYTES) return "truncated header";
+    memset(&header, 0, sizeof(header));
+    memcpy(&header, base, STORE_HEADER_V1_BYTES);
+    long long n = header.recordCount;
+    if (memcmp(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0) return "not a VectorStore file";
+    if (header.byteOrder != STORE_BYTE_ORDER) return "byte order mismatch";
+    if (header.version != 1 && header.version != STORE_FORMAT_VERSION) return "unsupported format version";
+    long long headerBytes = STORE_HEADER_V1_BYTES;
+    if (header.version == 1) {
+        header.tagsOffset = header.fileBytes;
+    } else {
+        headerBytes = sizeof(header);
+        if (size < headerBytes) return "truncated header";
+        memcpy(&header, base, sizeof(header));
+    }
+    if (header.dimension != dimension) return "dimension mismatch";
+    if (header.stride < dimension || header.stride > paddedStride(dimension) || n < 0 || n > INT_MAX ||
+        header.nextId < n || header.nextId > INT_MAX) {
+        return "corrupt header";
+    }
+    long long floatRow = static_cast<long long>(header.stride) * sizeof(float);
+    if (header.fileBytes != size || header.idsOffset < headerBytes ||
+        header.idsOffset % sizeof(int) != 0 || header.textOffsetsOffset % sizeof(long long) != 0 ||
+        !sectionFits(header.idsOffset, n, sizeof(int), header.textOffsetsOffset) ||
+        !sectionFits(header.textOffsetsOffset, n + 1, sizeof(long long), header.textOffset) ||
+        !sectionFits(header.textOffset, header.textBytes, 1, header.matrixOffset) ||
+        header.matrixOffset % VectorSlab::ALIGNMENT != 0 ||
+        !sectionFits(header.matrixOffset, n, floatRow, header.tagsOffset) ||
+        !sectionFits(header.tagsOffset, header.tagsBytes, 1, header.fileBytes) ||
+        header.tagsOffset + header.tagsBytes != header.fileBytes) {
+        return "truncated or corrupt sections";
+    }
+
+    const long long* textOffsets = reinterpret_cast<const long long*>(base + header.textOffsetsOffset);
+    if (textOffsets[0] != 0 || textOffsets[n] != header.textBytes) return "corrupt text offsets";
+    for (long long i = 0; i < n; ++i) {
+        long long length = textOffsets[i + 1] - textOffsets[i];
+        if (textOffsets[i + 1] < textOffsets[i] || textOffsets[i + 1] > header.textBytes || length > INT_MAX) {
+            return "corrupt text offsets";
+        }
+    }
+
+    const int* ids = reinterpret_cast<const int*>(base + header.idsOffset);
+    IdIndex seen(static_cast<int>(n));
+    for (int i = 0; i < n; ++i) {
+        if (ids[i] < 0 || ids[i] >= header.nextId) return "corrupt ids";
+        if (seen.get(ids[i]) != -1) return "duplicate ids";
+        seen.put(ids[i], i);
+    }
+    if (!tags.decode(base + header.tagsOffset, header.tagsBytes, static_cast<int>(header.nextId))) return "corrupt tags";
+    return nullptr;
+}
+
+void VectorStore::load(const string& path) {
+    MappedFile* file = new MappedFile(path);
+    const char* base = file->data();
+    StoreFileHeader header;
+    MetadataTable tags;
+    const char* problem = validateStoreFile(base, file->size(), dimension, header, tags);
+    if (problem) {
+        delete file;
+        throw std::runtime_error("VectorStore::load - " + path + ": " + problem);
+    }
+
+    clear();
+    metadata.swap(tags);
+    int n = static_cast<int>(header.recordCount);
+    const int* ids = reinterpret_cast<const int*>(base + header.idsOffset);
+    const long long* textOffsets = reinterpret_cast<const long long*>(base + header.textOffsetsOffset);
+    const char* text = base + header.textOffset;
+    float* matrix = reinterpret_cast<float*>(file->data() + header.matrixOffset);
+    for (int i = 0; i < n; ++i) {
+        VectorRecord* record = createRecord(ids[i], std::string_view(), nullptr);
+        record->mappedText = text + textOffsets[i];
+        record->rawLength = static_cast<int>(textOffsets[i + 1] - textOffsets[i]);
+        records.add(record);
+    }
+    if (storageMode == StorageMode::Contiguous && header.stride == slab.getStride()) {
+        slab.attach(matrix, n);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            const float* src = matrix + static_cast<long long>(i) * header.stride;
+            if (storageMode == StorageMode::Contiguous) {
+                memcpy(slab.appendRow(), src, sizeof(float) * dimension);
+            } else {
+                SinglyLinkedList<float>* vector = new SinglyLinkedList<float>();
+                for (int d = 0; d < dimension; ++d) vector->add(src[d]);
+                records.get(i)->vector = vector;
+            }
+        }
+    }
+    mapped = file;
+    count = static_cast<int>(header.nextId);
+    bool sorted = true;
+    for (int i = 1; i < n && sorted; ++i) sorted = ids[i - 1] < ids[i];
+    if (!sorted && !idIndex) idIndex = new IdIndex(n); // saved from a SwapWithLast store
+    if (idIndex) {
+        idIndex->reserve(n);
+        for (int i = 0; i < n; ++i) idIndex->put(ids[i], i);
+    }
+
+    if (normMode != NormMode::Raw) {
+        for (int i = 0; i < records.size(); ++i) updateNorm(i);
+    }
+    if (quantized) recalibrate();
+    if (hnsw || ivf || pq) {
+        for (int i = 0; i < records.size(); ++i) indexRecord(i);
+    }
+    if (wal) compactWal(); // the loaded records are not in the log
+}
+
+// ----------------- VectorStore Write-Ahead Log -----------------
+
+// Copy of the records taken when the log rotates, written out by the
+// compaction thread while the store keeps changing.
+struct SnapshotImage {
+    int n;
+    int dimension;
+    long long nextId;
+    int* ids;
+    long long* textOffsets;
+    string text;
+    float* rows;
+    string tags; // MetadataTable::encode
+
+    SnapshotImage(int n, int dimension) : n(n), dimension(dimension), nextId(0) {
+        ids = new int[n > 0 ? n : 1];
+        textOffsets = new long long[n + 1];
+        rows = new float[static_cast<long long>(n > 0 ? n : 1) * dimension];
+    }
+    ~SnapshotImage() {
+        delete[] ids;
+        delete[] textOffsets;
+        delete[] rows;
+    }
+};
+
+static string walPath(const string& base, int generation) {
+    return base + ".wal." + std::to_string(generation);
+}
+
+static string snapshotPath(const string& base, int generation) {
+    return base + ".snapshot." + std::to_string(generation);
+}
+
+// Generations n of the files "<base><infix><n>", ascending.
+static ArrayList<int> findGenerations(const string& base, const string& infix) {
+    namespace fs = std::filesystem;
+    fs::path basePath(base);
+    fs::path dir = basePath.has_parent_path() ? basePath.parent_path() : fs::path(".");
+    string prefix = basePath.filename().string() + infix;
+    ArrayList<int> found;
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        string name = it->path().filename().string();
+        if (name.compare(0, prefix.length(), prefix) != 0 || name.length() == prefix.length()) continue;
+        string digits = name.substr(prefix.length());
+        if (digits.length() > 9 || digits.find_first_not_of("0123456789") != string::npos) continue;
+        int generation = std::stoi(digits);
+        int at = found.size();
+        while (at > 0 && found.get(at - 1) > generation) --at;
+        found.add(at, generation);
+    }
+    return found;
+}
+
+// Appends the mutation to the log; Add / Update carry the record's current
+// text and vector so replay does not call the embedding function.
+void VectorStore::logMutation(WriteAheadLog::Op op, int index, int id) {
+    if (!wal) return;
+
+    if (op == WriteAheadLog::Op::Add || op == WriteAheadLog::Op::Update) {
+        float* scratch = (storageMode == StorageMode::Contiguous) ? nullptr : new float[dimension];
+        try {
+            wal->append(op, id, getRawText(index), rowData(index, scratch));
+        } catch (...) {
+            delete[] scratch;
+            throw;
+        }
+        delete[] scratch;
+    } else {
+        wal->append(op, id, string(), nullptr);
+    }
+    if (walCompactBytes > 0 && wal->size() >= walCompactBytes) compactWal();
+}
+
+// Appends an encoded MetadataTable block (see MetadataTable::encodeInt).
+void VectorStore::logTag(int id, const string& block) {
+    wal->append(WriteAheadLog::Op::Tag, id, block, nullptr);
+    if (walCompactBytes > 0 && wal->size() >= walCompactBytes) compactWal();
+}
+
+void VectorStore::replayEntry(const WriteAheadLog::Entry& entry) {
+    std::string_view text(entry.text, entry.textLength);
+    switch (entry.op) {
+        case WriteAheadLog::Op::Add: {
+            if (storageMode == StorageMode::Contiguous) {
+                memcpy(slab.appendRow(), entry.vector, sizeof(float) * dimension);
+                records.add(createRecord(entry.id, text, nullptr));
+            } else {
+                SinglyLinkedList<float>* vector = new SinglyLinkedList<float>();
+                for (int d = 0; d < dimension; ++d) vector->add(entry.vector[d]);
+                records.add(createRecord(entry.id, text, vector));
+            }
+            if (entry.id >= count) count = entry.id + 1;
+            indexRecord(records.size() - 1);
+            break;
+        }
+        case WriteAheadLog::Op::Remove: {
+            int index = findIndexById(entry.id);
+            if (index >= 0) removeAt(index);
+            break;
+        }
+        case WriteAheadLog::Op::Update: {
+            int index = findIndexById(entry.id);
+            if (index < 0) break;
+            VectorRecord* record = records.get(index);
+            delete record->vector;
+            record->vector = nullptr;
+            if (storageMode == StorageMode::Contiguous) {
+                memcpy(slab.row(index), entry.vector, sizeof(float) * dimension);
+            } else {
+                record->vector = new SinglyLinkedList<float>();
+                for (int d = 0; d < dimension; ++d) record->vector->add(entry.vector[d]);
+            }
+            replaceText(record, text);
+            indexRecord(index);
+            break;
+        }
+        case WriteAheadLog::Op::Tag: {
+            if (!metadata.decode(entry.text, entry.textLength, count)) {
+                throw std::runtime_error("VectorStore - corrupt tag entry in the write-ahead log");
+            }
+            break;
+        }
+        default:
+            clear();
+            break;
+    }
+}
+
+void VectorStore::openWal(const string& base, long long groupBytes, int groupDelayMs, long long compactBytes) {
+    closeWal();
+
+    ArrayList<int> snapshots = findGenerations(base, ".snapshot.");
+    ArrayList<int> logs = findGenerations(base, ".wal.");
+    int covered = 0;
+    if (snapshots.size() > 0 || logs.size() > 0) {
+        if (snapshots.size() > 0) {
+            covered = snapshots.get(snapshots.size() - 1);
+            load(snapshotPath(base, covered));
+        } else {
+            clear();
+        }
+        auto apply = [this](const WriteAheadLog::Entry& entry) { replayEntry(entry); };
+        int last = covered;
+        for (int i = 0; i < logs.size(); ++i) {
+            if (logs.get(i) <= covered) continue; // already in the snapshot
+            WriteAheadLog::replay(walPath(base, logs.get(i)), dimension, apply);
+            last = logs.get(i);
+        }
+        walGeneration = last + 1;
+    } else {
+        auto idAt = [this](int i) { return records.get(i)->id; };
+        TextArena::Reader reader;
+        auto textAt = [this, &reader](int i, const char*& text, int& length) {
+            std::string_view view = textOf(records.get(i), reader);
+            text = view.data();
+            length = static_cast<int>(view.size());
+        };
+        auto rowAt = [this](int i, float* scratch) { return rowData(i, scratch); };
+        string tags;
+        metadata.encode(tags);
+        writeStoreFile(snapshotPath(base, 0), dimension, records.size(), count, idAt, textAt, rowAt, tags, true);
+        walGeneration = 1;
+    }
+
+    walBase = base;
+    walGroupBytes = groupBytes;
+    walGroupDelayMs = groupDelayMs;
+    walCompactBytes = compactBytes;
+    wal = new WriteAheadLog(walPath(base, walGeneration), dimension, groupBytes, groupDelayMs);
+}
+
+void VectorStore::syncWal() {
+    if (!wal) throw std::logic_error("WAL is not enabled");
+    wal->sync();
+}
+
+// Rotates the log and copies the records here, on the writer's thread (the
+// O(store) pause), then writes <base>.snapshot.<g> on a background thread;
+// the snapshot and logs it covers are deleted afterwards.
+void VectorStore::compactWal() {
+    if (!wal) throw std::logic_error("WAL is not enabled");
+    finishCompaction();
+
+    wal->sync();
+    int n = records.size();
+    SnapshotImage* image = new SnapshotImage(n, dimension);
+    image->nextId = count;
+    image->textOffsets[0] = 0;
+    float* scratch = (storageMode == StorageMode::Contiguous) ? nullptr : new float[dimension];
+    TextArena::Reader reader;
+    for (int i = 0; i < n; ++i) {
+        const VectorRecord* record = records.get(i);
+        image->ids[i] = record->id;
+        std::string_view text = textOf(record, reader);
+        image->text.append(text.data(), text.size());
+        image->textOffsets[i + 1] = static_cast<long long>(image->text.length());
+        memcpy(image->rows + static_cast<long long>(i) * dimension, rowData(i, scratch), sizeof(float) * dimension);
+    }
+    delete[] scratch;
+    metadata.encode(image->tags);
+
+    int covered = walGeneration;
+    WriteAheadLog* next = new WriteAheadLog(walPath(walBase, covered + 1), dimension, walGroupBytes, walGroupDelayMs);
+    delete wal;
+    wal = next;
+    walGeneration = covered + 1;
+
+    string base = walBase;
+    compactor = std::thread([this, image, base, covered]() {
+        try {
+            auto idAt = [image](int i) { return image->ids[i]; };
+            auto textAt = [image](int i, const char*& text, int& length) {
+                text = image->text.data() + image->textOffsets[i];
+                length = static_cast<int>(image->textOffsets[i + 1] - image->textOffsets[i]);
+            };
+            auto rowAt = [image](int i, float*) {
+                return static_cast<const float*>(image->rows + static_cast<long long>(i) * image->dimension);
+            };
+            writeStoreFile(snapshotPath(base, covered), image->dimension, image->n, image->nextId,
+                           idAt, textAt, rowAt, image->tags, true);
+            ArrayList<int> snapshots = findGenerations(base, ".snapshot.");
+            for (int i = 0; i < snapshots.size(); ++i) {
+                if (snapshots.get(i) < covered) std::remove(snapshotPath(base, snapshots.get(i)).c_str());
+            }
+            ArrayList<int> logs = findGenerations(base, ".wal.");
+            for (int i = 0; i < logs.size(); ++i) {
+                if (logs.get(i) <= covered) std::remove(walPath(base, logs.get(i)).c_str());
+            }
+        } catch (...) {
+            compactFailed = true; // the older snapshot and logs still recover everything
+        }
+        delete image;
+    });
+}
+
+void VectorStore::finishCompaction() {
+    if (compactor.joinable()) compactor.join();
+}
+
+void VectorStore::closeWal() {
+    finishCompaction();
+    delete wal;
+    wal = nullptr;
+    if (compactFailed.exchange(false)) throw std::runtime_error("WAL compaction failed; logs were kept");
+}
+
+bool VectorStore::hasWal() const {
+    return wal != nullptr;
+}
+
+// ----------------- VectorStore Storage Precision -----------------
+
+void VectorStore::setStoragePrecision(StoragePrecision precision, int sampleSize) {
+    if (precision == StoragePrecision::Float32) {
+        delete quantized;
+        quantized = nullptr;
+        return;
+    }
+
+    ScalarQuantizer* built = new ScalarQuantizer(dimension, precision == StoragePrecision::Float16
+                                                                ? ScalarQuantizer::Precision::Float16
+                                                                : ScalarQuantizer::Precision::Int8);
+    ScalarQuantizer* previous = quantized;
+    quantized = built;
+    try {
+        recalibrate(sampleSize);
+    } catch (...) {
+        quantized = previous;
+        delete built;
+        throw;
+    }
+    delete previous;
+}
+
+VectorStore::StoragePrecision VectorStore::getStoragePrecision() const {
+    if (!quantized) return StoragePrecision::Float32;
+    return (quantized->getPrecision() == ScalarQuantizer::Precision::Float16) ? StoragePrecision::Float16
+                                                                              : StoragePrecision::Int8;
+}
+
+// Int8 ranges from a sample of the records, then every row is re-encoded.
+void VectorStore::recalibrate(int sampleSize) {
+    if (!quantized) return;
+
+    if (records.size() > 0 && quantized->getPrecision() == ScalarQuantizer::Precision::Int8) {
+        float* sample;
+        int samples;
+        samplePacked(sampleSize, sample, samples);
+        quantized->calibrate(sample, samples, dimension);
+        delete[] sample;
+    }
+    quantized->clear();
+    auto encodeBatch = [this](const float* rows, int n, int stride, const int*) {
+        for (int i = 0; i < n; ++i) quantized->appendRow(rows + static_cast<long long>(i) * stride);
+    };
+    forEachRowBatch(encodeBatch);
+}
+
+long long VectorStore::quantizedBytes() const {
+    return quantized ? quantized->codeBytes() : 0;
+}
+
+void VectorStore::setNormMode(NormMode mode) {
+    if (mode == normMode) return;
+    if (mode == NormMode::Normalized && (hnsw || ivf || pq || quantized)) {
+        throw std::logic_error("setNormMode - disable the ANN indexes and quantized precision first");
+    }
+
+    normMode = mode;
+    norms.clear();
+    if (mode == NormMode::CachedNorms) norms.reserve(records.size());
+    for (int i = 0; i < records.size(); ++i) updateNorm(i);
+    // The log still holds the unscaled rows.
+    if (mode == NormMode::Normalized && wal && records.size() > 0) compactWal();
+}
+
+VectorStore::NormMode VectorStore::getNormMode() const {
+    return normMode;
+}
+
+// ----------------- VectorStore Batch Search -----------------
+
+// Tile sizes: a record block is ~128 KB of floats so it stays in L2 while a
+// group of queries is scored against it four at a time.
+static const int BATCH_BLOCK_BYTES = 128 * 1024;
+static const int BATCH_QUERY_GROUP = 32;
+
+// Scores queries [first, last) against every record. Cosine and euclidean
+// reuse one dot product per (query, record) pair plus cached norms
+// (|q - x|^2 = |q|^2 + |x|^2 - 2 q.x), so scores may differ from the
+// single-query path in the last bits; manhattan uses the L1 kernel per pair.
+void VectorStore::batchScan(const float* queries, int first, int last, Metric metric, int k,
+                            TopKResult* results) const {
+    int n = records.size();
+    if (quantized) {
+        // No float rows to tile: each query scans the codes on its own.
+        ScalarQuantizer::Query prepared;
+        TopKSelector selector(k);
+        for (int j = first; j < last; ++j) {
+            const float* q = queries + static_cast<long long>(j) * dimension;
+            quantized->prepare(q, prepared);
+            selector.reset(k);
+            scanRows(q, &prepared, metric, 0, n, selector);
+            drainResult(selector, metric, results[j]);
+        }
+        return;
+    }
+
+    int groupSize = last - first;
+    bool contiguous = (storageMode == StorageMode::Contiguous);
+    int stride = contiguous ? slab.getStride() : dimension;
+    int blockRows = BATCH_BLOCK_BYTES / (dimension * static_cast<int>(sizeof(float)));
+    if (blockRows < 16) blockRows = 16;
+
+    float* packed = contiguous ? nullptr : new float[static_cast<long long>(blockRows) * dimension];
+    float* rowNorms = new float[blockRows];
+    float* queryNorms = new float[groupSize];
+    TopKSelector* selectors = new TopKSelector[groupSize];
+    for (int j = 0; j < groupSize; ++j) {
+        const float* q = queries + static_cast<long long>(first + j) * dimension;
+        queryNorms[j] = DistanceKernels::dot(q, q, dimension);
+        selectors[j].reset(k);
+    }
+
+    for (int blockStart = 0; blockStart < n; blockStart += blockRows) {
+        int rows = (blockStart + blockRows < n) ? blockRows : n - blockStart;
+        const float* block;
+        if (contiguous) {
+            block = slab.row(blockStart);
+        } else {
+            for (int r = 0; r < rows; ++r) {
+                copyVector(*records.get(blockStart + r)->vector, packed + static_cast<long long>(r) * dimension);
+            }
+            block = packed;
+        }
+        if (metric != Metric::Manhattan && normMode == NormMode::CachedNorms) {
+            for (int r = 0; r < rows; ++r) {
+                float norm = norms.get(blockStart + r);
+                rowNorms[r] = norm * norm;
+            }
+        } else if (metric != Metric::Manhattan) {
+            for (int r = 0; r < rows; ++r) {
+                const float* x = block + static_cast<long long>(r) * stride;
+                rowNorms[r] = DistanceKernels::dot(x, x, dimension);
+            }
+        }
+
+        for (int j = 0; j < groupSize; j += 4) {
+            int lanes = (groupSize - j < 4) ? groupSize - j : 4;
+            const float* q[4];
+            for (int l = 0; l < 4; ++l) {
+                int pick = (l < lanes) ? j + l : j; // pad a short group with a repeat
+                q[l] = queries + static_cast<long long>(first + pick) * dimension;
+            }
+            for (int r = 0; r < rows; ++r) {
+                const float* x = block + static_cast<long long>(r) * stride;
+                float dots[4];
+                if (metric == Metric::Manhattan) {
+                    for (int l = 0; l < lanes; ++l) dots[l] = DistanceKernels::l1(q[l], x, dimension);
+                } else {
+                    DistanceKernels::dot4(x, q, dimension, dots);
+                }
+                for (int l = 0; l < lanes; ++l) {
+                    double key;
+                    if (metric == Metric::Manhattan) {
+                        key = dots[l];
+                    } else if (metric == Metric::Euclidean) {
+                        double sq = static_cast<double>(queryNorms[j + l]) + rowNorms[r] - 2.0 * dots[l];
+                        key = sqrt(sq > 0.0 ? sq : 0.0);
+                    } else if (queryNorms[j + l] == 0.0f || rowNorms[r] == 0.0f) {
+                        key = -0.0;
+                    } else {
+                        key = -(dots[l] / (sqrt(static_cast<double>(queryNorms[j + l])) *
+                                           sqrt(static_cast<double>(rowNorms[r]))));
+                    }
+                    selectors[j + l].offer(key, blockStart + r);
+                }
+            }
+        }
+    }
+
+    for (int j = 0; j < groupSize; ++j) drainResult(selectors[j], metric, results[first + j]);
+    delete[] selectors;
+    delete[] queryNorms;
+    delete[] rowNorms;
+    delete[] packed;
+}
+
+void VectorStore::topKNearestBatch(const float* queries, int queryCount, int k, const string& metric,
+                                   TopKResult* results) const {
+    Metric m = DistanceKernels::parseMetric(metric);
+    if (k <= 0 || k > records.size()) throw invalid_k_value();
+    if (queryCount <= 0) return;
+    VS_COUNT(Queries, queryCount);
+
+    int groups = (queryCount + BATCH_QUERY_GROUP - 1) / BATCH_QUERY_GROUP;
+    auto scanGroup = [&](int group) {
+        int first = group * BATCH_QUERY_GROUP;
+        int last = (first + BATCH_QUERY_GROUP < queryCount) ? first + BATCH_QUERY_GROUP : queryCount;
+        batchScan(queries, first, last, m, k, results);
+    };
+    if (pool) {
+        pool->parallelFor(groups, scanGroup);
+    } else {
+        for (int g = 0; g < groups; ++g) scanGroup(g);
+    }
+}
+
+void VectorStore::topKNearestBatch(const ArrayList<SinglyLinkedList<float>*>& queries, int k,
+                                   const string& metric, TopKResult* results) const {
+    int queryCount = queries.size();
+    float* packed = new float[static_cast<long long>(queryCount > 0 ? queryCount : 1) * dimension];
+    for (int j = 0; j < queryCount; ++j) {
+        copyVector(*queries.get(j), packed + static_cast<long long>(j) * dimension);
+    }
+    try {
+        topKNearestBatch(packed, queryCount, k, metric, results);
+    } catch (...) {
+        delete[] packed;
+        throw;
+    }
+    delete[] packed;
+}
+
+// ----------------- VectorStore ANN Indexes -----------------
+
+// Ids are handed out in increasing order and a shifting removeAt keeps the
+// order, so without the id map records are sorted by id and a binary search
+// finds the index.
+int VectorStore::findIndexById(int id) const {
+    if (idIndex) return idIndex->get(id);
+
+    int lo = 0, hi = records.size() - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int midId = records.get(mid)->id;
+        if (midId == id) return mid;
+        if (midId < id) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -1;
+}
+
+// Feeds a new or re-embedded record to the id map, the norm cache, the
+// quantized rows and the ANN indexes.
+void VectorStore::indexRecord(int index) {
+    int id = records.get(index)->id;
+    if (idIndex) idIndex->put(id, index);
+    updateNorm(index);
+    if (!hnsw && !ivf && !pq && !quantized) return;
+
+    float* scratch = (storageMode == StorageMode::Contiguous) ? nullptr : new float[dimension];
+    const float* row = rowData(index, scratch);
+    if (quantized) {
+        if (index == quantized->size()) quantized->appendRow(row);
+        else quantized->setRow(index, row);
+    }
+    if (hnsw) hnsw->insert(row, id);
+    if (ivf) ivf->add(row, id);
+    if (pq) pq->add(row, id);
+    delete[] scratch;
+}
+
+void VectorStore::unindexRecord(int id) {
+    if (hnsw) hnsw->markDeleted(id);
+    if (ivf) ivf->remove(id);
+    if (pq) pq->remove(id);
+}
+
+// Squared norms within this of 1 count as unit length already.
+static const float UNIT_NORM_TOLERANCE = 1e-5f;
+
+// Brings row `index` in line with the norm mode: records |row| for
+// CachedNorms, rescales the row for Normalized. Unit rows are left as they
+// are, so reloads and index rebuilds do not rewrite them.
+void VectorStore::updateNorm(int index) {
+    if (normMode == NormMode::Raw) return;
+
+    VectorRecord* record = records.get(index);
+    bool contiguous = (storageMode == StorageMode::Contiguous);
+    float* scratch = contiguous ? nullptr : new float[dimension];
+    if (!contiguous) copyVector(*record->vector, scratch);
+    const float* row = contiguous ? static_cast<const VectorSlab&>(slab).row(index) : scratch;
+    float squared = DistanceKernels::dot(row, row, dimension);
+    if (normMode == NormMode::CachedNorms) {
+        float norm = static_cast<float>(sqrt(static_cast<double>(squared)));
+        if (index == norms.size()) norms.add(norm);
+        else norms.set(index, norm);
+    } else if (squared > 0.0f && fabsf(squared - 1.0f) > UNIT_NORM_TOLERANCE) {
+        DistanceKernels::normalize(contiguous ? slab.row(index) : scratch, dimension);
+        if (!contiguous) {
+            int d = 0;
+            for (SinglyLinkedList<float>::Iterator it = record->vector->begin();
+                 d < dimension && it != record->vector->end(); ++it) {
+                *it = scratch[d++];
+            }
+        }
+    }
+    delete[] scratch;
+}
+
+// Maps index labels (record ids) back to record indices for a TopKResult.
+void VectorStore::labelsToResult(const double* keys, const int* labels, int found, Metric metric,
+                                 TopKResult& out) const {
+    out.resize(found);
+    int kept = 0;
+    for (int i = 0; i < found; ++i) {
+        int index = findIndexById(labels[i]);
+        if (index < 0) continue;
+        out.indexData()[kept] = index;
+        out.idData()[kept] = labels[i];
+        out.scoreData()[kept] = (metric == Metric::Cosine) ? 1.0 - keys[i] : keys[i];
+        ++kept;
+    }
+    out.resize(kept);
+}
+
+void VectorStore::enableHnsw(const string& metric, int M, int efConstruction) {
+    HnswIndex* built = new HnswIndex(dimension, DistanceKernels::parseMetric(metric), M, efConstruction);
+    delete hnsw;
+    hnsw = built;
+    for (int i = 0; i < records.size(); ++i) indexRecord(i);
+}
+
+void VectorStore::disableHnsw() {
+    delete hnsw;
+    hnsw = nullptr;
+}
+
+bool VectorStore::hasHnsw() const {
+    return hnsw != nullptr;
+}
+
+void VectorStore::setHnswEfSearch(int efSearch) {
+    if (!hnsw) throw std::logic_error("HNSW index is not enabled");
+
+    hnsw->setEfSearch(efSearch);
+}
+
+void VectorStore::trainIvf(const string& metric, int nlist, int sampleSize, int iterations) {
+    Metric kind = DistanceKernels::parseMetric(metric);
+    if (records.size() == 0) throw std::logic_error("Cannot train IVF on an empty store");
+
+    int n = records.size();
+    if (nlist > n) nlist = n;
+    IvfIndex* built = new IvfIndex(dimension, kind, nlist);
+    delete ivf;
+    ivf = built;
+    retrainIvf(sampleSize, iterations);
+}
+
+// Evenly spaced sample of the current records, packed dimension-wide.
+void VectorStore::samplePacked(int sampleSize, float*& sample, int& samples) const {
+    int n = records.size();
+    samples = (sampleSize > 0 && sampleSize < n) ? sampleSize : n;
+    sample = new float[static_cast<long long>(samples) * dimension];
+    float* scratch = new float[dimension];
+    for (int i = 0; i < samples; ++i) {
+        int index = static_cast<int>(static_cast<long long>(i) * n / samples);
+        memcpy(sample + static_cast<long long>(i) * dimension, rowData(index, scratch), sizeof(float) * dimension);
+    }
+    delete[] scratch;
+}
+
+// Hands every record to visit(rows, n, stride, ids) in batches: slab rows
+// directly in contiguous mode, packed copies of the lists otherwise.
+template <class F>
+void VectorStore::forEachRowBatch(F& visit) const {
+    auto visitBlock = [&visit](const ScanBlock& block) {
+        visit(block.data(), block.size(), block.getStride(), block.ids());
+    };
+    scan(visitBlock, 65536);
+}
+
+// k-means on a sample of the current records, then reassign all of them.
+void VectorStore::retrainIvf(int sampleSize, int iterations) {
+    if (!ivf) throw std::logic_error("IVF index is not enabled");
+    if (records.size() == 0) throw std::logic_error("Cannot train IVF on an empty store");
+
+    int listCount = ivf->getListCount();
+    if (sampleSize > 0 && sampleSize < listCount) sampleSize = listCount;
+    float* sample;
+    int samples;
+    samplePacked(sampleSize, sample, samples);
+    try {
+        ivf->train(sample, samples, dimension, iterations, pool);
+    } catch (...) {
+        delete[] sample;
+        throw;
+    }
+    delete[] sample;
+
+    auto addBatch = [this](const float* rows, int n, int stride, const int* ids) {
+        ivf->add(rows, n, stride, ids, pool);
+    };
+    forEachRowBatch(addBatch);
+}
+
+void VectorStore::disableIvf() {
+    delete ivf;
+    ivf = nullptr;
+}
+
+bool VectorStore::hasIvf() const {
+    return ivf != nullptr;
+}
+
+void VectorStore::setIvfNprobe(int nprobe) {
+    if (!ivf) throw std::logic_error("IVF index is not enabled");
+
+    ivf->setNprobe(nprobe);
+}
+
+void VectorStore::trainPq(const string& metric, int subspaces, int sampleSize, int iterations) {
+    Metric kind = DistanceKernels::parseMetric(metric);
+    if (records.size() == 0) throw std::logic_error("Cannot train PQ on an empty store");
+
+    PqIndex* built = new PqIndex(dimension, subspaces, kind);
+    float* sample;
+    int samples;
+    samplePacked(sampleSize, sample, samples);
+    try {
+        built->train(sample, samples, dimension, iterations, pool);
+    } catch (...) {
+        delete[] sample;
+        delete built;
+        throw;
+    }
+    delete[] sample;
+    delete pq;
+    pq = built;
+
+    auto addBatch = [this](const float* rows, int n, int stride, const int* ids) {
+        pq->add(rows, n, stride, ids, pool);
+    };
+    forEachRowBatch(addBatch);
+}
+
+void VectorStore::disablePq() {
+    delete pq;
+    pq = nullptr;
+}
+
+bool VectorStore::hasPq() const {
+    return pq != nullptr;
+}
+
+void VectorStore::setPqRerank(int factor) {
+    pqRerank = (factor > 0) ? factor : 0;
+}
+
+long long VectorStore::pqCodeBytes() const {
+    return pq ? pq->codeBytes() : 0;
+}
+
+bool VectorStore::releaseMappedRows() {
+    if (!mapped || !mapped->isMapped() || !slab.isAttached() || slab.isWritten() || slab.size() == 0) {
+        return false;
+    }
+    const float* first = static_cast<const VectorSlab&>(slab).row(0);
+    mapped->release(reinterpret_cast<const char*>(first),
+                    static_cast<long long>(slab.size()) * slab.getStride() * static_cast<long long>(sizeof(float)));
+    return true;
+}
+
+// On unit rows |q - x|^2 = |q|^2 + 1 - 2|q| cos(q, x), so in Normalized
+// mode a cosine index orders rows as a euclidean one would and vice versa.
+bool VectorStore::serves(Metric built, Metric wanted) const {
+    if (built == wanted) return true;
+    return normMode == NormMode::Normalized && built != Metric::Manhattan && wanted != Metric::Manhattan;
+}
+
+bool VectorStore::hasIndexFor(Metric metric) const {
+    return (hnsw && serves(hnsw->getDistance(), metric)) || (ivf && serves(ivf->getDistance(), metric)) ||
+           (pq && serves(pq->getCodec().getDistance(), metric));
+}
+
+// Searches the first index that serves `kind` (HNSW, then IVF, then PQ);
+// the caller has checked hasIndexFor(kind). Labels outside `allowed` are
+// skipped by the index itself. An index built for the other metric only
+// supplies the candidates, which are then scored exactly for `kind`.
+void VectorStore::approximateSelect(const float* q, Metric kind, int k, const RowBitmap* allowed,
+                                    TopKResult& out) const {
+    bool useHnsw = hnsw && serves(hnsw->getDistance(), kind);
+    bool useIvf = !useHnsw && ivf && serves(ivf->getDistance(), kind);
+    bool usePq = !useHnsw && !useIvf;
+    Metric built = useHnsw ? hnsw->getDistance() : useIvf ? ivf->getDistance() : pq->getCodec().getDistance();
+    bool rescore = (usePq && pqRerank > 0) || built != kind;
+    int fetch = k;
+    if (usePq && pqRerank > 0) {
+        long long wanted = static_cast<long long>(k) * pqRerank;
+        fetch = (wanted < records.size()) ? static_cast<int>(wanted) : records.size();
+    }
+    double* keys = new double[fetch];
+    int* labels = new int[fetch];
+    int found;
+    if (useHnsw) found = hnsw->search(q, k, keys, labels, allowed);
+    else if (useIvf) found = ivf->search(q, k, keys, labels, allowed);
+    else found = pq->search(q, fetch, keys, labels, allowed);
+
+    if (rescore) {
+        // Re-score the ADC shortlist (or the other metric's hits) against the full-precision rows.
+        float* scratch = (storageMode == StorageMode::Contiguous) ? nullptr : new float[dimension];
+        TopKSelector exact(k);
+        for (int i = 0; i < found; ++i) {
+            int index = findIndexById(labels[i]);
+            if (index < 0) continue;
+            double s = score(kind, q, rowData(index, scratch));
+            exact.offer(kind == Metric::Cosine ? -s : s, index);
+        }
+        delete[] scratch;
+        out.resize(exact.size());
+        int kept = exact.drainSorted(out.scoreData(), out.indexData());
+        for (int i = 0; i < kept; ++i) {
+            if (kind == Metric::Cosine) out.scoreData()[i] = -out.scoreData()[i];
+            out.idData()[i] = records.get(out.indexData()[i])->id;
+        }
+    } else {
+        labelsToResult(keys, labels, found, kind, out);
+    }
+    delete[] labels;
+    delete[] keys;
+}
+
+void VectorStore::approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                         TopKResult& out) const {
+    Metric kind = DistanceKernels::parseMetric(metric);
+    if (!hasIndexFor(kind)) {
+        topKNearest(query, k, metric, out);
+        return;
+    }
+    VS_TIME(ApproximateSearch);
+    VS_COUNT(Queries, 1);
+    if (k <= 0 || k > records.size()) throw invalid_k_value();
+
+    float* q = new float[dimension];
+    copyVector(query, q);
+    approximateSelect(q, kind, k, nullptr, out);
+    delete[] q;
+}
+
+// Below this many eligible records (or 1 / FILTERED_EXACT_RATIO of the
+// store) an exact scan of the matches is cheaper than a filtered index
+// search, and it does not lose recall when matches are sparse in the graph.
+static const int FILTERED_EXACT_ROWS = 4096;
+static const int FILTERED_EXACT_RATIO = 32;
+
+void VectorStore::approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                         const Filter& filter, TopKResult& out) const {
+    Metric kind = DistanceKernels::parseMetric(metric);
+    if (filter.matchesAll()) {
+        approximateTopKNearest(query, k, metric, out);
+        return;
+    }
+    if (!hasIndexFor(kind)) {
+        topKNearest(query, k, metric, filter, out);
+        return;
+    }
+    VS_TIME(ApproximateSearch);
+    VS_COUNT(Queries, 1);
+    if (k <= 0 || k > records.size()) throw invalid_k_value();
+
+    RowBitmap eligible;
+    metadata.evaluate(filter, count, eligible);
+    long long matches = eligible.count();
+    float* q = new float[dimension];
+    copyVector(query, q);
+    if (matches <= FILTERED_EXACT_ROWS || matches * FILTERED_EXACT_RATIO < records.size()) {
+        filteredScan(q, kind, k, eligible, out);
+    } else {
+        approximateSelect(q, kind, k, &eligible, out);
+    }
+    delete[] q;
+}
+
+double VectorStore::recallAtK(const ArrayList<SinglyLinkedList<float>*>& queries, int k,
+                              const string& metric) const {
+    if (queries.size() == 0) return 1.0;
+
+    TopKResult exact, approximate;
+    long long hits = 0;
+    for (int j = 0; j < queries.size(); ++j) {
+        topKNearest(*queries.get(j), k, metric, exact);
+        approximateTopKNearest(*queries.get(j), k, metric, approximate);
+        for (int a = 0; a < approximate.size(); ++a) {
+            for (int e = 0; e < exact.size(); ++e) {
+                if (approximate.getId(a) == exact.getId(e)) {
+                    ++hits;
+                    break;
+                }
+            }
+        }
+    }
+    return static_cast<double>(hits) / (static_cast<double>(queries.size()) * k);
 }
 
 // ----------------- VectorRecord Implementation -----------------
-VectorStore::VectorRecord::VectorRecord(int id, const string& rawText, SinglyLinkedList<float>* vector)
-    : id(id), rawText(rawText), rawLength(static_cast<int>(rawText.length())), vector(vector) {}
+VectorStore::VectorRecord::VectorRecord(int id, long long textOffset, int rawLength, SinglyLinkedList<float>* vector)
+    : id(id), rawLength(rawLength), textOffset(textOffset), vector(vector), mappedText(nullptr) {}
+
+VectorStore::VectorRecord* VectorStore::createRecord(int id, std::string_view rawText, SinglyLinkedList<float>* vector) {
+    int length = static_cast<int>(rawText.size());
+    long long offset = texts.append(rawText);
+    void* block = nullptr;
+    try {
+        block = recordAllocator->allocate(sizeof(VectorRecord));
+        return new (block) VectorRecord(id, offset, length, vector);
+    } catch (...) {
+        if (block) recordAllocator->deallocate(block, sizeof(VectorRecord));
+        texts.release(offset, length);
+        throw;
+    }
+}
+
+void VectorStore::appendRecord(int id, std::string_view rawText, SinglyLinkedList<float>* vector) {
+    VectorRecord* record = createRecord(id, rawText, vector);
+    try {
+        records.add(record);
+    } catch (...) {
+        releaseText(record);
+        record->vector = nullptr;
+        destroyRecord(record);
+        throw;
+    }
+}
+
+void VectorStore::destroyRecord(VectorRecord* record) {
+    delete record->vector;
+    record->~VectorRecord();
+    recordAllocator->deallocate(record, sizeof(VectorRecord));
+}
+
+std::string_view VectorStore::textOf(const VectorRecord* record, TextArena::Reader& reader) const {
+    if (record->mappedText) return std::string_view(record->mappedText, record->rawLength);
+    return texts.view(record->textOffset, record->rawLength, reader);
+}
+
+void VectorStore::replaceText(VectorRecord* record, std::string_view newRawText) {
+    long long offset = texts.append(newRawText);
+    releaseText(record);
+    record->textOffset = offset;
+    record->rawLength = static_cast<int>(newRawText.size());
+    record->mappedText = nullptr;
+}
+
+void VectorStore::releaseText(VectorRecord* record) {
+    if (!record->mappedText) texts.release(record->textOffset, record->rawLength);
+}
+
+// Released text worth rebuilding for: at least this much and half the arena.
+static const long long TEXT_RECLAIM_MIN_BYTES = 4LL * TextArena::BLOCK_BYTES;
+
+void VectorStore::reclaimTexts() {
+    long long garbage = texts.garbageBytes();
+    if (garbage >= TEXT_RECLAIM_MIN_BYTES && 2 * garbage >= texts.storedBytes()) compactTexts();
+}
+
+// ----------------- ShardedVectorStore Implementation -----------------
+ShardedVectorStore::ShardedVectorStore(int shardCount, int dimension, VectorStore::EmbedFn embeddingFunction,
+                                       VectorStore::StorageMode storageMode, int threads) {
+    if (shardCount <= 0) throw std::invalid_argument("ShardedVectorStore - shardCount must be positive");
+    this->shardCount = shardCount;
+    this->dimension = dimension;
+    sequence.store(0);
+    shards = new Shard[shardCount];
+    for (int s = 0; s < shardCount; ++s) shards[s].store = nullptr;
+    try {
+        for (int s = 0; s < shardCount; ++s) {
+            shards[s].store = new VectorStore(dimension, embeddingFunction, storageMode);
+        }
+        pool = new WorkerPool(threads);
+    } catch (...) {
+        for (int s = 0; s < shardCount; ++s) delete shards[s].store;
+        delete[] shards;
+        throw;
+    }
+}
+
+ShardedVectorStore::~ShardedVectorStore() {
+    delete pool;
+    for (int s = 0; s < shardCount; ++s) delete shards[s].store;
+    delete[] shards;
+}
+
+int ShardedVectorStore::shardOf(int id) const {
+    return id < 0 ? -1 : id % shardCount;
+}
+
+int ShardedVectorStore::size() const {
+    int total = 0;
+    for (int s = 0; s < shardCount; ++s) {
+        std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+        total += shards[s].store->size();
+    }
+    return total;
+}
+
+bool ShardedVectorStore::empty() const {
+    return size() == 0;
+}
+
+void ShardedVectorStore::clear() {
+    for (int s = 0; s < shardCount; ++s) {
+        std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+        shards[s].store->clear();
+    }
+}
+
+int ShardedVectorStore::getShardCount() const {
+    return shardCount;
+}
+
+int ShardedVectorStore::getDimension() const {
+    return dimension;
+}
+
+VectorStore& ShardedVectorStore::getShard(int shard) {
+    if (shard < 0 || shard >= shardCount) throw std::out_of_range("ShardedVectorStore::getShard - no such shard");
+    return *shards[shard].store;
+}
+
+int ShardedVectorStore::addText(string rawText) {
+    int s = static_cast<int>(hashInt64(static_cast<long long>(sequence.fetch_add(1))) % shardCount);
+    Shard& shard = shards[s];
+    SinglyLinkedList<float>* vector = shard.store->preprocessing(rawText);
+
+    std::unique_lock<std::shared_mutex> lock(shard.lock);
+    if (shard.store->count > (INT_MAX - s) / shardCount) {
+        delete vector;
+        throw std::out_of_range("ShardedVectorStore::addText - id space exhausted");
+    }
+    int local = shard.store->addEmbedded(std::move(rawText), vector);
+    return local * shardCount + s;
+}
+
+bool ShardedVectorStore::removeById(int id) {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+    return shards[s].store->removeById(id / shardCount);
+}
+
+bool ShardedVectorStore::updateById(int id, string newRawText) {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    Shard& shard = shards[s];
+    {
+        std::shared_lock<std::shared_mutex> lock(shard.lock);
+        if (shard.store->indexOfId(id / shardCount) < 0) return false;
+    }
+    SinglyLinkedList<float>* vector = shard.store->preprocessing(newRawText);
+
+    std::unique_lock<std::shared_mutex> lock(shard.lock);
+    int index = shard.store->indexOfId(id / shardCount); // may have moved or gone meanwhile
+    if (index < 0) {
+        delete vector;
+        return false;
+    }
+    shard.store->updateEmbedded(index, std::move(newRawText), vector);
+    return true;
+}
+
+bool ShardedVectorStore::contains(int id) const {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+    return shards[s].store->indexOfId(id / shardCount) >= 0;
+}
+
+bool ShardedVectorStore::getRawText(int id, string& out) const {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+    int index = shards[s].store->indexOfId(id / shardCount);
+    if (index < 0) return false;
+    out = shards[s].store->getRawText(index);
+    return true;
+}
+
+void ShardedVectorStore::setIntTag(int id, const string& tag, long long value) {
+    int s = shardOf(id);
+    if (s < 0) throw std::out_of_range("ShardedVectorStore::setIntTag - no record with this id");
+    std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+    shards[s].store->setIntTag(id / shardCount, tag, value);
+}
+
+void ShardedVectorStore::setFloatTag(int id, const string& tag, double value) {
+    int s = shardOf(id);
+    if (s < 0) throw std::out_of_range("ShardedVectorStore::setFloatTag - no record with this id");
+    std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+    shards[s].store->setFloatTag(id / shardCount, tag, value);
+}
+
+void ShardedVectorStore::setStringTag(int id, const string& tag, const string& value) {
+    int s = shardOf(id);
+    if (s < 0) throw std::out_of_range("ShardedVectorStore::setStringTag - no record with this id");
+    std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+    shards[s].store->setStringTag(id / shardCount, tag, value);
+}
+
+bool ShardedVectorStore::removeTag(int id, const string& tag) {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+    return shards[s].store->removeTag(id / shardCount, tag);
+}
+
+bool ShardedVectorStore::getIntTag(int id, const string& tag, long long& out) const {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+    return shards[s].store->getIntTag(id / shardCount, tag, out);
+}
+
+bool ShardedVectorStore::getFloatTag(int id, const string& tag, double& out) const {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+    return shards[s].store->getFloatTag(id / shardCount, tag, out);
+}
+
+bool ShardedVectorStore::getStringTag(int id, const string& tag, string& out) const {
+    int s = shardOf(id);
+    if (s < 0) return false;
+    std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+    return shards[s].store->getStringTag(id / shardCount, tag, out);
+}
+
+int ShardedVectorStore::countMatching(const Filter& filter) const {
+    int total = 0;
+    for (int s = 0; s < shardCount; ++s) {
+        std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+        total += shards[s].store->countMatching(filter);
+    }
+    return total;
+}
+
+void ShardedVectorStore::enableHnsw(const string& metric, int M, int efConstruction) {
+    for (int s = 0; s < shardCount; ++s) {
+        std::unique_lock<std::shared_mutex> lock(shards[s].lock);
+        shards[s].store->enableHnsw(metric, M, efConstruction);
+    }
+}
+
+// Scatter: every shard computes its own top-min(k, shard size) under a
+// shared lock. Gather: the partial lists are merged on the same keys the
+// shards ranked by, and shard-local ids are rewritten to global ids.
+void ShardedVectorStore::search(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                const Filter* filter, bool approximate, TopKResult& out) const {
+    bool cosine = (DistanceKernels::parseMetric(metric) == DistanceKernels::Metric::Cosine);
+    if (k <= 0) throw invalid_k_value();
+
+    TopKResult* partial = new TopKResult[shardCount];
+    std::atomic<int> records(0);
+    std::exception_ptr failure;
+    std::mutex failureLock;
+    auto searchShard = [&](int s) {
+        try {
+            std::shared_lock<std::shared_mutex> lock(shards[s].lock);
+            const VectorStore& store = *shards[s].store;
+            int shardK = k < store.size() ? k : store.size();
+            records.fetch_add(store.size());
+            if (shardK == 0) {
+                partial[s].clear();
+                return;
+            }
+            if (approximate) {
+                if (filter) store.approximateTopKNearest(query, shardK, metric, *filter, partial[s]);
+                else store.approximateTopKNearest(query, shardK, metric, partial[s]);
+            } else {
+                if (filter) store.topKNearest(query, shardK, metric, *filter, partial[s]);
+                else store.topKNearest(query, shardK, metric, partial[s]);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(failureLock);
+            if (!failure) failure = std::current_exception();
+        }
+    };
+    pool->parallelFor(shardCount, searchShard);
+    if (failure) {
+        delete[] partial;
+        std::rethrow_exception(failure);
+    }
+
+    if (!filter && k > records.load()) {
+        delete[] partial;
+        throw invalid_k_value();
+    }
+
+    // Candidates are numbered shard-major; the flat position is the item.
+    TopKSelector selector(k);
+    int base = 0;
+    for (int s = 0; s < shardCount; ++s) {
+        for (int i = 0; i < partial[s].size(); ++i) {
+            double score = partial[s].getScore(i);
+            selector.offer(cosine ? -score : score, base + i);
+        }
+        base += partial[s].size();
+    }
+    int found = selector.size();
+    out.resize(found);
+    selector.drainSorted(out.scoreData(), out.indexData());
+    for (int i = 0; i < found; ++i) {
+        int item = out.indexData()[i];
+        int s = 0;
+        while (item >= partial[s].size()) item -= partial[s++].size();
+        if (cosine) out.scoreData()[i] = -out.scoreData()[i];
+        out.indexData()[i] = -1;
+        out.idData()[i] = partial[s].getId(item) * shardCount + s;
+    }
+    delete[] partial;
+}
+
+int ShardedVectorStore::findNearest(const SinglyLinkedList<float>& query, const string& metric) const {
+    TopKResult result(1);
+    Filter all;
+    search(query, 1, metric, &all, false, result);
+    return result.empty() ? -1 : result.getId(0);
+}
+
+void ShardedVectorStore::topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                     TopKResult& out) const {
+    search(query, k, metric, nullptr, false, out);
+}
+
+void ShardedVectorStore::topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                     const Filter& filter, TopKResult& out) const {
+    search(query, k, metric, &filter, false, out);
+}
+
+void ShardedVectorStore::approximateTopKNearest(const SinglyLinkedList<float>& query, int k,
+                                                const string& metric, TopKResult& out) const {
+    search(query, k, metric, nullptr, true, out);
+}
+
+void ShardedVectorStore::approximateTopKNearest(const SinglyLinkedList<float>& query, int k,
+                                                const string& metric, const Filter& filter,
+                                                TopKResult& out) const {
+    search(query, k, metric, &filter, true, out);
+}
+
+// ----------------- EpochManager Implementation -----------------
+EpochManager::EpochManager() {
+    for (int s = 0; s < SLOTS; ++s) slots[s].epoch.store(0);
+    epoch.store(1);
+}
+
+EpochManager::~EpochManager() {
+    for (int i = 0; i < retired.size(); ++i) retired.get(i).deleter(retired.get(i).object);
+}
+
+int EpochManager::enter() {
+    static std::atomic<int> nextHint(0);
+    thread_local int hint = nextHint.fetch_add(1) % SLOTS;
+    for (int probe = 0;; ++probe) {
+        int slot = (hint + probe) % SLOTS;
+        unsigned long long idle = 0;
+        // Pinning an epoch read before the CAS is conservative: the snapshot
+        // is loaded after the slot is visible, so a writer that missed the
+        // slot has already published a newer one.
+        if (slots[slot].epoch.compare_exchange_strong(idle, epoch.load())) {
+            hint = slot;
+            return slot;
+        }
+        if (probe % SLOTS == SLOTS - 1) std::this_thread::yield();
+    }
+}
+
+void EpochManager::leave(int slot) {
+    slots[slot].epoch.store(0);
+}
+
+void EpochManager::retire(void* object, Deleter deleter) {
+    Retired entry;
+    entry.object = object;
+    entry.deleter = deleter;
+    entry.epoch = epoch.load();
+    retired.add(entry);
+}
+
+int EpochManager::reclaim() {
+    if (retired.size() == 0) return 0;
+    unsigned long long oldest = epoch.fetch_add(1) + 1; // readers pinned from now on are safe
+    for (int s = 0; s < SLOTS; ++s) {
+        unsigned long long pinned = slots[s].epoch.load();
+        if (pinned != 0 && pinned < oldest) oldest = pinned;
+    }
+    int freed = 0;
+    int kept = 0;
+    for (int i = 0; i < retired.size(); ++i) {
+        Retired entry = retired.get(i);
+        if (entry.epoch < oldest) {
+            entry.deleter(entry.object);
+            ++freed;
+        } else {
+            retired.set(kept++, entry);
+        }
+    }
+    while (retired.size() > kept) retired.removeAt(retired.size() - 1);
+    return freed;
+}
+
+int EpochManager::pending() const {
+    return retired.size();
+}
+
+// ----------------- ConcurrentVectorStore Implementation -----------------
+template <class T>
+static void destroyObject(void* object) {
+    delete static_cast<T*>(object);
+}
+
+// Lower-is-better key of a row (negated cosine, squared L2, L1) and the
+// score reported for it. rowNorm < 0 means the norm is not known.
+static double rowKey(DistanceKernels::Metric metric, const float* query, double queryNorm, const float* row,
+                     double rowNorm, int n) {
+    if (metric == DistanceKernels::Metric::Cosine) {
+        if (rowNorm >= 0.0) {
+            if (queryNorm == 0.0 || rowNorm == 0.0) return 0.0;
+            return -(DistanceKernels::dot(query, row, n) / (queryNorm * rowNorm));
+        }
+        float dot, normQ, normR;
+        DistanceKernels::cosineParts(query, row, n, dot, normQ, normR);
+        if (normQ == 0.0f || normR == 0.0f) return 0.0;
+        return -(dot / (sqrt(static_cast<double>(normQ)) * sqrt(static_cast<double>(normR))));
+    }
+    if (metric == DistanceKernels::Metric::Euclidean) return DistanceKernels::l2Squared(query, row, n);
+    return DistanceKernels::l1(query, row, n);
+}
+
+// Whether an index built for `built` ranks rows as `wanted` would; on unit
+// rows cosine and euclidean agree (see VectorStore::serves).
+static bool servesMetric(DistanceKernels::Metric built, DistanceKernels::Metric wanted, bool unitRows) {
+    if (built == wanted) return true;
+    return unitRows && built != DistanceKernels::Metric::Manhattan && wanted != DistanceKernels::Metric::Manhattan;
+}
+
+// The same key from a ScalarQuantizer score (cosine, L2 or L1).
+static double quantizedKey(DistanceKernels::Metric metric, double score) {
+    if (metric == DistanceKernels::Metric::Cosine) return -score;
+    if (metric == DistanceKernels::Metric::Euclidean) return score * score;
+    return score;
+}
+
+static double keyToScore(DistanceKernels::Metric metric, double key) {
+    if (metric == DistanceKernels::Metric::Cosine) return -key;
+    if (metric == DistanceKernels::Metric::Euclidean) return sqrt(key);
+    return key;
+}
+
+ConcurrentVectorStore::Segment::Segment(int capacity, int dimension, bool keepNorms, bool normalized)
+    : normalized(normalized), capacity(capacity) {
+    rows = new float[static_cast<size_t>(capacity) * dimension];
+    ids = new int[capacity];
+    texts = new string[capacity];
+    fileText = nullptr;
+    fileTextOffsets = nullptr;
+    file = nullptr;
+    stride = dimension;
+    norms = keepNorms ? new float[capacity] : nullptr;
+    index = nullptr;
+    quantized = nullptr;
+    ann = nullptr;
+    ivf = nullptr;
+    pq = nullptr;
+    pqRerank = 0;
+}
+
+ConcurrentVectorStore::Segment::Segment(MappedFile* file, int rows, int stride, bool keepNorms, bool normalized)
+    : rows(nullptr), ids(nullptr), texts(nullptr), fileText(nullptr), fileTextOffsets(nullptr), file(file),
+      stride(stride), normalized(normalized), capacity(rows) {
+    norms = keepNorms ? new float[rows > 0 ? rows : 1] : nullptr;
+    index = nullptr;
+    quantized = nullptr;
+    ann = nullptr;
+    ivf = nullptr;
+    pq = nullptr;
+    pqRerank = 0;
+}
+
+ConcurrentVectorStore::Segment::~Segment() {
+    if (!file) {
+        delete[] rows;
+        delete[] ids;
+    }
+    delete file;
+    delete[] texts;
+    delete[] norms;
+    delete index;
+    delete quantized;
+    delete ann;
+    delete ivf;
+    delete pq;
+}
+
+std::string_view ConcurrentVectorStore::Segment::text(int row) const {
+    if (texts) return texts[row];
+    return std::string_view(fileText + fileTextOffsets[row],
+                            static_cast<size_t>(fileTextOffsets[row + 1] - fileTextOffsets[row]));
+}
+
+ConcurrentVectorStore::Snapshot::Snapshot(int capacity) : segmentCount(0), capacity(capacity), live(0), idLimit(0) {
+    views = new SegmentView[capacity > 0 ? capacity : 1];
+}
+
+ConcurrentVectorStore::Snapshot::~Snapshot() {
+    delete[] views;
+}
+
+ConcurrentVectorStore::ConcurrentVectorStore(int dimension, VectorStore::EmbedFn embeddingFunction,
+                                             int segmentRows)
+    : dimension(dimension), segmentRows(segmentRows), embeddingFunction(embeddingFunction), nextId(0) {
+    if (dimension <= 0) throw std::invalid_argument("ConcurrentVectorStore - dimension must be positive");
+    if (segmentRows <= 0) throw std::invalid_argument("ConcurrentVectorStore - segmentRows must be positive");
+    mergeFactor = 4;
+    mergeDeletedRatio = 0.25;
+    settings.normMode = VectorStore::NormMode::CachedNorms;
+    settings.precision = VectorStore::StoragePrecision::Float32;
+    settings.hnsw = false;
+    settings.hnswMetric = DistanceKernels::Metric::Cosine;
+    settings.hnswM = 16;
+    settings.hnswEfConstruction = 200;
+    settings.hnswEfSearch = 64;
+    settings.hnswMinRows = 0;
+    settings.ivf = false;
+    settings.ivfMetric = DistanceKernels::Metric::Cosine;
+    settings.ivfLists = 1024;
+    settings.ivfNprobe = 8;
+    settings.ivfMinRows = 0;
+    settings.pq = false;
+    settings.pqMetric = DistanceKernels::Metric::Cosine;
+    settings.pqSubspaces = 8;
+    settings.pqRerank = 4;
+    settings.pqMinRows = 0;
+    mergeStop = false;
+    mergeRequested = false;
+    mergeFailed = false;
+    wal = nullptr;
+    walGeneration = 0;
+    walGroupBytes = 0;
+    walGroupDelayMs = 0;
+    walCompactBytes = 0;
+    compactFailed = false;
+    current.store(new Snapshot(0));
+}
+
+ConcurrentVectorStore::~ConcurrentVectorStore() {
+    {
+        std::lock_guard<std::mutex> lock(mergeSignalLock);
+        mergeStop = true;
+    }
+    mergeWake.notify_all();
+    if (merger.joinable()) merger.join();
+    finishCompaction();
+    delete wal;
+
+    Snapshot* snapshot = current.load();
+    for (int s = 0; s < snapshot->segmentCount; ++s) {
+        delete snapshot->views[s].deleted;
+        delete snapshot->views[s].segment;
+    }
+    delete snapshot;
+}
+
+void ConcurrentVectorStore::embed(const string& rawText, float* out) const {
+    VS_TIME(Preprocessing);
+    VS_COUNT(Embeddings, 1);
+    if (embeddingFunction) {
+        SinglyLinkedList<float>* embedded = embeddingFunction(rawText);
+        copyList(*embedded, out, dimension);
+        delete embedded;
+        return;
+    }
+    int len = static_cast<int>(rawText.length());
+    if (len > dimension) len = dimension;
+    for (int i = 0; i < len; ++i) out[i] = static_cast<float>(rawText[i]);
+    for (int i = len; i < dimension; ++i) out[i] = 0.0f;
+}
+
+ConcurrentVectorStore::Snapshot* ConcurrentVectorStore::cloneSnapshot(const Snapshot* from,
+                                                                      int spareSegments) const {
+    Snapshot* next = new Snapshot(from->segmentCount + spareSegments);
+    for (int s = 0; s < from->segmentCount; ++s) next->views[s] = from->views[s];
+    next->segmentCount = from->segmentCount;
+    next->live = from->live;
+    next->idLimit = from->idLimit;
+    return next;
+}
+
+ConcurrentVectorStore::Segment* ConcurrentVectorStore::newSegment(int capacity) const {
+    return new Segment(capacity, dimension, settings.normMode != VectorStore::NormMode::Raw,
+                       settings.normMode == VectorStore::NormMode::Normalized);
+}
+
+// IVF and PQ train on at most this many evenly spaced rows of a segment.
+static const int SEGMENT_TRAIN_ROWS = 65536;
+
+// Id index and quantized codes of rows [0, rows), plus the HNSW / IVF / PQ
+// indexes the settings ask for when withAnn. Parts the segment already has
+// are kept. Readers reach the parts of a published segment through its view.
+void ConcurrentVectorStore::buildSegment(Segment* segment, int rows, const Settings& with, bool withAnn) const {
+    if (!segment->index) {
+        segment->index = new IdIndex(rows);
+        for (int r = 0; r < rows; ++r) segment->index->put(segment->ids[r], r); // later copies win
+    }
+    if (!segment->quantized && rows > 0 && with.precision != VectorStore::StoragePrecision::Float32) {
+        ScalarQuantizer* codes = new ScalarQuantizer(dimension, with.precision == VectorStore::StoragePrecision::Float16
+                                                                   ? ScalarQuantizer::Precision::Float16
+                                                                   : ScalarQuantizer::Precision::Int8);
+        try {
+            codes->calibrate(segment->rows, rows, segment->stride);
+            for (int r = 0; r < rows; ++r) codes->appendRow(segment->rows + static_cast<size_t>(r) * segment->stride);
+        } catch (...) {
+            delete codes;
+            throw;
+        }
+        segment->quantized = codes;
+    }
+    if (withAnn && !segment->ann && with.hnsw && rows > 0 && rows >= with.hnswMinRows) {
+        HnswIndex* ann = new HnswIndex(dimension, with.hnswMetric, with.hnswM, with.hnswEfConstruction);
+        try {
+            ann->setEfSearch(with.hnswEfSearch);
+            for (int r = 0; r < rows; ++r) ann->insert(segment->rows + static_cast<size_t>(r) * segment->stride, r);
+        } catch (...) {
+            delete ann;
+            throw;
+        }
+        segment->ann = ann;
+    }
+
+    // Every step-th row, read in place through a wider stride.
+    int step = (rows + SEGMENT_TRAIN_ROWS - 1) / SEGMENT_TRAIN_ROWS;
+    int samples = (rows + step - 1) / step;
+    int sampleStride = step * segment->stride;
+    if (withAnn && !segment->ivf && with.ivf && rows > 0 && rows >= with.ivfMinRows) {
+        IvfIndex* ivf = new IvfIndex(dimension, with.ivfMetric, with.ivfLists < rows ? with.ivfLists : rows);
+        try {
+            ivf->train(segment->rows, samples, sampleStride);
+            ivf->setNprobe(with.ivfNprobe);
+            for (int r = 0; r < rows; ++r) ivf->add(segment->rows + static_cast<size_t>(r) * segment->stride, r);
+        } catch (...) {
+            delete ivf;
+            throw;
+        }
+        segment->ivf = ivf;
+    }
+    if (withAnn && !segment->pq && with.pq && rows > 0 && rows >= with.pqMinRows) {
+        PqIndex* pq = new PqIndex(dimension, with.pqSubspaces, with.pqMetric);
+        try {
+            pq->train(segment->rows, samples, sampleStride);
+            for (int r = 0; r < rows; ++r) pq->add(segment->rows + static_cast<size_t>(r) * segment->stride, r);
+        } catch (...) {
+            delete pq;
+            throw;
+        }
+        segment->pq = pq;
+        segment->pqRerank = with.pqRerank;
+    }
+}
+
+void ConcurrentVectorStore::seal(SegmentView& view) {
+    buildSegment(view.segment, view.rows, settings, false);
+    view.index = view.segment->index;
+    view.quantized = view.segment->quantized;
+}
+
+void ConcurrentVectorStore::sealTail() {
+    Snapshot* published = current.load();
+    if (published->segmentCount == 0 || published->views[published->segmentCount - 1].index) return;
+    Snapshot* next = cloneSnapshot(published, 0);
+    try {
+        seal(next->views[next->segmentCount - 1]);
+    } catch (...) {
+        discard(published, next);
+        throw;
+    }
+    publish(next);
+}
+
+// Copies `vector` into a row the snapshot does not cover yet (or takes the
+// row as it is when `vector` is that row), scaled to unit length for a
+// normalized segment, and records its norm.
+void ConcurrentVectorStore::writeRow(Segment* segment, int row, const float* vector) const {
+    float* out = segment->rows + static_cast<size_t>(row) * segment->stride;
+    if (out != vector) memcpy(out, vector, sizeof(float) * dimension);
+    if (!segment->normalized && !segment->norms) return;
+
+    double norm = sqrt(static_cast<double>(DistanceKernels::dot(out, out, dimension)));
+    if (segment->normalized && norm > 0.0) {
+        float inverse = static_cast<float>(1.0 / norm);
+        for (int d = 0; d < dimension; ++d) out[d] *= inverse;
+        norm = 1.0;
+    }
+    if (segment->norms) segment->norms[row] = static_cast<float>(norm);
+}
+
+// Writes land past every published row count, so no reader can see them
+// until `next` is published.
+void ConcurrentVectorStore::appendRow(Snapshot* next, int id, string rawText, const float* vector) {
+    SegmentView* tail = next->segmentCount > 0 ? &next->views[next->segmentCount - 1] : nullptr;
+    if (!tail || tail->index || tail->rows == tail->segment->capacity) {
+        if (tail && !tail->index) seal(*tail);
+        tail = &next->views[next->segmentCount++];
+        tail->segment = newSegment(segmentRows);
+        tail->rows = 0;
+        tail->live = 0;
+        tail->deleted = nullptr;
+        tail->index = nullptr;
+        tail->quantized = nullptr;
+    }
+    Segment* segment = tail->segment;
+    int row = tail->rows;
+    writeRow(segment, row, vector);
+    segment->ids[row] = id;
+    segment->texts[row] = std::move(rawText);
+    ++tail->rows;
+    ++tail->live;
+    ++next->live;
+    if (id >= next->idLimit) next->idLimit = id + 1;
+}
+
+void ConcurrentVectorStore::deleteRow(Snapshot* next, int segment, int row) {
+    SegmentView& view = next->views[segment];
+    RowBitmap* deleted = view.deleted ? new RowBitmap(*view.deleted) : new RowBitmap();
+    deleted->set(row);
+    if (view.deleted) epochs.retire(const_cast<RowBitmap*>(view.deleted), &destroyObject<RowBitmap>);
+    view.deleted = deleted;
+    --view.live;
+    --next->live;
+}
+
+void ConcurrentVectorStore::discard(const Snapshot* published, Snapshot* next) {
+    for (int s = published->segmentCount; s < next->segmentCount; ++s) delete next->views[s].segment;
+    if (published->segmentCount > 0) {
+        const SegmentView& tail = published->views[published->segmentCount - 1];
+        if (!tail.index && tail.segment->index) { // sealed by the failed write
+            delete tail.segment->index;
+            tail.segment->index = nullptr;
+            delete tail.segment->quantized;
+            tail.segment->quantized = nullptr;
+        }
+    }
+    delete next;
+}
+
+void ConcurrentVectorStore::publish(Snapshot* next) {
+    Snapshot* previous = current.exchange(next);
+    epochs.retire(previous, &destroyObject<Snapshot>);
+    epochs.reclaim();
+    requestMerge();
+}
+
+void ConcurrentVectorStore::requestMerge() {
+    {
+        std::lock_guard<std::mutex> lock(mergeSignalLock);
+        mergeRequested = true;
+    }
+    mergeWake.notify_one();
+}
+
+// Newest segment first: an id's newest copy is its only live one.
+bool ConcurrentVectorStore::locate(const Snapshot* snapshot, int id, int& segment, int& row) const {
+    for (int s = snapshot->segmentCount - 1; s >= 0; --s) {
+        const SegmentView& view = snapshot->views[s];
+        int r = -1;
+        if (view.index) {
+            r = view.index->get(id);
+        } else {
+            for (int i = view.rows - 1; i >= 0; --i) {
+                if (view.segment->ids[i] == id) {
+                    r = i;
+                    break;
+                }
+            }
+        }
+        if (r < 0) continue;
+        if (view.deleted && view.deleted->test(r)) return false;
+        segment = s;
+        row = r;
+        return true;
+    }
+    return false;
+}
+
+int ConcurrentVectorStore::size() const {
+    EpochManager::Guard guard(epochs);
+    return current.load()->live;
+}
+
+bool ConcurrentVectorStore::empty() const {
+    return size() == 0;
+}
+
+int ConcurrentVectorStore::getDimension() const {
+    return dimension;
+}
+
+int ConcurrentVectorStore::segmentCount() const {
+    EpochManager::Guard guard(epochs);
+    return current.load()->segmentCount;
+}
+
+int ConcurrentVectorStore::pendingReclaim() const {
+    std::lock_guard<std::mutex> lock(writeLock);
+    return epochs.pending();
+}
+
+int ConcurrentVectorStore::addText(string rawText) {
+    VS_TIME(AddText);
+    float* vector = new float[dimension];
+    int id;
+    try {
+        embed(rawText, vector);
+        std::lock_guard<std::mutex> lock(writeLock);
+        Snapshot* next = cloneSnapshot(current.load(), 1);
+        try {
+            logWrite(WriteAheadLog::Op::Add, nextId, rawText, vector);
+            appendRow(next, nextId, std::move(rawText), vector);
+        } catch (...) {
+            discard(current.load(), next);
+            throw;
+        }
+        publish(next);
+        id = nextId++;
+        compactWalIfDue();
+    } catch (...) {
+        delete[] vector;
+        throw;
+    }
+    delete[] vector;
+    return id;
+}
+
+void ConcurrentVectorStore::addTexts(const ArrayList<string>& rawTexts) {
+    int n = rawTexts.size();
+    if (n == 0) return;
+    float* vectors = new float[static_cast<size_t>(n) * dimension];
+    try {
+        for (int i = 0; i < n; ++i) embed(rawTexts.get(i), vectors + static_cast<size_t>(i) * dimension);
+        std::lock_guard<std::mutex> lock(writeLock);
+        Snapshot* next = cloneSnapshot(current.load(), n / segmentRows + 2);
+        try {
+            for (int i = 0; i < n; ++i) {
+                const float* vector = vectors + static_cast<size_t>(i) * dimension;
+                logWrite(WriteAheadLog::Op::Add, nextId + i, rawTexts.get(i), vector);
+                appendRow(next, nextId + i, rawTexts.get(i), vector);
+            }
+        } catch (...) {
+            discard(current.load(), next);
+            throw;
+        }
+        publish(next);
+        nextId += n;
+        compactWalIfDue();
+    } catch (...) {
+        delete[] vectors;
+        throw;
+    }
+    delete[] vectors;
+}
+
+bool ConcurrentVectorStore::removeById(int id) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (!removeLocked(id)) return false;
+    compactWalIfDue();
+    return true;
+}
+
+bool ConcurrentVectorStore::removeLocked(int id) {
+    Snapshot* published = current.load();
+    int segment, row;
+    if (!locate(published, id, segment, row)) return false;
+    logWrite(WriteAheadLog::Op::Remove, id, string(), nullptr);
+    Snapshot* next = cloneSnapshot(published, 0);
+    deleteRow(next, segment, row);
+    publish(next);
+    std::unique_lock<std::shared_mutex> tags(tagLock);
+    metadata.eraseId(id);
+    return true;
+}
+
+void ConcurrentVectorStore::clear() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    logWrite(WriteAheadLog::Op::Clear, 0, string(), nullptr);
+    clearLocked();
+}
+
+void ConcurrentVectorStore::clearLocked() {
+    Snapshot* old = current.load();
+    Snapshot* next = new Snapshot(0);
+    next->idLimit = old->idLimit;
+    for (int s = 0; s < old->segmentCount; ++s) {
+        if (old->views[s].deleted) epochs.retire(const_cast<RowBitmap*>(old->views[s].deleted), &destroyObject<RowBitmap>);
+        epochs.retire(old->views[s].segment, &destroyObject<Segment>);
+    }
+    publish(next);
+    std::unique_lock<std::shared_mutex> tags(tagLock);
+    metadata.clear();
+}
+
+bool ConcurrentVectorStore::updateById(int id, string newRawText) {
+    float* vector = new float[dimension];
+    try {
+        embed(newRawText, vector);
+        std::lock_guard<std::mutex> lock(writeLock);
+        Snapshot* published = current.load();
+        int segment, row;
+        if (!locate(published, id, segment, row)) {
+            delete[] vector;
+            return false;
+        }
+        Snapshot* next = cloneSnapshot(published, 1);
+        try {
+            logWrite(WriteAheadLog::Op::Update, id, newRawText, vector);
+            appendRow(next, id, std::move(newRawText), vector);
+        } catch (...) {
+            discard(published, next);
+            throw;
+        }
+        deleteRow(next, segment, row);
+        publish(next);
+        compactWalIfDue();
+    } catch (...) {
+        delete[] vector;
+        throw;
+    }
+    delete[] vector;
+    return true;
+}
+
+void ConcurrentVectorStore::compact() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    Snapshot* old = current.load();
+    Snapshot* next = new Snapshot(old->live / segmentRows + 1);
+    next->idLimit = old->idLimit;
+    try {
+        for (int s = 0; s < old->segmentCount; ++s) {
+            const SegmentView& view = old->views[s];
+            for (int r = 0; r < view.rows; ++r) {
+                if (view.deleted && view.deleted->test(r)) continue;
+                // Copied, not moved: readers of `old` may still be reading it.
+                appendRow(next, view.segment->ids[r], string(view.segment->text(r)),
+                          view.segment->rows + static_cast<size_t>(r) * view.segment->stride);
+            }
+        }
+        if (next->segmentCount > 0) seal(next->views[next->segmentCount - 1]);
+    } catch (...) {
+        for (int s = 0; s < next->segmentCount; ++s) delete next->views[s].segment;
+        delete next;
+        throw;
+    }
+    for (int s = 0; s < old->segmentCount; ++s) {
+        if (old->views[s].deleted) epochs.retire(const_cast<RowBitmap*>(old->views[s].deleted), &destroyObject<RowBitmap>);
+        epochs.retire(old->views[s].segment, &destroyObject<Segment>);
+    }
+    publish(next);
+}
+
+// ----------------- ConcurrentVectorStore Merging -----------------
+
+void ConcurrentVectorStore::setMergePolicy(int factor, double deletedRatio) {
+    if (factor < 2) throw std::invalid_argument("ConcurrentVectorStore::setMergePolicy - factor must be >= 2");
+    std::lock_guard<std::mutex> lock(writeLock);
+    mergeFactor = factor;
+    mergeDeletedRatio = deletedRatio;
+}
+
+void ConcurrentVectorStore::enableHnsw(const string& metric, int M, int efConstruction, int efSearch,
+                                       int minRows) {
+    DistanceKernels::Metric parsed = DistanceKernels::parseMetric(metric);
+    std::lock_guard<std::mutex> lock(writeLock);
+    settings.hnsw = true;
+    settings.hnswMetric = parsed;
+    settings.hnswM = M;
+    settings.hnswEfConstruction = efConstruction;
+    settings.hnswEfSearch = efSearch;
+    settings.hnswMinRows = minRows;
+}
+
+void ConcurrentVectorStore::disableHnsw() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    settings.hnsw = false;
+}
+
+void ConcurrentVectorStore::enableIvf(const string& metric, int nlist, int nprobe, int minRows) {
+    DistanceKernels::Metric parsed = DistanceKernels::parseMetric(metric);
+    if (nlist <= 0 || nprobe <= 0) throw std::invalid_argument("ConcurrentVectorStore::enableIvf - nlist and nprobe must be positive");
+    std::lock_guard<std::mutex> lock(writeLock);
+    settings.ivf = true;
+    settings.ivfMetric = parsed;
+    settings.ivfLists = nlist;
+    settings.ivfNprobe = nprobe;
+    settings.ivfMinRows = minRows;
+}
+
+void ConcurrentVectorStore::disableIvf() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    settings.ivf = false;
+}
+
+void ConcurrentVectorStore::enablePq(const string& metric, int subspaces, int rerank, int minRows) {
+    DistanceKernels::Metric parsed = DistanceKernels::parseMetric(metric);
+    if (subspaces <= 0) throw std::invalid_argument("ConcurrentVectorStore::enablePq - subspaces must be positive");
+    std::lock_guard<std::mutex> lock(writeLock);
+    settings.pq = true;
+    settings.pqMetric = parsed;
+    settings.pqSubspaces = subspaces;
+    settings.pqRerank = (rerank > 0) ? rerank : 0;
+    settings.pqMinRows = minRows;
+}
+
+void ConcurrentVectorStore::disablePq() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    settings.pq = false;
+}
+
+void ConcurrentVectorStore::setNormMode(VectorStore::NormMode mode) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (mode == settings.normMode) return;
+    sealTail();
+    settings.normMode = mode;
+}
+
+VectorStore::NormMode ConcurrentVectorStore::getNormMode() const {
+    std::lock_guard<std::mutex> lock(writeLock);
+    return settings.normMode;
+}
+
+void ConcurrentVectorStore::setStoragePrecision(VectorStore::StoragePrecision precision) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    settings.precision = precision;
+}
+
+VectorStore::StoragePrecision ConcurrentVectorStore::getStoragePrecision() const {
+    std::lock_guard<std::mutex> lock(writeLock);
+    return settings.precision;
+}
+
+long long ConcurrentVectorStore::quantizedBytes() const {
+    EpochManager::Guard guard(epochs);
+    const Snapshot* snapshot = current.load();
+    long long bytes = 0;
+    for (int s = 0; s < snapshot->segmentCount; ++s) {
+        if (snapshot->views[s].quantized) bytes += snapshot->views[s].quantized->codeBytes();
+    }
+    return bytes;
+}
+
+// Tier t holds segments of up to segmentRows * factor^t live rows.
+int ConcurrentVectorStore::tierOf(int rows) const {
+    int tier = 0;
+    long long limit = segmentRows;
+    while (rows > limit && tier < 30) {
+        limit *= mergeFactor;
+        ++tier;
+    }
+    return tier;
+}
+
+// Only sealed segments take part, and only as an adjacent run, so the
+// newest-copy-wins order of the snapshot survives the merge.
+bool ConcurrentVectorStore::pickMerge(const Snapshot* snapshot, int& first, int& count) const {
+    int sealed = snapshot->segmentCount;
+    if (sealed > 0 && !snapshot->views[sealed - 1].index) --sealed;
+
+    for (int s = 0; s + mergeFactor <= sealed; ++s) {
+        int tier = tierOf(snapshot->views[s].live);
+        int run = 1;
+        while (run < mergeFactor && tierOf(snapshot->views[s + run].live) == tier) ++run;
+        if (run == mergeFactor) {
+            first = s;
+            count = run;
+            return true;
+        }
+    }
+    for (int s = 0; s < sealed; ++s) {
+        const SegmentView& view = snapshot->views[s];
+        if (view.rows - view.live > mergeDeletedRatio * view.rows) {
+            first = s;
+            count = 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The merged segment (rows, id index, HNSW) is built without the write
+// lock while an epoch pin keeps the inputs alive. Rows deleted in the
+// meantime show up as a changed bitmap pointer and are carried over when
+// the result is installed.
+bool ConcurrentVectorStore::mergeOnce() {
+    std::lock_guard<std::mutex> serial(mergeLock);
+    EpochManager::Guard guard(epochs);
+
+    const Snapshot* snapshot;
+    int first, count;
+    int total = 0;
+    Settings with;
+    {
+        std::lock_guard<std::mutex> lock(writeLock);
+        snapshot = current.load();
+        if (!pickMerge(snapshot, first, count)) return false;
+        for (int c = 0; c < count; ++c) total += snapshot->views[first + c].live;
+        with = settings;
+    }
+
+    Segment* merged = nullptr;
+    int* origin = new int[total > 0 ? total : 1]; // input segment of each merged row
+    int* originRow = new int[total > 0 ? total : 1];
+    try {
+        if (total > 0) {
+            bool allNormalized = true;
+            for (int c = 0; c < count; ++c) allNormalized = allNormalized && snapshot->views[first + c].segment->normalized;
+            merged = new Segment(total, dimension, with.normMode != VectorStore::NormMode::Raw,
+                                 with.normMode == VectorStore::NormMode::Normalized || allNormalized);
+            int row = 0;
+            for (int c = 0; c < count; ++c) {
+                const SegmentView& view = snapshot->views[first + c];
+                for (int r = 0; r < view.rows; ++r) {
+                    if (view.deleted && view.deleted->test(r)) continue;
+                    writeRow(merged, row, view.segment->rows + static_cast<size_t>(r) * view.segment->stride);
+                    merged->ids[row] = view.segment->ids[r];
+                    merged->texts[row] = view.segment->text(r);
+                    origin[row] = c;
+                    originRow[row] = r;
+                    ++row;
+                }
+            }
+            buildSegment(merged, total, with, true);
+        }
+    } catch (...) {
+        delete merged;
+        delete[] origin;
+        delete[] originRow;
+        throw;
+    }
+
+    std::lock_guard<std::mutex> lock(writeLock);
+    Snapshot* published = current.load();
+    int at = -1;
+    for (int s = 0; s + count <= published->segmentCount && at < 0; ++s) {
+        if (published->views[s].segment == snapshot->views[first].segment) at = s;
+    }
+    for (int c = 0; at >= 0 && c < count; ++c) {
+        if (published->views[at + c].segment != snapshot->views[first + c].segment) at = -1;
+    }
+    if (at < 0) { // compact(), clear() or load() replaced the inputs meanwhile
+        delete merged;
+        delete[] origin;
+        delete[] originRow;
+        return true;
+    }
+
+    RowBitmap* deleted = nullptr;
+    int live = total;
+    for (int r = 0; r < total; ++r) {
+        const SegmentView& now = published->views[at + origin[r]];
+        if (now.deleted != snapshot->views[first + origin[r]].deleted && now.deleted->test(originRow[r])) {
+            if (!deleted) deleted = new RowBitmap(total);
+            deleted->set(r);
+            --live;
+        }
+    }
+    delete[] origin;
+    delete[] originRow;
+
+    Snapshot* next = new Snapshot(published->segmentCount - count + 2);
+    for (int s = 0; s < at; ++s) next->views[next->segmentCount++] = published->views[s];
+    if (merged) {
+        SegmentView& view = next->views[next->segmentCount++];
+        view.segment = merged;
+        view.rows = total;
+        view.live = live;
+        view.deleted = deleted;
+        view.index = merged->index;
+        view.quantized = merged->quantized;
+    }
+    for (int s = at + count; s < published->segmentCount; ++s) next->views[next->segmentCount++] = published->views[s];
+    next->live = published->live;
+    next->idLimit = published->idLimit;
+    for (int c = 0; c < count; ++c) {
+        const SegmentView& input = published->views[at + c];
+        if (input.deleted) epochs.retire(const_cast<RowBitmap*>(input.deleted), &destroyObject<RowBitmap>);
+        epochs.retire(input.segment, &destroyObject<Segment>);
+    }
+    publish(next);
+    return true;
+}
+
+int ConcurrentVectorStore::merge() {
+    if (mergeFailed.exchange(false)) throw std::runtime_error("Background segment merge failed; segments were kept");
+    int merges = 0;
+    while (mergeOnce()) ++merges;
+    return merges;
+}
+
+void ConcurrentVectorStore::mergeLoop() {
+    std::unique_lock<std::mutex> lock(mergeSignalLock);
+    while (true) {
+        mergeWake.wait(lock, [this] { return mergeStop || mergeRequested; });
+        if (mergeStop) return;
+        mergeRequested = false;
+        lock.unlock();
+        try {
+            while (mergeOnce()) {
+                std::lock_guard<std::mutex> check(mergeSignalLock);
+                if (mergeStop) break;
+            }
+        } catch (...) {
+            mergeFailed = true;
+        }
+        lock.lock();
+    }
+}
+
+void ConcurrentVectorStore::startBackgroundMerge() {
+    if (merger.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(mergeSignalLock);
+        mergeStop = false;
+        mergeRequested = true;
+    }
+    merger = std::thread(&ConcurrentVectorStore::mergeLoop, this);
+}
+
+void ConcurrentVectorStore::stopBackgroundMerge() {
+    {
+        std::lock_guard<std::mutex> lock(mergeSignalLock);
+        mergeStop = true;
+    }
+    mergeWake.notify_all();
+    if (merger.joinable()) merger.join();
+    if (mergeFailed.exchange(false)) throw std::runtime_error("Background segment merge failed; segments were kept");
+}
+
+// ----------------- ConcurrentVectorStore Search -----------------
+
+bool ConcurrentVectorStore::contains(int id) const {
+    EpochManager::Guard guard(epochs);
+    int segment, row;
+    return locate(current.load(), id, segment, row);
+}
+
+bool ConcurrentVectorStore::getRawText(int id, string& out) const {
+    EpochManager::Guard guard(epochs);
+    const Snapshot* snapshot = current.load();
+    int segment, row;
+    if (!locate(snapshot, id, segment, row)) return false;
+    out = snapshot->views[segment].segment->text(row);
+    return true;
+}
+
+int ConcurrentVectorStore::findNearest(const SinglyLinkedList<float>& query, const string& metric) const {
+    DistanceKernels::parseMetric(metric);
+    if (empty()) return -1;
+    float* q = new float[dimension];
+    copyList(query, q, dimension);
+    TopKResult result(1);
+    try {
+        topKNearest(q, 1, metric, result);
+    } catch (const invalid_k_value&) {
+        result.clear(); // emptied by a writer in between
+    }
+    delete[] q;
+    return result.empty() ? -1 : result.getId(0);
+}
+
+void ConcurrentVectorStore::topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                        TopKResult& out) const {
+    float* q = new float[dimension];
+    copyList(query, q, dimension);
+    try {
+        search(q, k, metric, false, nullptr, out);
+    } catch (...) {
+        delete[] q;
+        throw;
+    }
+    delete[] q;
+}
+
+void ConcurrentVectorStore::topKNearest(const float* query, int k, const string& metric, TopKResult& out) const {
+    search(query, k, metric, false, nullptr, out);
+}
+
+void ConcurrentVectorStore::topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                        const Filter& filter, TopKResult& out) const {
+    float* q = new float[dimension];
+    copyList(query, q, dimension);
+    try {
+        search(q, k, metric, false, &filter, out);
+    } catch (...) {
+        delete[] q;
+        throw;
+    }
+    delete[] q;
+}
+
+void ConcurrentVectorStore::approximateTopKNearest(const SinglyLinkedList<float>& query, int k,
+                                                   const string& metric, const Filter& filter,
+                                                   TopKResult& out) const {
+    float* q = new float[dimension];
+    copyList(query, q, dimension);
+    try {
+        search(q, k, metric, true, &filter, out);
+    } catch (...) {
+        delete[] q;
+        throw;
+    }
+    delete[] q;
+}
+
+void ConcurrentVectorStore::approximateTopKNearest(const SinglyLinkedList<float>& query, int k,
+                                                   const string& metric, TopKResult& out) const {
+    float* q = new float[dimension];
+    copyList(query, q, dimension);
+    try {
+        search(q, k, metric, true, nullptr, out);
+    } catch (...) {
+        delete[] q;
+        throw;
+    }
+    delete[] q;
+}
+
+// Fans out over the segments of one snapshot into a single selector whose
+// items are ids. With a filter only rows whose id it matches are offered.
+void ConcurrentVectorStore::search(const float* query, int k, const string& metric, bool approximate,
+                                   const Filter* filter, TopKResult& out) const {
+    DistanceKernels::Metric m = DistanceKernels::parseMetric(metric);
+    if (k <= 0) throw invalid_k_value();
+    VS_COUNT(Queries, 1);
+
+    EpochManager::Guard guard(epochs);
+    const Snapshot* snapshot = current.load();
+    if (k > snapshot->live) throw invalid_k_value();
+
+    RowBitmap eligible;
+    const RowBitmap* ids = nullptr;
+    if (filter && !filter->matchesAll()) {
+        {
+            std::shared_lock<std::shared_mutex> tags(tagLock);
+            metadata.evaluate(*filter, snapshot->idLimit, eligible);
+        }
+        ids = &eligible;
+        long long matches = eligible.count();
+        if (matches <= FILTERED_EXACT_ROWS || matches * FILTERED_EXACT_RATIO < snapshot->live) approximate = false;
+    }
+
+    TopKSelector selector(k);
+    double queryNorm = sqrt(static_cast<double>(DistanceKernels::dot(query, query, dimension)));
+    auto floatKey = [&](const Segment* segment, int r) {
+        double rowNorm = segment->normalized ? 1.0 : segment->norms ? segment->norms[r] : -1.0;
+        const float* row = segment->rows + static_cast<size_t>(r) * segment->stride;
+        return rowKey(m, query, queryNorm, row, rowNorm, dimension);
+    };
+    double* annKeys = nullptr;
+    int* annRows = nullptr;
+    int annCapacity = 0;
+    for (int s = 0; s < snapshot->segmentCount; ++s) {
+        const SegmentView& view = snapshot->views[s];
+        const Segment* segment = view.segment;
+        if (view.live == 0) continue;
+        bool unit = segment->normalized;
+        const HnswIndex* hnsw = (approximate && segment->ann && servesMetric(segment->ann->getDistance(), m, unit))
+                                    ? segment->ann : nullptr;
+        const IvfIndex* ivf = (approximate && !hnsw && segment->ivf && servesMetric(segment->ivf->getDistance(), m, unit))
+                                  ? segment->ivf : nullptr;
+        const PqIndex* pq = (approximate && !hnsw && !ivf && segment->pq &&
+                             servesMetric(segment->pq->getCodec().getDistance(), m, unit))
+                                ? segment->pq : nullptr;
+        if (hnsw || ivf || pq) {
+            // The index proposes candidates; they are re-scored against the float rows.
+            int want = k < view.live ? k : view.live;
+            if (pq && segment->pqRerank > 0) {
+                long long wider = static_cast<long long>(k) * segment->pqRerank;
+                want = (wider < view.live) ? static_cast<int>(wider) : view.live;
+            }
+            if (want > annCapacity) {
+                delete[] annKeys;
+                delete[] annRows;
+                annCapacity = want;
+                annKeys = new double[annCapacity];
+                annRows = new int[annCapacity];
+            }
+            RowBitmap* allowed = nullptr;
+            if (view.deleted) {
+                allowed = new RowBitmap(*view.deleted);
+                allowed->resize(view.rows);
+                allowed->flip();
+            }
+            if (ids) {
+                if (!allowed) {
+                    allowed = new RowBitmap(view.rows);
+                    allowed->setAll();
+                }
+                for (int r = 0; r < view.rows; ++r) {
+                    if (!ids->test(segment->ids[r])) allowed->reset(r);
+                }
+            }
+            int found;
+            if (hnsw) found = hnsw->search(query, want, annKeys, annRows, allowed);
+            else if (ivf) found = ivf->search(query, want, annKeys, annRows, allowed);
+            else found = pq->search(query, want, annKeys, annRows, allowed);
+            delete allowed;
+            for (int i = 0; i < found; ++i) selector.offer(floatKey(segment, annRows[i]), segment->ids[annRows[i]]);
+            continue;
+        }
+        if (view.quantized) {
+            ScalarQuantizer::Query prepared;
+            view.quantized->prepare(query, prepared);
+            for (int r = 0; r < view.rows; ++r) {
+                if ((view.deleted && view.deleted->test(r)) || (ids && !ids->test(segment->ids[r]))) continue;
+                selector.offer(quantizedKey(m, view.quantized->score(m, prepared, r)), segment->ids[r]);
+            }
+            continue;
+        }
+        for (int r = 0; r < view.rows; ++r) {
+            if ((view.deleted && view.deleted->test(r)) || (ids && !ids->test(segment->ids[r]))) continue;
+            selector.offer(floatKey(segment, r), segment->ids[r]);
+        }
+    }
+    delete[] annKeys;
+    delete[] annRows;
+
+    int found = selector.size();
+    out.resize(found);
+    selector.drainSorted(out.scoreData(), out.idData());
+    for (int i = 0; i < found; ++i) {
+        out.scoreData()[i] = keyToScore(m, out.scoreData()[i]);
+        out.indexData()[i] = -1;
+    }
+}
+
+// ----------------- ConcurrentVectorStore Metadata -----------------
+
+void ConcurrentVectorStore::setIntTag(int id, const string& tag, long long value) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    int segment, row;
+    if (!locate(current.load(), id, segment, row))
+        throw std::out_of_range("ConcurrentVectorStore::setIntTag - unknown id");
+
+    if (wal) {
+        string block;
+        MetadataTable::encodeInt(block, id, tag, value);
+        logWrite(WriteAheadLog::Op::Tag, id, block, nullptr);
+    }
+    {
+        std::unique_lock<std::shared_mutex> tags(tagLock);
+        metadata.setInt(id, tag, value);
+    }
+    compactWalIfDue();
+}
+
+void ConcurrentVectorStore::setFloatTag(int id, const string& tag, double value) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    int segment, row;
+    if (!locate(current.load(), id, segment, row))
+        throw std::out_of_range("ConcurrentVectorStore::setFloatTag - unknown id");
+
+    if (wal) {
+        string block;
+        MetadataTable::encodeFloat(block, id, tag, value);
+        logWrite(WriteAheadLog::Op::Tag, id, block, nullptr);
+    }
+    {
+        std::unique_lock<std::shared_mutex> tags(tagLock);
+        metadata.setFloat(id, tag, value);
+    }
+    compactWalIfDue();
+}
+
+void ConcurrentVectorStore::setStringTag(int id, const string& tag, const string& value) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    int segment, row;
+    if (!locate(current.load(), id, segment, row))
+        throw std::out_of_range("ConcurrentVectorStore::setStringTag - unknown id");
+
+    if (wal) {
+        string block;
+        MetadataTable::encodeString(block, id, tag, value);
+        logWrite(WriteAheadLog::Op::Tag, id, block, nullptr);
+    }
+    {
+        std::unique_lock<std::shared_mutex> tags(tagLock);
+        metadata.setString(id, tag, value);
+    }
+    compactWalIfDue();
+}
+
+bool ConcurrentVectorStore::removeTag(int id, const string& tag) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    {
+        std::unique_lock<std::shared_mutex> tags(tagLock);
+        if (!metadata.erase(id, tag)) return false;
+    }
+    if (wal) {
+        string block;
+        MetadataTable::encodeErase(block, id, tag);
+        logWrite(WriteAheadLog::Op::Tag, id, block, nullptr);
+        compactWalIfDue();
+    }
+    return true;
+}
+
+bool ConcurrentVectorStore::getIntTag(int id, const string& tag, long long& out) const {
+    std::shared_lock<std::shared_mutex> tags(tagLock);
+    return metadata.getInt(id, tag, out);
+}
+
+bool ConcurrentVectorStore::getFloatTag(int id, const string& tag, double& out) const {
+    std::shared_lock<std::shared_mutex> tags(tagLock);
+    return metadata.getFloat(id, tag, out);
+}
+
+bool ConcurrentVectorStore::getStringTag(int id, const string& tag, string& out) const {
+    std::shared_lock<std::shared_mutex> tags(tagLock);
+    return metadata.getString(id, tag, out);
+}
+
+int ConcurrentVectorStore::countMatching(const Filter& filter) const {
+    EpochManager::Guard guard(epochs);
+    const Snapshot* snapshot = current.load();
+    if (filter.matchesAll()) return snapshot->live;
+
+    RowBitmap eligible;
+    {
+        std::shared_lock<std::shared_mutex> tags(tagLock);
+        metadata.evaluate(filter, snapshot->idLimit, eligible);
+    }
+    int matches = 0;
+    for (int s = 0; s < snapshot->segmentCount; ++s) {
+        const SegmentView& view = snapshot->views[s];
+        for (int r = 0; r < view.rows; ++r) {
+            if ((!view.deleted || !view.deleted->test(r)) && eligible.test(view.segment->ids[r])) ++matches;
+        }
+    }
+    return matches;
+}
+
+// ----------------- ConcurrentVectorStore Persistence -----------------
+
+// Writes the live rows of `snapshot`, oldest segment first, in VectorStore's
+// file layout. Nothing under a pinned snapshot changes, so no lock is held.
+void ConcurrentVectorStore::writeSnapshot(const Snapshot* snapshot, const string& path, const string& tags,
+                                          bool durable) const {
+    int n = snapshot->live;
+    const Segment** segments = new const Segment*[n > 0 ? n : 1];
+    int* rows = new int[n > 0 ? n : 1];
+    int at = 0;
+    for (int s = 0; s < snapshot->segmentCount; ++s) {
+        const SegmentView& view = snapshot->views[s];
+        for (int r = 0; r < view.rows; ++r) {
+            if (view.deleted && view.deleted->test(r)) continue;
+            segments[at] = view.segment;
+            rows[at++] = r;
+        }
+    }
+    auto idAt = [segments, rows](int i) { return segments[i]->ids[rows[i]]; };
+    auto textAt = [segments, rows](int i, const char*& text, int& length) {
+        std::string_view view = segments[i]->text(rows[i]);
+        text = view.data();
+        length = static_cast<int>(view.size());
+    };
+    auto rowAt = [segments, rows](int i, float*) {
+        return static_cast<const float*>(segments[i]->rows + static_cast<size_t>(rows[i]) * segments[i]->stride);
+    };
+    try {
+        writeStoreFile(path, dimension, n, snapshot->idLimit, idAt, textAt, rowAt, tags, durable);
+    } catch (...) {
+        delete[] segments;
+        delete[] rows;
+        throw;
+    }
+    delete[] segments;
+    delete[] rows;
+}
+
+// The snapshot and the tags are taken together under the write lock, so
+// every tagged id is below the file's nextId; the rows are written after
+// the lock is released.
+void ConcurrentVectorStore::save(const string& path) const {
+    EpochManager::Guard guard(epochs);
+    const Snapshot* snapshot;
+    string tags;
+    {
+        std::lock_guard<std::mutex> lock(writeLock);
+        snapshot = current.load();
+        std::shared_lock<std::shared_mutex> shared(tagLock);
+        metadata.encode(tags);
+    }
+    writeSnapshot(snapshot, path, tags, false);
+}
+
+void ConcurrentVectorStore::load(const string& path) {
+    std::lock_guard<std::mutex> lock(writeLock);
+    loadFile(path);
+    if (wal) rotateWal(); // the loaded rows are not in the log
+}
+
+// Replaces the contents with one sealed segment whose rows, ids and texts
+// are read in place from the mapped file. Norms are computed and, for a
+// normalized segment, rows rescaled in the private mapping.
+void ConcurrentVectorStore::loadFile(const string& path) {
+    MappedFile* file = new MappedFile(path);
+    StoreFileHeader header;
+    MetadataTable tags;
+    const char* problem = validateStoreFile(file->data(), file->size(), dimension, header, tags);
+    if (problem) {
+        delete file;
+        throw std::runtime_error("ConcurrentVectorStore::load - " + path + ": " + problem);
+    }
+
+    int n = static_cast<int>(header.recordCount);
+    Snapshot* next = new Snapshot(1);
+    next->idLimit = static_cast<int>(header.nextId);
+    if (n == 0) {
+        delete file;
+    } else {
+        Segment* segment = new Segment(file, n, header.stride, settings.normMode != VectorStore::NormMode::Raw,
+                                       settings.normMode == VectorStore::NormMode::Normalized);
+        segment->rows = reinterpret_cast<float*>(file->data() + header.matrixOffset);
+        segment->ids = reinterpret_cast<int*>(file->data() + header.idsOffset);
+        segment->fileText = file->data() + header.textOffset;
+        segment->fileTextOffsets = reinterpret_cast<const long long*>(file->data() + header.textOffsetsOffset);
+        try {
+            for (int r = 0; r < n; ++r) writeRow(segment, r, segment->rows + static_cast<size_t>(r) * segment->stride);
+            buildSegment(segment, n, settings, true);
+        } catch (...) {
+            delete segment;
+            delete next;
+            throw;
+        }
+        SegmentView& view = next->views[next->segmentCount++];
+        view.segment = segment;
+        view.rows = n;
+        view.live = n;
+        view.deleted = nullptr;
+        view.index = segment->index;
+        view.quantized = segment->quantized;
+        next->live = n;
+    }
+
+    Snapshot* old = current.load();
+    for (int s = 0; s < old->segmentCount; ++s) {
+        if (old->views[s].deleted) epochs.retire(const_cast<RowBitmap*>(old->views[s].deleted), &destroyObject<RowBitmap>);
+        epochs.retire(old->views[s].segment, &destroyObject<Segment>);
+    }
+    publish(next);
+    nextId = next->idLimit;
+    std::unique_lock<std::shared_mutex> lock(tagLock);
+    metadata.swap(tags);
+}
+
+// ----------------- ConcurrentVectorStore Write-Ahead Log -----------------
+
+// Appends a write before it is published; Add / Update carry the embedded
+// vector so replay does not call the embedding function.
+void ConcurrentVectorStore::logWrite(WriteAheadLog::Op op, int id, const string& text, const float* vector) {
+    if (wal) wal->append(op, id, text, vector);
+}
+
+void ConcurrentVectorStore::compactWalIfDue() {
+    if (wal && walCompactBytes > 0 && wal->size() >= walCompactBytes) rotateWal();
+}
+
+void ConcurrentVectorStore::replayEntry(const WriteAheadLog::Entry& entry) {
+    switch (entry.op) {
+        case WriteAheadLog::Op::Add:
+        case WriteAheadLog::Op::Update: {
+            Snapshot* published = current.load();
+            int segment, row;
+            bool replaces = locate(published, entry.id, segment, row);
+            if (entry.op == WriteAheadLog::Op::Update && !replaces) break;
+            Snapshot* next = cloneSnapshot(published, 1);
+            try {
+                appendRow(next, entry.id, string(entry.text, entry.textLength), entry.vector);
+            } catch (...) {
+                discard(published, next);
+                throw;
+            }
+            if (replaces) deleteRow(next, segment, row);
+            publish(next);
+            if (entry.id >= nextId) nextId = entry.id + 1;
+            break;
+        }
+        case WriteAheadLog::Op::Remove:
+            removeLocked(entry.id);
+            break;
+        case WriteAheadLog::Op::Tag: {
+            std::unique_lock<std::shared_mutex> tags(tagLock);
+            if (!metadata.decode(entry.text, entry.textLength, nextId)) {
+                throw std::runtime_error("ConcurrentVectorStore - corrupt tag entry in the write-ahead log");
+            }
+            break;
+        }
+        default:
+            clearLocked();
+            break;
+    }
+}
+
+void ConcurrentVectorStore::openWal(const string& base, long long groupBytes, int groupDelayMs,
+                                    long long compactBytes) {
+    closeWal();
+    std::lock_guard<std::mutex> lock(writeLock);
+
+    ArrayList<int> snapshots = findGenerations(base, ".snapshot.");
+    ArrayList<int> logs = findGenerations(base, ".wal.");
+    int covered = 0;
+    if (snapshots.size() > 0 || logs.size() > 0) {
+        if (snapshots.size() > 0) {
+            covered = snapshots.get(snapshots.size() - 1);
+            loadFile(snapshotPath(base, covered));
+        } else {
+            clearLocked();
+        }
+        auto apply = [this](const WriteAheadLog::Entry& entry) { replayEntry(entry); };
+        int last = covered;
+        for (int i = 0; i < logs.size(); ++i) {
+            if (logs.get(i) <= covered) continue; // already in the snapshot
+            WriteAheadLog::replay(walPath(base, logs.get(i)), dimension, apply);
+            last = logs.get(i);
+        }
+        walGeneration = last + 1;
+    } else {
+        string tags;
+        {
+            std::shared_lock<std::shared_mutex> shared(tagLock);
+            metadata.encode(tags);
+        }
+        writeSnapshot(current.load(), snapshotPath(base, 0), tags, true);
+        walGeneration = 1;
+    }
+
+    walBase = base;
+    walGroupBytes = groupBytes;
+    walGroupDelayMs = groupDelayMs;
+    walCompactBytes = compactBytes;
+    wal = new WriteAheadLog(walPath(base, walGeneration), dimension, groupBytes, groupDelayMs);
+}
+
+void ConcurrentVectorStore::syncWal() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (!wal) throw std::logic_error("WAL is not enabled");
+    wal->sync();
+}
+
+void ConcurrentVectorStore::compactWal() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    if (!wal) throw std::logic_error("WAL is not enabled");
+    rotateWal();
+}
+
+// The published snapshot is exactly what the closed logs produced, so the
+// compaction thread writes <base>.snapshot.<g> from it under an epoch pin,
+// deletes the snapshot and logs it covers, then unpins.
+void ConcurrentVectorStore::rotateWal() {
+    finishCompaction();
+
+    wal->sync();
+    string tags;
+    {
+        std::shared_lock<std::shared_mutex> shared(tagLock);
+        metadata.encode(tags);
+    }
+    int covered = walGeneration;
+    WriteAheadLog* next = new WriteAheadLog(walPath(walBase, covered + 1), dimension, walGroupBytes, walGroupDelayMs);
+    delete wal;
+    wal = next;
+    walGeneration = covered + 1;
+
+    int slot = epochs.enter();
+    const Snapshot* snapshot = current.load();
+    string base = walBase;
+    try {
+        compactor = std::thread([this, snapshot, slot, tags = std::move(tags), base, covered]() {
+            try {
+                writeSnapshot(snapshot, snapshotPath(base, covered), tags, true);
+                ArrayList<int> snapshots = findGenerations(base, ".snapshot.");
+                for (int i = 0; i < snapshots.size(); ++i) {
+                    if (snapshots.get(i) < covered) std::remove(snapshotPath(base, snapshots.get(i)).c_str());
+                }
+                ArrayList<int> logs = findGenerations(base, ".wal.");
+                for (int i = 0; i < logs.size(); ++i) {
+                    if (logs.get(i) <= covered) std::remove(walPath(base, logs.get(i)).c_str());
+                }
+            } catch (...) {
+                compactFailed = true; // the older snapshot and logs still recover everything
+            }
+            epochs.leave(slot);
+        });
+    } catch (...) {
+        epochs.leave(slot);
+        throw;
+    }
+}
+
+void ConcurrentVectorStore::finishCompaction() {
+    if (compactor.joinable()) compactor.join();
+}
+
+void ConcurrentVectorStore::closeWal() {
+    std::lock_guard<std::mutex> lock(writeLock);
+    finishCompaction();
+    delete wal;
+    wal = nullptr;
+    if (compactFailed.exchange(false)) throw std::runtime_error("WAL compaction failed; logs were kept");
+}
+
+bool ConcurrentVectorStore::hasWal() const {
+    std::lock_guard<std::mutex> lock(writeLock);
+    return wal != nullptr;
+}
 
 // Explicit template instantiation for char, string, int, double, float, and Point
 
@@ -374,6 +9588,7 @@ template class ArrayList<int>;
 template class ArrayList<double>;
 template class ArrayList<float>;
 template class ArrayList<Point>;
+template class ArrayList<SinglyLinkedList<float>*>;
 
 template class SinglyLinkedList<char>;
 template class SinglyLinkedList<string>;
@@ -2,11 +2,25 @@
 #define VECTORSTORE_H
 
 #include "main.h"
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <cstring>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <chrono>
+#include <string_view>
 
 // ==============================
 // Class ArrayList
 // ==============================
 
+// Elements live in raw storage and are constructed in place, so capacity
+// beyond size() holds no objects. Growth relocates by memcpy for trivially
+// copyable T and by move construction otherwise.
 template <class T>
 class ArrayList {
     #ifdef TESTING
@@ -18,6 +32,14 @@ private:
     int count;
 
     void ensureCapacity(int cap); // check
+    int grownCapacity(int cap) const; // 1.5x, at least cap
+    void reallocate(int newCapacity);
+    void insertAt(int index, T&& e);
+
+    static T* allocate(int n);
+    static void deallocate(T* block);
+    static void destroy(T* first, int n);
+    static void relocate(T* from, T* to, int n); // leaves `from` raw
 
 public:
     class Iterator;
@@ -25,19 +47,30 @@ public:
 
     ArrayList(int initCapacity = 10); // check
     ArrayList(const ArrayList<T>& other); //Deep Copy //check
+    ArrayList(ArrayList<T>&& other) noexcept; // steals the buffer, other is left empty
     ~ArrayList();
     ArrayList<T>& operator=(const ArrayList<T>& other); //Deep Copy //check
+    ArrayList<T>& operator=(ArrayList<T>&& other) noexcept;
 
-    void add(T e); // check
-    void add(int index, T e); // check
+    void add(const T& e); // check
+    void add(T&& e);
+    template <class... Args>
+    T& emplace_back(Args&&... args); // constructs the element in place
+    void add(int index, const T& e); // check
+    void add(int index, T&& e);
     T removeAt(int index); // check
     bool empty() const; // check
     int size() const; // check
+    int getCapacity() const;
     void clear(); // check
+    void reserve(int cap); // capacity of at least cap, grown once
+    void shrink_to_fit(); // capacity down to size() (at least 1)
     T& get(int index); // check
-    void set(int index, T e); //check
-    int indexOf(T item) const; // check
-    bool contains(T item) const; // check
+    const T& get(int index) const;
+    void set(int index, const T& e); //check
+    void set(int index, T&& e);
+    int indexOf(const T& item) const; // check
+    bool contains(const T& item) const; // check
     string toString(string (*item2str)(T&) = 0) const; // check
 
     Iterator begin(); // check
@@ -53,6 +86,7 @@ public:
         ArrayList<T>* pList;
     public:
         Iterator(ArrayList<T>* pList = nullptr, int index = 0); // check
+        Iterator(const Iterator& other) = default;
         Iterator& operator=(const Iterator& other); //Deep Copy // check
         T& operator*(); // check
         bool operator!=(const Iterator& other) const; // check
@@ -63,9 +97,90 @@ public:
     };
 };
 
+template <class T>
+template <class... Args>
+T& ArrayList<T>::emplace_back(Args&&... args) {
+    if (count < capacity) {
+        new (data + count) T(std::forward<Args>(args)...);
+    } else {
+        // Build the new element first: args may refer into the old buffer.
+        int newCapacity = grownCapacity(count + 1);
+        T* newData = allocate(newCapacity);
+        try {
+            new (newData + count) T(std::forward<Args>(args)...);
+        } catch (...) {
+            deallocate(newData);
+            throw;
+        }
+        try {
+            relocate(data, newData, count);
+        } catch (...) {
+            newData[count].~T();
+            deallocate(newData);
+            throw;
+        }
+        deallocate(data);
+        data = newData;
+        capacity = newCapacity;
+    }
+    return data[count++];
+}
+
+// =====================================
+// Class NodeAllocator
+// =====================================
+// Source of fixed-size blocks for list nodes and store records. Blocks are
+// raw memory; callers construct / destroy objects in them.
+class NodeAllocator {
+public:
+    virtual ~NodeAllocator() {}
+    virtual void* allocate(size_t bytes) = 0;
+    virtual void deallocate(void* block, size_t bytes) = 0;
+};
+
+// =====================================
+// Class SlabArena
+// =====================================
+// Carves blocks of one size out of large chunks (each twice the previous,
+// up to maxChunkBlocks) and recycles freed blocks through an intrusive free
+// list. Chunks go back to the heap only in release() / the destructor, so
+// dropping a whole list or store is a handful of frees. Requests larger
+// than the block size fall through to the heap. Not thread-safe.
+class SlabArena : public NodeAllocator {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    size_t blockSize;
+    int nextChunkBlocks;
+    int maxChunkBlocks;
+    char* chunks;   // singly linked through each chunk's first word
+    void* freeList; // singly linked through each free block's first word
+    char* cursor;   // unused tail of the newest chunk
+    char* limit;
+    long long reservedBytes;
+
+    void grow();
+
+public:
+    SlabArena(size_t blockSize, int firstChunkBlocks = 8, int maxChunkBlocks = 1024);
+    ~SlabArena();
+    SlabArena(const SlabArena& other) = delete;
+    SlabArena& operator=(const SlabArena& other) = delete;
+
+    void* allocate(size_t bytes) override;
+    void deallocate(void* block, size_t bytes) override;
+    // Returns every chunk to the heap. Objects still living in the arena
+    // must have been destroyed (or be trivially destructible).
+    void release();
+    long long bytesReserved() const;
+};
+
 // =====================================
 // Class SinglyLinkedList
 // =====================================
+// Nodes come from the list's own SlabArena unless an allocator is passed
+// in, in which case the list only borrows it (several lists may share one).
 template <class T>
 class SinglyLinkedList {
     #ifdef TESTING
@@ -79,29 +194,41 @@ private:
 
         Node() : data(), next(nullptr) {}
         Node(const T& data, Node* next = nullptr) : data(data), next(next) {}
+        Node(T&& data, Node* next = nullptr) : data(std::move(data)), next(next) {}
     };
 
     Node* head;
     Node* tail;
     int count;
+    SlabArena ownArena;
+    NodeAllocator* allocator;
+
+    template <class U>
+    Node* createNode(U&& e, Node* next);
+    void destroyNode(Node* node);
 
 public:
     class Iterator;
     friend class Iterator;
 
-    SinglyLinkedList();
+    static const size_t NODE_BYTES = sizeof(Node);
+
+    SinglyLinkedList(NodeAllocator* allocator = nullptr);
+    SinglyLinkedList(const SinglyLinkedList<T>& other); //Deep Copy, into its own arena
     ~SinglyLinkedList();
+    SinglyLinkedList<T>& operator=(const SinglyLinkedList<T>& other); //Deep Copy
 
-    void add(T e);
+    void add(const T& e);
+    void add(T&& e);
     void add(int index, T e);
     T removeAt(int index);
-    bool removeItem(T item);
+    bool removeItem(const T& item);
     bool empty() const;
     int size() const;
     void clear();
     T& get(int index);
-    int indexOf(T item) const;
-    bool contains(T item) const;
+    int indexOf(const T& item) const;
+    bool contains(const T& item) const;
     string toString(string (*item2str)(T&) = 0) const;
 
     Iterator begin();
@@ -116,6 +243,7 @@ public:
         Node* current;
     public:
         Iterator(Node* node = nullptr);
+        Iterator(const Iterator& other) = default;
         Iterator& operator=(const Iterator& other); //Deep Copy
         T& operator*();
         bool operator!=(const Iterator& other) const;
@@ -124,6 +252,1103 @@ public:
     };
 };
 
+// =====================================
+// Class Instrumentation
+// =====================================
+// Opt-in counters and latency histograms for the hot paths, compiled in
+// with -DVECTORSTORE_STATS. Each thread records into its own slab and
+// snapshot() sums them, so recording costs a relaxed add to thread-local
+// memory. Without the macro every probe compiles to nothing and
+// snapshot() is all zeros. Figures are process wide, not per store.
+class Instrumentation {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    enum class Counter {
+        DistanceEvaluations, // kernel calls (dot4 counts four)
+        BytesScanned,        // row bytes read by the kernels
+        NodesVisited,        // HNSW nodes expanded
+        Embeddings,          // embedding function / default encoder calls
+        Queries              // findNearest / topKNearest / approximate calls
+    };
+    // Scan covers scoring and top-k selection, which are fused per row.
+    enum class Timer { Preprocessing, AddText, FindNearest, TopKNearest, ApproximateSearch, Scan };
+
+    static const int COUNTERS = 5;
+    static const int TIMERS = 6;
+    // HDR-style buckets: exact below 16 ns, then 16 linear sub-buckets per
+    // power of two (at most ~6% relative error) up to 2^48 ns.
+    static const int SUB_BUCKETS = 16;
+    static const int BUCKETS = SUB_BUCKETS * 45;
+
+    struct Histogram {
+        unsigned long long count;
+        unsigned long long sumNanos;
+        unsigned long long minNanos;
+        unsigned long long maxNanos;
+        unsigned long long buckets[BUCKETS];
+
+        double mean() const;
+        double percentile(double p) const; // p in [0, 100], nanoseconds
+    };
+
+    struct Snapshot {
+        unsigned long long counters[COUNTERS];
+        Histogram timers[TIMERS];
+
+        unsigned long long counter(Counter c) const;
+        const Histogram& timer(Timer t) const;
+        string toText() const;
+        string toJson() const;
+    };
+
+    static bool enabled(); // compiled with VECTORSTORE_STATS
+    static Snapshot snapshot();
+    static void reset();   // approximate while other threads are recording
+    static const char* counterName(Counter c);
+    static const char* timerName(Timer t);
+    static int bucketOf(unsigned long long nanos);
+    static unsigned long long bucketLow(int bucket);
+
+    static void add(Counter c, unsigned long long n);
+    static void record(Timer t, unsigned long long nanos);
+
+    class ScopedTimer {
+    private:
+        Timer timer;
+        std::chrono::steady_clock::time_point started;
+    public:
+        explicit ScopedTimer(Timer timer) : timer(timer), started(std::chrono::steady_clock::now()) {}
+        ~ScopedTimer();
+        ScopedTimer(const ScopedTimer& other) = delete;
+        ScopedTimer& operator=(const ScopedTimer& other) = delete;
+    };
+};
+
+// =====================================
+// Class DistanceKernels
+// =====================================
+// Metric kernels over contiguous float spans. On x86 with GCC/Clang the
+// widest variant the CPU supports (AVX-512F, AVX2+FMA, SSE2) is picked once
+// through cpuid; everything else falls back to the scalar loops.
+class DistanceKernels {
+public:
+    enum class Isa { Scalar, SSE2, AVX2, AVX512 };
+    enum class Metric { Cosine, Euclidean, Manhattan };
+
+    // "cosine" | "euclidean" | "manhattan", otherwise throws invalid_metric.
+    static Metric parseMetric(const string& metric);
+    static void normalize(float* v, int n); // to unit L2 norm, zero stays zero
+    // Lower-is-better distance used by the ANN indexes. Cosine expects unit
+    // vectors and returns 1 - dot.
+    static double distance(Metric metric, const float* a, const float* b, int n);
+
+    static float dot(const float* a, const float* b, int n);
+    static float l1(const float* a, const float* b, int n);
+    static float l2Squared(const float* a, const float* b, int n);
+    // dot(a, b), |a|^2 and |b|^2 in a single pass.
+    static void cosineParts(const float* a, const float* b, int n,
+                            float& dot, float& normA, float& normB);
+    // out[j] = dot(x, q[j]) for four queries, loading x once (batch search).
+    static void dot4(const float* x, const float* const* q, int n, float* out);
+
+    // Quantized rows (ScalarQuantizer): int8 codes multiply with int32
+    // accumulation, fp16 rows are widened to float lane by lane.
+    static int dotInt8(const signed char* a, const signed char* b, int n);
+    static float l1Int8(const float* q, const float* scale, const signed char* c, int n); // sum |q - scale * c|
+    static float dotHalf(const float* q, const unsigned short* x, int n);
+    static float l1Half(const float* q, const unsigned short* x, int n);
+    static float l2SquaredHalf(const float* q, const unsigned short* x, int n);
+    static unsigned short toHalf(float v); // IEEE binary16, round to nearest even
+    static float fromHalf(unsigned short h);
+
+    static Isa activeIsa();
+    static Isa detectIsa();
+    static bool select(Isa isa); // false if the CPU cannot run `isa`
+    static const char* isaName(Isa isa);
+
+    struct Table {
+        Isa isa;
+        float (*dot)(const float*, const float*, int);
+        float (*l1)(const float*, const float*, int);
+        float (*l2Squared)(const float*, const float*, int);
+        void (*cosineParts)(const float*, const float*, int, float&, float&, float&);
+        void (*dot4)(const float*, const float* const*, int, float*);
+        int (*dotInt8)(const signed char*, const signed char*, int);
+        float (*l1Int8)(const float*, const float*, const signed char*, int);
+        float (*dotHalf)(const float*, const unsigned short*, int);
+        float (*l1Half)(const float*, const unsigned short*, int);
+        float (*l2SquaredHalf)(const float*, const unsigned short*, int);
+    };
+
+private:
+    static const Table* tableFor(Isa isa);
+    static std::atomic<const Table*>& active();
+};
+
+// =====================================
+// Class WorkerPool
+// =====================================
+// Persistent threads that split index ranges [0, tasks) between them. The
+// calling thread works on its own job too, so several callers can share one
+// pool concurrently and nested calls cannot deadlock.
+class WorkerPool {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    struct Job {
+        void (*fn)(void*, int);
+        void* ctx;
+        int tasks;
+        std::atomic<int> next;
+        std::atomic<int> pending;
+        Job* nextJob;
+    };
+
+    std::thread* workers;
+    int workerCount;
+    bool stopping;
+    Job* head;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    void workerLoop();
+    void unlink(Job* job);
+
+    template <class F>
+    static void invoke(void* ctx, int task) { (*static_cast<F*>(ctx))(task); }
+
+public:
+    WorkerPool(int threads = 0); // total threads including the caller; 0 = hardware
+    ~WorkerPool();
+    WorkerPool(const WorkerPool& other) = delete;
+    WorkerPool& operator=(const WorkerPool& other) = delete;
+
+    int size() const;
+    void run(int tasks, void (*fn)(void*, int), void* ctx);
+
+    template <class F>
+    void parallelFor(int tasks, F& body) { run(tasks, &WorkerPool::invoke<F>, &body); }
+};
+
+// =====================================
+// Class VectorSlab
+// =====================================
+// Row-major float matrix backing the contiguous storage mode of VectorStore.
+// Every row starts on a 64-byte boundary (stride is padded to 16 floats) and
+// row i always belongs to the i-th record of the owning store.
+class VectorSlab {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    float* data;
+    int dimension;
+    int stride;
+    int rows;
+    int capacity; // in rows
+    bool borrowed; // data belongs to attach()'s caller
+    bool written;  // rows were handed out writable or moved since the last attach/reset
+
+    void ensureCapacity(int cap);
+    void reallocate(int newCapacity);
+
+public:
+    static const int ALIGNMENT = 64;
+
+    VectorSlab(int dimension = 0);
+    ~VectorSlab();
+    VectorSlab(const VectorSlab& other) = delete;
+    VectorSlab& operator=(const VectorSlab& other) = delete;
+
+    void reset(int dimension);
+    void clear();
+    int  size() const;
+    int  getDimension() const;
+    int  getStride() const;
+
+    float* row(int index);
+    const float* row(int index) const;
+    void reserve(int rows);      // capacity for `rows` rows, grown once
+    float* appendRow();          // zero-filled row at the end
+    void removeRow(int index);   // shifts later rows up by one
+    void swapRemoveRow(int index); // moves the last row into `index`
+
+    // Uses `count` rows of an external, ALIGNMENT-aligned buffer laid out with
+    // this slab's stride (e.g. a mapped file) without copying. Rows are read
+    // and written in place; the first growth copies them into owned memory.
+    void attach(float* external, int count);
+    bool isAttached() const;
+    bool isWritten() const;
+};
+
+// =====================================
+// Class MappedFile
+// =====================================
+// Whole-file view for VectorStore::load. Uses a private mmap where available
+// (pages load on first touch, writes stay private to the process), otherwise
+// reads the file into an aligned buffer.
+class MappedFile {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    char* base;
+    long long length;
+    bool mapped;
+
+public:
+    explicit MappedFile(const string& path);
+    ~MappedFile();
+    MappedFile(const MappedFile& other) = delete;
+    MappedFile& operator=(const MappedFile& other) = delete;
+
+    char* data() const;
+    long long size() const;
+    bool isMapped() const;
+    void release(const char* from, long long bytes); // drop resident pages (madvise)
+};
+
+// =====================================
+// Class WriteAheadLog
+// =====================================
+// Append-only log of store mutations with their vectors. Every entry is
+// framed as [payload length][crc32c][payload]. Entries are buffered and
+// written + fsynced together (group commit) once groupBytes are pending, or
+// groupDelayMs after the first pending entry by a background flusher.
+class WriteAheadLog {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    enum class Op { Add = 1, Remove = 2, Update = 3, Clear = 4, Tag = 5 }; // Tag: text is a MetadataTable block
+
+    struct Entry {
+        Op op;
+        int id;
+        const char* text;
+        int textLength;
+        const float* vector; // dimension floats for Add / Update, else nullptr
+    };
+
+private:
+    string path;
+    int dimension;
+    int fd;             // POSIX descriptor, or -1 when `stream` is used
+    void* stream;       // std::FILE* fallback
+    long long groupBytes;
+    std::chrono::milliseconds groupDelay;
+    char* buffer;       // entries appended since the last flush
+    long long pending;
+    long long bufferCapacity;
+    char* spare;        // swapped in while `buffer` is written out
+    long long spareCapacity;
+    long long written;
+    std::chrono::steady_clock::time_point firstPending;
+    bool stopping;
+    bool failed;
+    std::mutex mutex;   // buffer / pending / stopping
+    std::mutex ioMutex; // one flush at a time, in order
+    std::condition_variable wake;
+    std::thread flusher;
+
+    void flusherLoop();
+    void writeOut(const char* data, long long bytes);
+
+public:
+    WriteAheadLog(const string& path, int dimension, long long groupBytes = 1 << 20, int groupDelayMs = 10);
+    ~WriteAheadLog(); // flushes what is pending
+    WriteAheadLog(const WriteAheadLog& other) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog& other) = delete;
+
+    void append(Op op, int id, const string& text, const float* vector);
+    void sync(); // write and fsync everything appended so far
+    long long size(); // bytes written plus pending
+    const string& getPath() const;
+
+    // Calls apply(const Entry&) for each intact entry of the log at `path`
+    // and stops at the first torn or corrupt one. Returns the entry count.
+    template <class F>
+    static int replay(const string& path, int dimension, F& apply);
+};
+
+// =====================================
+// Class IdIndex
+// =====================================
+// Open-addressing map from record id to slot: linear probing over a
+// power-of-two table kept at most half full, with backward-shift deletion
+// so erased keys leave no tombstones behind.
+class IdIndex {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    int* keys;   // -1 = empty
+    int* values;
+    int bits;
+    int capacity;
+    int count;
+
+    int home(int key) const;
+    void rehash(int newBits);
+
+public:
+    IdIndex(int expected = 16);
+    ~IdIndex();
+    IdIndex(const IdIndex& other) = delete;
+    IdIndex& operator=(const IdIndex& other) = delete;
+
+    void put(int key, int value); // inserts or overwrites; key >= 0
+    int get(int key) const;       // -1 if absent
+    bool erase(int key);
+    void reserve(int expected);
+    void clear();
+    int size() const;
+};
+
+// =====================================
+// Class RowBitmap
+// =====================================
+// Dense bitset, one bit per record id. Bits past size() read as clear.
+class RowBitmap {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    unsigned long long* words;
+    int bitCount;
+    int wordCapacity;
+
+    void ensureWords(int needed);
+
+public:
+    RowBitmap(int bits = 0);
+    RowBitmap(const RowBitmap& other);
+    RowBitmap(RowBitmap&& other) noexcept;
+    ~RowBitmap();
+    RowBitmap& operator=(const RowBitmap& other);
+    RowBitmap& operator=(RowBitmap&& other) noexcept;
+
+    void resize(int bits); // new bits are clear
+    void set(int bit);     // grows when bit >= size()
+    void reset(int bit);
+    bool test(int bit) const;
+    void setAll();         // every bit below size()
+    void clearAll();
+    void andWith(const RowBitmap& other);
+    void orWith(const RowBitmap& other);
+    void flip();           // within size()
+    int count() const;
+    int nextSet(int from) const; // -1 if none
+    int size() const;
+};
+
+// =====================================
+// Class Filter
+// =====================================
+// Predicate over record tags: comparisons combined with &&, || and !.
+// Terms are kept in postfix order, so a filter is a flat, copyable list.
+// A default-constructed filter matches every record.
+class Filter {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    enum class Op { All, Has, IntEquals, StringEquals, IntRange, FloatRange, And, Or, Not };
+
+    struct Term {
+        Op op;
+        string tag;
+        string text;
+        long long intLow;
+        long long intHigh;
+        double floatLow;
+        double floatHigh;
+
+        Term(Op op = Op::All, const string& tag = string());
+    };
+
+private:
+    ArrayList<Term> terms;
+
+    Filter combine(const Filter& other, Op op) const;
+
+public:
+    Filter();
+    Filter(const Filter& other);
+    ~Filter();
+    Filter& operator=(const Filter& other);
+
+    static Filter has(const string& tag);
+    static Filter intEquals(const string& tag, long long value);
+    static Filter stringEquals(const string& tag, const string& value);
+    static Filter intRange(const string& tag, long long low, long long high);  // inclusive
+    static Filter floatRange(const string& tag, double low, double high);      // inclusive
+
+    Filter operator&&(const Filter& other) const;
+    Filter operator||(const Filter& other) const;
+    Filter operator!() const;
+
+    bool matchesAll() const;
+    int termCount() const;
+    const Term& term(int i) const;
+};
+
+// =====================================
+// Class MetadataTable
+// =====================================
+// Typed per-record tags stored column by column and addressed by record id.
+// Int and String values are dictionary coded; the first MAX_BITMAP_VALUES
+// distinct values of a column also keep a bitmap of the ids holding them, so
+// an equality filter is a bitmap copy. Ranges scan the column's value array.
+class MetadataTable {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    enum class Type { Int, Float, String };
+
+    static const int MAX_BITMAP_VALUES = 256;
+
+private:
+    struct Column;
+    ArrayList<Column*> columns;
+
+    Column* find(const string& tag) const;
+    Column* column(const string& tag, Type type); // created on first use
+    void ensureIds(Column& c, int ids);
+    int lookup(const Column& c, unsigned long long hash, long long intValue, const string* text) const;
+    int intern(Column& c, long long intValue, const string* text);
+    void unlink(Column& c, int id);
+    void link(Column& c, int id, int code);
+    void evaluateTerm(const Filter::Term& t, int idLimit, RowBitmap& out) const;
+
+public:
+    MetadataTable();
+    ~MetadataTable();
+    MetadataTable(const MetadataTable& other) = delete;
+    MetadataTable& operator=(const MetadataTable& other) = delete;
+
+    // A tag's type is fixed by its first value; std::invalid_argument after.
+    void setInt(int id, const string& tag, long long value);
+    void setFloat(int id, const string& tag, double value);
+    void setString(int id, const string& tag, const string& value);
+    bool erase(int id, const string& tag);
+    void eraseId(int id); // every tag of a removed record
+    bool getInt(int id, const string& tag, long long& out) const;
+    bool getFloat(int id, const string& tag, double& out) const;
+    bool getString(int id, const string& tag, string& out) const;
+    bool hasTag(const string& tag) const;
+    void clear();
+    void swap(MetadataTable& other);
+
+    // Tags as bytes: one block per column holding its type, name and
+    // (id, value) pairs. save() stores encode(); the WAL logs one-value
+    // blocks from the encode* helpers. decode() applies blocks and returns
+    // false on malformed bytes or ids outside [0, idLimit); blocks before the
+    // bad one stay applied, so decode into a scratch table to validate.
+    void encode(string& out) const;
+    bool decode(const char* data, long long bytes, int idLimit);
+    static void encodeInt(string& out, int id, const string& tag, long long value);
+    static void encodeFloat(string& out, int id, const string& tag, double value);
+    static void encodeString(string& out, int id, const string& tag, const string& value);
+    static void encodeErase(string& out, int id, const string& tag);
+
+    // Ids below idLimit that satisfy `filter`.
+    void evaluate(const Filter& filter, int idLimit, RowBitmap& out) const;
+};
+
+// =====================================
+// Class TopKSelector
+// =====================================
+// Fixed-size max-heap keeping the k smallest keys seen so far (O(log k) per
+// offer). Equal keys are ordered by item, so the selection is deterministic.
+class TopKSelector {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    double* keys;
+    int* items;
+    int k;
+    int count;
+
+    bool worse(int a, int b) const;
+    void siftUp(int pos);
+    void siftDown(int pos);
+
+public:
+    TopKSelector(int k = 0);
+    ~TopKSelector();
+    TopKSelector(const TopKSelector& other) = delete;
+    TopKSelector& operator=(const TopKSelector& other) = delete;
+
+    void reset(int k);
+    bool offer(double key, int item);
+    bool full() const;
+    int  size() const;
+    double worstKey() const;
+    // Empties the heap into keysOut/itemsOut, best (smallest key) first.
+    int drainSorted(double* keysOut, int* itemsOut);
+};
+
+// =====================================
+// Class TopKResult
+// =====================================
+// Owning result of a top-k query, best match first. Reuse one instance
+// across queries to avoid reallocating the buffers.
+class TopKResult {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    int* indices;
+    int* ids;
+    double* scores;
+    int count;
+    int capacity;
+
+public:
+    TopKResult(int capacity = 0);
+    TopKResult(const TopKResult& other);
+    TopKResult(TopKResult&& other) noexcept;
+    ~TopKResult();
+    TopKResult& operator=(const TopKResult& other);
+    TopKResult& operator=(TopKResult&& other) noexcept;
+
+    void reserve(int capacity);
+    void resize(int count); // keeps capacity, grows if needed
+    void clear();
+    int  size() const;
+    bool empty() const;
+
+    int getIndex(int i) const;
+    int getId(int i) const;
+    double getScore(int i) const;
+
+    int* indexData();
+    int* idData();
+    double* scoreData();
+    const int* indexData() const;
+    const int* idData() const;
+    const double* scoreData() const;
+};
+
+// =====================================
+// Class HnswIndex
+// =====================================
+// Hierarchical Navigable Small World graph over labelled vectors (labels are
+// record ids). Removed labels are tombstoned: their nodes keep routing
+// searches but never appear in results, and later inserts relink them in
+// place instead of growing the graph. Concurrent searches are safe; inserts
+// must not overlap with anything else.
+class HnswIndex {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    using Distance = DistanceKernels::Metric;
+
+    static const int MAX_LEVEL = 16;
+
+    // Visited marks for one search (hnswlib's VisitedList): a node is
+    // visited when its tag equals the epoch, so a new layer search bumps the
+    // epoch instead of clearing nodeCount bytes.
+    struct VisitedList {
+        unsigned short* tags;
+        unsigned short epoch;
+        int capacity;
+    };
+
+    int dimension;
+    Distance distanceKind;
+    int M;
+    int maxM0;
+    int efConstruction;
+    int efSearch;
+    double levelMult;
+
+    float* vectors;        // nodeCapacity x dimension, cosine rows are normalised
+    int* levels;
+    int* labels;
+    unsigned char* deleted;
+    int* level0Links;      // nodeCapacity x (maxM0 + 1), slot 0 holds the count
+    int** upperLinks;      // per node: levels[node] x (M + 1)
+    int nodeCount;
+    int nodeCapacity;
+    int liveCount;
+    int entryPoint;
+    int maxLevel;
+
+    int* labelToNode;
+    int labelCapacity;
+    unsigned long long rngState;
+
+    int* freeNodes;        // tombstones waiting to be relinked
+    int freeCount;
+    int freeCapacity;
+
+    mutable std::mutex visitedLock;
+    mutable VisitedList** visitedPool; // idle lists, one per concurrent search at most
+    mutable int visitedPooled;
+    mutable int visitedPoolCapacity;
+
+    double distance(const float* a, const float* b) const;
+    const float* nodeVector(int node) const;
+    int* linksAt(int node, int level) const;
+    int randomLevel();
+    void ensureNodeCapacity(int cap);
+    void ensureLabelCapacity(int cap);
+    void prepareQuery(const float* query, float* out) const;
+    void greedyDescend(const float* q, int& ep, double& epDist, int level, int skip = -1) const;
+    int searchLayer(const float* q, int entry, int ef, int level, bool liveOnly, const RowBitmap* allowed,
+                    VisitedList& visited, double* keysOut, int* nodesOut) const;
+    int selectNeighbors(double* keys, int* nodes, int n, int m) const;
+    void sortCandidates(const float* base, double* keys, int* nodes, int n) const;
+    void addLink(int from, int to, int level);
+    void linkNode(int node, int level);
+    void relinkNode(int node, const float* vector);
+    VisitedList* acquireVisited() const;
+    void releaseVisited(VisitedList* list) const;
+    static void nextEpoch(VisitedList& list);
+
+public:
+    HnswIndex(int dimension, DistanceKernels::Metric distanceKind = DistanceKernels::Metric::Cosine, int M = 16,
+              int efConstruction = 200, unsigned long long seed = 100);
+    ~HnswIndex();
+    HnswIndex(const HnswIndex& other) = delete;
+    HnswIndex& operator=(const HnswIndex& other) = delete;
+
+    void insert(const float* vector, int label); // replaces a live label
+    bool markDeleted(int label);
+    bool contains(int label) const;
+    void clear();
+
+    // Up to k labels, nearest first; keysOut are distances (cosine: 1 - sim).
+    // With `allowed`, only labels whose bit is set are returned.
+    int search(const float* query, int k, double* keysOut, int* labelsOut,
+               const RowBitmap* allowed = nullptr) const;
+
+    void setEfSearch(int efSearch);
+    int getEfSearch() const;
+    int getM() const;
+    int getEfConstruction() const;
+    DistanceKernels::Metric getDistance() const;
+    int size() const;      // live labels
+    int nodeSize() const;  // including tombstones
+};
+
+// =====================================
+// Class IvfIndex
+// =====================================
+// Inverted-file index: k-means centroids as a coarse quantizer, one posting
+// list per centroid holding labels and their vectors back to back. A search
+// only scans the nprobe lists whose centroids are nearest to the query.
+class IvfIndex {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    using Distance = DistanceKernels::Metric;
+
+    struct PostingList {
+        float* vectors;
+        int* labels;
+        int count;
+        int capacity;
+    };
+
+    int dimension;
+    Distance distanceKind;
+    int nlist;
+    int nprobe;
+    bool trained;
+    float* centroids;      // nlist x dimension
+    PostingList* lists;
+    int* labelList;        // label -> list, -1 if absent
+    int* labelPos;         // label -> slot inside its list
+    int labelCapacity;
+    int liveCount;
+
+    double distance(const float* a, const float* b) const;
+    int nearestCentroid(const float* v) const;
+    void prepare(const float* v, float* out) const;
+    void append(int list, const float* prepared, int label);
+    void ensureLabelCapacity(int cap);
+
+public:
+    IvfIndex(int dimension, DistanceKernels::Metric distanceKind = DistanceKernels::Metric::Cosine,
+             int nlist = 1024);
+    ~IvfIndex();
+    IvfIndex(const IvfIndex& other) = delete;
+    IvfIndex& operator=(const IvfIndex& other) = delete;
+
+    // Lloyd's k-means over n rows spaced `stride` floats apart. Retraining
+    // drops every posting list; re-add the vectors afterwards.
+    void train(const float* data, int n, int stride, int iterations = 10,
+               WorkerPool* pool = nullptr, unsigned long long seed = 1234);
+    void add(const float* vector, int label); // replaces a present label
+    void add(const float* data, int n, int stride, const int* labels, WorkerPool* pool = nullptr);
+    bool remove(int label);
+    bool contains(int label) const;
+    void reset(); // empties the lists, keeps the centroids
+
+    // Up to k labels, nearest first; keysOut are distances (cosine: 1 - sim).
+    // With `allowed`, only labels whose bit is set are returned.
+    int search(const float* query, int k, double* keysOut, int* labelsOut,
+               const RowBitmap* allowed = nullptr) const;
+
+    void setNprobe(int nprobe);
+    int getNprobe() const;
+    int getListCount() const;
+    int listSize(int list) const;
+    bool isTrained() const;
+    DistanceKernels::Metric getDistance() const;
+    int size() const;
+};
+
+// =====================================
+// Class ProductQuantizer
+// =====================================
+// Splits a vector into `subspaces` slices and encodes each slice as the id of
+// its nearest centroid in a 256-entry codebook (one byte per slice). Queries
+// are scored by asymmetric distance computation: one lookup table of
+// query-slice to centroid distances, then a table sum per code.
+class ProductQuantizer {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    using Distance = DistanceKernels::Metric;
+
+    int dimension;
+    int subspaces;
+    int subDim;            // ceil(dimension / subspaces), the tail is zero padded
+    int centroidsPerSub;   // <= CODEBOOK_SIZE, smaller if trained on few rows
+    Distance distanceKind;
+    float* codebooks;      // subspaces x CODEBOOK_SIZE x subDim
+    bool trained;
+
+    void pad(const float* v, float* out) const;
+
+public:
+    static const int CODEBOOK_SIZE = 256;
+
+    ProductQuantizer(int dimension, int subspaces = 8,
+                     DistanceKernels::Metric distanceKind = DistanceKernels::Metric::Cosine);
+    ~ProductQuantizer();
+    ProductQuantizer(const ProductQuantizer& other) = delete;
+    ProductQuantizer& operator=(const ProductQuantizer& other) = delete;
+
+    void train(const float* data, int n, int stride, int iterations = 10,
+               WorkerPool* pool = nullptr, unsigned long long seed = 4321);
+    void encode(const float* vector, unsigned char* code) const;
+    void decode(const unsigned char* code, float* out) const;
+    // table[s * CODEBOOK_SIZE + c] = partial distance of query slice s to centroid c
+    void computeTable(const float* query, float* table) const;
+    double adcDistance(const float* table, const unsigned char* code) const;
+
+    int codeSize() const;
+    int tableSize() const;
+    bool isTrained() const;
+    DistanceKernels::Metric getDistance() const;
+};
+
+// =====================================
+// Class PqIndex
+// =====================================
+// PQ codes of labelled vectors packed back to back (codeSize bytes each),
+// scanned linearly with the ADC table of the query.
+class PqIndex {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    ProductQuantizer codec;
+    unsigned char* codes;
+    int* labels;
+    int count;
+    int capacity;
+    int* labelPos;   // label -> slot, -1 if absent
+    int labelCapacity;
+
+    void ensureCapacity(int cap);
+    void ensureLabelCapacity(int cap);
+    void appendCode(const unsigned char* code, int label);
+
+public:
+    PqIndex(int dimension, int subspaces = 8,
+            DistanceKernels::Metric distanceKind = DistanceKernels::Metric::Cosine);
+    ~PqIndex();
+    PqIndex(const PqIndex& other) = delete;
+    PqIndex& operator=(const PqIndex& other) = delete;
+
+    void train(const float* data, int n, int stride, int iterations = 10, WorkerPool* pool = nullptr);
+    void add(const float* vector, int label); // replaces a present label
+    void add(const float* data, int n, int stride, const int* labels, WorkerPool* pool = nullptr);
+    bool remove(int label);
+    bool contains(int label) const;
+    void reset();
+
+    // Up to k labels, nearest first by ADC distance (cosine: 1 - sim).
+    int search(const float* query, int k, double* keysOut, int* labelsOut,
+               const RowBitmap* allowed = nullptr) const;
+
+    const ProductQuantizer& getCodec() const;
+    int size() const;
+    long long codeBytes() const;
+};
+
+// =====================================
+// Class ScalarQuantizer
+// =====================================
+// Reduced-precision copy of the store's vectors, row i = record i. Float16
+// keeps every value as binary16; Int8 calibrates a per-dimension range so
+// x[d] ~= center[d] + scale[d] * code[d] with code in [-127, 127].
+class ScalarQuantizer {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    enum class Precision { Float16, Int8 };
+
+    // Query-side state, prepared once per search and shared by every row.
+    struct Query {
+        float* values;      // the query (Float16) or query - center (Int8, for L1)
+        signed char* codes; // Int8: query * scale quantized with step alpha
+        float alpha;
+        double centerDot;   // Int8: query . center
+        double normSq;      // |query|^2
+        int dimension;
+
+        Query();
+        ~Query();
+        Query(const Query& other) = delete;
+        Query& operator=(const Query& other) = delete;
+    };
+
+private:
+    Precision precision;
+    int dimension;
+    int rowBytes;
+    float* center;
+    float* scale;
+    bool calibrated;
+    unsigned char* rows;
+    float* norms;       // |decoded row|^2
+    int count;
+    int capacity;
+
+    void ensureCapacity(int cap);
+    void encode(const float* v, unsigned char* out, float& normSq) const;
+
+public:
+    ScalarQuantizer(int dimension, Precision precision);
+    ~ScalarQuantizer();
+    ScalarQuantizer(const ScalarQuantizer& other) = delete;
+    ScalarQuantizer& operator=(const ScalarQuantizer& other) = delete;
+
+    // Int8 only: per-dimension [min, max] of the rows. Dimensions without
+    // spread use the widest amplitude seen. Rows already stored keep their
+    // old codes. An uncalibrated quantizer calibrates on its first row.
+    void calibrate(const float* data, int n, int stride);
+    bool isCalibrated() const;
+
+    void appendRow(const float* v);
+    void setRow(int index, const float* v);
+    void removeRow(int index);   // shifts later rows up by one
+    void swapRemoveRow(int index); // moves the last row into `index`
+    void clear();
+    int size() const;
+    void decodeRow(int index, float* out) const;
+
+    void prepare(const float* query, Query& out) const;
+    // Same convention as VectorStore::score: cosine similarity, L2 or L1.
+    double score(DistanceKernels::Metric metric, const Query& query, int index) const;
+
+    Precision getPrecision() const;
+    long long codeBytes() const;
+};
+
+// =====================================
+// Class TextArena
+// =====================================
+// Append-only storage for raw texts, referenced by (offset, length). Texts
+// are packed back to back into 64 KiB blocks; one longer than half a block
+// gets a block of its own. With interning a text that is already present is
+// not stored again. With compression every block that fills up is packed
+// with an LZ4-style codec in independent 16 KiB frames, and only the frames
+// holding a text are decoded when it is read.
+// Dropped texts are only counted (garbageBytes); the space comes back when
+// the owner rebuilds the arena from its live texts.
+class TextArena {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    static const int BLOCK_BYTES = 64 * 1024;
+    static const int FRAME_BYTES = 16 * 1024;
+
+    // Decoded copy of the last packed frames read through it. Views returned
+    // with a Reader stay valid until the next read with the same Reader or
+    // the next change to the arena.
+    struct Reader {
+        string buffer;
+        unsigned long long version = 0;
+        int block = -1;
+        int firstFrame = 0;
+        int lastFrame = -1;
+    };
+
+private:
+    struct Block {
+        char* data;      // raw bytes; nullptr while packed
+        char* packed;    // LZ frames back to back; nullptr unless packed
+        int* frameEnds;  // end of each frame in `packed`
+        int used;
+        int capacity;    // bytes allocated for data
+        int packedBytes;
+    };
+
+    ArrayList<Block*> blocks;
+    int tail;            // open block, -1 if none
+    bool interning;
+    bool compression;
+    long long stored;    // text bytes appended (interned repeats excluded)
+    long long garbage;   // text bytes released since the last rebuild
+    unsigned long long version; // changes whenever block indices are reused
+
+    unsigned long long* internHashes;
+    long long* internOffsets; // -1 = empty slot
+    int* internLengths;
+    int* internRefs;          // 0 = garbage until an equal text revives it
+    int internBits;
+    int internUsed;
+
+    static unsigned long long nextVersion();
+    Block* newBlock(int capacity);
+    void freeBlocks();
+    void pack(Block* block);
+    void unpack(Block* block);
+    void decodeFrames(const Block* block, int first, int last, char* out) const;
+    int findInterned(unsigned long long hash, std::string_view text, Reader& reader) const; // slot or -1
+    void intern(unsigned long long hash, long long offset, int length, int refs);
+    void rehashIntern(int bits); // 0 drops the table
+
+public:
+    TextArena();
+    ~TextArena();
+    TextArena(const TextArena& other) = delete;
+    TextArena& operator=(const TextArena& other) = delete;
+
+    void setInterning(bool enabled); // applies to texts appended from now on
+    bool getInterning() const;
+    void setCompression(bool enabled); // packs / unpacks the full blocks
+    bool getCompression() const;
+
+    long long append(std::string_view text); // returns the offset
+    std::string_view view(long long offset, int length, Reader& reader) const;
+    void release(long long offset, int length); // drops one reference to the text
+    void clear();
+    void swap(TextArena& other);
+
+    long long storedBytes() const;
+    long long garbageBytes() const;
+    long long memoryBytes() const; // blocks (packed size when packed) plus the intern table
+
+    // LZ4 block format: token (literal / match length nibbles), extra
+    // length bytes, literals, 2-byte offset. compress needs
+    // compressBound(n) bytes at dst; decompress stops after `limit` bytes
+    // and throws std::runtime_error on malformed input.
+    static int compressBound(int n);
+    static int compress(const char* src, int n, char* dst);
+    static int decompress(const char* src, int srcBytes, char* dst, int limit);
+};
+
+// =====================================
+// Class EmbeddingCache
+// =====================================
+// Bounded map from raw text to the vector the embedding function returned
+// for it, so duplicate texts are embedded once. Entries are spread over
+// shards by text hash; each shard has its own lock, hash table and CLOCK
+// ring, and evicts once it passes its share of the byte budget. The text is
+// kept with the vector, so a hash collision is a miss, never a wrong vector.
+class EmbeddingCache {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    struct Stats {
+        long long hits;
+        long long misses;
+        long long evictions;
+        long long entries;
+        long long bytes;
+    };
+
+private:
+    struct Entry {
+        unsigned long long hash;
+        string text;
+        float* values;
+        int length;      // floats returned by the embedding function
+        bool referenced; // CLOCK bit, set on every hit
+    };
+
+    struct Shard {
+        std::mutex lock;
+        Entry** table;   // open addressing on hash, nullptr = empty
+        int bits;
+        int used;
+        ArrayList<Entry*> ring; // CLOCK order
+        int hand;
+        long long bytes;
+    };
+
+    Shard* shards;
+    int shardCount;
+    long long budget;
+    long long shardBudget;
+    std::atomic<unsigned long long> generation;
+    std::atomic<long long> hits;
+    std::atomic<long long> misses;
+    std::atomic<long long> evictions;
+
+    static long long entryBytes(const Entry* entry);
+    Shard& shardOf(unsigned long long hash) const;
+    int find(const Shard& shard, unsigned long long hash) const; // table slot or -1
+    void place(Shard& shard, Entry* entry);
+    void remove(Shard& shard, int ringIndex);
+    void evictOne(Shard& shard);
+    void resetShard(Shard& shard);
+
+public:
+    EmbeddingCache(long long byteBudget, int shardCount = 16);
+    ~EmbeddingCache();
+    EmbeddingCache(const EmbeddingCache& other) = delete;
+    EmbeddingCache& operator=(const EmbeddingCache& other) = delete;
+
+    // Bumped by clear(). Read it before embedding and hand it to insert(),
+    // so a vector computed by a model that was swapped out meanwhile is
+    // dropped instead of cached.
+    unsigned long long currentGeneration() const;
+
+    // Hit: copies the vector into out[0..dimension), truncating or zero
+    // padding like VectorStore::copyVector.
+    bool lookup(const string& text, float* out, int dimension);
+    // Hit: a new list with the cached floats; nullptr on a miss.
+    SinglyLinkedList<float>* lookupList(const string& text);
+    // Keeps a copy of `vector`. Dropped if clear() ran since `generation`
+    // was read or the entry alone exceeds a shard's budget.
+    void insert(const string& text, const SinglyLinkedList<float>& vector, unsigned long long generation);
+    void clear(); // hit / miss / eviction counters are kept
+    Stats stats() const;
+    long long byteBudget() const;
+};
+
 // =====================================
 // Class VectorStore
 // =====================================
@@ -132,43 +1357,317 @@ class VectorStore {
     #ifdef TESTING
         friend class TestHelper;
     #endif
+    friend class ShardedVectorStore;
 public:
     struct VectorRecord {
         int id;
-        string rawText;
         int rawLength;
+        long long textOffset;   // the text is rawLength bytes at this TextArena offset
         SinglyLinkedList<float>* vector;
+        const char* mappedText; // rawLength bytes in the loaded file; textOffset unused while set
 
-        VectorRecord(int id, const string& rawText, SinglyLinkedList<float>* vector);
+        VectorRecord(int id, long long textOffset, int rawLength, SinglyLinkedList<float>* vector);
     };
 
     using EmbedFn = SinglyLinkedList<float>* (*)(const string&);
 
+    // LinkedList keeps one SinglyLinkedList<float> per record (original layout).
+    // Contiguous keeps every vector in a single VectorSlab; record->vector is
+    // then nullptr.
+    enum class StorageMode { LinkedList, Contiguous };
+
+    // Precision of the rows read by the exact scan. Float32 scans the stored
+    // vectors; Float16 / Int8 scan a quantized copy (2x / 4x fewer bytes).
+    enum class StoragePrecision { Float32, Float16, Int8 };
+
+    // How the float scan gets the norms cosine needs. Raw recomputes both
+    // norms per row. CachedNorms keeps |row| per record and takes the query
+    // norm once per search, so a row costs one dot product. Normalized
+    // scales rows to unit length when they are stored (getVector returns
+    // the unit vector); cosine is then a dot product too, and since unit
+    // rows rank the same under cosine and euclidean, an ANN index built for
+    // either metric also answers the other.
+    enum class NormMode { Raw, CachedNorms, Normalized };
+
+    // One block of a scan(): rows [first(), first() + size()) of the store.
+    // In Contiguous mode data() points into the slab itself; in LinkedList
+    // mode it is a packed copy of the block's lists. Either way the rows,
+    // ids and texts are only valid while the visitor runs.
+    class ScanBlock {
+        friend class VectorStore;
+    private:
+        const VectorStore* store;
+        const float* rows;
+        const int* idList;
+        TextArena::Reader* reader;
+        int firstIndex;
+        int count;
+        int stride;
+    public:
+        int first() const { return firstIndex; }
+        int size() const { return count; }
+        int getStride() const { return stride; } // floats between consecutive rows
+        const float* data() const { return rows; }
+        const float* row(int r) const { return rows + static_cast<long long>(r) * stride; }
+        const int* ids() const { return idList; }
+        int id(int r) const { return idList[r]; }
+        // No copy for unpacked texts; packed ones are decoded into a buffer
+        // of the block, so the view only lasts until the next text() call.
+        std::string_view text(int r) const;
+    };
+
+    // Shift keeps records in insertion (= id) order and removeAt is O(N).
+    // SwapWithLast moves the last record into the hole (O(1)); ids are then
+    // resolved through an id -> index hash map.
+    enum class RemovalMode { Shift, SwapWithLast };
+
 private:
+    using Metric = DistanceKernels::Metric;
+
     ArrayList<VectorRecord*> records;
+    TextArena texts;
+    SlabArena recordArena;
+    NodeAllocator* recordAllocator; // &recordArena unless one was plugged in
     int dimension;
     int count;
     EmbedFn embeddingFunction;
+    EmbeddingCache* embeddingCache; // nullptr unless setEmbeddingCache was called
+    StorageMode storageMode;
+    VectorSlab slab;
+    WorkerPool* pool;
+    mutable WorkerPool* bulkPool; // addTexts / scan workers when no search pool is set
+    mutable std::mutex bulkPoolLock;
+    HnswIndex* hnsw;
+    IvfIndex* ivf;
+    PqIndex* pq;
+    int pqRerank;
+    ScalarQuantizer* quantized;
+    NormMode normMode;
+    ArrayList<float> norms; // |row| per record, CachedNorms only
+    MappedFile* mapped;
+    IdIndex* idIndex;     // id -> index; always present in SwapWithLast mode
+    RemovalMode removalMode;
+    MetadataTable metadata;
+    WriteAheadLog* wal;
+    string walBase;          // <base>.snapshot and <base>.wal.<generation>
+    int walGeneration;
+    long long walGroupBytes;
+    int walGroupDelayMs;
+    long long walCompactBytes;
+    std::thread compactor;
+    std::atomic<bool> compactFailed;
+
+    void embedInto(const string& rawText, float* out);
+    const float* rowData(int index, float* scratch) const;
+    void copyVector(const SinglyLinkedList<float>& v, float* out) const;
+    double score(Metric metric, const float* query, const float* row) const;
+    double cachedCosine(const float* query, double queryNorm, int index, const float* row) const;
+    void scanRows(const float* query, const ScalarQuantizer::Query* prepared, Metric metric,
+                  int begin, int end, TopKSelector& selector, const RowBitmap* eligible = nullptr) const;
+    int selectNearest(const float* query, Metric metric, int k, double* keys, int* items,
+                      const RowBitmap* eligible = nullptr) const;
+    int selectEligible(const float* query, Metric metric, int k, const RowBitmap& eligible,
+                       double* keys, int* items) const;
+    void filteredScan(const float* query, Metric metric, int k, const RowBitmap& eligible,
+                      TopKResult& out) const;
+    bool serves(Metric built, Metric wanted) const; // can an index built for `built` answer `wanted`
+    bool hasIndexFor(Metric metric) const;
+    void approximateSelect(const float* query, Metric metric, int k, const RowBitmap* allowed,
+                           TopKResult& out) const;
+    void drainResult(TopKSelector& selector, Metric metric, TopKResult& out) const;
+    void batchScan(const float* queries, int first, int last, Metric metric, int k,
+                   TopKResult* results) const;
+    int findIndexById(int id) const;
+    VectorRecord* createRecord(int id, std::string_view rawText, SinglyLinkedList<float>* vector);
+    void destroyRecord(VectorRecord* record); // also frees record->vector
+    // createRecord + records.add; if either throws nothing is left behind
+    // and `vector` still belongs to the caller.
+    void appendRecord(int id, std::string_view rawText, SinglyLinkedList<float>* vector);
+    std::string_view textOf(const VectorRecord* record, TextArena::Reader& reader) const;
+    void replaceText(VectorRecord* record, std::string_view newRawText);
+    void releaseText(VectorRecord* record);
+    void reclaimTexts(); // compactTexts() once released text is half the arena
+    void indexRecord(int index);
+    void unindexRecord(int id);
+    void updateNorm(int index);
+    template <class F>
+    void forEachRowBatch(F& visit) const;
+    bool scanBlocks(bool (*fn)(void*, const ScanBlock&), void* ctx, int blockRows, int threads) const;
+    WorkerPool* bulkWorkers(int threads) const;
+    template <class F>
+    static bool invokeScan(void* ctx, const ScanBlock& block) {
+        F& visit = *static_cast<F*>(ctx);
+        if constexpr (std::is_void<decltype(visit(block))>::value) {
+            visit(block);
+            return true;
+        } else {
+            return visit(block);
+        }
+    }
+    void samplePacked(int sampleSize, float*& sample, int& samples) const;
+    void labelsToResult(const double* keys, const int* labels, int found, Metric metric,
+                        TopKResult& out) const;
+    // Writes with a vector embedded by the caller (ownership passes to the
+    // store), so ShardedVectorStore can embed outside its shard locks.
+    int addEmbedded(string rawText, SinglyLinkedList<float>* vector); // returns the new id
+    void updateEmbedded(int index, string newRawText, SinglyLinkedList<float>* vector);
+    void logMutation(WriteAheadLog::Op op, int index, int id);
+    void logTag(int id, const string& block);
+    void replayEntry(const WriteAheadLog::Entry& entry);
+    void finishCompaction();
 
 public:
-    VectorStore(int dimension = 512, EmbedFn embeddingFunction = nullptr);
+    VectorStore(int dimension = 512, EmbedFn embeddingFunction = nullptr,
+                StorageMode storageMode = StorageMode::LinkedList);
     ~VectorStore();
     int  size() const;
     bool empty() const;
     void clear();    
 
-    SinglyLinkedList<float>* preprocessing(string rawText);
+    SinglyLinkedList<float>* preprocessing(const string& rawText);
 
     void addText(string rawText);
-    SinglyLinkedList<float>& getVector(int index);
+    // Bulk insert: capacity is reserved once, texts are embedded serially
+    // or in parallel (threads: 1 = serial, 0 = search pool or all cores,
+    // n = n threads; anything but 1 needs a thread-safe embedding function)
+    // and ids are assigned in input order. All or nothing if an embedding
+    // throws.
+    void addTexts(const ArrayList<string>& rawTexts, int threads = 1);
+    // A copy of the vector (built from the slab in Contiguous mode); nothing
+    // is kept on the record. Edits to it are not stored, since they would
+    // bypass the norms, quantized rows, ANN indexes and WAL: change a vector
+    // through updateText, updateById or forEach.
+    SinglyLinkedList<float> getVector(int index) const;
+    const float* getVectorData(int index) const; // Contiguous mode only
+    int getDimension() const;
+    StorageMode getStorageMode() const;
     string getRawText(int index) const;
+    // No copy when the text is stored unpacked; a packed block is decoded
+    // into `reader`. Valid until the next mutation or the next call with
+    // the same reader.
+    std::string_view getRawTextView(int index, TextArena::Reader& reader) const;
     int getId(int index) const;
     bool removeAt(int index);
     bool updateText(int index, string newRawText);
-    void setEmbeddingFunction(EmbedFn newEmbeddingFunction);
 
+    // Where VectorRecord objects live (nullptr = the store's own SlabArena).
+    // The allocator is borrowed and must outlive the store; the store has
+    // to be empty when it is switched.
+    void setRecordAllocator(NodeAllocator* allocator);
+
+    void setRemovalMode(RemovalMode mode);
+    RemovalMode getRemovalMode() const;
+    int indexOfId(int id) const; // -1 if no record has this id
+    // Record or nullptr, read only for the same reason as getVector; in
+    // Contiguous mode its vector is nullptr (read the row with
+    // getVectorData). The pointer is invalidated by the next mutation. The
+    // text stays in the
+    // arena: read it with getRawTextView(indexOfId(id), reader), or take a
+    // copy through the second overload.
+    const VectorRecord* getById(int id) const;
+    const VectorRecord* getById(int id, string& rawText) const; // rawText is left alone when absent
+    bool removeById(int id);     // false if absent
+    bool updateById(int id, string newRawText);
+    void setEmbeddingFunction(EmbedFn newEmbeddingFunction); // also empties the embedding cache
+
+    // Raw texts live in a TextArena. Interning keeps one copy of identical
+    // texts (switching it on also merges the texts already stored);
+    // compression LZ-packs every full 64 KiB block. compactTexts() rewrites
+    // the arena with the live texts only; it also runs by itself once the
+    // dropped texts make up half the arena.
+    void setTextInterning(bool enabled);
+    void setTextCompression(bool enabled);
+    void compactTexts();
+    long long textMemoryBytes() const;
+
+    // Optional cache of embedding-function results keyed by raw text, so
+    // addText / updateText skip the model for texts seen before. byteBudget
+    // bounds vectors plus texts (0 disables); the default encoder is never
+    // cached. Replaces any previous cache.
+    void setEmbeddingCache(long long byteBudget, int shards = 16);
+    bool hasEmbeddingCache() const;
+    EmbeddingCache::Stats embeddingCacheStats() const; // all zeros when disabled
+    void clearEmbeddingCache();
+
+    // Versioned binary snapshot: header, id table, raw-text offsets + blob and
+    // the vectors as a 64-byte aligned matrix. save() writes a temporary file
+    // and renames it over `path`. load() replaces the contents; in contiguous
+    // mode texts and vectors are served from the mapped file until modified,
+    // so start-up only touches the pages a query reads. Enabled indexes are
+    // rebuilt from the loaded records.
+    void save(const string& path) const;
+    void load(const string& path);
+
+    // Durable mode. Recovers <base>.snapshot plus every <base>.wal.<n> (in
+    // order) if any exist, otherwise snapshots the current contents; from
+    // then on addText / removeAt / updateText / clear are logged with their
+    // vectors. A mutation is on disk after the next group commit, or after
+    // syncWal(). Once the log passes compactBytes it is compacted (see
+    // compactWal).
+    void openWal(const string& base, long long groupBytes = 1 << 20, int groupDelayMs = 10,
+                 long long compactBytes = 256LL << 20);
+    void syncWal();
+    // Rotates the log and writes a fresh snapshot. The records are copied on
+    // the calling thread first, which stalls that mutation for O(store) time
+    // (about 130 ms for 200k x 256 floats); only writing and fsyncing the
+    // copy runs in the background.
+    void compactWal();
+    void closeWal();
+    bool hasWal() const;
+
+    // Threads used by findNearest/topKNearest (1 = serial, 0 = hardware).
+    // Not safe to call while queries are running.
+    void setSearchThreads(int threads);
+    int getSearchThreads() const;
+
+    // Opt-in; re-encodes the current records. Int8 calibrates its ranges on
+    // up to sampleSize records (recalibrate after the data drifts).
+    void setStoragePrecision(StoragePrecision precision, int sampleSize = 65536);
+    StoragePrecision getStoragePrecision() const;
+    void recalibrate(int sampleSize = 65536);
+    long long quantizedBytes() const;
+
+    // See NormMode. Switching to Normalized rescales the stored rows, so it
+    // needs the ANN indexes and quantized precision off (enable them after).
+    void setNormMode(NormMode mode);
+    NormMode getNormMode() const;
+
+    // Typed tags on a record, addressed by id. A tag's type is fixed by its
+    // first value. save/load and the WAL carry them.
+    void setIntTag(int id, const string& tag, long long value);
+    void setFloatTag(int id, const string& tag, double value);
+    void setStringTag(int id, const string& tag, const string& value);
+    bool removeTag(int id, const string& tag);
+    bool getIntTag(int id, const string& tag, long long& out) const;
+    bool getFloatTag(int id, const string& tag, double& out) const;
+    bool getStringTag(int id, const string& tag, string& out) const;
+    int countMatching(const Filter& filter) const;
+
+    // Process-wide Instrumentation figures (all zeros unless built with
+    // -DVECTORSTORE_STATS); dump them with toText() / toJson().
+    static Instrumentation::Snapshot stats();
+    static void resetStats();
+
+    // Edits the action makes to the vector or the text are stored back (in
+    // Contiguous mode the vector is a scratch copy written into the slab).
+    // As with updateText, a changed vector gets its norm, quantized codes and
+    // HNSW / IVF / PQ entries redone, and a changed record is logged.
     void forEach(void (*action)(SinglyLinkedList<float>&, int, string&));
 
+    // Streaming read of every record in index order, blockRows at a time.
+    // visit(const ScanBlock&) returns void, or bool where false stops the
+    // scan. The visitor is called once per block through a template thunk,
+    // so its per-row loop is compiled inline. threads: 1 = serial on the
+    // caller, 0 = search pool or all cores, n = the store's bulk pool (sized
+    // by its first user and reused); with more than one thread the
+    // blocks run concurrently, the visitor must be thread safe and blocks
+    // already started still finish after a stop. Returns false if stopped.
+    // The store must not be modified during the scan.
+    template <class F>
+    bool scan(F& visit, int blockRows = 4096, int threads = 1) const {
+        return scanBlocks(&VectorStore::invokeScan<F>, &visit, blockRows, threads);
+    }
+
     double cosineSimilarity(const SinglyLinkedList<float>& v1,
                             const SinglyLinkedList<float>& v2) const;
     double l1Distance(const SinglyLinkedList<float>& v1,
@@ -176,9 +1675,499 @@ public:
     double l2Distance(const SinglyLinkedList<float>& v1,
                       const SinglyLinkedList<float>& v2) const;
 
+    double cosineSimilarity(const float* v1, const float* v2, int n) const;
+    double l1Distance(const float* v1, const float* v2, int n) const;
+    double l2Distance(const float* v1, const float* v2, int n) const;
+
     int findNearest(const SinglyLinkedList<float>& query, const string& metric = "cosine") const;
 
     int* topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric = "cosine") const;
+
+    // Bounded-heap selection, O(N log k). `out` is reused between calls.
+    void topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                     TopKResult& out) const;
+    void topKNearest(const float* query, int k, const string& metric, TopKResult& out) const;
+    TopKResult topKNearestScored(const SinglyLinkedList<float>& query, int k,
+                                 const string& metric = "cosine") const;
+
+    // Filtered search: the filter is turned into a bitmap of eligible ids
+    // first and only those records are scored. Fewer than k results come
+    // back when fewer records match; findNearest returns -1 if none does.
+    int findNearest(const SinglyLinkedList<float>& query, const string& metric, const Filter& filter) const;
+    void topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric, const Filter& filter,
+                     TopKResult& out) const;
+    void topKNearest(const float* query, int k, const string& metric, const Filter& filter,
+                     TopKResult& out) const;
+
+    // Q queries at once. `queries` is row-major queryCount x dimension and
+    // results[q] receives the top-k of query q. Records are scored in
+    // cache-sized blocks against groups of queries (GEMM-style tiling).
+    void topKNearestBatch(const float* queries, int queryCount, int k, const string& metric,
+                          TopKResult* results) const;
+    // Same with list queries; results must hold queries.size() entries.
+    void topKNearestBatch(const ArrayList<SinglyLinkedList<float>*>& queries, int k, const string& metric,
+                          TopKResult* results) const;
+
+    // Optional HNSW index, built from the current records and kept in sync
+    // by addText / removeAt / updateText.
+    void enableHnsw(const string& metric = "cosine", int M = 16, int efConstruction = 200);
+    void disableHnsw();
+    bool hasHnsw() const;
+    void setHnswEfSearch(int efSearch);
+
+    // Optional IVF index. trainIvf runs k-means on up to sampleSize records,
+    // then assigns every record; later addText calls go to their nearest list.
+    void trainIvf(const string& metric = "cosine", int nlist = 1024, int sampleSize = 65536,
+                  int iterations = 10);
+    void retrainIvf(int sampleSize = 65536, int iterations = 10);
+    void disableIvf();
+    bool hasIvf() const;
+    void setIvfNprobe(int nprobe);
+
+    // Optional product-quantization codes (one byte per sub-space per record).
+    // With a rerank factor r > 0 the best k * r ADC candidates are re-scored
+    // against the full-precision rows before the top k is returned.
+    void trainPq(const string& metric = "cosine", int subspaces = 8, int sampleSize = 65536,
+                 int iterations = 10);
+    void disablePq();
+    bool hasPq() const;
+    void setPqRerank(int factor);
+    long long pqCodeBytes() const;
+    // PQ-only serving for a store load()ed in Contiguous mode: hands the
+    // pages of the mapped float rows back to the OS, so the codes are what
+    // stays resident and a rerank (or an exact scan) reads its rows from the
+    // file. Returns false and releases nothing unless the rows are still the
+    // file's own (none written, removed or appended since load).
+    bool releaseMappedRows();
+
+    // Uses an approximate index built for `metric` (HNSW, then IVF, then PQ),
+    // otherwise the exact scan.
+    void approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                TopKResult& out) const;
+    // Filtered variant: the index skips ineligible labels while it searches.
+    // Selective filters (few matching records) use the exact scan instead.
+    void approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                const Filter& filter, TopKResult& out) const;
+    // Mean recall@k of approximateTopKNearest against the exact topKNearest.
+    double recallAtK(const ArrayList<SinglyLinkedList<float>*>& queries, int k,
+                     const string& metric = "cosine") const;
+};
+
+// =====================================
+// Class ShardedVectorStore
+// =====================================
+// Spreads records over several independent VectorStores. Each shard sits
+// behind its own reader/writer lock, so writes to different shards run
+// concurrently and queries only take shared locks. A record's global id is
+// localId * shardCount + shard. Searches fan out over the shards on a
+// WorkerPool and merge the per-shard top-k.
+class ShardedVectorStore {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    struct Shard {
+        VectorStore* store;
+        mutable std::shared_mutex lock;
+    };
+
+    Shard* shards;
+    int shardCount;
+    int dimension;
+    std::atomic<unsigned long long> sequence; // hashed to pick the shard of a new record
+    WorkerPool* pool;
+
+    int shardOf(int id) const; // -1 if no shard can hold this id
+    void search(const SinglyLinkedList<float>& query, int k, const string& metric,
+                const Filter* filter, bool approximate, TopKResult& out) const;
+
+public:
+    // threads: search fan-out (1 = serial, 0 = hardware).
+    ShardedVectorStore(int shardCount, int dimension = 512, VectorStore::EmbedFn embeddingFunction = nullptr,
+                       VectorStore::StorageMode storageMode = VectorStore::StorageMode::LinkedList,
+                       int threads = 0);
+    ~ShardedVectorStore();
+    ShardedVectorStore(const ShardedVectorStore& other) = delete;
+    ShardedVectorStore& operator=(const ShardedVectorStore& other) = delete;
+
+    int  size() const;
+    bool empty() const;
+    void clear();
+    int getShardCount() const;
+    int getDimension() const;
+    // For per-shard setup (indexes, precision, removal mode, WAL files).
+    // Not synchronised: configure the shards before sharing the store.
+    VectorStore& getShard(int shard);
+
+    // The calls below are thread safe. Texts are embedded before the shard
+    // lock is taken, so the embedding function must be thread safe too.
+    int  addText(string rawText); // returns the global id
+    bool removeById(int id);      // false if absent
+    bool updateById(int id, string newRawText);
+    bool contains(int id) const;
+    bool getRawText(int id, string& out) const;
+
+    void setIntTag(int id, const string& tag, long long value);
+    void setFloatTag(int id, const string& tag, double value);
+    void setStringTag(int id, const string& tag, const string& value);
+    bool removeTag(int id, const string& tag);
+    bool getIntTag(int id, const string& tag, long long& out) const;
+    bool getFloatTag(int id, const string& tag, double& out) const;
+    bool getStringTag(int id, const string& tag, string& out) const;
+    int countMatching(const Filter& filter) const;
+
+    // Builds an HNSW index on every shard.
+    void enableHnsw(const string& metric = "cosine", int M = 16, int efConstruction = 200);
+
+    // Results carry global ids; getIndex(i) is -1, since a position inside
+    // a shard is stale once its lock is released. Filtered searches may
+    // return fewer than k results, findNearest returns -1 when nothing is
+    // found.
+    int  findNearest(const SinglyLinkedList<float>& query, const string& metric = "cosine") const;
+    void topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                     TopKResult& out) const;
+    void topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                     const Filter& filter, TopKResult& out) const;
+    void approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                TopKResult& out) const;
+    void approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                const Filter& filter, TopKResult& out) const;
+};
+
+// =====================================
+// Class EpochManager
+// =====================================
+// Epoch-based reclamation. A reader pins the current epoch while it holds
+// pointers into shared data; an object unlinked by a writer is retired and
+// freed only once every reader that pinned an epoch up to its retirement
+// has left. enter/leave are lock free, retire/reclaim must be serialised
+// by the caller.
+class EpochManager {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+public:
+    static const int SLOTS = 128; // concurrent readers; more spin until one leaves
+    using Deleter = void (*)(void*);
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<unsigned long long> epoch; // 0 = idle
+    };
+    struct Retired {
+        void* object;
+        Deleter deleter;
+        unsigned long long epoch;
+    };
+
+    Slot slots[SLOTS];
+    std::atomic<unsigned long long> epoch;
+    ArrayList<Retired> retired;
+
+public:
+    EpochManager();
+    ~EpochManager(); // frees everything still retired; no reader may be inside
+    EpochManager(const EpochManager& other) = delete;
+    EpochManager& operator=(const EpochManager& other) = delete;
+
+    int  enter();           // returns the slot to hand back to leave()
+    void leave(int slot);
+    void retire(void* object, Deleter deleter);
+    int  reclaim();         // frees what no reader can still see; returns how many
+    int  pending() const;   // retired but not yet freed
+
+    class Guard {
+    private:
+        EpochManager& manager;
+        int slot;
+    public:
+        explicit Guard(EpochManager& manager) : manager(manager), slot(manager.enter()) {}
+        ~Guard() { manager.leave(slot); }
+        Guard(const Guard& other) = delete;
+        Guard& operator=(const Guard& other) = delete;
+    };
+};
+
+// =====================================
+// Class ConcurrentVectorStore
+// =====================================
+// Log-structured store with lock-free readers. Rows go to one appendable
+// tail segment; a full tail is sealed and never changes again, and deletes
+// are per-segment bitmaps. Readers pin an epoch, load the published
+// Snapshot and fan out over its segments without locks. A snapshot lists
+// the segments, how many rows of each it covers and their bitmaps.
+// Writers are serialised by one mutex; they append past every published
+// row count, copy the bitmaps they change and publish a new snapshot with
+// a single atomic store. A merge policy folds runs of similar-sized sealed
+// segments (and segments with many deletes) into one, dropping deleted
+// rows and building the merged segment's HNSW index off the write lock.
+// Replaced snapshots, bitmaps and segments are reclaimed through the
+// EpochManager.
+// It is the segment-based replacement for VectorStore where writes and
+// searches overlap: it has the same norm modes, storage precisions, HNSW /
+// IVF / PQ indexes (per segment), tags and filtered search, store files and
+// write-ahead log. It has no positional API, so records are addressed by id.
+class ConcurrentVectorStore {
+    #ifdef TESTING
+        friend class TestHelper;
+    #endif
+private:
+    struct Segment {
+        float* rows;     // capacity x stride
+        int* ids;
+        string* texts;   // nullptr for a loaded segment, whose texts stay in `file`
+        const char* fileText;             // text blob and offsets of a loaded segment
+        const long long* fileTextOffsets;
+        MappedFile* file; // a loaded segment's rows and ids point into it, or nullptr
+        int stride;
+        float* norms;    // |row|, kept unless the segment was written in Raw mode
+        bool normalized; // every row was scaled to unit length
+        IdIndex* index;  // id -> row, built when the segment is sealed
+        ScalarQuantizer* quantized; // codes of the rows, built when sealed
+        HnswIndex* ann;  // set before a merged segment is published, or nullptr
+        IvfIndex* ivf;   // likewise
+        PqIndex* pq;     // likewise
+        int pqRerank;    // PQ candidates per result wanted
+        int capacity;
+
+        Segment(int capacity, int dimension, bool keepNorms, bool normalized);
+        Segment(MappedFile* file, int rows, int stride, bool keepNorms, bool normalized); // see loadFile
+        ~Segment();
+
+        std::string_view text(int row) const;
+    };
+    struct SegmentView {
+        Segment* segment;
+        int rows;                 // rows [0, rows) belong to the snapshot
+        int live;
+        const RowBitmap* deleted; // nullptr = nothing deleted
+        const IdIndex* index;     // nullptr = appendable tail, scan it for ids
+        const ScalarQuantizer* quantized; // set with `index` when sealed, or nullptr
+    };
+    struct Snapshot {
+        SegmentView* views; // oldest first; an id's newest copy is its live one
+        int segmentCount;
+        int capacity;       // room in views for segments appended by the writer
+        int live;
+        int idLimit;        // every id in the snapshot is below it
+
+        Snapshot(int capacity);
+        ~Snapshot();
+    };
+
+    // How segments are laid out and indexed when they are written, sealed
+    // or merged. Each segment records what it got, so changing a setting
+    // never invalidates a published segment.
+    struct Settings {
+        VectorStore::NormMode normMode;
+        VectorStore::StoragePrecision precision;
+        bool hnsw;
+        DistanceKernels::Metric hnswMetric;
+        int hnswM;
+        int hnswEfConstruction;
+        int hnswEfSearch;
+        int hnswMinRows;
+        bool ivf;
+        DistanceKernels::Metric ivfMetric;
+        int ivfLists;
+        int ivfNprobe;
+        int ivfMinRows;
+        bool pq;
+        DistanceKernels::Metric pqMetric;
+        int pqSubspaces;
+        int pqRerank;
+        int pqMinRows;
+    };
+
+    int dimension;
+    int segmentRows;
+    VectorStore::EmbedFn embeddingFunction;
+    std::atomic<Snapshot*> current;
+    mutable EpochManager epochs;
+    mutable std::mutex writeLock;
+    int nextId;
+
+    // Merge policy and segment settings; changed under writeLock.
+    int mergeFactor;
+    double mergeDeletedRatio;
+    Settings settings;
+
+    std::mutex mergeLock; // one merge at a time
+    std::thread merger;
+    std::mutex mergeSignalLock;
+    std::condition_variable mergeWake;
+    bool mergeStop;
+    bool mergeRequested;
+    std::atomic<bool> mergeFailed;
+
+    // Tags live beside the snapshots: written under writeLock plus tagLock,
+    // read under a shared tagLock.
+    MetadataTable metadata;
+    mutable std::shared_mutex tagLock;
+
+    // Durable mode, as on VectorStore; entries are appended under writeLock.
+    WriteAheadLog* wal;
+    string walBase;
+    int walGeneration;
+    long long walGroupBytes;
+    int walGroupDelayMs;
+    long long walCompactBytes;
+    std::thread compactor;
+    std::atomic<bool> compactFailed;
+
+    void embed(const string& rawText, float* out) const;
+    Snapshot* cloneSnapshot(const Snapshot* from, int spareSegments) const;
+    void appendRow(Snapshot* next, int id, string rawText, const float* vector);
+    void writeRow(Segment* segment, int row, const float* vector) const;
+    void deleteRow(Snapshot* next, int segment, int row);
+    void seal(SegmentView& view);
+    void sealTail(); // so rows written from now on start a segment under the current settings
+    void buildSegment(Segment* segment, int rows, const Settings& with, bool withAnn) const;
+    Segment* newSegment(int capacity) const;
+    void discard(const Snapshot* published, Snapshot* next); // undoes an unpublished write
+    void publish(Snapshot* next);
+    void requestMerge();
+    bool locate(const Snapshot* snapshot, int id, int& segment, int& row) const;
+    int tierOf(int rows) const;
+    bool pickMerge(const Snapshot* snapshot, int& first, int& count) const;
+    bool mergeOnce();
+    void mergeLoop();
+    void search(const float* query, int k, const string& metric, bool approximate, const Filter* filter,
+                TopKResult& out) const;
+
+    // The caller holds writeLock for these.
+    bool removeLocked(int id);
+    void clearLocked();
+    void loadFile(const string& path);
+    void logWrite(WriteAheadLog::Op op, int id, const string& text, const float* vector);
+    void replayEntry(const WriteAheadLog::Entry& entry);
+    void rotateWal();
+    void compactWalIfDue(); // after a logged write is published
+    void finishCompaction();
+    void writeSnapshot(const Snapshot* snapshot, const string& path, const string& tags, bool durable) const;
+
+public:
+    ConcurrentVectorStore(int dimension = 512, VectorStore::EmbedFn embeddingFunction = nullptr,
+                          int segmentRows = 4096);
+    ~ConcurrentVectorStore();
+    ConcurrentVectorStore(const ConcurrentVectorStore& other) = delete;
+    ConcurrentVectorStore& operator=(const ConcurrentVectorStore& other) = delete;
+
+    int  size() const;
+    bool empty() const;
+    int  getDimension() const;
+    int  segmentCount() const;
+    int  pendingReclaim() const; // retired objects still waiting for readers
+
+    // Writers. Texts are embedded before the write lock is taken; the
+    // embedding function must be thread safe. Each call publishes once.
+    int  addText(string rawText);                      // returns the new id
+    void addTexts(const ArrayList<string>& rawTexts);  // ids are consecutive
+    bool removeById(int id);
+    bool updateById(int id, string newRawText);        // id and tags are kept
+    void clear();                                      // ids are not reused
+    // Copies the live rows into fresh sealed segments under the current
+    // settings, so deleted and replaced rows are freed once the readers
+    // still using them have left.
+    void compact();
+
+    // Merges `factor` adjacent sealed segments of the same size tier, or
+    // rewrites one whose deleted fraction exceeds deletedRatio.
+    void setMergePolicy(int factor = 4, double deletedRatio = 0.25);
+    // Runs the policy until nothing qualifies; returns the merges done.
+    int  merge();
+    // Merges on a background thread whenever writes may have made a merge
+    // due. A failed background merge keeps its inputs and is reported as a
+    // runtime_error by the next merge() or stopBackgroundMerge().
+    void startBackgroundMerge();
+    void stopBackgroundMerge();
+    // Segments merged from now on get an HNSW index if they hold at least
+    // minRows rows. Published indexes are immutable, so efSearch is fixed
+    // when a segment's index is built.
+    void enableHnsw(const string& metric = "cosine", int M = 16, int efConstruction = 200, int efSearch = 64,
+                    int minRows = 0);
+    void disableHnsw();
+    // Segments merged from now on get an IVF index with up to nlist lists
+    // (at most one per row), trained on that segment.
+    void enableIvf(const string& metric = "cosine", int nlist = 1024, int nprobe = 8, int minRows = 0);
+    void disableIvf();
+    // Segments merged from now on get PQ codes trained on that segment. The
+    // best k * rerank ADC candidates of a segment (k if rerank is 0) are
+    // re-scored against its float rows.
+    void enablePq(const string& metric = "cosine", int subspaces = 8, int rerank = 4, int minRows = 0);
+    void disablePq();
+
+    // As VectorStore::NormMode, per segment: rows are normalized as they are
+    // written, and cached norms are computed once since rows never change.
+    // Applies to rows written or merged from now on; compact() rewrites the
+    // others. The default is CachedNorms.
+    void setNormMode(VectorStore::NormMode mode);
+    VectorStore::NormMode getNormMode() const;
+    // Sealed segments keep Float16 / Int8 codes of their rows, calibrated on
+    // that segment alone, and the exact scan reads the codes; the appendable
+    // tail is always scanned in float. Applies to segments sealed or merged
+    // from now on; compact() re-encodes the others.
+    void setStoragePrecision(VectorStore::StoragePrecision precision);
+    VectorStore::StoragePrecision getStoragePrecision() const;
+    long long quantizedBytes() const;
+
+    // Lock-free readers, each answered from one consistent snapshot. Result
+    // indices are -1: a snapshot has no stable record positions, use ids.
+    bool contains(int id) const;
+    bool getRawText(int id, string& out) const;
+    int  findNearest(const SinglyLinkedList<float>& query, const string& metric = "cosine") const; // id or -1
+    void topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                     TopKResult& out) const;
+    void topKNearest(const float* query, int k, const string& metric, TopKResult& out) const;
+    // Each segment is searched through its first index that serves `metric`
+    // (HNSW, then IVF, then PQ; on normalized segments a cosine index also
+    // serves euclidean and vice versa) and the candidates are re-scored
+    // exactly; segments without one are scanned.
+    void approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                TopKResult& out) const;
+
+    // Typed tags, as on VectorStore. Tag writes take the write lock; tag
+    // reads and filtered searches hold a shared tag lock only while the
+    // filter is evaluated, so unfiltered searches stay lock free.
+    void setIntTag(int id, const string& tag, long long value);
+    void setFloatTag(int id, const string& tag, double value);
+    void setStringTag(int id, const string& tag, const string& value);
+    bool removeTag(int id, const string& tag);
+    bool getIntTag(int id, const string& tag, long long& out) const;
+    bool getFloatTag(int id, const string& tag, double& out) const;
+    bool getStringTag(int id, const string& tag, string& out) const;
+    int countMatching(const Filter& filter) const;
+
+    // Filtered search: only rows whose id matches are scored; fewer than k
+    // results come back when fewer match. The approximate variant lets each
+    // segment's index skip ineligible rows, and falls back to the exact scan
+    // for selective filters as VectorStore does.
+    void topKNearest(const SinglyLinkedList<float>& query, int k, const string& metric, const Filter& filter,
+                     TopKResult& out) const;
+    void approximateTopKNearest(const SinglyLinkedList<float>& query, int k, const string& metric,
+                                const Filter& filter, TopKResult& out) const;
+
+    // VectorStore's file format, so either store reads the other's files.
+    // save() writes one pinned snapshot while writers carry on. load()
+    // replaces the contents with a single sealed segment served from the
+    // mapped file (rows are copied only when it is merged or compacted) and
+    // builds that segment's indexes under the current settings.
+    void save(const string& path) const;
+    void load(const string& path);
+
+    // Durable mode, as VectorStore::openWal: each write is logged with its
+    // vector under the write lock before it is published, and recovery
+    // replays the logs over <base>.snapshot.<n>.
+    void openWal(const string& base, long long groupBytes = 1 << 20, int groupDelayMs = 10,
+                 long long compactBytes = 256LL << 20);
+    void syncWal();
+    // Rotates the log and pins the current snapshot; a background thread
+    // writes it out and then drops the pin. Nothing is copied on the
+    // writer's thread, but retired segments are not freed until the pin
+    // goes.
+    void compactWal();
+    void closeWal();
+    bool hasWal() const;
 };
 
 #endif // VECTORSTORE_H
@@ -0,0 +1,385 @@
+#include "VectorStore.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ctime>
+#include <cstdlib>
+
+// Benchmark driver for the ArrayList, SinglyLinkedList and VectorStore hot
+// paths, in the spirit of Google Benchmark: every case repeats until it has
+// run for --min-time seconds, reports time per item and is written to a
+// JSON file for regression comparison (see README).
+
+struct Options {
+    std::vector<long long> sizes = {1000, 10000};
+    std::vector<int> dims = {64, 384};
+    std::vector<int> ks = {10};
+    std::vector<std::string> metrics = {"cosine", "euclidean", "manhattan"};
+    std::vector<std::string> ann = {"hnsw", "ivf", "pq"};
+    std::string filter;
+    std::string out;
+    double minTime = 0.5;
+    int queries = 64;
+    bool contiguous = false;
+};
+
+struct Result {
+    std::string name;
+    long long iterations = 0;
+    double nsPerItem = 0.0;
+    double itemsPerSecond = 0.0;
+    double recall = -1.0; // < 0: not an approximate case
+};
+
+// Wall-clock stopwatch with Google Benchmark's PauseTiming/ResumeTiming.
+struct State {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point started;
+    double elapsed = 0.0;
+    bool running = false;
+
+    void resume() { started = Clock::now(); running = true; }
+    void pause() {
+        if (!running) return;
+        elapsed += std::chrono::duration<double>(Clock::now() - started).count();
+        running = false;
+    }
+};
+
+static Options options;
+static std::vector<Result> results;
+static volatile double sink = 0.0; // keeps measured results alive
+static double forEachTotal = 0.0;  // forEach takes a plain function pointer, so no captures
+
+static bool selected(const std::string& name) {
+    return options.filter.empty() || name.find(options.filter) != std::string::npos;
+}
+
+// Calls body(state) until min-time has been measured; each call handles
+// itemsPerIteration items.
+template <class F>
+static Result* runBenchmark(const std::string& name, long long itemsPerIteration, F&& body) {
+    if (!selected(name)) return nullptr;
+    State state;
+    long long iterations = 0;
+    while (iterations == 0 || state.elapsed < options.minTime) {
+        state.resume();
+        body(state);
+        state.pause();
+        ++iterations;
+    }
+    Result r;
+    r.name = name;
+    r.iterations = iterations;
+    double items = static_cast<double>(iterations) * itemsPerIteration;
+    r.nsPerItem = state.elapsed * 1e9 / items;
+    r.itemsPerSecond = items / state.elapsed;
+    results.push_back(r);
+    std::printf("%-58s %14.1f ns %10lld %14.0f items/s\n", name.c_str(), r.nsPerItem, r.iterations,
+                r.itemsPerSecond);
+    std::fflush(stdout);
+    return &results.back();
+}
+
+// ---------------------------------------------------------------- inputs
+
+static int embedDimension = 64;
+
+static unsigned long long mix(unsigned long long x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Deterministic pseudo-embedding: the text's hash seeds the components.
+static SinglyLinkedList<float>* embed(const string& text) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (size_t i = 0; i < text.size(); ++i) h = (h ^ static_cast<unsigned char>(text[i])) * 1099511628211ULL;
+    SinglyLinkedList<float>* v = new SinglyLinkedList<float>();
+    for (int i = 0; i < embedDimension; ++i) {
+        h = mix(h);
+        v->add(static_cast<float>((h >> 40) & 0xFFFF) / 32768.0f - 1.0f);
+    }
+    return v;
+}
+
+static std::string key(const char* family, const char* op, long long n) {
+    std::ostringstream s;
+    s << family << "/" << op << "/" << n;
+    return s.str();
+}
+
+// --------------------------------------------------------- list benchmarks
+
+static void benchLists(long long n) {
+    runBenchmark(key("ArrayList<int>", "add", n), n, [n](State&) {
+        ArrayList<int> list;
+        for (long long i = 0; i < n; ++i) list.add(static_cast<int>(i));
+        sink = sink + list.size();
+    });
+    runBenchmark(key("ArrayList<int>", "removeAt_back", n), n, [n](State& state) {
+        state.pause();
+        ArrayList<int> list;
+        for (long long i = 0; i < n; ++i) list.add(static_cast<int>(i));
+        state.resume();
+        while (list.size() > 0) list.removeAt(list.size() - 1);
+    });
+    if (n <= 100000) { // O(N^2) in total
+        runBenchmark(key("ArrayList<int>", "removeAt_front", n), n, [n](State& state) {
+            state.pause();
+            ArrayList<int> list;
+            for (long long i = 0; i < n; ++i) list.add(static_cast<int>(i));
+            state.resume();
+            while (list.size() > 0) list.removeAt(0);
+        });
+    }
+    runBenchmark(key("SinglyLinkedList<float>", "add", n), n, [n](State&) {
+        SinglyLinkedList<float> list;
+        for (long long i = 0; i < n; ++i) list.add(static_cast<float>(i));
+        sink = sink + list.size();
+    });
+
+    if (!selected(key("SinglyLinkedList<float>", "get", n))) return;
+    SinglyLinkedList<float> list;
+    for (long long i = 0; i < n; ++i) list.add(static_cast<float>(i));
+    long long gets = 100000000LL / n; // get() walks the list
+    if (gets > 256) gets = 256;
+    if (gets < 1) gets = 1;
+    unsigned long long seed = 1;
+    runBenchmark(key("SinglyLinkedList<float>", "get", n), gets, [&](State&) {
+        double sum = 0.0;
+        for (long long g = 0; g < gets; ++g) {
+            seed = mix(seed);
+            sum += list.get(static_cast<int>(seed % static_cast<unsigned long long>(n)));
+        }
+        sink = sink + sum;
+    });
+}
+
+// ---------------------------------------------------- VectorStore benchmarks
+
+static VectorStore* buildStore(long long n, int dim) {
+    VectorStore* store = new VectorStore(dim, embed, options.contiguous ? VectorStore::StorageMode::Contiguous
+                                                                        : VectorStore::StorageMode::LinkedList);
+    for (long long i = 0; i < n; ++i) store->addText("document " + std::to_string(i));
+    return store;
+}
+
+static void benchStore(long long n, int dim) {
+    embedDimension = dim;
+    std::ostringstream prefix;
+    prefix << "VectorStore/";
+    std::ostringstream shape;
+    shape << n << "/" << dim;
+
+    // The last store built by the addText case is reused by the searches.
+    VectorStore* store = nullptr;
+    if (!runBenchmark(prefix.str() + "addText/" + shape.str(), n, [&](State& state) {
+            state.pause();
+            delete store;
+            store = nullptr;
+            state.resume();
+            store = buildStore(n, dim);
+        })) {
+        store = buildStore(n, dim);
+    }
+
+    // Full read of every row, per item: the streaming scan against forEach.
+    runBenchmark(prefix.str() + "scan/" + shape.str(), n, [&](State&) {
+        double total = 0.0;
+        auto visit = [&total](const VectorStore::ScanBlock& block) {
+            for (int r = 0; r < block.size(); ++r) {
+                const float* row = block.row(r);
+                for (int d = 0; d < embedDimension; ++d) total += row[d];
+            }
+        };
+        store->scan(visit);
+        sink = sink + total;
+    });
+    runBenchmark(prefix.str() + "forEach/" + shape.str(), n, [&](State&) {
+        forEachTotal = 0.0;
+        store->forEach([](SinglyLinkedList<float>& vector, int, string&) {
+            for (SinglyLinkedList<float>::Iterator it = vector.begin(); it != vector.end(); ++it) forEachTotal += *it;
+        });
+        sink = sink + forEachTotal;
+    });
+
+    ArrayList<SinglyLinkedList<float>*> queries;
+    for (int q = 0; q < options.queries; ++q) queries.add(embed("query " + std::to_string(q)));
+    int next = 0;
+
+    for (const std::string& metric : options.metrics) {
+        runBenchmark(prefix.str() + "findNearest/" + shape.str() + "/" + metric, 1, [&](State&) {
+            sink = sink + store->findNearest(*queries.get(next++ % queries.size()), metric);
+        });
+        for (int k : options.ks) {
+            if (k > n) continue;
+            TopKResult out;
+            std::ostringstream name;
+            name << prefix.str() << "topKNearest/" << shape.str() << "/" << k << "/" << metric;
+            runBenchmark(name.str(), 1, [&](State&) {
+                store->topKNearest(*queries.get(next++ % queries.size()), k, metric, out);
+                sink = sink + out.getScore(0);
+            });
+        }
+    }
+
+    for (const std::string& mode : options.ann) {
+        for (const std::string& metric : options.metrics) {
+            std::string built = prefix.str() + mode + "_build/" + shape.str() + "/" + metric;
+            bool wanted = selected(built);
+            for (int k : options.ks) {
+                std::ostringstream name;
+                name << prefix.str() << mode << "/" << shape.str() << "/" << k << "/" << metric;
+                wanted = wanted || selected(name.str());
+            }
+            if (!wanted) continue;
+
+            int nlist = 1;
+            while (static_cast<long long>(nlist) * nlist < n && nlist < 4096) nlist *= 2;
+            State build;
+            build.resume();
+            if (mode == "hnsw") store->enableHnsw(metric);
+            else if (mode == "ivf") store->trainIvf(metric, nlist);
+            else store->trainPq(metric, 8);
+            build.pause();
+            Result r;
+            r.name = built;
+            r.iterations = 1;
+            r.nsPerItem = build.elapsed * 1e9 / static_cast<double>(n);
+            r.itemsPerSecond = static_cast<double>(n) / build.elapsed;
+            results.push_back(r);
+            std::printf("%-58s %14.1f ns %10d %14.0f items/s\n", r.name.c_str(), r.nsPerItem, 1, r.itemsPerSecond);
+
+            if (mode == "ivf") store->setIvfNprobe(nlist / 16 > 1 ? nlist / 16 : 1);
+            if (mode == "pq") store->setPqRerank(4);
+            for (int k : options.ks) {
+                if (k > n) continue;
+                TopKResult out;
+                std::ostringstream name;
+                name << prefix.str() << mode << "/" << shape.str() << "/" << k << "/" << metric;
+                Result* measured = runBenchmark(name.str(), 1, [&](State&) {
+                    store->approximateTopKNearest(*queries.get(next++ % queries.size()), k, metric, out);
+                    sink = sink + out.size();
+                });
+                if (measured) {
+                    measured->recall = store->recallAtK(queries, k, metric);
+                    std::printf("%-58s recall@%d = %.4f\n", "", k, measured->recall);
+                }
+            }
+            if (mode == "hnsw") store->disableHnsw();
+            else if (mode == "ivf") store->disableIvf();
+            else store->disablePq();
+        }
+    }
+
+    for (int q = 0; q < queries.size(); ++q) delete queries.get(q);
+    delete store;
+}
+
+// ------------------------------------------------------------------ output
+
+static std::string escape(const std::string& s) {
+    std::string r;
+    for (char c : s) {
+        if (c == '"' || c == '\\') r += '\\';
+        r += c;
+    }
+    return r;
+}
+
+static bool writeJson(const std::string& path) {
+    std::ofstream out(path);
+    if (!out) return false;
+    char date[64];
+    std::time_t now = std::time(nullptr);
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    out << "{\n  \"context\": {\n"
+        << "    \"date\": \"" << date << "\",\n"
+        << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+        << "    \"kernel_isa\": \"" << DistanceKernels::isaName(DistanceKernels::activeIsa()) << "\",\n"
+        << "    \"storage\": \"" << (options.contiguous ? "contiguous" : "linkedlist") << "\",\n"
+        << "    \"min_time\": " << options.minTime << "\n  },\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        out << "    {\"name\": \"" << escape(r.name) << "\", \"iterations\": " << r.iterations
+            << ", \"real_time\": " << r.nsPerItem << ", \"time_unit\": \"ns\", \"items_per_second\": "
+            << r.itemsPerSecond;
+        if (r.recall >= 0.0) out << ", \"recall\": " << r.recall;
+        out << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    return true;
+}
+
+// ------------------------------------------------------------------- main
+
+static std::vector<std::string> splitList(const std::string& s) {
+    std::vector<std::string> parts;
+    std::stringstream in(s);
+    std::string part;
+    while (std::getline(in, part, ',')) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+static bool parseArgs(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        size_t eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = (eq == std::string::npos) ? "" : arg.substr(eq + 1);
+        if (name == "--sizes") {
+            options.sizes.clear();
+            for (const std::string& v : splitList(value)) options.sizes.push_back(std::atoll(v.c_str()));
+        } else if (name == "--dims") {
+            options.dims.clear();
+            for (const std::string& v : splitList(value)) options.dims.push_back(std::atoi(v.c_str()));
+        } else if (name == "--k") {
+            options.ks.clear();
+            for (const std::string& v : splitList(value)) options.ks.push_back(std::atoi(v.c_str()));
+        } else if (name == "--metrics") {
+            options.metrics = splitList(value);
+        } else if (name == "--ann") {
+            options.ann = splitList(value);
+        } else if (name == "--filter") {
+            options.filter = value;
+        } else if (name == "--out") {
+            options.out = value;
+        } else if (name == "--min-time") {
+            options.minTime = std::atof(value.c_str());
+        } else if (name == "--queries") {
+            options.queries = std::atoi(value.c_str());
+        } else if (name == "--storage") {
+            options.contiguous = (value == "contiguous");
+        } else {
+            return false;
+        }
+    }
+    return !options.sizes.empty() && !options.dims.empty() && options.queries > 0;
+}
+
+int main(int argc, char** argv) {
+    if (!parseArgs(argc, argv)) {
+        std::cout << "Usage: bench_runner [--sizes=1000,10000] [--dims=64,384] [--k=10]\n"
+                     "                    [--metrics=cosine,euclidean,manhattan] [--ann=hnsw,ivf,pq]\n"
+                     "                    [--storage=linkedlist|contiguous] [--filter=substring]\n"
+                     "                    [--min-time=0.5] [--queries=64] [--out=results.json]\n";
+        return 1;
+    }
+    std::printf("%-58s %17s %10s %21s\n", "Benchmark", "Time/item", "Iter", "Throughput");
+    for (long long n : options.sizes) benchLists(n);
+    for (long long n : options.sizes) {
+        for (int dim : options.dims) benchStore(n, dim);
+    }
+    if (!options.out.empty() && !writeJson(options.out)) {
+        std::cout << "Cannot open output file: " << options.out << "\n";
+        return 1;
+    }
+    return 0;
+}
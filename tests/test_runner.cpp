@@ -78,6 +78,9 @@ int main(int argc, char** argv) {
             // CONTAINS <value> = true|false
             // TO_STRING = <literalList>
             // CLEAR
+            // RESERVE <capacity> / SHRINK / CAPACITY = <expected>
+            // EMPLACE <value>
+            // MOVE_NEW / MOVE_TO2 / MOVE_FROM2   (move ctor / move assignment)
             // Ex: TEST 1 ADD 1; ADD 2; SIZE = 2; GET 0 = 1; TO_STRING = [1, 2]
             std::istringstream lss(line);
             std::string word; lss >> word; // TEST
@@ -114,6 +117,13 @@ int main(int argc, char** argv) {
                 else if(cmdOp=="CONTAINS") { int v; if(!(oss>>v)){ testFail=true; failMsg="CONTAINS missing value"; break;} std::string eq,val; if(!(oss>>eq>>val)||eq!="="){ testFail=true; failMsg="CONTAINS expected '= <bool>'"; break;} bool exp=(val=="true"); bool got=arr.contains(v); recordAssert(got==exp, std::string("CONTAINS got=")+(got?"true":"false")+" exp="+val); }
                 else if(cmdOp=="TO_STRING") { std::string eq; if(!(oss>>eq)||eq!="="){ testFail=true; failMsg="TO_STRING expected '= <literal>'"; break;} std::string expect; std::getline(oss, expect); if(!expect.empty()&&expect[0]==' ') expect.erase(0,1); recordAssert(listStr()==expect, "TO_STRING got="+listStr()+" exp="+expect); }
                 else if(cmdOp=="TO_STRING2") { if(!arr2){ testFail=true; failMsg="TO_STRING2 no arr2"; break;} std::string eq; if(!(oss>>eq)||eq!="="){ testFail=true; failMsg="TO_STRING2 expected '= <literal>'"; break;} std::string expect; std::getline(oss, expect); if(!expect.empty()&&expect[0]==' ') expect.erase(0,1); recordAssert(listStr2()==expect, "TO_STRING2 got="+listStr2()+" exp="+expect); }
+                else if(cmdOp=="RESERVE") { int c; if(!(oss>>c)){ testFail=true; failMsg="RESERVE missing value"; break;} arr.reserve(c); }
+                else if(cmdOp=="SHRINK") { arr.shrink_to_fit(); }
+                else if(cmdOp=="CAPACITY") { std::string eq; int exp; if(!(oss>>eq>>exp)||eq!="="){ testFail=true; failMsg="CAPACITY expected '= <val>'"; break;} recordAssert(arr.getCapacity()==exp, "CAPACITY got="+std::to_string(arr.getCapacity())+" exp="+std::to_string(exp)); }
+                else if(cmdOp=="EMPLACE") { int v; if(!(oss>>v)){ testFail=true; failMsg="EMPLACE missing value"; break;} int& slot=arr.emplace_back(v); recordAssert(slot==v, "EMPLACE returned "+std::to_string(slot)+" exp="+std::to_string(v)); }
+                else if(cmdOp=="MOVE_NEW") { if(arr2){ delete arr2; arr2=nullptr;} arr2 = new ArrayList<int>(std::move(arr)); }
+                else if(cmdOp=="MOVE_TO2") { if(!arr2){ testFail=true; failMsg="MOVE_TO2 with no arr2"; break;} *arr2 = std::move(arr); }
+                else if(cmdOp=="MOVE_FROM2") { if(!arr2){ testFail=true; failMsg="MOVE_FROM2 with no arr2"; break;} arr = std::move(*arr2); }
                 else if(cmdOp=="CLEAR") { arr.clear(); }
                 else if(cmdOp=="CLEAR2") { if(!arr2){ testFail=true; failMsg="CLEAR2 no arr2"; break;} arr2->clear(); }
                 else if(cmdOp=="ITER_SUM") { // ITER_SUM = <expectedSum>
@@ -0,0 +1,1997 @@
+#include "VectorStore.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <thread>
+#include <vector>
+
+// Scenario tests for VectorStore and the structures under it. Each TEST_CASE
+// is a function; CHECK records one assertion and carries on, so a failing
+// case reports every broken expectation, like the TEST lines of test_runner.
+// Usage: vectorstore_tests [name filter] [--verbose]
+
+struct TestCase { const char* name; void (*body)(); };
+
+static std::vector<TestCase>& registry() {
+    static std::vector<TestCase> cases;
+    return cases;
+}
+
+struct Registrar {
+    Registrar(const char* name, void (*body)()) { registry().push_back({name, body}); }
+};
+
+#define TEST_CASE(name)                                 \
+    static void name();                                 \
+    static Registrar name##Registrar(#name, name);      \
+    static void name()
+
+static long long assertsPassed = 0;
+static long long assertsFailed = 0;
+static const char* currentCase = "";
+
+static bool check(bool cond, const char* expr, int line) {
+    if (cond) {
+        ++assertsPassed;
+    } else {
+        ++assertsFailed;
+        std::cout << "FAIL: " << currentCase << " line " << line << ": " << expr << "\n";
+    }
+    return cond;
+}
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+// ----------------- Distance kernels -----------------
+
+static bool close(double got, double want, double scale) {
+    return fabs(got - want) <= 1e-5 * scale + 1e-6;
+}
+
+// Every ISA the CPU supports, through select(), against a double reference
+// on lengths that exercise the unrolled body, the vector tail and the
+// scalar tail.
+TEST_CASE(kernelsMatchReferenceOnEveryIsa) {
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<float> value(-2.0f, 2.0f);
+    std::vector<int> lengths;
+    for (int n = 0; n <= 70; ++n) lengths.push_back(n);
+    int wide[] = {127, 128, 129, 383, 384, 385, 1000, 1536};
+    for (int n : wide) lengths.push_back(n);
+
+    DistanceKernels::Isa original = DistanceKernels::activeIsa();
+    DistanceKernels::Isa isas[] = {DistanceKernels::Isa::Scalar, DistanceKernels::Isa::SSE2,
+                                   DistanceKernels::Isa::AVX2, DistanceKernels::Isa::AVX512};
+    for (DistanceKernels::Isa isa : isas) {
+        if (!DistanceKernels::select(isa)) continue;
+        for (int n : lengths) {
+            std::vector<float> a(n + 1), b(n + 1), scale(n + 1);
+            std::vector<float> q0(n + 1), q1(n + 1), q2(n + 1), q3(n + 1);
+            std::vector<signed char> ca(n + 1), cb(n + 1);
+            std::vector<unsigned short> half(n + 1);
+            for (int i = 0; i < n; ++i) {
+                a[i] = value(rng); b[i] = value(rng); scale[i] = fabsf(value(rng)) / 64.0f;
+                q0[i] = value(rng); q1[i] = value(rng); q2[i] = value(rng); q3[i] = value(rng);
+                ca[i] = static_cast<signed char>(rng() % 255 - 127);
+                cb[i] = static_cast<signed char>(rng() % 255 - 127);
+                half[i] = DistanceKernels::toHalf(b[i]);
+            }
+
+            double dot = 0, l1 = 0, l2 = 0, na = 0, nb = 0, mag = 0, l1q = 0, dotH = 0, l1H = 0, l2H = 0;
+            double dots[4] = {0, 0, 0, 0};
+            long long dotInt8 = 0;
+            const float* q[4] = {q0.data(), q1.data(), q2.data(), q3.data()};
+            for (int i = 0; i < n; ++i) {
+                double x = a[i], y = b[i], h = DistanceKernels::fromHalf(half[i]);
+                dot += x * y; l1 += fabs(x - y); l2 += (x - y) * (x - y);
+                na += x * x; nb += y * y; mag += fabs(x * y) + x * x + y * y;
+                for (int j = 0; j < 4; ++j) dots[j] += x * q[j][i];
+                dotInt8 += ca[i] * cb[i];
+                l1q += fabs(x - scale[i] * ca[i]);
+                dotH += x * h; l1H += fabs(x - h); l2H += (x - h) * (x - h);
+            }
+
+            bool ok = CHECK(close(DistanceKernels::dot(a.data(), b.data(), n), dot, mag));
+            ok &= CHECK(close(DistanceKernels::l1(a.data(), b.data(), n), l1, l1));
+            ok &= CHECK(close(DistanceKernels::l2Squared(a.data(), b.data(), n), l2, l2));
+            float pd, pa, pb;
+            DistanceKernels::cosineParts(a.data(), b.data(), n, pd, pa, pb);
+            ok &= CHECK(close(pd, dot, mag) && close(pa, na, na) && close(pb, nb, nb));
+            float out[4];
+            DistanceKernels::dot4(a.data(), q, n, out);
+            for (int j = 0; j < 4; ++j) ok &= CHECK(close(out[j], dots[j], mag * 2));
+            ok &= CHECK(DistanceKernels::dotInt8(ca.data(), cb.data(), n) == dotInt8);
+            ok &= CHECK(close(DistanceKernels::l1Int8(a.data(), scale.data(), ca.data(), n), l1q, l1q));
+            ok &= CHECK(close(DistanceKernels::dotHalf(a.data(), half.data(), n), dotH, mag));
+            ok &= CHECK(close(DistanceKernels::l1Half(a.data(), half.data(), n), l1H, l1H));
+            ok &= CHECK(close(DistanceKernels::l2SquaredHalf(a.data(), half.data(), n), l2H, l2H));
+            if (!ok) std::cout << "  isa " << DistanceKernels::isaName(isa) << " n=" << n << "\n";
+        }
+    }
+    DistanceKernels::select(original);
+}
+
+// ----------------- Store fixtures -----------------
+
+static const int DIM = 24;
+
+// Deterministic pseudo-random embedding of a text.
+static SinglyLinkedList<float>* embedText(const string& text) {
+    unsigned h = 2166136261u;
+    for (char c : text) h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+    SinglyLinkedList<float>* v = new SinglyLinkedList<float>();
+    for (int i = 0; i < DIM; ++i) {
+        h = h * 1664525u + 1013904223u;
+        v->add((h >> 8) / 16777216.0f - 0.5f);
+    }
+    return v;
+}
+
+static string textFor(int i) {
+    return "text-" + std::to_string(i);
+}
+
+static bool sameVector(SinglyLinkedList<float> a, SinglyLinkedList<float> b) {
+    if (a.size() != b.size()) return false;
+    SinglyLinkedList<float>::Iterator x = a.begin(), y = b.begin();
+    for (; x != a.end(); ++x, ++y) {
+        if (*x != *y) return false;
+    }
+    return true;
+}
+
+static void fill(VectorStore& store, int n, int first = 0) {
+    for (int i = first; i < first + n; ++i) store.addText(textFor(i));
+}
+
+// Scratch files are created in the working directory and removed by the
+// cases that make them.
+static string scratchPath(const string& name) {
+    return "vectorstore_tests." + name;
+}
+
+static const char* METRICS[] = {"cosine", "euclidean", "manhattan"};
+
+// ----------------- Id index -----------------
+
+// Random puts, overwrites and erases against std::unordered_map. Dense and
+// strided keys make long probe runs, so erase's backward shift has to keep
+// every survivor reachable.
+TEST_CASE(idIndexMatchesMapUnderChurn) {
+    std::mt19937 rng(13);
+    int strides[] = {1, 64, 4096};
+    for (int stride : strides) {
+        IdIndex index(4);
+        std::unordered_map<int, int> model;
+        for (int step = 0; step < 20000; ++step) {
+            int key = static_cast<int>(rng() % 3000) * stride;
+            int op = static_cast<int>(rng() % 3);
+            if (op < 2) {
+                index.put(key, step);
+                model[key] = step;
+            } else {
+                CHECK(index.erase(key) == (model.erase(key) == 1));
+            }
+        }
+        bool same = CHECK(index.size() == static_cast<int>(model.size()));
+        for (int key = 0; same && key < 3000; ++key) {
+            auto found = model.find(key * stride);
+            same = CHECK(index.get(key * stride) == (found == model.end() ? -1 : found->second));
+        }
+        for (const auto& entry : model) index.erase(entry.first);
+        CHECK(index.size() == 0 && index.get(0) == -1);
+    }
+}
+
+// SwapWithLast moves records around; every surviving id must still resolve
+// to the record that carries it, and removed ids must not resolve.
+TEST_CASE(swapWithLastResolvesIds) {
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    store.setRemovalMode(VectorStore::RemovalMode::SwapWithLast);
+    fill(store, 1000);
+    std::mt19937 rng(5);
+    std::vector<bool> alive(1000, true);
+    for (int step = 0; step < 600; ++step) {
+        int id = static_cast<int>(rng() % 1000);
+        CHECK(store.removeById(id) == alive[id]);
+        alive[id] = false;
+    }
+    fill(store, 50, 1000);
+    bool ok = true;
+    for (int i = 0; ok && i < store.size(); ++i) ok = CHECK(store.indexOfId(store.getId(i)) == i);
+    for (int id = 0; ok && id < 1000; ++id) {
+        int index = store.indexOfId(id);
+        ok = alive[id] ? CHECK(index >= 0 && store.getRawText(index) == textFor(id)) : CHECK(index == -1);
+    }
+    store.setRemovalMode(VectorStore::RemovalMode::Shift);
+    for (int i = 0; ok && i < store.size(); ++i) ok = CHECK(store.indexOfId(store.getId(i)) == i);
+}
+
+// ----------------- Allocators -----------------
+
+// Counts the blocks it hands out on top of a SlabArena.
+struct CountingAllocator : NodeAllocator {
+    SlabArena arena;
+    long long live = 0;
+    long long oversize = 0;
+
+    explicit CountingAllocator(size_t blockSize) : arena(blockSize) {}
+    void* allocate(size_t bytes) override {
+        ++live;
+        return arena.allocate(bytes);
+    }
+    void deallocate(void* block, size_t bytes) override {
+        --live;
+        arena.deallocate(block, bytes);
+    }
+};
+
+// Freed blocks come back before the arena grows, every block is aligned for
+// any object, release() returns the chunks and larger requests bypass the
+// chunks altogether.
+TEST_CASE(slabArenaRecyclesBlocks) {
+    SlabArena arena(24, 4, 16);
+    std::vector<void*> blocks;
+    for (int i = 0; i < 10; ++i) {
+        blocks.push_back(arena.allocate(24));
+        memset(blocks.back(), 0xab, 24);
+        CHECK(reinterpret_cast<uintptr_t>(blocks.back()) % alignof(std::max_align_t) == 0);
+    }
+    std::sort(blocks.begin(), blocks.end());
+    CHECK(std::adjacent_find(blocks.begin(), blocks.end()) == blocks.end());
+    long long reserved = arena.bytesReserved();
+    CHECK(reserved > 0);
+
+    arena.deallocate(blocks[2], 24);
+    arena.deallocate(blocks[7], 24);
+    void* first = arena.allocate(24);
+    void* second = arena.allocate(24);
+    CHECK(first == blocks[7] && second == blocks[2]); // free list is LIFO
+    CHECK(arena.bytesReserved() == reserved);
+
+    void* big = arena.allocate(200);
+    memset(big, 0xcd, 200);
+    CHECK(arena.bytesReserved() == reserved);
+    arena.deallocate(big, 200);
+    void* small = arena.allocate(24);
+    CHECK(small != big);
+    arena.deallocate(small, 24);
+
+    arena.release();
+    CHECK(arena.bytesReserved() == 0);
+    void* fresh = arena.allocate(24);
+    memset(fresh, 0, 24);
+    CHECK(arena.bytesReserved() > 0);
+}
+
+// Lists sharing one allocator interleave their nodes in it and hand every
+// node back as they shrink and die; records of a store do the same.
+TEST_CASE(sharedAllocatorsServeSeveralOwners) {
+    CountingAllocator shared(SinglyLinkedList<int>::NODE_BYTES);
+    {
+        SinglyLinkedList<int> a(&shared), b(&shared);
+        SinglyLinkedList<int>* c = new SinglyLinkedList<int>(&shared);
+        for (int i = 0; i < 100; ++i) {
+            a.add(i);
+            b.add(1000 + i);
+            c->add(2000 + i);
+        }
+        CHECK(shared.live == 300);
+        CHECK(a.get(99) == 99 && b.get(0) == 1000 && c->get(50) == 2050);
+        for (int i = 0; i < 40; ++i) b.removeAt(0);
+        CHECK(shared.live == 260 && b.get(0) == 1040);
+        delete c;
+        CHECK(shared.live == 160);
+        a.clear();
+        CHECK(shared.live == 60);
+        for (int i = 0; i < 60; ++i) a.add(i); // refilled from the free list
+        CHECK(a.get(59) == 59 && b.get(59) == 1099);
+    }
+    CHECK(shared.live == 0);
+
+    CountingAllocator records(64);
+    {
+        VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        store.setRecordAllocator(&records);
+        fill(store, 50);
+        CHECK(records.live == 50);
+        for (int i = 0; i < 10; ++i) store.removeAt(0);
+        CHECK(records.live == 40);
+        bool refused = false;
+        try {
+            store.setRecordAllocator(nullptr);
+        } catch (const std::logic_error&) {
+            refused = true;
+        }
+        CHECK(refused);
+        store.clear();
+        CHECK(records.live == 0);
+        fill(store, 5);
+        CHECK(records.live == 5);
+    }
+    CHECK(records.live == 0);
+}
+
+// Hands out `budget` blocks, then throws bad_alloc.
+struct FailingAllocator : NodeAllocator {
+    SlabArena arena;
+    int budget;
+
+    FailingAllocator(size_t blockSize, int budget) : arena(blockSize), budget(budget) {}
+    void* allocate(size_t bytes) override {
+        if (budget == 0) throw std::bad_alloc();
+        --budget;
+        return arena.allocate(bytes);
+    }
+    void deallocate(void* block, size_t bytes) override {
+        arena.deallocate(block, bytes);
+    }
+};
+
+// An add that fails half way (record allocation refused) leaves no record,
+// slab row or text behind, in either storage mode and on every add path
+// (addEmbedded through a one-shard ShardedVectorStore); the store then
+// reads, searches and grows as if it never happened.
+TEST_CASE(failedAddsLeaveNoTrace) {
+    VectorStore::StorageMode modes[] = {VectorStore::StorageMode::LinkedList, VectorStore::StorageMode::Contiguous};
+    for (VectorStore::StorageMode mode : modes) {
+        FailingAllocator allocator(64, 20);
+        ShardedVectorStore sharded(1, DIM, embedText, mode, 1);
+        VectorStore& store = sharded.getShard(0);
+        store.setRecordAllocator(&allocator);
+        store.setTextInterning(true);
+        fill(store, 20);
+        long long textBytes = store.textMemoryBytes();
+
+        int failures = 0;
+        try { store.addText("lost-1"); } catch (const std::bad_alloc&) { ++failures; }
+        try { sharded.addText("lost-2"); } catch (const std::bad_alloc&) { ++failures; }
+        ArrayList<string> batch;
+        for (int i = 0; i < 3; ++i) batch.add("lost-batch-" + std::to_string(i));
+        allocator.budget = 2; // the third record of the batch fails
+        try { store.addTexts(batch); } catch (const std::bad_alloc&) { ++failures; }
+        CHECK(failures == 3);
+        CHECK(store.size() == 20 && store.textMemoryBytes() == textBytes);
+
+        allocator.budget = 1;
+        store.addText("kept");
+        CHECK(store.size() == 21 && store.getRawText(20) == "kept");
+        SinglyLinkedList<float>* query = embedText("kept");
+        TopKResult top;
+        store.topKNearest(*query, 21, "euclidean", top);
+        CHECK(top.size() == 21 && store.getRawText(top.getIndex(0)) == "kept");
+        delete query;
+        if (mode == VectorStore::StorageMode::Contiguous) {
+            SinglyLinkedList<float> row = store.getVector(20);
+            SinglyLinkedList<float>* want = embedText("kept");
+            CHECK(sameVector(row, *want));
+            delete want;
+        }
+        store.clear();
+    }
+}
+
+// ----------------- Text arena -----------------
+
+// Inputs that stress an LZ codec: random bytes (literal runs only), long
+// repeats (long and self-overlapping matches), a mix, and the tiny edge
+// cases. A prefix decode stops at its limit; a truncated stream either
+// throws or comes up short, it never reads past its end.
+TEST_CASE(textCodecRoundTrips) {
+    std::mt19937 rng(23);
+    string random(70000, '\0');
+    for (char& c : random) c = static_cast<char>(rng());
+    string repeated;
+    while (repeated.size() < 70000) repeated += "the quick brown fox ";
+    string inputs[] = {string(), string("x"), string("abcdefghijkl"), random, repeated, string(5000, 'a'),
+                       random.substr(0, 300) + repeated.substr(0, 3000) + random.substr(300, 300)};
+    for (const string& input : inputs) {
+        int n = static_cast<int>(input.size());
+        char* packed = new char[TextArena::compressBound(n)];
+        int bytes = TextArena::compress(input.data(), n, packed);
+        CHECK(bytes <= TextArena::compressBound(n));
+        char* out = new char[n + 1];
+        CHECK(TextArena::decompress(packed, bytes, out, n) == n && string(out, n) == input);
+        if (n >= 5000 && input[0] != random[0]) CHECK(bytes < n / 10);
+        if (n > 1) {
+            int half = n / 2;
+            CHECK(TextArena::decompress(packed, bytes, out, half) == half);
+            CHECK(string(out, half) == input.substr(0, half));
+            bool rejected;
+            try {
+                rejected = TextArena::decompress(packed, bytes - 1, out, n) < n;
+            } catch (const std::runtime_error&) {
+                rejected = true;
+            }
+            CHECK(rejected);
+        }
+        delete[] out;
+        delete[] packed;
+    }
+}
+
+// Compressed blocks are read frame by frame, so texts that straddle 16 KiB
+// frames, fill a block, or get a block of their own must read back
+// unchanged through one reused Reader, in any order, packed or not.
+TEST_CASE(textArenaReadsAcrossFrames) {
+    TextArena arena;
+    arena.setCompression(true);
+    std::vector<string> stored;
+    std::vector<long long> offsets;
+    int sizes[] = {1, 700, 5000, 20000, 40000, 3, 16384, 12000};
+    for (int i = 0; i < 60; ++i) {
+        string text;
+        while (static_cast<int>(text.size()) < sizes[i % 8]) text += "record " + std::to_string(i) + " word ";
+        text.resize(sizes[i % 8]);
+        offsets.push_back(arena.append(text));
+        stored.push_back(text);
+    }
+    CHECK(arena.memoryBytes() < arena.storedBytes() / 2); // full blocks were packed
+    for (int pass = 0; pass < 2; ++pass) {
+        TextArena::Reader reader;
+        for (size_t i = 0; i < stored.size(); ++i) {
+            CHECK(arena.view(offsets[i], static_cast<int>(stored[i].size()), reader) == stored[i]);
+        }
+        for (size_t i = stored.size(); i-- > 0;) {
+            CHECK(arena.view(offsets[i], static_cast<int>(stored[i].size()), reader) == stored[i]);
+        }
+        arena.setCompression(false);
+    }
+}
+
+// An interned text is shared until its last reference goes; a store with
+// interning and compression keeps every text intact through removals,
+// updates onto shared and fresh texts, and compaction.
+TEST_CASE(textInterningCountsReferences) {
+    TextArena arena;
+    arena.setInterning(true);
+    long long first = arena.append("shared");
+    CHECK(arena.append("shared") == first && arena.storedBytes() == 6);
+    arena.release(first, 6);
+    CHECK(arena.garbageBytes() == 0);
+    arena.release(first, 6);
+    CHECK(arena.garbageBytes() == 6);
+    CHECK(arena.append("shared") == first && arena.garbageBytes() == 0); // revived
+
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    store.setTextCompression(true);
+    store.setTextInterning(true);
+    std::unordered_map<int, string> model;
+    for (int i = 0; i < 4000; ++i) {
+        string text = (i % 3 == 0) ? "unique " + std::to_string(i) + string(40, 'u') : "shared " + textFor(i % 40);
+        store.addText(text);
+        model[i] = text;
+    }
+    auto same = [&store, &model]() {
+        if (!CHECK(store.size() == static_cast<int>(model.size()))) return false;
+        for (const auto& entry : model) {
+            string text;
+            if (!CHECK(store.getById(entry.first, text) != nullptr && text == entry.second)) return false;
+        }
+        return true;
+    };
+    for (int id = 0; id < 4000; id += 2) {
+        store.removeById(id);
+        model.erase(id);
+    }
+    same();
+    for (int id = 1; id < 4000; id += 6) {
+        string text = (id % 4 == 1) ? "shared " + textFor(id % 7) : "fresh " + std::to_string(id);
+        store.updateById(id, text);
+        model[id] = text;
+    }
+    same();
+    store.compactTexts();
+    same();
+    for (int id = 3; id < 4000; id += 4) { // every copy of some shared texts goes
+        store.removeById(id);
+        model.erase(id);
+    }
+    store.compactTexts();
+    same();
+}
+
+// ----------------- Records -----------------
+
+// Contiguous rows are copied out on demand; reading every vector leaves no
+// list behind on the records.
+TEST_CASE(getVectorCopiesWithoutCaching) {
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(store, 50);
+    for (int i = 0; i < store.size(); ++i) {
+        SinglyLinkedList<float> copy = store.getVector(i);
+        const float* row = store.getVectorData(i);
+        bool same = CHECK(copy.size() == DIM);
+        for (int d = 0; same && d < DIM; ++d) same = CHECK(copy.get(d) == row[d]);
+    }
+    for (int i = 0; i < store.size(); ++i) CHECK(store.getById(store.getId(i))->vector == nullptr);
+}
+
+// Writing through a getVector copy changes nothing stored, so cached norms
+// and normalized rows still match the vectors and cosine stays exact.
+TEST_CASE(getVectorEditsDoNotReachTheStore) {
+    VectorStore::NormMode modes[] = {VectorStore::NormMode::CachedNorms, VectorStore::NormMode::Normalized};
+    for (VectorStore::NormMode mode : modes) {
+        VectorStore edited(DIM, embedText, VectorStore::StorageMode::LinkedList);
+        VectorStore untouched(DIM, embedText, VectorStore::StorageMode::LinkedList);
+        edited.setNormMode(mode);
+        untouched.setNormMode(mode);
+        fill(edited, 200);
+        fill(untouched, 200);
+        for (int i = 0; i < edited.size(); i += 3) {
+            SinglyLinkedList<float> copy = edited.getVector(i);
+            for (SinglyLinkedList<float>::Iterator it = copy.begin(); it != copy.end(); ++it) *it *= -10.0f;
+        }
+        SinglyLinkedList<float>* query = embedText("text-42");
+        TopKResult got, want;
+        edited.topKNearest(*query, 10, "cosine", got);
+        untouched.topKNearest(*query, 10, "cosine", want);
+        delete query;
+        CHECK(got.size() == 10 && got.getId(0) == 42);
+        for (int i = 0; i < want.size(); ++i) {
+            CHECK(got.getId(i) == want.getId(i));
+            CHECK(got.getScore(i) == want.getScore(i));
+        }
+    }
+}
+
+// ----------------- Embedding cache -----------------
+
+static std::atomic<int> embedCalls(0);
+
+static SinglyLinkedList<float>* countedEmbed(const string& text) {
+    ++embedCalls;
+    return embedText(text);
+}
+
+// A second model: same texts, other vectors.
+static SinglyLinkedList<float>* negatedEmbed(const string& text) {
+    SinglyLinkedList<float>* v = embedText(text);
+    for (SinglyLinkedList<float>::Iterator it = v->begin(); it != v->end(); ++it) *it = -*it;
+    return v;
+}
+
+// A repeated text is a hit and skips the model; the vector is the one the
+// model gave the first time.
+TEST_CASE(embeddingCacheHitsAndMisses) {
+    VectorStore store(DIM, countedEmbed, VectorStore::StorageMode::Contiguous);
+    store.setEmbeddingCache(1 << 20);
+    embedCalls = 0;
+    store.addText("alpha");
+    store.addText("beta");
+    store.addText("alpha");
+    EmbeddingCache::Stats stats = store.embeddingCacheStats();
+    CHECK(embedCalls == 2);
+    CHECK(stats.hits == 1 && stats.misses == 2 && stats.entries == 2);
+    CHECK(sameVector(store.getVector(0), store.getVector(2)));
+}
+
+// The resident bytes never pass the budget; every insert beyond it evicts.
+TEST_CASE(embeddingCacheKeepsToItsBudget) {
+    const long long budget = 16 << 10;
+    EmbeddingCache cache(budget, 4);
+    long long lastEvictions = 0;
+    for (int i = 0; i < 2000; ++i) {
+        string text = textFor(i);
+        SinglyLinkedList<float>* v = embedText(text);
+        cache.insert(text, *v, cache.currentGeneration());
+        delete v;
+        EmbeddingCache::Stats stats = cache.stats();
+        CHECK(stats.bytes <= budget);
+        CHECK(stats.evictions >= lastEvictions);
+        lastEvictions = stats.evictions;
+    }
+    EmbeddingCache::Stats stats = cache.stats();
+    CHECK(stats.evictions > 0 && stats.evictions == 2000 - stats.entries);
+}
+
+// CLOCK: with one shard full, the entry looked up since the last sweep
+// keeps its place and the next unreferenced one under the hand goes.
+TEST_CASE(embeddingCacheGivesReferencedEntriesASecondChance) {
+    SinglyLinkedList<float>* v = embedText("probe");
+    long long entryBytes;
+    {
+        EmbeddingCache sizing(1 << 20, 1);
+        sizing.insert("text-00", *v, 0);
+        entryBytes = sizing.stats().bytes;
+    }
+    const int n = 8;
+    EmbeddingCache cache(entryBytes * n, 1);
+    for (int i = 0; i < n; ++i) cache.insert("text-0" + std::to_string(i), *v, 0);
+    CHECK(cache.stats().entries == n && cache.stats().evictions == 0);
+
+    float out[DIM];
+    CHECK(cache.lookup("text-00", out, DIM));
+    cache.insert("text-10", *v, 0);
+    CHECK(cache.stats().evictions == 1);
+    CHECK(cache.lookup("text-00", out, DIM));
+    CHECK(!cache.lookup("text-01", out, DIM));
+    CHECK(cache.lookup("text-10", out, DIM));
+    delete v;
+}
+
+// Swapping the model empties the cache, and a vector computed before the
+// swap but inserted after it is dropped, so an old vector never comes back.
+TEST_CASE(embeddingCacheDropsVectorsOfAReplacedModel) {
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::LinkedList);
+    store.setEmbeddingCache(1 << 20);
+    store.addText("gamma");
+    store.setEmbeddingFunction(negatedEmbed);
+    CHECK(store.embeddingCacheStats().entries == 0);
+    store.addText("gamma");
+    SinglyLinkedList<float>* want = negatedEmbed("gamma");
+    CHECK(sameVector(store.getVector(1), *want));
+    delete want;
+
+    EmbeddingCache cache(1 << 20);
+    unsigned long long generation = cache.currentGeneration();
+    SinglyLinkedList<float>* stale = embedText("delta");
+    cache.clear();
+    cache.insert("delta", *stale, generation);
+    CHECK(cache.lookupList("delta") == nullptr && cache.stats().entries == 0);
+    delete stale;
+}
+
+// ----------------- Batch search -----------------
+
+// The tiled batch scan has to agree with one topKNearest per query, for
+// query counts that leave partial groups of four and of BATCH_QUERY_GROUP.
+TEST_CASE(batchSearchMatchesSingleQueries) {
+    VectorStore::StorageMode modes[] = {VectorStore::StorageMode::LinkedList, VectorStore::StorageMode::Contiguous};
+    for (VectorStore::StorageMode mode : modes) {
+        VectorStore store(DIM, embedText, mode);
+        fill(store, 700);
+        ArrayList<SinglyLinkedList<float>*> queries;
+        for (int j = 0; j < 37; ++j) queries.add(embedText("query-" + std::to_string(j)));
+        for (const char* metric : METRICS) {
+            for (int k : {1, 10}) {
+                std::vector<TopKResult> batch(queries.size());
+                store.topKNearestBatch(queries, k, metric, batch.data());
+                for (int j = 0; j < queries.size(); ++j) {
+                    TopKResult single;
+                    store.topKNearest(*queries.get(j), k, metric, single);
+                    bool same = CHECK(batch[j].size() == single.size());
+                    for (int i = 0; same && i < single.size(); ++i) {
+                        same = CHECK(batch[j].getId(i) == single.getId(i)) &&
+                               CHECK(fabs(batch[j].getScore(i) - single.getScore(i)) < 1e-4);
+                    }
+                }
+            }
+        }
+        for (int j = 0; j < queries.size(); ++j) delete queries.get(j);
+    }
+}
+
+// Partial selection into one reused TopKResult has to give the prefix of a
+// full sort of every row's score, equal scores in index order (each text is
+// stored six times), while the result shrinks and grows with k.
+TEST_CASE(topKMatchesFullSortWithReusedResult) {
+    const int n = 300;
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::LinkedList);
+    for (int i = 0; i < n; ++i) store.addText(textFor(i % 50));
+    SinglyLinkedList<float>* query = embedText("probe");
+    for (const char* metric : METRICS) {
+        bool higherIsBetter = (string(metric) == "cosine");
+        TopKResult all;
+        store.topKNearest(*query, n, metric, all);
+        CHECK(all.size() == n);
+        std::vector<double> scoreOf(n);
+        for (int i = 0; i < all.size(); ++i) scoreOf[all.getIndex(i)] = all.getScore(i);
+        std::vector<int> order(n);
+        for (int i = 0; i < n; ++i) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            if (scoreOf[a] != scoreOf[b]) return higherIsBetter ? scoreOf[a] > scoreOf[b] : scoreOf[a] < scoreOf[b];
+            return a < b;
+        });
+
+        TopKResult reused;
+        for (int k : {50, 3, 120, 1, n, 7}) {
+            store.topKNearest(*query, k, metric, reused);
+            bool same = CHECK(reused.size() == k);
+            for (int i = 0; same && i < k; ++i) {
+                same = CHECK(reused.getIndex(i) == order[i]) && CHECK(reused.getScore(i) == scoreOf[order[i]]) &&
+                       CHECK(reused.getId(i) == store.getId(order[i]));
+            }
+        }
+    }
+    delete query;
+}
+
+// Chunked parallel scans merge per-chunk heaps; the (key, index) order is
+// total, so they must reproduce the serial scan bit for bit, ties included
+// (texts repeat every 3000 rows, so equal rows straddle chunk boundaries).
+TEST_CASE(parallelScanEqualsSerialScan) {
+    for (int n : {4095, 4096, 8193}) {
+        VectorStore serial(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        VectorStore parallel(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        for (int i = 0; i < n; ++i) {
+            serial.addText(textFor(i % 3000));
+            parallel.addText(textFor(i % 3000));
+        }
+        parallel.setSearchThreads(4);
+        for (int j = 0; j < 5; ++j) {
+            SinglyLinkedList<float>* query = embedText(j == 0 ? textFor(7) : "query-" + std::to_string(j));
+            for (const char* metric : METRICS) {
+                CHECK(parallel.findNearest(*query, metric) == serial.findNearest(*query, metric));
+                for (int k : {1, 10, 1000, n}) {
+                    TopKResult want, got;
+                    serial.topKNearest(*query, k, metric, want);
+                    parallel.topKNearest(*query, k, metric, got);
+                    bool same = CHECK(got.size() == want.size());
+                    for (int i = 0; same && i < want.size(); ++i) {
+                        same = CHECK(got.getIndex(i) == want.getIndex(i)) &&
+                               CHECK(got.getScore(i) == want.getScore(i));
+                    }
+                }
+            }
+            delete query;
+        }
+    }
+}
+
+// ----------------- Store files -----------------
+
+static string readFile(const string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::ostringstream bytes;
+    bytes << in.rdbuf();
+    return bytes.str();
+}
+
+static void writeFile(const string& path, const string& bytes) {
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+// Loads `path` into a fresh store; a load that succeeds has to leave a
+// store whose every record can be read and searched.
+static bool loadsCleanly(const string& path, VectorStore::StorageMode mode) {
+    VectorStore store(DIM, embedText, mode);
+    try {
+        store.load(path);
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+    long long textBytes = 0;
+    for (int i = 0; i < store.size(); ++i) {
+        textBytes += static_cast<long long>(store.getRawText(i).size());
+        string text;
+        CHECK(store.getById(store.getId(i), text) != nullptr && text == store.getRawText(i));
+    }
+    CHECK(textBytes >= 0);
+    if (store.size() > 0) {
+        SinglyLinkedList<float>* query = embedText("probe");
+        TopKResult top;
+        store.topKNearest(*query, 1, "euclidean", top);
+        CHECK(top.size() == 1);
+        delete query;
+    }
+    return true;
+}
+
+TEST_CASE(saveLoadRoundTrip) {
+    string path = scratchPath("roundtrip.vs");
+    VectorStore source(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    source.setRemovalMode(VectorStore::RemovalMode::SwapWithLast);
+    fill(source, 300);
+    for (int i = 0; i < 300; i += 7) source.removeById(i);
+    source.save(path);
+    VectorStore::StorageMode modes[] = {VectorStore::StorageMode::LinkedList, VectorStore::StorageMode::Contiguous};
+    for (VectorStore::StorageMode mode : modes) {
+        VectorStore loaded(DIM, embedText, mode);
+        loaded.load(path);
+        bool same = CHECK(loaded.size() == source.size());
+        for (int i = 0; same && i < source.size(); ++i) {
+            same = CHECK(loaded.getId(i) == source.getId(i)) && CHECK(loaded.getRawText(i) == source.getRawText(i));
+        }
+        loaded.addText("after load");
+        CHECK(loaded.getId(loaded.size() - 1) == 300); // next id survives
+    }
+    std::remove(path.c_str());
+}
+
+// Int, float and string tags on most live ids; some are removed again.
+static void tagRecords(VectorStore& store) {
+    for (int i = 0; i < store.size(); ++i) {
+        int id = store.getId(i);
+        store.setIntTag(id, "bucket", id % 7);
+        if (id % 3 != 0) store.setFloatTag(id, "score", id * 0.25);
+        store.setStringTag(id, "kind", (id % 2) ? "odd" : "even");
+        if (id % 10 == 0) store.removeTag(id, "kind");
+    }
+}
+
+// Both stores hold the same tags for every id below idLimit.
+static bool sameTags(VectorStore& a, VectorStore& b, int idLimit) {
+    for (int id = 0; id < idLimit; ++id) {
+        long long ia = -1, ib = -1;
+        double fa = -1, fb = -1;
+        string sa = "-", sb = "-";
+        bool same = a.getIntTag(id, "bucket", ia) == b.getIntTag(id, "bucket", ib) && ia == ib &&
+                    a.getFloatTag(id, "score", fa) == b.getFloatTag(id, "score", fb) && fa == fb &&
+                    a.getStringTag(id, "kind", sa) == b.getStringTag(id, "kind", sb) && sa == sb;
+        if (!CHECK(same)) return false;
+    }
+    Filter filter = Filter::intEquals("bucket", 3) && Filter::stringEquals("kind", "odd");
+    return CHECK(a.countMatching(filter) == b.countMatching(filter));
+}
+
+TEST_CASE(tagsSurviveSaveLoad) {
+    string path = scratchPath("tags.vs");
+    VectorStore source(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(source, 200);
+    tagRecords(source);
+    for (int id = 0; id < 200; id += 9) source.removeById(id);
+    source.save(path);
+    VectorStore::StorageMode modes[] = {VectorStore::StorageMode::LinkedList, VectorStore::StorageMode::Contiguous};
+    for (VectorStore::StorageMode mode : modes) {
+        VectorStore loaded(DIM, embedText, mode);
+        loaded.addText("replaced by load");
+        loaded.setIntTag(0, "bucket", 99);
+        loaded.load(path);
+        long long value;
+        CHECK(!loaded.getIntTag(0, "bucket", value)); // removed record, and the pre-load tag is gone
+        sameTags(source, loaded, 200);
+    }
+
+    // A version 1 file (no tags section) still loads.
+    VectorStore untagged(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(untagged, 20);
+    untagged.save(path);
+    string bytes = readFile(path);
+    unsigned int version = 1;
+    bytes.replace(8, sizeof(version), reinterpret_cast<const char*>(&version), sizeof(version));
+    writeFile(path, bytes);
+    VectorStore old(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    old.load(path);
+    CHECK(old.size() == 20);
+    std::remove(path.c_str());
+}
+
+// Truncated files must be rejected; bit-flipped headers, id tables and
+// text offsets either fail validation or load into a usable store.
+TEST_CASE(loadRejectsTruncatedAndCorruptFiles) {
+    string path = scratchPath("corrupt.vs");
+    string damagedPath = scratchPath("damaged.vs");
+    {
+        VectorStore source(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        fill(source, 120);
+        source.save(path);
+    }
+    string bytes = readFile(path);
+    for (size_t keep : {size_t(0), size_t(7), size_t(64), size_t(100), bytes.size() / 2, bytes.size() - 1}) {
+        writeFile(damagedPath, bytes.substr(0, keep));
+        CHECK(!loadsCleanly(damagedPath, VectorStore::StorageMode::Contiguous));
+    }
+
+    std::mt19937 rng(11);
+    size_t span = bytes.size() < 2048 ? bytes.size() : 2048;
+    int rejected = 0;
+    for (int trial = 0; trial < 400; ++trial) {
+        string damaged = bytes;
+        int flips = 1 + static_cast<int>(rng() % 4);
+        for (int f = 0; f < flips; ++f) damaged[rng() % span] ^= static_cast<char>(1 << (rng() % 8));
+        writeFile(damagedPath, damaged);
+        VectorStore::StorageMode mode = (trial % 2) ? VectorStore::StorageMode::Contiguous
+                                                    : VectorStore::StorageMode::LinkedList;
+        if (!loadsCleanly(damagedPath, mode)) ++rejected;
+    }
+    CHECK(rejected > 0);
+    std::remove(path.c_str());
+    std::remove(damagedPath.c_str());
+}
+
+// ----------------- Write-ahead log -----------------
+
+// Same ids, texts and vectors in the same order.
+static bool sameRecords(VectorStore& a, VectorStore& b) {
+    if (!CHECK(a.size() == b.size())) return false;
+    for (int i = 0; i < a.size(); ++i) {
+        if (!CHECK(a.getId(i) == b.getId(i)) || !CHECK(a.getRawText(i) == b.getRawText(i))) return false;
+        SinglyLinkedList<float> va = a.getVector(i);
+        SinglyLinkedList<float> vb = b.getVector(i);
+        for (int d = 0; d < DIM; ++d) {
+            if (!CHECK(va.get(d) == vb.get(d))) return false;
+        }
+    }
+    return true;
+}
+
+// A fresh directory per case, since recovery scans the base's directory.
+static string walBase(const string& name) {
+    string directory = scratchPath(name);
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+    return directory + "/db";
+}
+
+static string lastLog(const string& base) {
+    string directory = std::filesystem::path(base).parent_path().string();
+    string last;
+    int lastGeneration = -1;
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        string name = entry.path().filename().string();
+        if (name.rfind("db.wal.", 0) != 0) continue;
+        int generation = std::stoi(name.substr(7));
+        if (generation > lastGeneration) { lastGeneration = generation; last = entry.path().string(); }
+    }
+    return last;
+}
+
+TEST_CASE(walReplaysUpToATornTail) {
+    string base = walBase("wal-torn");
+    {
+        VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        store.openWal(base);
+        fill(store, 20);
+        store.closeWal();
+    }
+    string log = lastLog(base);
+    string bytes = readFile(log);
+    // Cut the last entry in half and follow it with garbage.
+    writeFile(log, bytes.substr(0, bytes.size() - 40) + string("\x13\x37garbage", 9));
+
+    VectorStore recovered(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    recovered.openWal(base);
+    CHECK(recovered.size() == 19);
+    for (int i = 0; i < recovered.size(); ++i) CHECK(recovered.getRawText(i) == textFor(i));
+    recovered.addText("after the tear");
+    recovered.closeWal();
+
+    VectorStore again(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    again.openWal(base);
+    CHECK(again.size() == 20);
+    CHECK(again.getRawText(19) == "after the tear");
+    again.closeWal();
+    std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+}
+
+// A small compactBytes rotates the log many times while mutations continue,
+// so recovery has to stitch the newest snapshot and the later logs.
+TEST_CASE(walReplaysAcrossRotationsAndCompaction) {
+    string base = walBase("wal-rotate");
+    VectorStore::StorageMode modes[] = {VectorStore::StorageMode::LinkedList, VectorStore::StorageMode::Contiguous};
+    for (VectorStore::StorageMode mode : modes) {
+        std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+        std::filesystem::create_directories(std::filesystem::path(base).parent_path());
+        VectorStore store(DIM, embedText, mode);
+        store.openWal(base, 1 << 20, 10, 8 * 1024);
+        for (int i = 0; i < 600; ++i) {
+            store.addText(textFor(i));
+            if (i % 5 == 4) store.removeAt(i % store.size());
+            if (i % 7 == 6) store.updateText(store.size() / 2, "updated-" + std::to_string(i));
+        }
+        store.closeWal();
+        int snapshots = 0;
+        for (const auto& entry : std::filesystem::directory_iterator(std::filesystem::path(base).parent_path())) {
+            if (entry.path().filename().string().rfind("db.snapshot.", 0) == 0) ++snapshots;
+        }
+        CHECK(snapshots == 1); // older generations were cleaned up
+        CHECK(std::stoi(lastLog(base).substr(base.size() + 5)) > 3); // it did rotate
+
+        VectorStore recovered(DIM, embedText, mode);
+        recovered.openWal(base);
+        sameRecords(store, recovered);
+        recovered.addText("next");
+        CHECK(recovered.getId(recovered.size() - 1) == 600);
+        recovered.closeWal();
+    }
+    std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+}
+
+TEST_CASE(walReplaysClear) {
+    string base = walBase("wal-clear");
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    store.openWal(base);
+    fill(store, 30);
+    store.clear();
+    fill(store, 5, 100);
+    store.closeWal();
+
+    VectorStore recovered(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    recovered.openWal(base);
+    CHECK(recovered.size() == 5);
+    sameRecords(store, recovered);
+    CHECK(recovered.getRawText(0) == textFor(100));
+    recovered.closeWal();
+    std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+}
+
+// Tag changes are logged and compaction snapshots carry the tags, so a
+// recovered store matches whether the tags came from a snapshot or a log.
+TEST_CASE(walReplaysTags) {
+    string base = walBase("wal-tags");
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    store.openWal(base, 1 << 20, 10, 8 * 1024);
+    for (int round = 0; round < 4; ++round) {
+        fill(store, 60, round * 60);
+        tagRecords(store);
+        store.removeAt(store.size() / 2);
+    }
+    store.closeWal();
+    CHECK(std::stoi(lastLog(base).substr(base.size() + 5)) > 1); // some tags came from a snapshot
+
+    VectorStore recovered(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    recovered.openWal(base);
+    sameRecords(store, recovered);
+    sameTags(store, recovered, 240);
+    recovered.closeWal();
+    std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+}
+
+// With a long group delay nothing reaches the file on its own; syncWal has
+// to make every earlier mutation recoverable while the store stays open.
+TEST_CASE(walSyncMakesGroupCommitsDurable) {
+    string base = walBase("wal-sync");
+    string copyBase = walBase("wal-sync-copy");
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    store.openWal(base, 64LL << 20, 60000);
+    fill(store, 40);
+    store.updateText(3, "changed");
+    store.removeAt(10);
+    store.syncWal();
+
+    // Recover from a copy of the files as they are on disk right now.
+    string directory = std::filesystem::path(base).parent_path().string();
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        std::filesystem::copy_file(entry.path(), std::filesystem::path(copyBase).parent_path() / entry.path().filename());
+    }
+    VectorStore recovered(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    recovered.openWal(copyBase);
+    sameRecords(store, recovered);
+    CHECK(recovered.getRawText(3) == "changed");
+    recovered.closeWal();
+    store.closeWal();
+    std::filesystem::remove_all(directory);
+    std::filesystem::remove_all(std::filesystem::path(copyBase).parent_path());
+}
+
+// ----------------- Bulk paths -----------------
+
+static std::mutex embedThreadsLock;
+static std::vector<std::thread::id> embedThreads;
+
+static SinglyLinkedList<float>* embedRecordingThread(const string& text) {
+    {
+        std::lock_guard<std::mutex> lock(embedThreadsLock);
+        std::thread::id self = std::this_thread::get_id();
+        bool seen = false;
+        for (const std::thread::id& id : embedThreads) seen = seen || id == self;
+        if (!seen) embedThreads.push_back(self);
+    }
+    return embedText(text);
+}
+
+struct RowSum {
+    std::mutex lock;
+    double sum = 0;
+    int rows = 0;
+    void operator()(const VectorStore::ScanBlock& block) {
+        double local = 0;
+        for (int r = 0; r < block.size(); ++r) local += block.row(r)[0];
+        std::lock_guard<std::mutex> guard(lock);
+        sum += local;
+        rows += block.size();
+    }
+};
+
+// addTexts embeds on the caller unless asked for threads, parallel inserts
+// match serial ones, and repeated parallel scans agree with a serial scan.
+TEST_CASE(bulkPathsSerialByDefaultAndParallelOnRequest) {
+    ArrayList<string> texts;
+    for (int i = 0; i < 5000; ++i) texts.add(textFor(i));
+
+    embedThreads.clear();
+    VectorStore serial(DIM, embedRecordingThread, VectorStore::StorageMode::Contiguous);
+    serial.addTexts(texts);
+    CHECK(embedThreads.size() == 1 && embedThreads[0] == std::this_thread::get_id());
+
+    VectorStore parallel(DIM, embedRecordingThread, VectorStore::StorageMode::Contiguous);
+    parallel.addTexts(texts, 4);
+    bool same = CHECK(parallel.size() == serial.size());
+    for (int i = 0; same && i < serial.size(); ++i) {
+        same = CHECK(parallel.getId(i) == serial.getId(i)) && CHECK(parallel.getRawText(i) == serial.getRawText(i));
+    }
+
+    RowSum expected;
+    serial.scan(expected, 256);
+    for (int pass = 0; pass < 3; ++pass) {
+        RowSum got;
+        CHECK(parallel.scan(got, 256, 4));
+        CHECK(got.rows == expected.rows && close(got.sum, expected.sum, expected.rows));
+    }
+}
+
+// Renames every record whose text ends in 7 and gives it that name's
+// embedding, as updateText would.
+static void moveSevens(SinglyLinkedList<float>& vector, int, string& text) {
+    if (text.empty() || text.back() != '7') return;
+    text = "moved-" + text;
+    SinglyLinkedList<float>* fresh = embedText(text);
+    int d = 0;
+    for (SinglyLinkedList<float>::Iterator it = vector.begin(); it != vector.end(); ++it) *it = fresh->get(d++);
+    delete fresh;
+}
+
+// forEach edits reach the cached norms, the quantized codes, HNSW and the
+// log exactly like the same edits made through updateText.
+TEST_CASE(forEachEditsKeepDerivedStateInStep) {
+    string base = walBase("foreach-wal");
+    VectorStore::StorageMode modes[] = {VectorStore::StorageMode::LinkedList, VectorStore::StorageMode::Contiguous};
+    for (VectorStore::StorageMode mode : modes) {
+        std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+        std::filesystem::create_directories(std::filesystem::path(base).parent_path());
+        VectorStore edited(DIM, embedText, mode);
+        VectorStore reference(DIM, embedText, mode);
+        for (VectorStore* store : {&edited, &reference}) {
+            store->setNormMode(VectorStore::NormMode::CachedNorms);
+            fill(*store, 300);
+            store->setStoragePrecision(VectorStore::StoragePrecision::Float16);
+            store->enableHnsw("cosine", 16, 100);
+            store->setHnswEfSearch(300);
+        }
+        edited.openWal(base);
+        edited.forEach(moveSevens);
+        for (int i = 0; i < reference.size(); ++i) {
+            string text = reference.getRawText(i);
+            if (text.back() == '7') reference.updateText(i, "moved-" + text);
+        }
+
+        const char* probes[] = {"moved-text-7", "moved-text-117", "probe-1"};
+        for (const char* probe : probes) {
+            SinglyLinkedList<float>* query = embedText(probe);
+            for (const char* metric : {"cosine", "euclidean"}) {
+                TopKResult got, want;
+                edited.topKNearest(*query, 5, metric, got);
+                reference.topKNearest(*query, 5, metric, want);
+                for (int i = 0; i < want.size(); ++i) {
+                    CHECK(got.getId(i) == want.getId(i));
+                    CHECK(fabs(got.getScore(i) - want.getScore(i)) < 1e-6);
+                }
+            }
+            TopKResult got, want;
+            edited.approximateTopKNearest(*query, 5, "cosine", got);
+            reference.approximateTopKNearest(*query, 5, "cosine", want);
+            for (int i = 0; i < want.size(); ++i) CHECK(got.getId(i) == want.getId(i));
+            delete query;
+        }
+        edited.closeWal();
+
+        VectorStore recovered(DIM, embedText, mode);
+        recovered.openWal(base);
+        sameRecords(edited, recovered);
+        recovered.closeWal();
+    }
+    std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+}
+
+// ----------------- Storage precision -----------------
+
+// Drifted data: the same embeddings four times larger.
+static SinglyLinkedList<float>* widerEmbed(const string& text) {
+    SinglyLinkedList<float>* v = embedText(text);
+    for (SinglyLinkedList<float>::Iterator it = v->begin(); it != v->end(); ++it) *it *= 4.0f;
+    return v;
+}
+
+struct PrecisionError {
+    double recall;   // share of the float32 top-k the quantized scan finds
+    double maxError; // largest score gap at equal rank
+};
+
+static PrecisionError comparePrecision(const VectorStore& quantized, const VectorStore& exact,
+                                       const char* metric, VectorStore::EmbedFn embedQuery) {
+    const int k = 10, queries = 30;
+    PrecisionError out = {0.0, 0.0};
+    for (int j = 0; j < queries; ++j) {
+        SinglyLinkedList<float>* query = embedQuery("probe-" + std::to_string(j));
+        TopKResult got, want;
+        quantized.topKNearest(*query, k, metric, got);
+        exact.topKNearest(*query, k, metric, want);
+        for (int a = 0; a < got.size() && a < want.size(); ++a) {
+            out.maxError = std::max(out.maxError, fabs(got.getScore(a) - want.getScore(a)));
+            for (int e = 0; e < want.size(); ++e) {
+                if (got.getId(a) == want.getId(e)) { out.recall += 1.0; break; }
+            }
+        }
+        delete query;
+    }
+    out.recall /= static_cast<double>(k) * queries;
+    return out;
+}
+
+// Float16 / Int8 scans against float32 on the same records: recall@10 and
+// the score error at equal rank stay within per-metric bounds (below 1% of
+// a typical score: cosine ~0.5, euclidean ~1.4, manhattan ~5), and codes
+// take 2 / 1 bytes per value, rows padded to 16 bytes. Data that drifts
+// past the Int8 ranges is clipped until recalibrate().
+TEST_CASE(quantizedPrecisionStaysClose) {
+    const int n = 2000;
+    const double halfError[] = {5e-4, 1e-3, 5e-3};
+    const double int8Error[] = {5e-3, 1e-2, 5e-2};
+    VectorStore exact(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(exact, n);
+    VectorStore::StoragePrecision precisions[] = {VectorStore::StoragePrecision::Float16,
+                                                  VectorStore::StoragePrecision::Int8};
+    for (VectorStore::StoragePrecision precision : precisions) {
+        bool half = (precision == VectorStore::StoragePrecision::Float16);
+        VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        fill(store, n);
+        store.setStoragePrecision(precision);
+        CHECK(store.getStoragePrecision() == precision);
+        long long rowBytes = ((half ? 2 * DIM : DIM) + 15) & ~15;
+        CHECK(store.quantizedBytes() == n * rowBytes);
+        CHECK(store.quantizedBytes() <= n * static_cast<long long>(DIM * sizeof(float)) / 2);
+        for (int m = 0; m < 3; ++m) {
+            PrecisionError e = comparePrecision(store, exact, METRICS[m], embedText);
+            std::cout << "  " << (half ? "float16 " : "int8 ") << METRICS[m] << ": recall@10 " << e.recall
+                      << ", max error " << e.maxError << "\n";
+            CHECK(e.recall >= (half ? 0.95 : 0.9));
+            CHECK(e.maxError <= (half ? halfError[m] : int8Error[m]));
+        }
+    }
+
+    VectorStore drifted(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    VectorStore reference(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(drifted, 500);
+    fill(reference, 500);
+    drifted.setStoragePrecision(VectorStore::StoragePrecision::Int8);
+    drifted.setEmbeddingFunction(widerEmbed);
+    reference.setEmbeddingFunction(widerEmbed);
+    fill(drifted, 1500, 500);
+    fill(reference, 1500, 500);
+    PrecisionError clipped = comparePrecision(drifted, reference, "euclidean", widerEmbed);
+    drifted.recalibrate();
+    PrecisionError recalibrated = comparePrecision(drifted, reference, "euclidean", widerEmbed);
+    std::cout << "  int8 drift: max error " << clipped.maxError << " before recalibrate, "
+              << recalibrated.maxError << " after\n";
+    CHECK(recalibrated.maxError < clipped.maxError);
+    CHECK(recalibrated.recall >= 0.9 && recalibrated.recall > clipped.recall);
+    CHECK(drifted.quantizedBytes() == 2000LL * ((DIM + 15) & ~15));
+}
+
+// ----------------- Inverted file index -----------------
+
+// Probing every list makes IVF an exact scan, so under removeAt / updateText
+// / addText churn (swap-removes inside the posting lists) it has to give the
+// exact answers, in both removal modes.
+TEST_CASE(ivfWithEveryListProbedIsExact) {
+    VectorStore::RemovalMode removals[] = {VectorStore::RemovalMode::Shift, VectorStore::RemovalMode::SwapWithLast};
+    for (VectorStore::RemovalMode removal : removals) {
+        for (const char* metric : METRICS) {
+            VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+            store.setRemovalMode(removal);
+            fill(store, 1200);
+            store.trainIvf(metric, 16);
+            store.setIvfNprobe(16);
+            std::mt19937 rng(21);
+            int next = 1200;
+            for (int round = 0; round < 4; ++round) {
+                for (int j = 0; j < 150; ++j) store.removeAt(static_cast<int>(rng() % store.size()));
+                for (int j = 0; j < 150; ++j) {
+                    store.updateText(static_cast<int>(rng() % store.size()), "moved-" + std::to_string(next++));
+                }
+                fill(store, 100, next);
+                next += 100;
+
+                for (int q = 0; q < 5; ++q) {
+                    SinglyLinkedList<float>* query = embedText("probe-" + std::to_string(round * 5 + q));
+                    TopKResult exact, approx;
+                    store.topKNearest(*query, 20, metric, exact);
+                    store.approximateTopKNearest(*query, 20, metric, approx);
+                    bool same = CHECK(approx.size() == exact.size());
+                    for (int i = 0; same && i < exact.size(); ++i) {
+                        same = CHECK(approx.getId(i) == exact.getId(i)) &&
+                               CHECK(fabs(approx.getScore(i) - exact.getScore(i)) < 1e-4);
+                    }
+                    delete query;
+                }
+            }
+        }
+    }
+}
+
+// ----------------- Product quantization -----------------
+
+// Share of the exact top k that the approximate search also returned.
+static double recallAt(VectorStore& store, int k, const char* metric, int queries) {
+    double hits = 0;
+    for (int j = 0; j < queries; ++j) {
+        SinglyLinkedList<float>* query = embedText("probe-" + std::to_string(j));
+        TopKResult exact, approx;
+        store.topKNearest(*query, k, metric, exact);
+        store.approximateTopKNearest(*query, k, metric, approx);
+        for (int a = 0; a < approx.size(); ++a) {
+            for (int e = 0; e < exact.size(); ++e) {
+                if (approx.getId(a) == exact.getId(e)) { ++hits; break; }
+            }
+        }
+        delete query;
+    }
+    return hits / (static_cast<double>(k) * queries);
+}
+
+TEST_CASE(pqRecallWithAndWithoutRerank) {
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(store, 3000);
+    store.trainPq("euclidean", 8);
+    CHECK(store.pqCodeBytes() == 3000LL * 8);
+    double adcOnly = recallAt(store, 10, "euclidean", 40);
+    store.setPqRerank(10);
+    double reranked = recallAt(store, 10, "euclidean", 40);
+    std::cout << "  pq recall@10: adc " << adcOnly << ", rerank x10 " << reranked << "\n";
+    CHECK(adcOnly >= 0.5);
+    CHECK(reranked >= 0.9);
+    CHECK(reranked >= adcOnly);
+}
+
+// Loaded rows are served from the mapping; once released the answers must
+// not change, and a written row keeps the store from releasing.
+TEST_CASE(pqOnlyServingFromMappedRows) {
+    string path = scratchPath("pq.vs");
+    {
+        VectorStore source(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        fill(source, 2000);
+        source.save(path);
+    }
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    store.load(path);
+    store.trainPq("cosine", 8);
+    store.setPqRerank(8);
+    SinglyLinkedList<float>* query = embedText("probe");
+    TopKResult before, after;
+    store.approximateTopKNearest(*query, 10, "cosine", before);
+    CHECK(store.releaseMappedRows());
+    store.approximateTopKNearest(*query, 10, "cosine", after);
+    bool same = CHECK(before.size() == after.size());
+    for (int i = 0; same && i < before.size(); ++i) same = CHECK(before.getId(i) == after.getId(i));
+    store.updateText(0, "edited");
+    CHECK(!store.releaseMappedRows());
+    delete query;
+
+    VectorStore inMemory(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(inMemory, 10);
+    CHECK(!inMemory.releaseMappedRows());
+    std::remove(path.c_str());
+}
+
+// ----------------- Graph index -----------------
+
+static std::vector<float> vectorFor(const string& text) {
+    SinglyLinkedList<float>* list = embedText(text);
+    std::vector<float> v;
+    for (SinglyLinkedList<float>::Iterator it = list->begin(); it != list->end(); ++it) v.push_back(*it);
+    delete list;
+    return v;
+}
+
+// Re-inserting a live label relinks its node and new labels take tombstoned
+// nodes, so update and remove/add churn leaves the graph size flat while
+// recall against a brute-force scan of the live vectors holds.
+TEST_CASE(hnswReusesNodesUnderChurn) {
+    const int n = 1500;
+    HnswIndex index(DIM, DistanceKernels::Metric::Euclidean, 16, 100);
+    std::unordered_map<int, std::vector<float>> live;
+    for (int i = 0; i < n; ++i) {
+        live[i] = vectorFor(textFor(i));
+        index.insert(live[i].data(), i);
+    }
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < n; ++i) {
+            live[i] = vectorFor("moved-" + std::to_string(round) + "-" + std::to_string(i));
+            index.insert(live[i].data(), i);
+        }
+    }
+    CHECK(index.nodeSize() <= n + 2); // only the entry point's label appends
+    for (int i = 0; i < 500; ++i) {
+        CHECK(index.markDeleted(i));
+        live.erase(i);
+    }
+    for (int i = n; i < n + 500; ++i) {
+        live[i] = vectorFor(textFor(i));
+        index.insert(live[i].data(), i);
+    }
+    CHECK(index.size() == n);
+    CHECK(index.nodeSize() <= n + 2);
+    CHECK(!index.contains(0) && index.contains(n));
+
+    index.setEfSearch(100);
+    const int k = 10, queries = 40;
+    double hits = 0;
+    for (int j = 0; j < queries; ++j) {
+        std::vector<float> q = vectorFor("probe-" + std::to_string(j));
+        std::vector<std::pair<double, int>> exact;
+        for (const auto& entry : live) {
+            exact.push_back({DistanceKernels::distance(DistanceKernels::Metric::Euclidean, q.data(),
+                                                        entry.second.data(), DIM), entry.first});
+        }
+        std::partial_sort(exact.begin(), exact.begin() + k, exact.end());
+        double keys[k];
+        int labels[k];
+        int found = index.search(q.data(), k, keys, labels);
+        CHECK(found == k);
+        for (int a = 0; a < found; ++a) {
+            CHECK(live.count(labels[a]) == 1);
+            for (int e = 0; e < k; ++e) {
+                if (labels[a] == exact[e].second) { ++hits; break; }
+            }
+        }
+    }
+    double recall = hits / (static_cast<double>(k) * queries);
+    std::cout << "  hnsw recall@10 after churn: " << recall << "\n";
+    CHECK(recall >= 0.9);
+}
+
+// Concurrent searches each take their own visited list from the pool and
+// must answer exactly as a lone search does.
+TEST_CASE(hnswConcurrentSearchesAgree) {
+    HnswIndex index(DIM, DistanceKernels::Metric::Cosine, 16, 100);
+    for (int i = 0; i < 2000; ++i) index.insert(vectorFor(textFor(i)).data(), i);
+    const int k = 5, queries = 50;
+    std::vector<int> want(queries * k, -1);
+    for (int j = 0; j < queries; ++j) {
+        double keys[k];
+        index.search(vectorFor("probe-" + std::to_string(j)).data(), k, keys, &want[j * k]);
+    }
+    std::atomic<int> mismatches(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&]() {
+            for (int rep = 0; rep < 3; ++rep) {
+                for (int j = 0; j < queries; ++j) {
+                    double keys[k];
+                    int labels[k];
+                    index.search(vectorFor("probe-" + std::to_string(j)).data(), k, keys, labels);
+                    for (int a = 0; a < k; ++a) {
+                        if (labels[a] != want[j * k + a]) ++mismatches;
+                    }
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) thread.join();
+    CHECK(mismatches == 0);
+}
+
+// ----------------- Sharded store -----------------
+
+// Global ids encode the shard; every id-addressed call has to land on the
+// record addText returned it for.
+TEST_CASE(shardedIdsRoundTrip) {
+    ShardedVectorStore store(4, DIM, embedText, VectorStore::StorageMode::LinkedList, 2);
+    std::vector<int> ids;
+    for (int i = 0; i < 200; ++i) ids.push_back(store.addText(textFor(i)));
+    CHECK(store.size() == 200);
+    std::unordered_map<int, int> seen;
+    for (int i = 0; i < 200; ++i) {
+        string text;
+        CHECK(++seen[ids[i]] == 1);
+        CHECK(store.contains(ids[i]) && store.getRawText(ids[i], text) && text == textFor(i));
+    }
+
+    for (int i = 0; i < 200; i += 5) CHECK(store.updateById(ids[i], "updated-" + std::to_string(i)));
+    for (int i = 1; i < 200; i += 5) CHECK(store.removeById(ids[i]));
+    CHECK(!store.removeById(ids[1]) && !store.updateById(ids[1], "gone"));
+    CHECK(store.size() == 160);
+    for (int i = 0; i < 200; ++i) {
+        string text;
+        bool present = store.getRawText(ids[i], text);
+        if (i % 5 == 1) {
+            CHECK(!present && !store.contains(ids[i]));
+        } else {
+            CHECK(present && text == (i % 5 == 0 ? "updated-" + std::to_string(i) : textFor(i)));
+        }
+    }
+    SinglyLinkedList<float>* query = embedText("updated-35");
+    CHECK(store.findNearest(*query, "euclidean") == ids[35]);
+    delete query;
+}
+
+// The scatter-gather merge has to give what one store holding every record
+// gives: same texts, same scores, best first (cosine is negated for the
+// merge and restored), also when k exceeds the rows of a single shard.
+TEST_CASE(shardedSearchMatchesSingleStore) {
+    const int n = 60;
+    ShardedVectorStore sharded(4, DIM, embedText, VectorStore::StorageMode::Contiguous, 2);
+    VectorStore single(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    for (int i = 0; i < n; ++i) {
+        sharded.addText(textFor(i));
+        single.addText(textFor(i));
+    }
+    for (int j = 0; j < 10; ++j) {
+        SinglyLinkedList<float>* query = embedText("query-" + std::to_string(j));
+        for (const char* metric : METRICS) {
+            string nearest;
+            CHECK(sharded.getRawText(sharded.findNearest(*query, metric), nearest) &&
+                  nearest == single.getRawText(single.findNearest(*query, metric)));
+            for (int k : {1, 10, 40, n}) {
+                TopKResult want, got;
+                single.topKNearest(*query, k, metric, want);
+                sharded.topKNearest(*query, k, metric, got);
+                bool same = CHECK(got.size() == want.size());
+                for (int i = 0; same && i < want.size(); ++i) {
+                    string text;
+                    same = CHECK(sharded.getRawText(got.getId(i), text) &&
+                                 text == single.getRawText(want.getIndex(i))) &&
+                           CHECK(got.getScore(i) == want.getScore(i)) && CHECK(got.getIndex(i) == -1);
+                }
+            }
+        }
+        delete query;
+    }
+}
+
+// Writers on different shards and readers run at once; each reader result
+// must be full and ordered, and afterwards every writer's records read back.
+TEST_CASE(shardedWritersRunAlongsideSearches) {
+    ShardedVectorStore store(4, DIM, embedText, VectorStore::StorageMode::LinkedList, 2);
+    for (int i = 0; i < 100; ++i) store.addText(textFor(i));
+    const int writers = 3, perWriter = 150;
+    std::vector<std::vector<int>> kept(writers);
+    std::atomic<bool> done(false);
+    std::atomic<int> broken(0);
+
+    std::vector<std::thread> threads;
+    for (int r = 0; r < 2; ++r) {
+        threads.emplace_back([&, r]() {
+            SinglyLinkedList<float>* query = embedText("reader-" + std::to_string(r));
+            while (!done.load()) {
+                TopKResult top;
+                store.topKNearest(*query, 10, "cosine", top);
+                if (top.size() != 10) ++broken;
+                for (int i = 1; i < top.size(); ++i) {
+                    if (top.getScore(i) > top.getScore(i - 1)) ++broken;
+                }
+            }
+            delete query;
+        });
+    }
+    for (int w = 0; w < writers; ++w) {
+        threads.emplace_back([&, w]() {
+            for (int i = 0; i < perWriter; ++i) {
+                int id = store.addText("writer-" + std::to_string(w) + "-" + std::to_string(i));
+                if (i % 3 == 0) {
+                    if (!store.removeById(id)) ++broken;
+                } else {
+                    kept[w].push_back(id);
+                }
+            }
+        });
+    }
+    for (int t = 2; t < 2 + writers; ++t) threads[t].join();
+    done = true;
+    threads[0].join();
+    threads[1].join();
+
+    CHECK(broken == 0);
+    CHECK(store.size() == 100 + writers * (perWriter - perWriter / 3));
+    for (int w = 0; w < writers; ++w) {
+        int i = 0;
+        for (int id : kept[w]) {
+            if (i % 3 == 0) ++i;
+            string text;
+            CHECK(store.getRawText(id, text) && text == "writer-" + std::to_string(w) + "-" + std::to_string(i));
+            ++i;
+        }
+    }
+}
+
+// ----------------- Concurrent store -----------------
+
+// Same mutations on a ConcurrentVectorStore (small segments, merged) and
+// a VectorStore.
+static void mirrorWrites(ConcurrentVectorStore& segments, VectorStore& reference, int n) {
+    for (int i = 0; i < n; ++i) {
+        segments.addText(textFor(i));
+        reference.addText(textFor(i));
+    }
+    for (int id = 0; id < n; id += 9) {
+        segments.removeById(id);
+        reference.removeById(id);
+    }
+    for (int id = 1; id < n; id += 13) {
+        segments.updateById(id, "updated-" + std::to_string(id));
+        reference.updateById(id, "updated-" + std::to_string(id));
+    }
+}
+
+// The same tags on both, for every live id.
+static void mirrorTags(ConcurrentVectorStore& segments, VectorStore& reference) {
+    for (int i = 0; i < reference.size(); ++i) {
+        int id = reference.getId(i);
+        segments.setIntTag(id, "bucket", id % 7);
+        reference.setIntTag(id, "bucket", id % 7);
+        segments.setStringTag(id, "kind", (id % 2) ? "odd" : "even");
+        reference.setStringTag(id, "kind", (id % 2) ? "odd" : "even");
+    }
+}
+
+// Both answer every metric with the same ids and scores.
+static bool sameAnswers(const ConcurrentVectorStore& segments, const VectorStore& reference, double tolerance) {
+    for (const char* metric : METRICS) {
+        for (int j = 0; j < 5; ++j) {
+            SinglyLinkedList<float>* query = embedText("probe-" + std::to_string(j));
+            TopKResult got, want;
+            segments.topKNearest(*query, 10, metric, got);
+            reference.topKNearest(*query, 10, metric, want);
+            delete query;
+            bool same = CHECK(got.size() == want.size());
+            for (int i = 0; same && i < got.size(); ++i) {
+                same = CHECK(got.getId(i) == want.getId(i)) &&
+                       CHECK(fabs(got.getScore(i) - want.getScore(i)) <= tolerance * (1 + fabs(want.getScore(i))));
+            }
+            if (!same) {
+                std::cout << "  metric " << metric << " query " << j << "\n";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+TEST_CASE(segmentsMatchVectorStoreInEveryNormMode) {
+    VectorStore::NormMode modes[] = {VectorStore::NormMode::Raw, VectorStore::NormMode::CachedNorms,
+                                     VectorStore::NormMode::Normalized};
+    for (VectorStore::NormMode mode : modes) {
+        ConcurrentVectorStore segments(DIM, embedText, 64);
+        segments.setNormMode(mode);
+        VectorStore reference(DIM, embedText, VectorStore::StorageMode::Contiguous);
+        reference.setNormMode(mode);
+        mirrorWrites(segments, reference, 700);
+        segments.merge();
+        CHECK(segments.size() == reference.size());
+        sameAnswers(segments, reference, 1e-5);
+    }
+}
+
+// Float16 codes are the same whichever store encodes them; Int8 is
+// calibrated per segment, so it is only held to a recall bound.
+TEST_CASE(segmentsScanQuantizedCodes) {
+    ConcurrentVectorStore segments(DIM, embedText, 64);
+    VectorStore reference(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    mirrorWrites(segments, reference, 700);
+    segments.setStoragePrecision(VectorStore::StoragePrecision::Float16);
+    segments.compact();
+    CHECK(segments.quantizedBytes() > 0);
+    reference.setStoragePrecision(VectorStore::StoragePrecision::Float16);
+    sameAnswers(segments, reference, 1e-5);
+
+    reference.setStoragePrecision(VectorStore::StoragePrecision::Float32);
+    segments.setStoragePrecision(VectorStore::StoragePrecision::Int8);
+    segments.compact();
+    CHECK(segments.quantizedBytes() == static_cast<long long>(segments.size()) * 32); // DIM bytes, 16-aligned
+    double hits = 0;
+    for (int j = 0; j < 20; ++j) {
+        SinglyLinkedList<float>* query = embedText("probe-" + std::to_string(j));
+        TopKResult got, want;
+        segments.topKNearest(*query, 10, "cosine", got);
+        reference.topKNearest(*query, 10, "cosine", want);
+        delete query;
+        for (int a = 0; a < got.size(); ++a) {
+            for (int e = 0; e < want.size(); ++e) {
+                if (got.getId(a) == want.getId(e)) { ++hits; break; }
+            }
+        }
+    }
+    CHECK(hits / 200 >= 0.9);
+}
+
+static double segmentRecall(const ConcurrentVectorStore& store, int k, const char* metric, int queries) {
+    double hits = 0;
+    for (int j = 0; j < queries; ++j) {
+        SinglyLinkedList<float>* query = embedText("probe-" + std::to_string(j));
+        TopKResult exact, approx;
+        store.topKNearest(*query, k, metric, exact);
+        store.approximateTopKNearest(*query, k, metric, approx);
+        for (int a = 0; a < approx.size(); ++a) {
+            for (int e = 0; e < exact.size(); ++e) {
+                if (approx.getId(a) == exact.getId(e)) { ++hits; break; }
+            }
+        }
+        delete query;
+    }
+    return hits / (static_cast<double>(k) * queries);
+}
+
+// Merged segments get the enabled index; a cosine index on normalized
+// segments also answers euclidean queries.
+TEST_CASE(segmentsSearchThroughTheirIndexes) {
+    for (int kind = 0; kind < 3; ++kind) {
+        ConcurrentVectorStore store(DIM, embedText, 256);
+        store.setNormMode(VectorStore::NormMode::Normalized);
+        if (kind == 0) store.enableHnsw("cosine", 16, 100, 64);
+        if (kind == 1) store.enableIvf("cosine", 16, 6);
+        if (kind == 2) store.enablePq("cosine", 8, 10);
+        for (int i = 0; i < 3000; ++i) store.addText(textFor(i));
+        for (int id = 0; id < 3000; id += 11) store.removeById(id);
+        CHECK(store.merge() > 0);
+        double cosine = segmentRecall(store, 10, "cosine", 30);
+        double euclidean = segmentRecall(store, 10, "euclidean", 30);
+        std::cout << "  segment " << (kind == 0 ? "hnsw" : kind == 1 ? "ivf" : "pq") << " recall@10: cosine "
+                  << cosine << ", euclidean " << euclidean << "\n";
+        CHECK(cosine >= 0.85);
+        CHECK(euclidean >= 0.85);
+        CHECK(segmentRecall(store, 10, "manhattan", 5) == 1.0); // no index serves it: exact scan
+    }
+}
+
+// Tags on the segment store filter like VectorStore's, across merges,
+// removals and clear().
+TEST_CASE(segmentsFilterByTags) {
+    ConcurrentVectorStore segments(DIM, embedText, 64);
+    segments.enableHnsw("cosine", 16, 100, 64);
+    VectorStore reference(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    mirrorWrites(segments, reference, 700);
+    mirrorTags(segments, reference);
+    bool threw = false;
+    try {
+        segments.setIntTag(0, "bucket", 1); // removed by mirrorWrites
+    } catch (const std::out_of_range&) {
+        threw = true;
+    }
+    CHECK(threw);
+    segments.merge();
+    segments.removeById(5);
+    reference.removeById(5);
+
+    Filter filters[] = {Filter::intEquals("bucket", 3),
+                        Filter::stringEquals("kind", "odd") && Filter::intRange("bucket", 1, 2),
+                        !Filter::intEquals("bucket", 0)};
+    for (const Filter& filter : filters) {
+        CHECK(segments.countMatching(filter) == reference.countMatching(filter));
+        for (const char* metric : METRICS) {
+            SinglyLinkedList<float>* query = embedText(string("probe-") + metric);
+            TopKResult got, want, approx;
+            segments.topKNearest(*query, 10, metric, filter, got);
+            reference.topKNearest(*query, 10, metric, filter, want);
+            segments.approximateTopKNearest(*query, 10, metric, filter, approx);
+            delete query;
+            if (!CHECK(got.size() == want.size())) continue;
+            for (int i = 0; i < got.size(); ++i) CHECK(got.getId(i) == want.getId(i));
+            CHECK(approx.size() == want.size());
+            for (int i = 0; i < approx.size(); ++i) {
+                long long bucket;
+                CHECK(segments.getIntTag(approx.getId(i), "bucket", bucket) && bucket != 0);
+            }
+        }
+    }
+    long long bucket;
+    CHECK(!segments.getIntTag(5, "bucket", bucket));
+
+    segments.clear();
+    CHECK(segments.size() == 0);
+    CHECK(!segments.getIntTag(1, "bucket", bucket));
+    segments.addText("after clear");
+    CHECK(segments.countMatching(Filter::has("bucket")) == 0);
+}
+
+// Either store reads the other's files; a loaded segment is served from
+// the mapping and takes writes, merges and compaction like any other.
+TEST_CASE(segmentsShareTheStoreFileFormat) {
+    string path = scratchPath("segments.vs");
+    ConcurrentVectorStore segments(DIM, embedText, 64);
+    VectorStore reference(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    mirrorWrites(segments, reference, 500);
+    mirrorTags(segments, reference);
+    segments.merge();
+    segments.save(path);
+    Filter filter = Filter::intEquals("bucket", 3) && Filter::stringEquals("kind", "odd");
+
+    VectorStore fromSegments(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fromSegments.load(path);
+    CHECK(fromSegments.size() == reference.size());
+    CHECK(fromSegments.countMatching(filter) == reference.countMatching(filter));
+    sameAnswers(segments, fromSegments, 1e-5);
+
+    reference.save(path);
+    ConcurrentVectorStore loaded(DIM, embedText, 64);
+    loaded.enableHnsw("cosine", 16, 100, 64);
+    loaded.load(path);
+    CHECK(loaded.segmentCount() == 1);
+    CHECK(loaded.countMatching(filter) == reference.countMatching(filter));
+    string text;
+    CHECK(loaded.getRawText(1, text) && text == "updated-1");
+    sameAnswers(loaded, reference, 1e-5);
+    CHECK(segmentRecall(loaded, 10, "cosine", 10) >= 0.85); // the loaded segment got its index
+
+    loaded.removeById(2);
+    reference.removeById(2);
+    loaded.updateById(3, "after load");
+    reference.updateById(3, "after load");
+    CHECK(loaded.addText("new") == 500); // next id survives
+    reference.addText("new");
+    sameAnswers(loaded, reference, 1e-5);
+    loaded.compact(); // copies the rows out of the mapping
+    sameAnswers(loaded, reference, 1e-5);
+    std::remove(path.c_str());
+}
+
+// Writes, tags and clear() are logged; a small compactBytes rotates the
+// log while writes and searches go on. VectorStore recovers the same files.
+TEST_CASE(segmentsRecoverFromTheirLog) {
+    string base = walBase("segments-wal");
+    VectorStore reference(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    {
+        ConcurrentVectorStore segments(DIM, embedText, 64);
+        segments.openWal(base, 1 << 20, 10, 16 * 1024);
+        std::atomic<bool> done(false);
+        std::thread reader([&segments, &done]() {
+            SinglyLinkedList<float>* query = embedText("probe");
+            while (!done) {
+                TopKResult top;
+                if (segments.size() > 0) segments.topKNearest(*query, 1, "cosine", top);
+            }
+            delete query;
+        });
+        mirrorWrites(segments, reference, 400);
+        mirrorTags(segments, reference);
+        segments.merge();
+        done = true;
+        reader.join();
+        segments.closeWal();
+    }
+    CHECK(std::stoi(lastLog(base).substr(base.size() + 5)) > 2); // it did rotate
+
+    ConcurrentVectorStore recovered(DIM, embedText, 64);
+    recovered.openWal(base);
+    CHECK(recovered.size() == reference.size());
+    Filter filter = Filter::intRange("bucket", 2, 4);
+    CHECK(recovered.countMatching(filter) == reference.countMatching(filter));
+    sameAnswers(recovered, reference, 1e-5);
+    recovered.clear();
+    CHECK(recovered.addText("after clear") == 400);
+    recovered.closeWal();
+
+    ConcurrentVectorStore again(DIM, embedText, 64);
+    again.openWal(base);
+    string text;
+    CHECK(again.size() == 1 && again.getRawText(400, text) && text == "after clear");
+    again.closeWal();
+    VectorStore replayed(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    replayed.openWal(base);
+    CHECK(replayed.size() == 1 && replayed.getId(0) == 400);
+    replayed.closeWal();
+    std::filesystem::remove_all(std::filesystem::path(base).parent_path());
+}
+
+// ----------------- Instrumentation -----------------
+
+// Recursive-descent check of the JSON subset toJson writes: objects,
+// strings without escapes, numbers and booleans.
+static bool parseJson(const string& text, size_t& at) {
+    if (at >= text.size()) return false;
+    char c = text[at];
+    if (c == '{') {
+        ++at;
+        if (at < text.size() && text[at] == '}') return ++at, true;
+        for (;;) {
+            if (at >= text.size() || text[at] != '"' || !parseJson(text, at)) return false;
+            if (at >= text.size() || text[at++] != ':' || !parseJson(text, at)) return false;
+            if (at >= text.size()) return false;
+            if (text[at] == '}') return ++at, true;
+            if (text[at++] != ',') return false;
+        }
+    }
+    if (c == '"') {
+        size_t end = text.find('"', at + 1);
+        if (end == string::npos) return false;
+        at = end + 1;
+        return true;
+    }
+    if (text.compare(at, 4, "true") == 0) return at += 4, true;
+    if (text.compare(at, 5, "false") == 0) return at += 5, true;
+    size_t start = at;
+    if (text[at] == '-') ++at;
+    while (at < text.size() && (isdigit(static_cast<unsigned char>(text[at])) || text[at] == '.')) ++at;
+    return at > start && isdigit(static_cast<unsigned char>(text[at - 1]));
+}
+
+static bool wellFormedJson(const string& text) {
+    size_t at = 0;
+    return parseJson(text, at) && at == text.size();
+}
+
+static bool consistent(const Instrumentation::Histogram& h) {
+    unsigned long long total = 0;
+    for (int b = 0; b < Instrumentation::BUCKETS; ++b) total += h.buckets[b];
+    return total == h.count && (h.count == 0 || (h.minNanos <= h.maxNanos && h.mean() >= h.minNanos &&
+                                                  h.mean() <= h.maxNanos));
+}
+
+// Built with -DVECTORSTORE_STATS the probes count every embedding, query,
+// kernel call and HNSW expansion; without it the snapshot stays all zeros.
+// Either way the dump is well-formed JSON.
+TEST_CASE(statsCountWhatTheStoreDoes) {
+    using Counter = Instrumentation::Counter;
+    using Timer = Instrumentation::Timer;
+    VectorStore store(DIM, embedText, VectorStore::StorageMode::Contiguous);
+    fill(store, 300);
+    VectorStore::resetStats();
+
+    fill(store, 10, 300);
+    SinglyLinkedList<float>* query = embedText("probe");
+    for (int j = 0; j < 3; ++j) store.findNearest(*query, "euclidean");
+    TopKResult top;
+    for (int j = 0; j < 2; ++j) store.topKNearest(*query, 10, "cosine", top);
+    Instrumentation::Snapshot exact = VectorStore::stats();
+
+    store.enableHnsw("cosine", 16, 100);
+    VectorStore::resetStats();
+    for (int j = 0; j < 4; ++j) store.approximateTopKNearest(*query, 10, "cosine", top);
+    Instrumentation::Snapshot approximate = VectorStore::stats();
+    delete query;
+
+    if (Instrumentation::enabled()) {
+        CHECK(exact.counter(Counter::Embeddings) == 10);
+        CHECK(exact.counter(Counter::Queries) == 5);
+        CHECK(exact.counter(Counter::DistanceEvaluations) >= 5ULL * store.size());
+        CHECK(exact.counter(Counter::BytesScanned) >= 5ULL * store.size() * DIM * sizeof(float));
+        CHECK(exact.counter(Counter::NodesVisited) == 0);
+        CHECK(exact.timer(Timer::AddText).count == 10);
+        CHECK(exact.timer(Timer::FindNearest).count == 3);
+        CHECK(exact.timer(Timer::TopKNearest).count == 2);
+        CHECK(exact.timer(Timer::Scan).count >= 5);
+        CHECK(approximate.counter(Counter::Queries) == 4);
+        CHECK(approximate.counter(Counter::NodesVisited) > 0);
+        CHECK(approximate.timer(Timer::ApproximateSearch).count == 4);
+        CHECK(approximate.timer(Timer::AddText).count == 0);
+    } else {
+        for (int c = 0; c < Instrumentation::COUNTERS; ++c) CHECK(exact.counters[c] == 0);
+        for (int t = 0; t < Instrumentation::TIMERS; ++t) CHECK(exact.timers[t].count == 0);
+    }
+    for (int t = 0; t < Instrumentation::TIMERS; ++t) {
+        CHECK(consistent(exact.timers[t]));
+        CHECK(consistent(approximate.timers[t]));
+    }
+    string json = exact.toJson();
+    CHECK(wellFormedJson(json));
+    CHECK(json.find("\"distance_evaluations\":") != string::npos);
+    CHECK(json.find(Instrumentation::enabled() ? "\"enabled\":true" : "\"enabled\":false") != string::npos);
+    CHECK(wellFormedJson(approximate.toJson()));
+}
+
+int main(int argc, char** argv) {
+    string filter;
+    bool verbose = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--verbose") verbose = true;
+        else filter = arg;
+    }
+
+    int passed = 0, failed = 0;
+    for (const TestCase& test : registry()) {
+        if (!filter.empty() && string(test.name).find(filter) == string::npos) continue;
+        currentCase = test.name;
+        long long before = assertsFailed;
+        try {
+            test.body();
+        } catch (const std::exception& e) {
+            ++assertsFailed;
+            std::cout << "FAIL: " << test.name << " threw: " << e.what() << "\n";
+        }
+        if (assertsFailed == before) {
+            ++passed;
+            if (verbose) std::cout << "PASS: " << test.name << "\n";
+        } else {
+            ++failed;
+        }
+    }
+    std::cout << "TEST_SUMMARY: passed=" << passed << " failed=" << failed << " total=" << passed + failed << "\n";
+    std::cout << "ASSERT_SUMMARY: passed=" << assertsPassed << " failed=" << assertsFailed
+              << " total=" << assertsPassed + assertsFailed << "\n";
+    return failed == 0 ? 0 : 1;
+}